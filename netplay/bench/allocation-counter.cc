@@ -0,0 +1,92 @@
+#include "bench/allocation-counter.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+namespace {
+
+std::atomic<int64_t> heap_allocations(0);
+
+void CountAllocation() {
+  heap_allocations.fetch_add(1, std::memory_order_relaxed);
+}
+
+void* CountedAllocate(std::size_t size) {
+#if !defined(__GLIBC__)
+  // Otherwise counted by malloc below.
+  CountAllocation();
+#endif
+  // Allocations of zero bytes must still return distinct pointers.
+  return std::malloc(size == 0 ? 1 : size);
+}
+
+}  // namespace
+
+namespace bench_utils {
+
+int64_t HeapAllocations() {
+  return heap_allocations.load(std::memory_order_relaxed);
+}
+
+}  // namespace bench_utils
+
+#if defined(__GLIBC__)
+// glibc lets programs replace malloc and friends, and exports its own
+// implementations under these names to forward to. free, memalign and the
+// other functions that are not replaced keep working on the same heap.
+extern "C" {
+
+void* __libc_malloc(std::size_t size);
+void* __libc_calloc(std::size_t count, std::size_t size);
+void* __libc_realloc(void* ptr, std::size_t size);
+
+void* malloc(std::size_t size) {
+  CountAllocation();
+  return __libc_malloc(size);
+}
+
+void* calloc(std::size_t count, std::size_t size) {
+  CountAllocation();
+  return __libc_calloc(count, size);
+}
+
+void* realloc(void* ptr, std::size_t size) {
+  CountAllocation();
+  return __libc_realloc(ptr, size);
+}
+
+}  // extern "C"
+#endif
+
+void* operator new(std::size_t size) {
+  void* ptr = CountedAllocate(size);
+  if (ptr == nullptr) {
+    throw std::bad_alloc();
+  }
+  return ptr;
+}
+
+void* operator new[](std::size_t size) {
+  return operator new(size);
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept {
+  return CountedAllocate(size);
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept {
+  return CountedAllocate(size);
+}
+
+void operator delete(void* ptr) noexcept { std::free(ptr); }
+
+void operator delete[](void* ptr) noexcept { std::free(ptr); }
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept {
+  std::free(ptr);
+}
+
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept {
+  std::free(ptr);
+}
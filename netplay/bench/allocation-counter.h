@@ -0,0 +1,16 @@
+#ifndef BENCH_ALLOCATION_COUNTER_H_
+#define BENCH_ALLOCATION_COUNTER_H_
+
+#include <cstdint>
+
+namespace bench_utils {
+
+// Returns the number of heap allocations made by any thread since the program
+// started. Programs linking allocation-counter.cc replace the global operator
+// new to count them and, with glibc, malloc, calloc and realloc too, so that
+// allocations made by C code are counted as well.
+int64_t HeapAllocations();
+
+}  // namespace bench_utils
+
+#endif  // BENCH_ALLOCATION_COUNTER_H_
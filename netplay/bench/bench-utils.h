@@ -0,0 +1,111 @@
+#ifndef BENCH_BENCH_UTILS_H_
+#define BENCH_BENCH_UTILS_H_
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "base/netplayServiceProto.pb.h"
+#include "client/loopback-event-transport.h"
+#include "client/mocks.h"
+#include "gmock/gmock.h"
+
+namespace bench_utils {
+
+// Returns a StartGamePB that connects the given ports with the given delay.
+inline StartGamePB MakeStartGame(int64_t console_id,
+                                 const std::vector<Port>& ports,
+                                 int delay_frames = 0) {
+  StartGamePB start_game;
+  start_game.set_console_id(console_id);
+  for (Port port : ports) {
+    StartGamePB::ConnectedPortPB* connected_port =
+        start_game.add_connected_ports();
+    connected_port->set_port(port);
+    connected_port->set_delay_frames(delay_frames);
+  }
+  return start_game;
+}
+
+// Plays both the server and a remote player who mirrors every button press of
+// the local player. Once the client sends its ClientReadyPB, the peer replies
+// with the given StartGamePB. Buttons written for a port in mirrored_ports are
+// then delivered back as the same buttons on the mapped remote port and frame,
+// so that remote buttons arrive as soon as the local ones are sent, or
+// reply_delay_micros later, which makes the local player wait for them when
+// events are written and read on other threads.
+//
+// Replies are built in a reused message, which the transport swaps into its
+// ring, so that once warmed up exchanging buttons allocates nothing. Frame
+// statuses are not relayed, unlike the server does: clearing a delivered event
+// frees its submessages, which would allocate a new status for every reply.
+class MirrorPeer : public LoopbackEventTransport::Peer {
+ public:
+  MirrorPeer(const StartGamePB& start_game,
+             const std::map<Port, Port>& mirrored_ports,
+             int reply_delay_micros = 0)
+      : mirrored_ports_(mirrored_ports),
+        reply_delay_micros_(reply_delay_micros) {
+    *start_game_event_.mutable_start_game() = start_game;
+  }
+
+  void HandleEvent(const OutgoingEventPB& event,
+                   LoopbackEventTransport* transport) override {
+    if (event.has_client_ready()) {
+      reply_ = start_game_event_;
+      transport->Deliver(&reply_);
+    }
+
+    if (event.key_press_size() > 0) {
+      if (reply_delay_micros_ > 0) {
+        std::this_thread::sleep_for(
+            std::chrono::microseconds(reply_delay_micros_));
+      }
+      for (const KeyStatePB& keys : event.key_press()) {
+        auto it = mirrored_ports_.find(keys.port());
+        if (it == mirrored_ports_.end()) {
+          continue;
+        }
+        KeyStatePB* mirrored_keys = reply_.add_key_press();
+        *mirrored_keys = keys;
+        mirrored_keys->set_port(it->second);
+      }
+      transport->Deliver(&reply_);
+    }
+  }
+
+ private:
+  IncomingEventPB start_game_event_;
+  const std::map<Port, Port> mirrored_ports_;
+  const int reply_delay_micros_;
+  // Only touched on the handler's writing thread.
+  IncomingEventPB reply_;
+};
+
+// Returns a stub that accepts any PlugController request for the given
+// console, assigning the requested ports to the given client. Events are not
+// exchanged through the stub, but through a LoopbackEventTransport.
+inline std::shared_ptr<NetPlayServerService::StubInterface> MakeLoopbackStub(
+    int64_t console_id, int64_t client_id, const std::vector<Port>& ports) {
+  auto* stub = new testing::NiceMock<MockNetPlayServerServiceStub>();
+
+  PlugControllerResponsePB response;
+  response.set_status(PlugControllerResponsePB::SUCCESS);
+  response.set_console_id(console_id);
+  response.set_client_id(client_id);
+  for (Port port : ports) {
+    response.add_port(port);
+  }
+  ON_CALL(*stub, PlugController(testing::_, testing::_, testing::_))
+      .WillByDefault(testing::DoAll(testing::SetArgPointee<2>(response),
+                                    testing::Return(grpc::Status::OK)));
+
+  return std::shared_ptr<NetPlayServerService::StubInterface>(stub);
+}
+
+}  // namespace bench_utils
+
+#endif  // BENCH_BENCH_UTILS_H_
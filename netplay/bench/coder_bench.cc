@@ -0,0 +1,83 @@
+#include "base/netplayServiceProto.pb.h"
+#include "benchmark/benchmark.h"
+#include "client/plugins/mupen64/coder.h"
+
+namespace {
+
+// Buttons with a mix of pressed buttons and non-zero axes.
+BUTTONS MakeButtons() {
+  BUTTONS buttons;
+  buttons.Value = 0;
+  buttons.A_BUTTON = 1;
+  buttons.Z_TRIG = 1;
+  buttons.U_CBUTTON = 1;
+  buttons.X_AXIS = 80;
+  buttons.Y_AXIS = -40;
+  return buttons;
+}
+
+// Encodes in the packed form if packed is set, and per field otherwise.
+void Encode(const Mupen64ButtonCoder& coder, bool packed, const BUTTONS& in,
+            KeyStatePB* out) {
+  if (packed) {
+    coder.EncodePackedButtons(in, out);
+  } else {
+    coder.EncodeButtons(in, out);
+  }
+}
+
+// The benchmark argument selects the packed form.
+void BM_Mupen64ButtonCoderEncodeButtons(benchmark::State& state) {
+  const Mupen64ButtonCoder coder;
+  const BUTTONS buttons = MakeButtons();
+  KeyStatePB keys;
+  while (state.KeepRunning()) {
+    Encode(coder, state.range(0) != 0, buttons, &keys);
+    benchmark::DoNotOptimize(keys);
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_Mupen64ButtonCoderEncodeButtons)
+    ->ArgName("packed")
+    ->Arg(0)
+    ->Arg(1);
+
+void BM_Mupen64ButtonCoderDecodeButtons(benchmark::State& state) {
+  const Mupen64ButtonCoder coder;
+  KeyStatePB keys;
+  Encode(coder, state.range(0) != 0, MakeButtons(), &keys);
+  BUTTONS buttons;
+  while (state.KeepRunning()) {
+    coder.DecodeButtons(keys, &buttons);
+    benchmark::DoNotOptimize(buttons);
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_Mupen64ButtonCoderDecodeButtons)
+    ->ArgName("packed")
+    ->Arg(0)
+    ->Arg(1);
+
+// Encodes, serializes, parses and decodes the buttons, as they travel between
+// two clients. Bytes processed is the size of the serialized KeyStatePB.
+void BM_Mupen64ButtonCoderRoundTrip(benchmark::State& state) {
+  const Mupen64ButtonCoder coder;
+  const BUTTONS in = MakeButtons();
+  KeyStatePB keys;
+  std::string wire;
+  BUTTONS out;
+  while (state.KeepRunning()) {
+    Encode(coder, state.range(0) != 0, in, &keys);
+    keys.SerializeToString(&wire);
+    keys.ParseFromString(wire);
+    coder.DecodeButtons(keys, &out);
+    benchmark::DoNotOptimize(out);
+  }
+  state.SetBytesProcessed(state.iterations() * wire.size());
+}
+BENCHMARK(BM_Mupen64ButtonCoderRoundTrip)
+    ->ArgName("packed")
+    ->Arg(0)
+    ->Arg(1);
+
+}  // namespace
@@ -0,0 +1,149 @@
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "bench/allocation-counter.h"
+#include "bench/bench-utils.h"
+#include "benchmark/benchmark.h"
+#include "client/event-stream-handler.h"
+#include "client/loopback-event-transport.h"
+#include "client/test-utils.h"
+#include "client/trace-ring.h"
+
+namespace {
+
+using test_utils::IntegerCoder;
+
+typedef EventStreamHandler<uint32_t> IntHandler;
+
+const int kConsoleId = 1;
+const int kClientId = 1;
+
+// Frames exchanged before allocations are counted, which lets the queues and
+// the reused messages grow to their steady-state size.
+const int kWarmupFrames = 256;
+
+// One iteration is one emulated frame with a local port 1 and a remote port 2
+// whose player mirrors port 1: put the local buttons, then get the buttons of
+// both ports, one port at a time or with a single GetFrame call. Reports the
+// heap allocations made per frame once warmed up.
+void PutGetButtons(benchmark::State& state, bool whole_frame) {
+  EventStreamHandlerOptions options;
+  options.background_reader = state.range(0) != 0;
+  options.async_write_queue_size = state.range(1);
+  options.queue_backend =
+      state.range(2) != 0 ? InputQueueBackend::RING : InputQueueBackend::MAP;
+
+  bench_utils::MirrorPeer peer(
+      bench_utils::MakeStartGame(kConsoleId, {PORT_1, PORT_2}),
+      {{PORT_1, PORT_2}});
+  const IntegerCoder coder;
+  TraceRing trace;
+  std::unique_ptr<IntHandler> handler(new IntHandler(
+      kConsoleId, kClientId, {PORT_1}, &trace, &coder,
+      std::unique_ptr<EventTransport>(new LoopbackEventTransport(&peer)),
+      options));
+  if (!handler->ClientReady() || !handler->WaitForConsoleStart()) {
+    state.SkipWithError("Failed to start the console");
+    return;
+  }
+
+  int frame = 0;
+  std::vector<IntHandler::ButtonsFrameTuple> buttons_tuples(1);
+  uint32_t buttons[4];
+  auto exchange_frame = [&]() {
+    buttons_tuples[0] = std::make_tuple(PORT_1, frame, frame);
+    bool ok = handler->PutButtons(buttons_tuples) ==
+              IntHandler::PutButtonsStatus::SUCCESS;
+    if (ok && whole_frame) {
+      ok = handler->GetFrame(frame, buttons) ==
+           IntHandler::GetButtonsStatus::SUCCESS;
+    } else if (ok) {
+      ok = handler->GetButtons(PORT_1, frame, &buttons[0]) ==
+               IntHandler::GetButtonsStatus::SUCCESS &&
+           handler->GetButtons(PORT_2, frame, &buttons[1]) ==
+               IntHandler::GetButtonsStatus::SUCCESS;
+    }
+    benchmark::DoNotOptimize(buttons);
+    ++frame;
+    return ok;
+  };
+
+  for (int i = 0; i < kWarmupFrames; ++i) {
+    if (!exchange_frame()) {
+      state.SkipWithError("Failed to exchange buttons");
+      return;
+    }
+  }
+
+  const int64_t heap_allocations = bench_utils::HeapAllocations();
+  while (state.KeepRunning()) {
+    if (!exchange_frame()) {
+      state.SkipWithError("Failed to exchange buttons");
+      break;
+    }
+  }
+  state.SetItemsProcessed(state.iterations());
+  state.counters["allocs_per_frame"] =
+      static_cast<double>(bench_utils::HeapAllocations() - heap_allocations) /
+      state.iterations();
+}
+
+// The benchmark arguments are EventStreamHandlerOptions' background_reader and
+// async_write_queue_size, and whether the queues use the ring backend. Map
+// queues allocate a node per frame, ring queues allocate nothing.
+void BM_EventStreamHandlerPutGetButtons(benchmark::State& state) {
+  PutGetButtons(state, false);
+}
+BENCHMARK(BM_EventStreamHandlerPutGetButtons)
+    ->ArgNames({"background_reader", "async_write_queue_size", "ring_queues"})
+    ->Args({0, 0, 0})
+    ->Args({1, 0, 0})
+    ->Args({1, 64, 0})
+    ->Args({0, 0, 1})
+    ->Args({1, 0, 1})
+    ->Args({1, 64, 1})
+    ->UseRealTime();
+
+void BM_EventStreamHandlerPutGetFrame(benchmark::State& state) {
+  PutGetButtons(state, true);
+}
+BENCHMARK(BM_EventStreamHandlerPutGetFrame)
+    ->ArgNames({"background_reader", "async_write_queue_size", "ring_queues"})
+    ->Args({0, 0, 0})
+    ->Args({1, 0, 0})
+    ->Args({1, 64, 0})
+    ->Args({0, 0, 1})
+    ->Args({1, 0, 1})
+    ->Args({1, 64, 1})
+    ->UseRealTime();
+
+// One iteration looks up the per-port state of each of the four ports, as
+// every call on the per-frame path does for the ports it is given, through
+// DelayFramesForPort. Port 1 is local and ports 2 to 4 are remote.
+void BM_EventStreamHandlerPortLookup(benchmark::State& state) {
+  bench_utils::MirrorPeer peer(
+      bench_utils::MakeStartGame(kConsoleId, {PORT_1, PORT_2, PORT_3, PORT_4}),
+      {});
+  const IntegerCoder coder;
+  TraceRing trace;
+  std::unique_ptr<IntHandler> handler(new IntHandler(
+      kConsoleId, kClientId, {PORT_1}, &trace, &coder,
+      std::unique_ptr<EventTransport>(new LoopbackEventTransport(&peer)),
+      EventStreamHandlerOptions()));
+  if (!handler->ClientReady() || !handler->WaitForConsoleStart()) {
+    state.SkipWithError("Failed to start the console");
+    return;
+  }
+
+  const Port ports[] = {PORT_1, PORT_2, PORT_3, PORT_4};
+  while (state.KeepRunning()) {
+    for (const Port port : ports) {
+      benchmark::DoNotOptimize(handler->DelayFramesForPort(port));
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * 4);
+}
+BENCHMARK(BM_EventStreamHandlerPortLookup);
+
+}  // namespace
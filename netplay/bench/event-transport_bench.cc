@@ -0,0 +1,114 @@
+#include <memory>
+#include <string>
+
+#include <unistd.h>
+
+#include "benchmark/benchmark.h"
+#include "client/loopback-event-transport.h"
+#include "client/shm-event-transport.h"
+#include "client/udp-event-transport.h"
+
+namespace {
+
+const int kConsoleId = 1;
+
+// Two transports of clients on the same host, and the control transports
+// they wrap, through which the game is started once both are ready.
+template <typename Transport>
+struct TransportPair {
+  LoopbackEventTransport* control[2];
+  std::unique_ptr<Transport> transport[2];
+};
+
+// Sends the ClientReadyPB of both open transports and starts the game.
+template <typename Transport>
+bool StartGame(TransportPair<Transport>* pair) {
+  for (int i = 0; i < 2; ++i) {
+    OutgoingEventPB ready;
+    ready.mutable_client_ready()->set_console_id(kConsoleId);
+    ready.mutable_client_ready()->set_client_id(i + 1);
+    if (!pair->transport[i]->Write(ready)) {
+      return false;
+    }
+  }
+  for (int i = 0; i < 2; ++i) {
+    IncomingEventPB start_game;
+    start_game.mutable_start_game()->set_console_id(kConsoleId);
+    if (!pair->control[i]->Deliver(&start_game) ||
+        !pair->transport[i]->Read(&start_game)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// One iteration sends a key press from the first transport to the second,
+// which sends it back, as two players exchanging a frame in lockstep do.
+template <typename Transport>
+void RoundTrip(benchmark::State& state, TransportPair<Transport>* pair) {
+  if (!StartGame(pair)) {
+    state.SkipWithError("Failed to start the game");
+    return;
+  }
+
+  OutgoingEventPB outgoing;
+  KeyStatePB* key_press = outgoing.add_key_press();
+  key_press->set_console_id(kConsoleId);
+  IncomingEventPB incoming;
+  int frame = 0;
+  while (state.KeepRunning()) {
+    key_press->set_port(PORT_1);
+    key_press->set_frame_number(frame);
+    bool ok = pair->transport[0]->Write(outgoing) &&
+              pair->transport[1]->Read(&incoming);
+    key_press->set_port(PORT_2);
+    ok = ok && pair->transport[1]->Write(outgoing) &&
+         pair->transport[0]->Read(&incoming);
+    if (!ok) {
+      state.SkipWithError("Failed to exchange key presses");
+      break;
+    }
+    ++frame;
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+void BM_ShmEventTransportRoundTrip(benchmark::State& state) {
+  ShmEventTransportOptions options;
+  options.name_prefix = "/netplay-bench-" + std::to_string(getpid()) + "-";
+  TransportPair<ShmEventTransport> pair;
+  for (int i = 0; i < 2; ++i) {
+    pair.control[i] = new LoopbackEventTransport(nullptr);
+    pair.transport[i].reset(new ShmEventTransport(
+        std::unique_ptr<EventTransport>(pair.control[i]), options));
+    if (!pair.transport[i]->Open()) {
+      state.SkipWithError("Failed to open the transports");
+      return;
+    }
+  }
+  RoundTrip(state, &pair);
+}
+BENCHMARK(BM_ShmEventTransportRoundTrip)->UseRealTime();
+
+// The same over UDP on 127.0.0.1, for comparison.
+void BM_UdpEventTransportRoundTrip(benchmark::State& state) {
+  TransportPair<UdpEventTransport> pair;
+  for (int i = 0; i < 2; ++i) {
+    pair.control[i] = new LoopbackEventTransport(nullptr);
+    pair.transport[i].reset(new UdpEventTransport(
+        std::unique_ptr<EventTransport>(pair.control[i]),
+        UdpEventTransportOptions()));
+    if (!pair.transport[i]->Open()) {
+      state.SkipWithError("Failed to open the transports");
+      return;
+    }
+  }
+  for (int i = 0; i < 2; ++i) {
+    pair.transport[i]->AddPeer(
+        "127.0.0.1:" + std::to_string(pair.transport[1 - i]->local_port()));
+  }
+  RoundTrip(state, &pair);
+}
+BENCHMARK(BM_UdpEventTransportRoundTrip)->UseRealTime();
+
+}  // namespace
@@ -0,0 +1,88 @@
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <thread>
+
+#include "benchmark/benchmark.h"
+#include "client/input-queue.h"
+
+namespace {
+
+typedef InputQueue<uint32_t> IntQueue;
+
+// Frames handed from the producer to the consumer per iteration of the
+// cross-thread benchmark. Smaller than the ring capacity, so that the producer
+// never runs far enough ahead to be rejected.
+const int kCrossThreadBatch = 128;
+
+// Puts and gets one frame per iteration on the same thread. The benchmark
+// argument is the InputQueueBackend.
+void BM_InputQueuePutGetSameThread(benchmark::State& state) {
+  std::unique_ptr<IntQueue> queue(IntQueue::MakeRemoteQueue(
+      0, static_cast<InputQueueBackend>(state.range(0))));
+
+  int frame = 0;
+  uint32_t buttons;
+  while (state.KeepRunning()) {
+    if (!queue->PutButtons(frame, frame) ||
+        queue->GetButtons(frame, IntQueue::kBlockForever, &buttons) !=
+            IntQueue::GetButtonsStatus::SUCCESS) {
+      state.SkipWithError("Queue rejected a frame");
+      break;
+    }
+    benchmark::DoNotOptimize(buttons);
+    ++frame;
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_InputQueuePutGetSameThread)
+    ->Arg(static_cast<int>(InputQueueBackend::MAP))
+    ->Arg(static_cast<int>(InputQueueBackend::RING));
+
+// A producer thread puts frames while the benchmark thread gets them, as the
+// stream reader and the emulator thread do. Each iteration releases a batch of
+// frames to the producer and waits for all of them. The benchmark argument is
+// the InputQueueBackend.
+void BM_InputQueuePutGetCrossThread(benchmark::State& state) {
+  std::unique_ptr<IntQueue> queue(IntQueue::MakeRemoteQueue(
+      0, static_cast<InputQueueBackend>(state.range(0))));
+
+  std::atomic<int> released_frames(0);
+  std::atomic<bool> stop(false);
+  std::thread producer([&] {
+    int frame = 0;
+    while (!stop.load(std::memory_order_acquire)) {
+      if (frame < released_frames.load(std::memory_order_acquire)) {
+        queue->PutButtons(frame, frame);
+        ++frame;
+      } else {
+        std::this_thread::yield();
+      }
+    }
+  });
+
+  int frame = 0;
+  uint32_t buttons;
+  while (state.KeepRunning()) {
+    released_frames.fetch_add(kCrossThreadBatch, std::memory_order_release);
+    for (int i = 0; i < kCrossThreadBatch; ++i, ++frame) {
+      if (queue->GetButtons(frame, IntQueue::kBlockForever, &buttons) !=
+          IntQueue::GetButtonsStatus::SUCCESS) {
+        state.SkipWithError("Failed to get a frame");
+        break;
+      }
+      benchmark::DoNotOptimize(buttons);
+    }
+  }
+
+  stop.store(true, std::memory_order_release);
+  queue->Close();
+  producer.join();
+  state.SetItemsProcessed(state.iterations() * kCrossThreadBatch);
+}
+BENCHMARK(BM_InputQueuePutGetCrossThread)
+    ->Arg(static_cast<int>(InputQueueBackend::MAP))
+    ->Arg(static_cast<int>(InputQueueBackend::RING))
+    ->UseRealTime();
+
+}  // namespace
@@ -0,0 +1,159 @@
+#ifndef BENCH_LOOPBACK_PLUGIN_H_
+#define BENCH_LOOPBACK_PLUGIN_H_
+
+#include <memory>
+#include <sstream>
+
+#include "bench/bench-utils.h"
+#include "client/client.h"
+#include "client/plugins/mupen64/coder.h"
+#include "client/plugins/mupen64/mocks.h"
+#include "client/plugins/mupen64/plugin-impl.h"
+#include "client/plugins/mupen64/util.h"
+#include "m64p_plugin.h"
+
+namespace bench_utils {
+
+const int kLoopbackConsoleId = 1;
+const int kLoopbackClientId = 1;
+const char kLoopbackRomName[] = "Rom Name";
+const char kLoopbackRomMd5[] = "12345678901234567890123456789012";
+
+// A PluginImpl whose single local controller, on port 1 and input channel 0,
+// plays against a remote player on port 2 who mirrors its buttons. Both ports
+// have the given delay, and the mirrored buttons arrive reply_delay_micros
+// after they are sent, see MirrorPeer.
+class LoopbackPlugin {
+ public:
+  explicit LoopbackPlugin(const EventStreamHandlerOptions& options,
+                          int delay_frames = 0, int reply_delay_micros = 0)
+      : peer_(MakeLoopbackStartGame(options, delay_frames), {{PORT_1, PORT_2}},
+              reply_delay_micros),
+        rollback_(options.rollback_frames > 0) {
+    auto* config_handler = new testing::NiceMock<MockConfigHandler>();
+    M64Config config;
+    config.enabled = true;
+    config.console_id = kLoopbackConsoleId;
+    config.port_1_request = util::PortToM64RequestedInt(PORT_1);
+    config.input_queue_backend = static_cast<int>(options.queue_backend);
+    config.background_reader = options.background_reader;
+    config.async_write_queue_size = options.async_write_queue_size;
+    config.rollback_frames = options.rollback_frames;
+    config.prediction_strategy = static_cast<int>(options.prediction_strategy);
+    config.measure_predictions = options.measure_predictions;
+    config.time_sync_window_frames = options.time_sync_window_frames;
+    config.delay_adjust_window_frames = options.delay_adjust_window_frames;
+    config.wait_max_spin_micros = options.wait_max_spin_micros;
+    config.wait_yield_micros = options.wait_yield_micros;
+    config.coalesce_max_frames = options.coalesce_max_frames;
+    config.coalesce_deadline_micros = options.coalesce_deadline_micros;
+    config.run_length_buttons = options.run_length_buttons;
+    config_handler->ExpectConfig(config);
+
+    auto* netplay_client = new NetplayClient<BUTTONS>(
+        MakeLoopbackStub(kLoopbackConsoleId, kLoopbackClientId, {PORT_1}),
+        std::unique_ptr<ButtonCoderInterface<BUTTONS>>(
+            new Mupen64ButtonCoder()),
+        0,  // delay_frames
+        options);
+    netplay_client->set_transport_factory([this]() {
+      return std::unique_ptr<EventTransport>(
+          new LoopbackEventTransport(&peer_));
+    });
+    trace_ = netplay_client->mutable_trace();
+    std::unique_ptr<PluginImpl::M64Client> client(netplay_client);
+
+    // Join the existing console.
+    cin_ << "n" << std::endl << kLoopbackConsoleId << std::endl;
+
+    plugin_.reset(
+        new PluginImpl(config_handler, &cin_, &cout_, std::move(client)));
+
+    for (int i = 0; i < 4; ++i) {
+      controls_[i] = {};
+      netplay_controllers_[i] = {};
+    }
+    controls_[0].Present = 1;
+    netplay_info_.Enabled = &netplay_enabled_;
+    netplay_info_.Controls = controls_;
+    netplay_info_.NetplayControls = netplay_controllers_;
+  }
+
+  bool Initiate() {
+    return plugin_->InitiateNetplay(&netplay_info_, kLoopbackRomName,
+                                    kLoopbackRomMd5);
+  }
+
+  // Emulates the given frame as called by the core: puts the buttons of the
+  // local port, then gets the buttons of both ports into buttons(). In
+  // rollback mode, the buttons are got speculatively, and rollbacks are taken
+  // but not replayed. Returns false if any call fails.
+  bool RunFrame(int frame) {
+    BUTTONS local_buttons;
+    local_buttons.Value = 0;
+    local_buttons.A_BUTTON = 1;
+    m64p_netplay_frame_update put_update = {util::PortToM64Port(PORT_1), frame,
+                                            &local_buttons};
+    m64p_netplay_frame_update get_update_1 = {util::PortToM64Port(PORT_1),
+                                              frame, &buttons_[0]};
+    m64p_netplay_frame_update get_update_2 = {util::PortToM64Port(PORT_2),
+                                              frame, &buttons_[1]};
+    if (!plugin_->PutButtons(&put_update, 1)) {
+      return false;
+    }
+    if (rollback_) {
+      int predicted;
+      const bool success =
+          plugin_->GetSpeculativeButtons(&get_update_1, &predicted) &&
+          plugin_->GetSpeculativeButtons(&get_update_2, &predicted);
+      plugin_->GetRollbackFrame();
+      return success;
+    }
+    return plugin_->GetButtons(&get_update_1) &&
+           plugin_->GetButtons(&get_update_2);
+  }
+
+  PluginImpl* plugin() { return plugin_.get(); }
+
+  // The trace of the plugin's client, whose snapshots summarize the stats of
+  // its event stream handler.
+  TraceRing* trace() { return trace_; }
+
+  // The buttons of ports 1 and 2 got by the last call to RunFrame.
+  const BUTTONS* buttons() const { return buttons_; }
+
+ private:
+  static StartGamePB MakeLoopbackStartGame(
+      const EventStreamHandlerOptions& options, int delay_frames);
+
+  // Outlives the plugin, whose event stream handler writes to it.
+  MirrorPeer peer_;
+
+  std::stringstream cin_;
+  std::stringstream cout_;
+  std::unique_ptr<PluginImpl> plugin_;
+  // Owned by plugin_.
+  TraceRing* trace_;
+  const bool rollback_;
+
+  CONTROL controls_[4];
+  NETPLAY_CONTROLLER netplay_controllers_[4];
+  int netplay_enabled_;
+  NETPLAY_INFO netplay_info_;
+
+  BUTTONS buttons_[2];
+};
+
+// static
+inline StartGamePB LoopbackPlugin::MakeLoopbackStartGame(
+    const EventStreamHandlerOptions& options, int delay_frames) {
+  StartGamePB start_game =
+      MakeStartGame(kLoopbackConsoleId, {PORT_1, PORT_2}, delay_frames);
+  // The server compresses key presses if every client offers to.
+  start_game.set_run_length_buttons(options.run_length_buttons);
+  return start_game;
+}
+
+}  // namespace bench_utils
+
+#endif  // BENCH_LOOPBACK_PLUGIN_H_
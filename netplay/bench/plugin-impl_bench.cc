@@ -0,0 +1,36 @@
+#include "bench/loopback-plugin.h"
+#include "benchmark/benchmark.h"
+
+namespace {
+
+// One iteration is one emulated frame, as called by the core: put the buttons
+// of the local port, then get the buttons of both ports. The benchmark
+// argument is EventStreamHandlerOptions::background_reader.
+void BM_PluginImplPutGetButtons(benchmark::State& state) {
+  EventStreamHandlerOptions options;
+  options.background_reader = state.range(0) != 0;
+  bench_utils::LoopbackPlugin loopback(options);
+  if (!loopback.Initiate()) {
+    state.SkipWithError("Failed to initiate netplay");
+    return;
+  }
+
+  int frame = 0;
+  while (state.KeepRunning()) {
+    if (!loopback.RunFrame(frame)) {
+      state.SkipWithError("Failed to exchange buttons");
+      break;
+    }
+    benchmark::DoNotOptimize(loopback.buttons()[0]);
+    benchmark::DoNotOptimize(loopback.buttons()[1]);
+    ++frame;
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_PluginImplPutGetButtons)
+    ->ArgName("background_reader")
+    ->Arg(0)
+    ->Arg(1)
+    ->UseRealTime();
+
+}  // namespace
@@ -0,0 +1,159 @@
+#include "bench/allocation-counter.h"
+#include "bench/loopback-plugin.h"
+#include "gtest/gtest.h"
+
+namespace {
+
+// Frames run before counting, which let queues, rings and messages grow to
+// their working sizes.
+const int kWarmupFrames = 256;
+const int kSteadyStateFrames = 10000;
+
+// Delay after which the peer replies, in the cases that need the buttons of
+// the remote port to be late.
+const int kReplyDelayMicros = 50;
+
+// Runs a loopback plugin with the given options, delay and peer reply delay
+// through the warm-up frames, then returns the number of heap allocations
+// made by any thread during the following kSteadyStateFrames frames. If
+// timings isn't null, it then receives a snapshot of the plugin's trace, to
+// check that the options were exercised.
+int64_t SteadyStateAllocations(const EventStreamHandlerOptions& options,
+                               int delay_frames = 0,
+                               int reply_delay_micros = 0,
+                               TimingsPB* timings = nullptr) {
+  bench_utils::LoopbackPlugin loopback(options, delay_frames,
+                                       reply_delay_micros);
+  EXPECT_TRUE(loopback.Initiate());
+
+  int frame = 0;
+  for (; frame < kWarmupFrames; ++frame) {
+    EXPECT_TRUE(loopback.RunFrame(frame));
+  }
+
+  const int64_t allocations_before = bench_utils::HeapAllocations();
+  bool success = true;
+  for (; frame < kWarmupFrames + kSteadyStateFrames; ++frame) {
+    // Check without EXPECT, which would allocate when it fails.
+    success = loopback.RunFrame(frame) && success;
+  }
+  const int64_t allocations =
+      bench_utils::HeapAllocations() - allocations_before;
+
+  EXPECT_TRUE(success);
+  BUTTONS expected_buttons;
+  expected_buttons.Value = 0;
+  expected_buttons.A_BUTTON = 1;
+  EXPECT_EQ(expected_buttons.Value, loopback.buttons()[0].Value);
+  EXPECT_EQ(expected_buttons.Value, loopback.buttons()[1].Value);
+  if (timings != nullptr) {
+    loopback.trace()->Snapshot(timings);
+  }
+  return allocations;
+}
+
+}  // namespace
+
+TEST(SteadyStateAllocationTest, MapQueues) {
+  EventStreamHandlerOptions options;
+  options.queue_backend = InputQueueBackend::MAP;
+  EXPECT_EQ(0, SteadyStateAllocations(options));
+}
+
+TEST(SteadyStateAllocationTest, RingQueues) {
+  EventStreamHandlerOptions options;
+  options.queue_backend = InputQueueBackend::RING;
+  EXPECT_EQ(0, SteadyStateAllocations(options));
+}
+
+TEST(SteadyStateAllocationTest, AsyncWrites) {
+  EventStreamHandlerOptions options;
+  options.queue_backend = InputQueueBackend::RING;
+  options.async_write_queue_size = 64;
+  EXPECT_EQ(0, SteadyStateAllocations(options));
+}
+
+TEST(SteadyStateAllocationTest, BackgroundReader) {
+  EventStreamHandlerOptions options;
+  options.queue_backend = InputQueueBackend::RING;
+  options.background_reader = true;
+  EXPECT_EQ(0, SteadyStateAllocations(options));
+}
+
+TEST(SteadyStateAllocationTest, WaitStrategy) {
+  EventStreamHandlerOptions options;
+  options.queue_backend = InputQueueBackend::RING;
+  options.background_reader = true;
+  options.async_write_queue_size = 64;
+  options.wait_max_spin_micros = 20;
+  options.wait_yield_micros = 20;
+  TimingsPB timings;
+  EXPECT_EQ(0, SteadyStateAllocations(options, 0, kReplyDelayMicros, &timings));
+
+  ASSERT_EQ(1, timings.wait_stats_size());
+  int64_t waits = 0;
+  for (const WaitPhaseStatsPB& phase : timings.wait_stats(0).phase()) {
+    waits += phase.waits();
+  }
+  EXPECT_LT(0, waits);
+}
+
+TEST(SteadyStateAllocationTest, TimeSync) {
+  EventStreamHandlerOptions options;
+  options.queue_backend = InputQueueBackend::RING;
+  options.background_reader = true;
+  options.time_sync_window_frames = 60;
+  EXPECT_EQ(0, SteadyStateAllocations(options));
+}
+
+TEST(SteadyStateAllocationTest, DelayAdjust) {
+  EventStreamHandlerOptions options;
+  options.queue_backend = InputQueueBackend::RING;
+  options.background_reader = true;
+  options.delay_adjust_window_frames = 60;
+  TimingsPB timings;
+  EXPECT_EQ(0, SteadyStateAllocations(options, 2, 0, &timings));
+
+  ASSERT_EQ(1, timings.delay_adjustment_size());
+  EXPECT_LT(0, timings.delay_adjustment(0).observed_frames());
+}
+
+TEST(SteadyStateAllocationTest, Coalescing) {
+  EventStreamHandlerOptions options;
+  options.queue_backend = InputQueueBackend::RING;
+  options.coalesce_max_frames = 4;
+  EXPECT_EQ(0, SteadyStateAllocations(options, 4));
+}
+
+TEST(SteadyStateAllocationTest, RunLengthButtons) {
+  EventStreamHandlerOptions options;
+  options.queue_backend = InputQueueBackend::RING;
+  options.coalesce_max_frames = 4;
+  options.run_length_buttons = true;
+  EXPECT_EQ(0, SteadyStateAllocations(options, 4));
+}
+
+TEST(SteadyStateAllocationTest, MeasurePredictions) {
+  EventStreamHandlerOptions options;
+  options.queue_backend = InputQueueBackend::RING;
+  options.background_reader = true;
+  options.async_write_queue_size = 64;
+  options.measure_predictions = true;
+  TimingsPB timings;
+  EXPECT_EQ(0, SteadyStateAllocations(options, 0, kReplyDelayMicros, &timings));
+
+  ASSERT_EQ(1, timings.prediction_stats_size());
+  EXPECT_LT(0, timings.prediction_stats(0).predicted_frames());
+}
+
+TEST(SteadyStateAllocationTest, Rollback) {
+  EventStreamHandlerOptions options;
+  options.queue_backend = InputQueueBackend::RING;
+  options.background_reader = true;
+  options.rollback_frames = 8;
+  TimingsPB timings;
+  EXPECT_EQ(0, SteadyStateAllocations(options, 0, 0, &timings));
+
+  ASSERT_EQ(1, timings.prediction_stats_size());
+  EXPECT_LT(0, timings.prediction_stats(0).predicted_frames());
+}
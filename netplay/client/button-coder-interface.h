@@ -5,14 +5,40 @@
 
 // Abstract interface for encoding and decoding buttons to and from a KeyStatePB
 // object.
+//
+// Buttons have two wire forms: one KeyStatePB field per button and axis, and
+// the optional packed form, where all of them are stored in the single
+// packed_buttons field. The packed form is only used for a session if every
+// client's coder supports it.
 template <typename ButtonsType>
 class ButtonCoderInterface {
  public:
   virtual ~ButtonCoderInterface() {}
   virtual bool EncodeButtons(const ButtonsType& buttons_in,
                              KeyStatePB* buttons_out) const = 0;
+  // Decodes buttons in either wire form if SupportsPackedButtons returns
+  // true, and in the per-field form otherwise.
   virtual bool DecodeButtons(const KeyStatePB& buttons_in,
                              ButtonsType* buttons_out) const = 0;
+
+  // Returns true if the coder implements EncodePackedButtons.
+  virtual bool SupportsPackedButtons() const { return false; }
+
+  // Encodes buttons in the packed form. Only called if SupportsPackedButtons
+  // returns true.
+  virtual bool EncodePackedButtons(const ButtonsType& /* buttons_in */,
+                                   KeyStatePB* /* buttons_out */) const {
+    return false;
+  }
+
+  // Returns the buttons a player who pressed buttons is expected to press
+  // frames_ahead frames later if they keep holding the digital buttons and let
+  // go of the analog controls. Used to predict remote buttons. The default
+  // keeps everything held.
+  virtual ButtonsType DecayButtons(const ButtonsType& buttons,
+                                   int /* frames_ahead */) const {
+    return buttons;
+  }
 };
 
 #endif  // BUTTON_CODER_INTERFACE_H_
@@ -1,14 +1,17 @@
 #ifndef CLIENT_H_
 #define CLIENT_H_
 
+#include <functional>
 #include <memory>
 #include <string>
 #include <vector>
 
 #include "base/netplayServiceProto.grpc.pb.h"
-#include "base/timings.pb.h"
 #include "client/button-coder-interface.h"
+#include "client/delay-tuner.h"
 #include "client/event-stream-handler.h"
+#include "client/event-transport.h"
+#include "client/trace-ring.h"
 
 template <typename ButtonsType>
 class NetplayClientInterface {
@@ -23,7 +26,7 @@ class NetplayClientInterface {
   virtual const std::vector<Port>& local_ports() const = 0;
   virtual std::shared_ptr<NetPlayServerService::StubInterface> stub() const = 0;
 
-  virtual TimingsPB* mutable_timings() = 0;
+  virtual TraceRing* mutable_trace() = 0;
 
   // To mock out MakeEventStreamHandler, override MakeEventStreamHandlerRaw.
   std::unique_ptr<EventStreamHandlerInterface<ButtonsType>>
@@ -42,14 +45,28 @@ class NetplayClient : public NetplayClientInterface<ButtonsType> {
  public:
   static const int kNoConsoleId = -1;
 
+  // Makes the transport of each event stream handler made by this client.
+  typedef std::function<std::unique_ptr<EventTransport>()> TransportFactory;
+
   // A note on return convention for client methods that call RPCs: These
   // methods return true if all RPC calls succeed. In the case of RPC success,
   // these methods populate *status with the appropriate server status code.
 
   // Creates a new client with the given local frame delay and console ID.
+  // Event stream handlers made by this client are constructed with
+  // handler_options.
   NetplayClient(std::shared_ptr<NetPlayServerService::StubInterface> stub,
                 std::unique_ptr<ButtonCoderInterface<ButtonsType>> coder,
-                int delay_frames);
+                int delay_frames,
+                const EventStreamHandlerOptions& handler_options =
+                    EventStreamHandlerOptions());
+
+  // Measures the round trip time to the server and replaces the delay frames
+  // with the delay it calls for. The measurements are kept in the trace. Must
+  // be called before PlugControllers, which sends the delay to the server.
+  // Returns false, keeping the current delay, if every ping failed.
+  bool TuneDelayFrames(
+      const DelayTunerOptions& tuner_options = DelayTunerOptions());
 
   // Request that the given ports be plugged into the server's virtual console.
   // Returns the resulting status code returned from the server for this
@@ -67,7 +84,14 @@ class NetplayClient : public NetplayClientInterface<ButtonsType> {
     return stub_;
   }
 
-  TimingsPB* mutable_timings() override { return &timings_; }
+  TraceRing* mutable_trace() override { return &trace_; }
+
+  // Makes the event stream handlers made from now on exchange events through
+  // transports made by factory, instead of the server's event stream. An empty
+  // factory restores the server's event stream.
+  void set_transport_factory(TransportFactory factory) {
+    transport_factory_ = std::move(factory);
+  }
 
  protected:
   // Create an event stream handler that will receive and transmit game events.
@@ -76,7 +100,8 @@ class NetplayClient : public NetplayClientInterface<ButtonsType> {
       override;
 
  private:
-  const int delay_frames_;
+  int delay_frames_;
+  const EventStreamHandlerOptions handler_options_;
   std::unique_ptr<ButtonCoderInterface<ButtonsType>> coder_;
   // Client ID and console ID are set by the PlugControllers method.
   int64_t console_id_;
@@ -84,9 +109,12 @@ class NetplayClient : public NetplayClientInterface<ButtonsType> {
 
   std::vector<Port> local_ports_;
 
-  TimingsPB timings_;
+  // Timing events of this client and the event stream handlers it makes.
+  TraceRing trace_;
 
   std::shared_ptr<NetPlayServerService::StubInterface> stub_;
+  // If empty, handlers use the server's event stream.
+  TransportFactory transport_factory_;
 };
 
 #include "client.hpp"
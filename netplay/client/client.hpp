@@ -4,7 +4,6 @@
 #include <iostream>
 
 #include "base/netplayServiceProto.grpc.pb.h"
-#include "client/utils.h"
 #include "glog/logging.h"
 #include "grpc++/create_channel.h"
 #include "grpc++/client_context.h"
@@ -12,13 +11,30 @@
 template <typename ButtonsType>
 NetplayClient<ButtonsType>::NetplayClient(
     std::shared_ptr<NetPlayServerService::StubInterface> stub,
-    std::unique_ptr<ButtonCoderInterface<ButtonsType>> coder, int delay_frames)
+    std::unique_ptr<ButtonCoderInterface<ButtonsType>> coder, int delay_frames,
+    const EventStreamHandlerOptions& handler_options)
     : delay_frames_(delay_frames),
+      handler_options_(handler_options),
       coder_(std::move(coder)),
       console_id_(-1),
       client_id_(-1),
       stub_(stub) {}
 
+template <typename ButtonsType>
+bool NetplayClient<ButtonsType>::TuneDelayFrames(
+    const DelayTunerOptions& tuner_options) {
+  DelayTuner tuner(stub_, &trace_, tuner_options);
+  DelayTuningPB tuning;
+  if (!tuner.Tune(&tuning)) {
+    LOG(ERROR) << "Failed to tune the delay, keeping " << delay_frames_
+               << " delay frames";
+    return false;
+  }
+
+  delay_frames_ = tuning.recommended_delay_frames();
+  return true;
+}
+
 template <typename ButtonsType>
 bool NetplayClient<ButtonsType>::PlugControllers(
     int64_t console_id, const std::string& rom_md5,
@@ -58,11 +74,9 @@ bool NetplayClient<ButtonsType>::PlugControllers(
                        std::chrono::milliseconds(5000));
   VLOG(3) << "Requesting controllers with message: \n" << request.DebugString();
 
-  mutable_timings()->add_event()->set_plug_controller_request(
-      client_utils::now_nanos());
+  mutable_trace()->Record(TimingEventPB::kPlugControllerRequest);
   grpc::Status rpc_status = stub_->PlugController(&context, request, &response);
-  mutable_timings()->add_event()->set_plug_controller_response(
-      client_utils::now_nanos());
+  mutable_trace()->Record(TimingEventPB::kPlugControllerResponse);
   if (!rpc_status.ok()) {
     LOG(ERROR) << "RPC failed with error message:\""
                << rpc_status.error_message() << "\"";
@@ -91,6 +105,12 @@ bool NetplayClient<ButtonsType>::PlugControllers(
 template <typename ButtonsType>
 EventStreamHandlerInterface<ButtonsType>*
 NetplayClient<ButtonsType>::MakeEventStreamHandlerRaw() {
+  if (transport_factory_) {
+    return new EventStreamHandler<ButtonsType>(
+        console_id_, client_id_, local_ports_, &trace_, coder_.get(),
+        transport_factory_(), handler_options_);
+  }
   return new EventStreamHandler<ButtonsType>(
-      console_id_, client_id_, local_ports_, &timings_, coder_.get(), stub_);
+      console_id_, client_id_, local_ports_, &trace_, coder_.get(), stub_,
+      handler_options_);
 }
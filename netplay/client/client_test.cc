@@ -9,6 +9,7 @@
 #include <vector>
 
 #include "client/host-utils.h"
+#include "client/loopback-event-transport.h"
 #include "client/mocks.h"
 #include "client/test-utils.h"
 
@@ -22,6 +23,7 @@ using std::vector;
 using ::testing::_;
 using ::testing::AtMost;
 using ::testing::DoAll;
+using ::testing::Property;
 using ::testing::Ref;
 using ::testing::Return;
 using ::testing::SetArgPointee;
@@ -138,6 +140,49 @@ TEST_F(NetplayClientTest, StartGameRPCFailure) {
   EXPECT_FALSE(host_utils::StartGame(kConsoleId, mock_stub_, &status));
 }
 
+// -----------------------------------------------------------------------------
+// TuneDelayFrames
+
+TEST_F(NetplayClientTest, TuneDelayFramesSuccess) {
+  EXPECT_CALL(*mock_stub_, Ping(_, _, _))
+      .WillRepeatedly(Return(grpc::Status::OK));
+
+  DelayTunerOptions options;
+  options.pings = 3;
+  ASSERT_TRUE(client_->TuneDelayFrames(options));
+  // A local round trip is well under a frame.
+  EXPECT_EQ(1, client_->delay_frames());
+
+  TimingsPB timings;
+  client_->mutable_trace()->Snapshot(&timings);
+  EXPECT_EQ(6, timings.event_size());
+  EXPECT_EQ(3, timings.delay_tuning().rtt_nanos_size());
+  EXPECT_EQ(1, timings.delay_tuning().recommended_delay_frames());
+
+  // The tuned delay is sent to the server.
+  PlugControllerResponsePB response;
+  response.set_console_id(kConsoleId);
+  response.set_status(PlugControllerResponsePB::SUCCESS);
+  response.set_client_id(kClientId);
+  EXPECT_CALL(*mock_stub_,
+              PlugController(
+                  _, Property(&PlugControllerRequestPB::delay_frames, 1), _))
+      .WillOnce(DoAll(SetArgPointee<2>(response), Return(grpc::Status::OK)));
+  PlugControllerResponsePB::Status status =
+      PlugControllerResponsePB::UNSPECIFIED_FAILURE;
+  EXPECT_TRUE(client_->PlugControllers(kConsoleId, kRomMD5, {PORT_1}, &status));
+}
+
+TEST_F(NetplayClientTest, TuneDelayFramesKeepsDelayOnFailure) {
+  EXPECT_CALL(*mock_stub_, Ping(_, _, _))
+      .WillRepeatedly(Return(grpc::Status::CANCELLED));
+
+  DelayTunerOptions options;
+  options.pings = 3;
+  EXPECT_FALSE(client_->TuneDelayFrames(options));
+  EXPECT_EQ(kDelayFrames, client_->delay_frames());
+}
+
 // -----------------------------------------------------------------------------
 // PlugControllers
 
@@ -161,7 +206,8 @@ TEST_F(NetplayClientTest, PlugControllerSuccess) {
     EXPECT_EQ(kClientId, client_->client_id());
   }
 
-  const auto& timings = *client_->mutable_timings();
+  TimingsPB timings;
+  client_->mutable_trace()->Snapshot(&timings);
   EXPECT_EQ(8, timings.event_size());
   EXPECT_GT(timings.event(0).plug_controller_request(), 0);
   EXPECT_GT(timings.event(1).plug_controller_response(), 0);
@@ -208,3 +254,54 @@ TEST_F(NetplayClientTest, PlugControllerRPCFailure) {
   EXPECT_FALSE(
       client_->PlugControllers(kConsoleId, kRomMD5, {PORT_1}, &status));
 }
+
+namespace {
+
+// Records the client ready events written to a LoopbackEventTransport.
+class ClientReadyPeer : public LoopbackEventTransport::Peer {
+ public:
+  void HandleEvent(const OutgoingEventPB& event,
+                   LoopbackEventTransport* /* transport */) override {
+    if (event.has_client_ready()) {
+      client_ready_events_.push_back(event.client_ready());
+    }
+  }
+
+  const vector<ClientReadyPB>& client_ready_events() const {
+    return client_ready_events_;
+  }
+
+ private:
+  vector<ClientReadyPB> client_ready_events_;
+};
+
+}  // namespace
+
+TEST_F(NetplayClientTest, MakeEventStreamHandlerWithTransportFactory) {
+  PlugControllerResponsePB response;
+  response.set_console_id(kConsoleId);
+  response.set_status(PlugControllerResponsePB::SUCCESS);
+  response.set_client_id(kClientId);
+  response.add_port(PORT_1);
+  EXPECT_CALL(*mock_stub_, PlugController(_, _, _))
+      .WillOnce(DoAll(SetArgPointee<2>(response), Return(grpc::Status::OK)));
+  EXPECT_CALL(*mock_stub_, SendEventRaw(_)).Times(0);
+
+  PlugControllerResponsePB::Status status =
+      PlugControllerResponsePB::UNSPECIFIED_FAILURE;
+  ASSERT_TRUE(client_->PlugControllers(kConsoleId, kRomMD5, {PORT_1}, &status));
+
+  ClientReadyPeer peer;
+  int transports_made = 0;
+  client_->set_transport_factory([&peer, &transports_made]() {
+    ++transports_made;
+    return std::unique_ptr<EventTransport>(new LoopbackEventTransport(&peer));
+  });
+
+  auto handler = client_->MakeEventStreamHandler();
+  EXPECT_EQ(1, transports_made);
+  ASSERT_TRUE(handler->ClientReady());
+  ASSERT_EQ(1, peer.client_ready_events().size());
+  EXPECT_EQ(kConsoleId, peer.client_ready_events()[0].console_id());
+  EXPECT_EQ(kClientId, peer.client_ready_events()[0].client_id());
+}
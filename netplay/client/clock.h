@@ -0,0 +1,30 @@
+#ifndef CLOCK_H_
+#define CLOCK_H_
+
+#include <cstdint>
+
+#include "client/utils.h"
+
+// Source of the current time, so that tests and simulations can replace the
+// real clock with one they control.
+class ClockInterface {
+ public:
+  virtual ~ClockInterface() {}
+
+  // Returns the current time in nanoseconds.
+  virtual int64_t now_nanos() const = 0;
+};
+
+// The real clock, as read by client_utils::now_nanos.
+class SystemClock : public ClockInterface {
+ public:
+  int64_t now_nanos() const override { return client_utils::now_nanos(); }
+
+  // Returns the process-wide instance.
+  static const SystemClock* Get() {
+    static const SystemClock clock;
+    return &clock;
+  }
+};
+
+#endif  // CLOCK_H_
@@ -0,0 +1,131 @@
+#include "client/delay-adjuster.h"
+
+#include <cstdlib>
+
+#include "glog/logging.h"
+
+DelayAdjuster::DelayAdjuster(int window_frames, double raise_stall_rate,
+                             double lower_stall_rate, int min_delay_frames,
+                             int max_delay_frames, int lead_frames)
+    : window_frames_(window_frames),
+      raise_stall_rate_(raise_stall_rate),
+      lower_stall_rate_(lower_stall_rate),
+      min_delay_frames_(min_delay_frames),
+      max_delay_frames_(max_delay_frames),
+      lead_frames_(lead_frames) {
+  if (window_frames_ < 0) {
+    LOG(ERROR) << "invalid window_frames: " << window_frames_;
+    std::abort();
+  }
+  if (raise_stall_rate_ <= 0 || raise_stall_rate_ > 1) {
+    LOG(ERROR) << "invalid raise_stall_rate: " << raise_stall_rate_;
+    std::abort();
+  }
+  if (lower_stall_rate_ < 0 || lower_stall_rate_ >= raise_stall_rate_) {
+    LOG(ERROR) << "invalid lower_stall_rate: " << lower_stall_rate_;
+    std::abort();
+  }
+  if (min_delay_frames_ < 0 || max_delay_frames_ < min_delay_frames_) {
+    LOG(ERROR) << "invalid delay bounds: [" << min_delay_frames_ << ", "
+               << max_delay_frames_ << "]";
+    std::abort();
+  }
+  if (lead_frames_ <= 0) {
+    LOG(ERROR) << "invalid lead_frames: " << lead_frames_;
+    std::abort();
+  }
+}
+
+void DelayAdjuster::AddPort(Port port, int delay_frames) {
+  PortState& state = ports_[port];
+  state.stats.set_port(port);
+  state.stats.set_delay_frames(delay_frames);
+}
+
+bool DelayAdjuster::ObserveFrame(Port port, int frame, bool stalled,
+                                 DelayChangePB* change) {
+  const auto it = ports_.find(port);
+  if (it == ports_.end()) {
+    return false;
+  }
+  PortState& state = it->second;
+  if (frame <= state.latest_frame || frame < state.first_counted_frame) {
+    return false;
+  }
+  state.latest_frame = frame;
+
+  state.stats.set_observed_frames(state.stats.observed_frames() + 1);
+  ++state.window_frames;
+  if (stalled) {
+    state.stats.set_stalled_frames(state.stats.stalled_frames() + 1);
+    ++state.window_stalls;
+  }
+  if (window_frames_ == 0 || state.window_frames < window_frames_) {
+    return false;
+  }
+
+  const double stall_rate =
+      static_cast<double>(state.window_stalls) / state.window_frames;
+  state.window_frames = 0;
+  state.window_stalls = 0;
+
+  const int delay_frames = state.stats.delay_frames();
+  int new_delay_frames = delay_frames;
+  if (stall_rate >= raise_stall_rate_ && delay_frames < max_delay_frames_) {
+    new_delay_frames = delay_frames + 1;
+  } else if (stall_rate <= lower_stall_rate_ &&
+             delay_frames > min_delay_frames_) {
+    new_delay_frames = delay_frames - 1;
+  }
+  if (new_delay_frames == delay_frames) {
+    return false;
+  }
+
+  VLOG(3) << "Proposing to change the delay of port " << Port_Name(port)
+          << " from " << delay_frames << " to " << new_delay_frames
+          << " frames, after a stall rate of " << stall_rate;
+  change->set_port(port);
+  change->set_frame(frame + lead_frames_);
+  change->set_delay_frames(new_delay_frames);
+  state.stats.set_proposed_changes(state.stats.proposed_changes() + 1);
+  return true;
+}
+
+bool DelayAdjuster::Accept(const DelayChangePB& change) {
+  const auto it = ports_.find(change.port());
+  if (it == ports_.end() || change.frame() < 0 || change.delay_frames() < 0) {
+    return false;
+  }
+  PortState& state = it->second;
+  if (change.frame() < state.latest_change_frame ||
+      (change.frame() == state.latest_change_frame &&
+       change.delay_frames() <= state.stats.delay_frames())) {
+    return false;
+  }
+
+  state.latest_change_frame = change.frame();
+  state.stats.set_delay_frames(change.delay_frames());
+  state.stats.set_accepted_changes(state.stats.accepted_changes() + 1);
+
+  // The stalls before the change say nothing about the new delay.
+  state.first_counted_frame = change.frame();
+  state.window_frames = 0;
+  state.window_stalls = 0;
+  return true;
+}
+
+int DelayAdjuster::delay_frames(Port port) const {
+  const auto it = ports_.find(port);
+  if (it == ports_.end()) {
+    return -1;
+  }
+  return it->second.stats.delay_frames();
+}
+
+DelayAdjustmentPB DelayAdjuster::stats(Port port) const {
+  const auto it = ports_.find(port);
+  if (it == ports_.end()) {
+    return DelayAdjustmentPB();
+  }
+  return it->second.stats;
+}
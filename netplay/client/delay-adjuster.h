@@ -0,0 +1,103 @@
+#ifndef DELAY_ADJUSTER_H_
+#define DELAY_ADJUSTER_H_
+
+#include <map>
+
+#include "base/netplayServiceProto.pb.h"
+#include "base/timings.pb.h"
+
+// Adjusts the delay of every port during the game, one frame at a time, and
+// lets the clients agree on the adjustments.
+//
+// For every remote port, the adjuster counts the frames whose buttons had to
+// be waited for over a window of frames. A window that stalled often enough
+// proposes to raise the port's delay, and one that hardly stalled proposes to
+// lower it. A change takes effect at a frame some way ahead, so that it can
+// reach the client that owns the port before that client emulates the frame.
+// The owner then changes the delay of its local queue, which keeps delayed
+// frames consecutive, see InputQueue::ChangeDelayFrames. Since every client
+// receives the same buttons for every delayed frame, a change that arrives
+// late only takes effect late, and never makes the clients diverge.
+//
+// Changes are proposed by any client and relayed to the others. Each client
+// accepts a change if it is newer than the latest change it accepted for the
+// port, where later frames are newer and larger delays break ties. All clients
+// end up accepting the same latest change, whatever the order in which the
+// changes reach them.
+//
+// Frames are emulated frames. Not thread safe.
+class DelayAdjuster {
+ public:
+  // Arguments are:
+  //  - window_frames: number of frames of a port over which its stalls are
+  //    counted before deciding whether to change its delay. If zero, nothing
+  //    is proposed, and changes proposed by other clients are still accepted.
+  //  - raise_stall_rate: share of the frames of a window that stalled at or
+  //    above which the delay is raised, in (0, 1].
+  //  - lower_stall_rate: share at or below which the delay is lowered, in
+  //    [0, raise_stall_rate).
+  //  - min_delay_frames, max_delay_frames: bounds of proposed delays.
+  //  - lead_frames: number of frames after the end of a window at which a
+  //    change proposed by the window takes effect.
+  // std::abort's if any argument is out of range.
+  DelayAdjuster(int window_frames, double raise_stall_rate,
+                double lower_stall_rate, int min_delay_frames,
+                int max_delay_frames, int lead_frames);
+
+  // Records the delay with which port started the game. Frames and changes of
+  // ports that were not added are ignored.
+  void AddPort(Port port, int delay_frames);
+
+  // Records whether the buttons of remote port for frame had to be waited
+  // for. Frames that are not past the latest observed frame of the port, or
+  // that precede the latest accepted change of its delay, are ignored. Once a
+  // window of frames was observed and its stall rate calls for a change,
+  // populates *change with the proposed change and returns true. The change
+  // is only proposed, and still has to be passed to Accept.
+  bool ObserveFrame(Port port, int frame, bool stalled, DelayChangePB* change);
+
+  // Accepts change if it is newer than the latest accepted change of its port.
+  // The stalls of the port are counted again from the frame at which the
+  // change takes effect. Returns true if the change was accepted.
+  bool Accept(const DelayChangePB& change);
+
+  // Returns the delay of port after the latest accepted change, or -1 if port
+  // was not added.
+  int delay_frames(Port port) const;
+
+  // Returns the stats of port, which are empty if port was not added.
+  DelayAdjustmentPB stats(Port port) const;
+
+ private:
+  struct PortState {
+    PortState()
+        : latest_change_frame(-1),
+          first_counted_frame(0),
+          latest_frame(-1),
+          window_frames(0),
+          window_stalls(0) {}
+
+    // Frame of the latest accepted change, or -1.
+    int latest_change_frame;
+    // Stalls of frames before this one are not counted.
+    int first_counted_frame;
+    // The latest observed frame, or -1.
+    int latest_frame;
+    // Frames observed and stalled in the current window.
+    int window_frames;
+    int window_stalls;
+    // Holds the current delay.
+    DelayAdjustmentPB stats;
+  };
+
+  const int window_frames_;
+  const double raise_stall_rate_;
+  const double lower_stall_rate_;
+  const int min_delay_frames_;
+  const int max_delay_frames_;
+  const int lead_frames_;
+
+  std::map<int /* Port */, PortState> ports_;
+};
+
+#endif  // DELAY_ADJUSTER_H_
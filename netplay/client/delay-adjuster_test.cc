@@ -0,0 +1,132 @@
+#include "client/delay-adjuster.h"
+
+#include "gtest/gtest.h"
+
+namespace {
+
+const int kWindowFrames = 10;
+const int kLeadFrames = 30;
+
+DelayChangePB MakeChange(Port port, int frame, int delay_frames) {
+  DelayChangePB change;
+  change.set_port(port);
+  change.set_frame(frame);
+  change.set_delay_frames(delay_frames);
+  return change;
+}
+
+// Observes frames [begin, end) of port, the first stalled_frames of which
+// stalled. Returns the number of proposed changes, the latest of which is
+// stored in *change.
+int ObserveFrames(DelayAdjuster* adjuster, Port port, int begin, int end,
+                  int stalled_frames, DelayChangePB* change) {
+  int proposals = 0;
+  for (int frame = begin; frame < end; ++frame) {
+    if (adjuster->ObserveFrame(port, frame, frame - begin < stalled_frames,
+                               change)) {
+      ++proposals;
+    }
+  }
+  return proposals;
+}
+
+}  // namespace
+
+TEST(DelayAdjusterTest, InvalidArguments) {
+  EXPECT_DEATH(DelayAdjuster(-1, 0.1, 0, 0, 10, kLeadFrames),
+               "invalid window_frames");
+  EXPECT_DEATH(DelayAdjuster(kWindowFrames, 0, 0, 0, 10, kLeadFrames),
+               "invalid raise_stall_rate");
+  EXPECT_DEATH(DelayAdjuster(kWindowFrames, 0.1, 0.1, 0, 10, kLeadFrames),
+               "invalid lower_stall_rate");
+  EXPECT_DEATH(DelayAdjuster(kWindowFrames, 0.1, 0, 5, 4, kLeadFrames),
+               "invalid delay bounds");
+  EXPECT_DEATH(DelayAdjuster(kWindowFrames, 0.1, 0, 0, 10, 0),
+               "invalid lead_frames");
+}
+
+TEST(DelayAdjusterTest, ProposesChangesFromStallRate) {
+  DelayAdjuster adjuster(kWindowFrames, 0.2, 0, 1, 3, kLeadFrames);
+  adjuster.AddPort(PORT_2, 2);
+  DelayChangePB change;
+
+  // Too few stalls to raise the delay, too many to lower it.
+  EXPECT_EQ(0, ObserveFrames(&adjuster, PORT_2, 0, 10, 1, &change));
+
+  EXPECT_EQ(1, ObserveFrames(&adjuster, PORT_2, 10, 20, 2, &change));
+  EXPECT_EQ(PORT_2, change.port());
+  EXPECT_EQ(19 + kLeadFrames, change.frame());
+  EXPECT_EQ(3, change.delay_frames());
+
+  // Proposals are not accepted until they are passed to Accept.
+  EXPECT_EQ(2, adjuster.delay_frames(PORT_2));
+  ASSERT_TRUE(adjuster.Accept(change));
+  EXPECT_EQ(3, adjuster.delay_frames(PORT_2));
+
+  // Frames before the change are not counted, and the delay is at its bound.
+  EXPECT_EQ(0, ObserveFrames(&adjuster, PORT_2, 20, 49, 29, &change));
+  EXPECT_EQ(0, ObserveFrames(&adjuster, PORT_2, 49, 59, 10, &change));
+
+  EXPECT_EQ(1, ObserveFrames(&adjuster, PORT_2, 59, 69, 0, &change));
+  EXPECT_EQ(2, change.delay_frames());
+
+  const DelayAdjustmentPB stats = adjuster.stats(PORT_2);
+  EXPECT_EQ(PORT_2, stats.port());
+  EXPECT_EQ(3, stats.delay_frames());
+  EXPECT_EQ(40, stats.observed_frames());
+  EXPECT_EQ(13, stats.stalled_frames());
+  EXPECT_EQ(2, stats.proposed_changes());
+  EXPECT_EQ(1, stats.accepted_changes());
+}
+
+TEST(DelayAdjusterTest, IgnoresUnknownPortsAndOldFrames) {
+  DelayAdjuster adjuster(kWindowFrames, 0.5, 0, 0, 10, kLeadFrames);
+  adjuster.AddPort(PORT_2, 2);
+  DelayChangePB change;
+
+  EXPECT_FALSE(adjuster.ObserveFrame(PORT_3, 0, true, &change));
+  EXPECT_FALSE(adjuster.Accept(MakeChange(PORT_3, 10, 3)));
+  EXPECT_EQ(-1, adjuster.delay_frames(PORT_3));
+  EXPECT_EQ(0, adjuster.stats(PORT_3).port());
+
+  // Frames observed twice count once.
+  for (int i = 0; i < 2 * kWindowFrames; ++i) {
+    EXPECT_FALSE(adjuster.ObserveFrame(PORT_2, 0, true, &change));
+  }
+  EXPECT_EQ(1, adjuster.stats(PORT_2).observed_frames());
+}
+
+TEST(DelayAdjusterTest, NeverProposesWithoutWindow) {
+  DelayAdjuster adjuster(0, 0.5, 0, 0, 10, kLeadFrames);
+  adjuster.AddPort(PORT_2, 2);
+  DelayChangePB change;
+
+  EXPECT_EQ(0, ObserveFrames(&adjuster, PORT_2, 0, 100, 100, &change));
+  EXPECT_TRUE(adjuster.Accept(MakeChange(PORT_2, 10, 4)));
+  EXPECT_EQ(4, adjuster.delay_frames(PORT_2));
+}
+
+TEST(DelayAdjusterTest, AgreesOnLatestChange) {
+  const DelayChangePB changes[] = {
+      MakeChange(PORT_2, 100, 3), MakeChange(PORT_2, 120, 1),
+      MakeChange(PORT_2, 120, 2), MakeChange(PORT_2, 110, 5)};
+
+  // Clients see the changes in different orders, and agree on the latest.
+  const int orders[][4] = {{0, 1, 2, 3}, {3, 2, 1, 0}, {2, 0, 3, 1}};
+  for (const auto& order : orders) {
+    DelayAdjuster adjuster(kWindowFrames, 0.5, 0, 0, 10, kLeadFrames);
+    adjuster.AddPort(PORT_2, 2);
+    for (const int i : order) {
+      adjuster.Accept(changes[i]);
+    }
+    EXPECT_EQ(2, adjuster.delay_frames(PORT_2));
+  }
+
+  DelayAdjuster adjuster(kWindowFrames, 0.5, 0, 0, 10, kLeadFrames);
+  adjuster.AddPort(PORT_2, 2);
+  EXPECT_FALSE(adjuster.Accept(MakeChange(PORT_2, -1, 3)));
+  EXPECT_FALSE(adjuster.Accept(MakeChange(PORT_2, 10, -1)));
+  EXPECT_TRUE(adjuster.Accept(MakeChange(PORT_2, 10, 3)));
+  EXPECT_FALSE(adjuster.Accept(MakeChange(PORT_2, 10, 3)));
+  EXPECT_EQ(1, adjuster.stats(PORT_2).accepted_changes());
+}
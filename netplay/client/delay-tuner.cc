@@ -0,0 +1,122 @@
+#include "client/delay-tuner.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+
+#include "client/utils.h"
+#include "glog/logging.h"
+#include "grpc++/client_context.h"
+
+DelayTuner::DelayTuner(
+    std::shared_ptr<NetPlayServerService::StubInterface> stub,
+    TraceRing* trace, const DelayTunerOptions& options)
+    : stub_(stub), trace_(trace), options_(options) {
+  if (options_.pings <= 0) {
+    LOG(ERROR) << "invalid pings: " << options_.pings;
+    std::abort();
+  }
+  if (options_.ping_timeout_millis <= 0) {
+    LOG(ERROR) << "invalid ping_timeout_millis: "
+               << options_.ping_timeout_millis;
+    std::abort();
+  }
+  if (options_.frame_period_millis <= 0) {
+    LOG(ERROR) << "invalid frame_period_millis: "
+               << options_.frame_period_millis;
+    std::abort();
+  }
+  if (options_.percentile <= 0 || options_.percentile > 100) {
+    LOG(ERROR) << "invalid percentile: " << options_.percentile;
+    std::abort();
+  }
+  if (options_.max_delay_frames < 0) {
+    LOG(ERROR) << "invalid max_delay_frames: " << options_.max_delay_frames;
+    std::abort();
+  }
+}
+
+bool DelayTuner::Tune(DelayTuningPB* tuning) {
+  tuning->Clear();
+
+  std::vector<int64_t> rtt_nanos;
+  int failed_pings = 0;
+  for (int i = 0; i < options_.pings; ++i) {
+    const PingPB request;
+    PingPB response;
+    grpc::ClientContext context;
+    context.set_deadline(
+        std::chrono::system_clock::now() +
+        std::chrono::milliseconds(options_.ping_timeout_millis));
+
+    const int64_t request_nanos = client_utils::now_nanos();
+    trace_->Record(TimingEventPB::kPingRequest, request_nanos);
+    const grpc::Status status = stub_->Ping(&context, request, &response);
+    const int64_t response_nanos = client_utils::now_nanos();
+    trace_->Record(TimingEventPB::kPingResponse, response_nanos);
+
+    if (!status.ok()) {
+      VLOG(3) << "Ping failed with error message: \"" << status.error_message()
+              << "\"";
+      ++failed_pings;
+      continue;
+    }
+    rtt_nanos.push_back(response_nanos - request_nanos);
+  }
+
+  if (rtt_nanos.empty()) {
+    LOG(ERROR) << "All " << options_.pings << " pings to the server failed";
+    tuning->set_failed_pings(failed_pings);
+    return false;
+  }
+
+  Recommend(rtt_nanos, options_, tuning);
+  tuning->set_failed_pings(failed_pings);
+  trace_->SetDelayTuning(*tuning);
+
+  LOG(INFO) << "Recommending " << tuning->recommended_delay_frames()
+            << " delay frames for a median round trip time of "
+            << tuning->median_rtt_nanos() / 1000 << "us and a "
+            << options_.percentile << "th percentile of "
+            << tuning->percentile_rtt_nanos() / 1000 << "us";
+  return true;
+}
+
+void DelayTuner::Recommend(const std::vector<int64_t>& rtt_nanos,
+                           const DelayTunerOptions& options,
+                           DelayTuningPB* tuning) {
+  tuning->Clear();
+  if (rtt_nanos.empty()) {
+    return;
+  }
+
+  // Jitter is the mean difference between consecutive round trips.
+  int64_t jitter_sum = 0;
+  for (size_t i = 0; i < rtt_nanos.size(); ++i) {
+    tuning->add_rtt_nanos(rtt_nanos[i]);
+    if (i > 0) {
+      jitter_sum += std::abs(rtt_nanos[i] - rtt_nanos[i - 1]);
+    }
+  }
+  if (rtt_nanos.size() > 1) {
+    tuning->set_jitter_nanos(jitter_sum / (rtt_nanos.size() - 1));
+  }
+
+  std::vector<int64_t> sorted(rtt_nanos);
+  std::sort(sorted.begin(), sorted.end());
+  tuning->set_median_rtt_nanos(sorted[(sorted.size() - 1) / 2]);
+
+  // Nearest-rank percentile, which is at least 1 since percentile is.
+  const size_t rank = (options.percentile * sorted.size() + 99) / 100;
+  const int64_t percentile_rtt = sorted[rank - 1];
+  tuning->set_percentile(options.percentile);
+  tuning->set_percentile_rtt_nanos(percentile_rtt);
+
+  const double frame_period_nanos = options.frame_period_millis * 1000 * 1000;
+  tuning->set_frame_period_nanos(static_cast<int64_t>(frame_period_nanos));
+  const int delay_frames =
+      static_cast<int>(std::ceil(percentile_rtt / frame_period_nanos));
+  tuning->set_recommended_delay_frames(
+      std::min(std::max(delay_frames, 0), options.max_delay_frames));
+}
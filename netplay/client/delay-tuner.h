@@ -0,0 +1,65 @@
+#ifndef DELAY_TUNER_H_
+#define DELAY_TUNER_H_
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "base/netplayServiceProto.grpc.pb.h"
+#include "base/timings.pb.h"
+#include "client/trace-ring.h"
+
+// Parameters of DelayTuner. The defaults suit a console running at 60 frames
+// per second.
+struct DelayTunerOptions {
+  // Number of Ping RPCs sent to measure the round trip time.
+  int pings = 20;
+
+  // Deadline of each Ping RPC. Pings that miss it are not counted.
+  int ping_timeout_millis = 1000;
+
+  // Time the console takes to emulate one frame.
+  double frame_period_millis = 1000.0 / 60;
+
+  // The recommended delay covers this percentile of the measured round trip
+  // times, so that roughly this share of remote buttons arrives before the
+  // frame that needs them.
+  int percentile = 95;
+
+  // Upper bound of the recommended delay.
+  int max_delay_frames = 10;
+};
+
+// Recommends a number of delay frames from the round trip time to the server.
+//
+// Buttons for frame f + delay are sent at frame f and relayed by the server to
+// the other clients, so they take about one round trip to arrive. The
+// recommended delay is the smallest number of frames at least as long as the
+// chosen percentile of the measured round trip times.
+class DelayTuner {
+ public:
+  // std::abort's if any option is out of range.
+  DelayTuner(std::shared_ptr<NetPlayServerService::StubInterface> stub,
+             TraceRing* trace,
+             const DelayTunerOptions& options = DelayTunerOptions());
+
+  // Pings the server and populates *tuning with the measurements and the
+  // recommended delay, which it also records in the trace. Each ping is
+  // recorded as a ping_request and ping_response event. Returns false if
+  // every ping failed, in which case *tuning holds no recommendation.
+  bool Tune(DelayTuningPB* tuning);
+
+  // Populates *tuning with the statistics of the given round trip times and
+  // the delay they call for. Exposed for testing.
+  static void Recommend(const std::vector<int64_t>& rtt_nanos,
+                        const DelayTunerOptions& options,
+                        DelayTuningPB* tuning);
+
+ private:
+  std::shared_ptr<NetPlayServerService::StubInterface> stub_;
+  // Borrowed reference
+  TraceRing* trace_;
+  const DelayTunerOptions options_;
+};
+
+#endif  // DELAY_TUNER_H_
@@ -0,0 +1,132 @@
+#include "client/delay-tuner.h"
+
+#include <memory>
+#include <vector>
+
+#include "client/mocks.h"
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+using testing::_;
+using testing::Return;
+
+// -----------------------------------------------------------------------------
+// DelayTuner
+
+class DelayTunerTest : public ::testing::Test {
+ protected:
+  DelayTunerTest() : mock_stub_(new MockNetPlayServerServiceStub()) {
+    options_.pings = 4;
+  }
+
+  // Nanoseconds in the given number of milliseconds.
+  static int64_t Millis(int64_t millis) { return millis * 1000 * 1000; }
+
+  std::shared_ptr<MockNetPlayServerServiceStub> mock_stub_;
+  TraceRing trace_;
+  DelayTunerOptions options_;
+};
+
+TEST_F(DelayTunerTest, InvalidOptions) {
+  DelayTunerOptions options;
+  options.pings = 0;
+  EXPECT_DEATH(DelayTuner(mock_stub_, &trace_, options), "invalid pings");
+
+  options = DelayTunerOptions();
+  options.frame_period_millis = 0;
+  EXPECT_DEATH(DelayTuner(mock_stub_, &trace_, options),
+               "invalid frame_period_millis");
+
+  options = DelayTunerOptions();
+  options.percentile = 101;
+  EXPECT_DEATH(DelayTuner(mock_stub_, &trace_, options), "invalid percentile");
+
+  options = DelayTunerOptions();
+  options.max_delay_frames = -1;
+  EXPECT_DEATH(DelayTuner(mock_stub_, &trace_, options),
+               "invalid max_delay_frames");
+}
+
+TEST_F(DelayTunerTest, RecommendCoversPercentile) {
+  options_.frame_period_millis = 10;
+  options_.percentile = 90;
+
+  // Ten round trips of 1..10 ms, with one slow outlier in place of 10 ms.
+  std::vector<int64_t> rtt_nanos;
+  for (int i = 1; i < 10; ++i) {
+    rtt_nanos.push_back(Millis(i));
+  }
+  rtt_nanos.push_back(Millis(95));
+
+  DelayTuningPB tuning;
+  DelayTuner::Recommend(rtt_nanos, options_, &tuning);
+  EXPECT_EQ(10, tuning.rtt_nanos_size());
+  EXPECT_EQ(Millis(5), tuning.median_rtt_nanos());
+  EXPECT_EQ(90, tuning.percentile());
+  EXPECT_EQ(Millis(9), tuning.percentile_rtt_nanos());
+  EXPECT_EQ(Millis(10), tuning.frame_period_nanos());
+  // Eight 1 ms steps and one 86 ms step.
+  EXPECT_EQ(Millis(94) / 9, tuning.jitter_nanos());
+  EXPECT_EQ(1, tuning.recommended_delay_frames());
+
+  // The outlier is covered by the 100th percentile.
+  options_.percentile = 100;
+  DelayTuner::Recommend(rtt_nanos, options_, &tuning);
+  EXPECT_EQ(Millis(95), tuning.percentile_rtt_nanos());
+  EXPECT_EQ(10, tuning.recommended_delay_frames());
+}
+
+TEST_F(DelayTunerTest, RecommendClampsDelay) {
+  options_.frame_period_millis = 10;
+  options_.max_delay_frames = 3;
+
+  DelayTuningPB tuning;
+  DelayTuner::Recommend({Millis(200)}, options_, &tuning);
+  EXPECT_EQ(3, tuning.recommended_delay_frames());
+  EXPECT_EQ(0, tuning.jitter_nanos());
+
+  DelayTuner::Recommend({0}, options_, &tuning);
+  EXPECT_EQ(0, tuning.recommended_delay_frames());
+}
+
+TEST_F(DelayTunerTest, TuneRecordsPings) {
+  EXPECT_CALL(*mock_stub_, Ping(_, _, _))
+      .WillOnce(Return(grpc::Status::OK))
+      .WillOnce(Return(grpc::Status::CANCELLED))
+      .WillRepeatedly(Return(grpc::Status::OK));
+
+  DelayTuner tuner(mock_stub_, &trace_, options_);
+  DelayTuningPB tuning;
+  ASSERT_TRUE(tuner.Tune(&tuning));
+  EXPECT_EQ(3, tuning.rtt_nanos_size());
+  EXPECT_EQ(1, tuning.failed_pings());
+  // A local round trip is well under a frame.
+  EXPECT_EQ(1, tuning.recommended_delay_frames());
+
+  TimingsPB timings;
+  trace_.Snapshot(&timings);
+  ASSERT_EQ(8, timings.event_size());
+  for (int i = 0; i < 8; i += 2) {
+    EXPECT_GT(timings.event(i).ping_request(), 0);
+    EXPECT_GE(timings.event(i + 1).ping_response(),
+              timings.event(i).ping_request());
+  }
+  EXPECT_EQ(tuning.SerializeAsString(),
+            timings.delay_tuning().SerializeAsString());
+}
+
+TEST_F(DelayTunerTest, TuneAllPingsFail) {
+  EXPECT_CALL(*mock_stub_, Ping(_, _, _))
+      .Times(options_.pings)
+      .WillRepeatedly(Return(grpc::Status::CANCELLED));
+
+  DelayTuner tuner(mock_stub_, &trace_, options_);
+  DelayTuningPB tuning;
+  EXPECT_FALSE(tuner.Tune(&tuning));
+  EXPECT_EQ(options_.pings, tuning.failed_pings());
+  EXPECT_EQ(0, tuning.rtt_nanos_size());
+
+  TimingsPB timings;
+  trace_.Snapshot(&timings);
+  EXPECT_FALSE(timings.has_delay_tuning());
+}
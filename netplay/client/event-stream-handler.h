@@ -1,16 +1,157 @@
 #ifndef EVENT_STREAM_HANDLER_H_
 #define EVENT_STREAM_HANDLER_H_
 
+#include <array>
+#include <atomic>
+#include <condition_variable>
 #include <memory>
-#include <unordered_map>
+#include <mutex>
+#include <thread>
 #include <set>
+#include <vector>
 
 #include <google/protobuf/repeated_field.h>
 
 #include "base/netplayServiceProto.grpc.pb.h"
-#include "base/timings.pb.h"
 #include "client/button-coder-interface.h"
+#include "client/delay-adjuster.h"
+#include "client/event-transport.h"
+#include "client/input-predictor.h"
 #include "client/input-queue.h"
+#include "client/rollback-buffer.h"
+#include "client/stream-latency.h"
+#include "client/time-sync.h"
+#include "client/trace-ring.h"
+#include "client/wait-strategy.h"
+
+// Optional behavior of EventStreamHandler. The defaults reproduce the original
+// handler.
+struct EventStreamHandlerOptions {
+  // Storage backend used for the input queue of every connected port.
+  InputQueueBackend queue_backend = InputQueueBackend::MAP;
+
+  // If true, a background thread owned by the handler reads the event stream
+  // as soon as the console starts, decoding button events into the remote
+  // input queues as they arrive. GetButtons then only waits on the queues.
+  // Otherwise, GetButtons reads the stream on the calling thread when the
+  // requested buttons are not yet queued. Stream reads made by the background
+  // thread are not recorded in the timings.
+  bool background_reader = false;
+
+  // If positive, PutButtons hands outgoing button events to a background
+  // writer thread instead of writing them to the stream itself, and returns
+  // once the buttons are in the local queues. At most this many events wait to
+  // be written; PutButtons blocks while the outbound queue is full. A failed
+  // write is reported by the next call to PutButtons. Writes made by the
+  // background thread are not recorded in the timings. If zero, PutButtons
+  // writes synchronously.
+  int async_write_queue_size = 0;
+
+  // If positive, enables rollback mode: GetSpeculativeButtons returns
+  // predicted buttons for remote frames that have not arrived yet, up to this
+  // many frames past the latest confirmed frame, and TakeRollbackFrame reports
+  // predictions that turned out to be wrong. GetButtons is unavailable in
+  // rollback mode. Requires background_reader, since nothing else reads the
+  // stream while the emulator runs ahead.
+  int rollback_frames = 0;
+
+  // Strategy used to predict remote buttons, in rollback mode and when
+  // measuring predictions.
+  PredictionStrategy prediction_strategy = PredictionStrategy::REPEAT_LAST;
+
+  // If true, outside of rollback mode, GetButtons predicts remote buttons that
+  // have not arrived when they are requested, as rollback mode would have had
+  // to, and scores the prediction once they do. This measures how often
+  // rollback mode would guess right, and how much waiting it would hide. The
+  // stats of each remote port are exported to the trace, as they always are
+  // in rollback mode.
+  bool measure_predictions = false;
+
+  // If positive, PutButtons attaches a ping to an outgoing button event at
+  // most once every this many milliseconds, which the server echoes on the
+  // event stream with its own timestamps. The echoes give the round trip time
+  // of the stream, its jitter and the offset of the server's clock, see
+  // stream_latency(). Echoes are timestamped when they are read, so without
+  // the background reader, the round trip time includes the time until the
+  // next read.
+  int stream_ping_period_millis = 0;
+
+  // If positive, every outgoing button event reports the local frame and the
+  // latest remote frame received, and the handler estimates from the reports
+  // of the other clients by how many frames this client runs ahead of them,
+  // averaged over this many frames, see frame_advantage(). TakePacingNanos
+  // then tells the emulator how much to slow down so that the clients stay
+  // within a frame of each other rather than taking turns stalling. See
+  // TimeSync. Requires background_reader: remote frames must be seen as they
+  // arrive, while GetButtons only reads the stream up to the frame it needs,
+  // which hides how far ahead the other clients are.
+  int time_sync_window_frames = 0;
+
+  // Time the console takes to emulate one frame, used by time sync.
+  double frame_period_millis = 1000.0 / 60;
+
+  // Share of a frame period by which time sync may slow down a single frame.
+  double max_frame_stretch = 0.25;
+
+  // If positive, GetButtons counts how often the buttons of each remote port
+  // had to be waited for, and once this many frames of a port were counted,
+  // proposes to raise or lower its delay by a frame, see DelayAdjuster. The
+  // proposals ride on outgoing button events, and the server relays them to
+  // the other clients. Whatever this option, the handler agrees on the
+  // changes proposed by other clients, and changes the delay of its local
+  // ports when their changes take effect, see
+  // InputQueue::ChangeDelayFrames. Requires background_reader, for the same
+  // reason as time sync: otherwise buttons only reach the queues when they
+  // are waited for. Unavailable in rollback mode, which does not wait for
+  // buttons.
+  int delay_adjust_window_frames = 0;
+
+  // Share of the frames of a window that stalled at or above which the delay
+  // of a port is raised, and at or below which it is lowered.
+  double delay_raise_stall_rate = 0.05;
+  double delay_lower_stall_rate = 0;
+
+  // Bounds of the delays proposed for a port.
+  int min_delay_frames = 0;
+  int max_delay_frames = 15;
+
+  // Number of frames after the window at which a proposed change takes
+  // effect, which should leave it time to reach the other clients.
+  int delay_change_lead_frames = 30;
+
+  // How long a wait for remote buttons that have not arrived may spin before
+  // yielding the CPU, and how long it then yields before blocking, see
+  // WaitStrategy. The spin budget of each remote port is tuned from its
+  // recent waits, and the waits are recorded in the timings. Both zero blocks
+  // right away, and records nothing. Requires background_reader: otherwise
+  // the thread that waits for buttons is the one reading them.
+  int wait_max_spin_micros = 0;
+  int wait_yield_micros = 0;
+
+  // If greater than one, PutButtons coalesces the key presses of up to this
+  // many consecutive calls into a single outgoing event, trading unused delay
+  // headroom for fewer writes. A batch never holds more frames than the
+  // smallest delay of the local ports leaves room for, after the round trip
+  // time measured by stream pings, if any, so that it still arrives before
+  // the other clients need it.
+  int coalesce_max_frames = 0;
+
+  // If positive, a batch of coalesced key presses is also sent once this many
+  // microseconds passed since its first key presses were put. Batches are only
+  // sent by PutButtons and FlushWrites, so the deadline is checked when
+  // buttons are put.
+  int coalesce_deadline_micros = 0;
+
+  // If true, offers the server to compress key presses that repeat the
+  // previous frame of their port, which the server only accepts if every
+  // client offers it. The buttons of such a frame are not sent again: the
+  // key press is marked unchanged instead, and consecutive frames of a port
+  // that share their buttons are merged into a single key press covering the
+  // whole run. Runs only span the frames of a single event, so they grow with
+  // coalesce_max_frames. Incoming runs are expanded into the remote queues
+  // frame by frame.
+  bool run_length_buttons = false;
+};
 
 template <typename ButtonsType>
 class EventStreamHandlerInterface {
@@ -68,22 +209,31 @@ class EventStreamHandlerInterface {
   virtual bool WaitForConsoleStart() = 0;
   virtual GetButtonsStatus GetButtons(const Port port, int frame,
                                       ButtonsType* buttons) = 0;
+  virtual GetButtonsStatus GetFrame(int frame, ButtonsType* buttons) = 0;
   virtual PutButtonsStatus PutButtons(
       const std::vector<ButtonsFrameTuple>& buttons_tuples) = 0;
+  virtual GetButtonsStatus GetSpeculativeButtons(const Port port, int frame,
+                                                 ButtonsType* buttons,
+                                                 bool* predicted) = 0;
+  virtual int TakeRollbackFrame() = 0;
   virtual void TryCancel() = 0;
   virtual std::set<Port> local_ports() const = 0;
   virtual std::set<Port> remote_ports() const = 0;
   virtual int DelayFramesForPort(Port port) const = 0;
-  virtual TimingsPB* mutable_timings() = 0;
+  virtual StreamLatencyPB stream_latency() const = 0;
+  virtual int64_t TakePacingNanos() = 0;
+  virtual TraceRing* mutable_trace() = 0;
 };
 
-// Handler that listens to a GRPC bidirectional stream and interprets the game
-// events that pass back and forth.
+// Handler that exchanges game events through an EventTransport, by default the
+// server's GRPC bidirectional stream, and interprets the game events that pass
+// back and forth. Once the console starts, snapshots of the trace summarize
+// the stream latency, time sync, delay adjustment and wait stats of the
+// handler.
 template <typename ButtonsType>
-class EventStreamHandler : public EventStreamHandlerInterface<ButtonsType> {
+class EventStreamHandler : public EventStreamHandlerInterface<ButtonsType>,
+                           private TraceSummarySource {
  public:
-  typedef grpc::ClientReaderWriterInterface<OutgoingEventPB, IncomingEventPB>
-      BidirectionalStream;
   typedef typename EventStreamHandlerInterface<ButtonsType>::HandlerStatus
       HandlerStatus;
 
@@ -94,20 +244,41 @@ class EventStreamHandler : public EventStreamHandlerInterface<ButtonsType> {
   //     - local_ports.size > 4
   //     - any ports repeat themselves
   //     - any port has value PORT_ANY
+  //  - trace: borrowed ring into which timing events are recorded.
   //  - coder: pointer to a coder object used to encode and decode buttons to
   //    and from KeyStatePB protos.
   //  - stub: stub from which to produce a stream handle.
+  //  - options: optional behavior, see EventStreamHandlerOptions.
   EventStreamHandler(int console_id, int client_id,
-                     const std::vector<Port> local_ports, TimingsPB* timings,
+                     const std::vector<Port> local_ports, TraceRing* trace,
                      const ButtonCoderInterface<ButtonsType>* coder,
-                     std::shared_ptr<NetPlayServerService::StubInterface> stub);
+                     std::shared_ptr<NetPlayServerService::StubInterface> stub,
+                     const EventStreamHandlerOptions& options =
+                         EventStreamHandlerOptions());
+
+  // Same as above, but exchanges events through transport, which is opened by
+  // ClientReady, instead of the server's event stream. std::abort's if
+  // transport is null.
+  EventStreamHandler(int console_id, int client_id,
+                     const std::vector<Port> local_ports, TraceRing* trace,
+                     const ButtonCoderInterface<ButtonsType>* coder,
+                     std::unique_ptr<EventTransport> transport,
+                     const EventStreamHandlerOptions& options =
+                         EventStreamHandlerOptions());
+
+  // Stops and joins the background reader and writer, if any. Button events
+  // that have not yet been written are dropped.
+  ~EventStreamHandler() override;
 
   HandlerStatus status() const override {
-    return status_;
+    return status_.load();
   }
 
   // Signal to the server that we are ready to start the game and wait until
-  // the server indicates the console has started.
+  // the server indicates the console has started. The ready signal tells the
+  // server whether the coder supports packed buttons and whether the handler
+  // offers run-length compression, and the start signal says which button
+  // form the session uses and whether it is compressed.
   bool ClientReady() override;
   bool WaitForConsoleStart() override;
 
@@ -119,14 +290,48 @@ class EventStreamHandler : public EventStreamHandlerInterface<ButtonsType> {
   PutButtonsStatus PutButtons(
       const std::vector<ButtonsFrameTuple>& buttons_frames) override;
 
+  // Sends the key presses PutButtons coalesced, if any, then blocks until all
+  // button events queued by PutButtons have been written to the stream.
+  // Returns false if any write failed. Must be called from the thread that
+  // puts buttons.
+  bool FlushWrites();
+
   // Read the given buttons from the server. Blocks until the client has
   // received the buttons for the given frame from the server, or until a game
-  // management event occurred.
+  // management event occurred. If the console was stopped, returns FAILURE and
+  // status() returns CONSOLE_TERMINATED.
   typedef typename EventStreamHandlerInterface<ButtonsType>::GetButtonsStatus
       GetButtonsStatus;
   GetButtonsStatus GetButtons(const Port port, int frame,
                               ButtonsType* buttons) override;
 
+  // Read the buttons of every connected port for the given frame in one pass,
+  // which is equivalent to calling GetButtons for each of them. buttons must
+  // point to an array of four, the buttons of PORT_1 + i being written to
+  // buttons[i]. Ports that are not connected get default-constructed
+  // buttons. Local ports are read first, since their buttons are already
+  // queued, and then remote ports are waited for. With the background reader,
+  // and unless remote waits are predicted, counted or timed one by one, all
+  // ports are read with InputQueue::GetFrame, so that map queues, which share
+  // a lock, take it once per frame. Returns FAILURE if any port failed, in
+  // which case the contents of buttons are unspecified.
+  GetButtonsStatus GetFrame(int frame, ButtonsType* buttons) override;
+
+  // Rollback mode only. Get the buttons for the given port and frame without
+  // waiting for remote buttons that have not arrived yet. Sets *predicted to
+  // true if the returned buttons are a prediction rather than the buttons that
+  // were actually pressed. Frames may be requested again after a rollback.
+  GetButtonsStatus GetSpeculativeButtons(const Port port, int frame,
+                                         ButtonsType* buttons,
+                                         bool* predicted) override;
+
+  // Rollback mode only. Returns the earliest frame, on any port, for which
+  // GetSpeculativeButtons returned a prediction that differs from the buttons
+  // that later arrived, or -1 if there was none. The emulator must restore its
+  // state to before that frame and simulate forward from it. Each
+  // misprediction is only reported once.
+  int TakeRollbackFrame() override;
+
   // Abruptly cancel the stream. Note this method cannot guarantee the stream 
   // will actually be cancelled.
   // TODO(alexgolec): Implement a clean protocol-based method to end the game 
@@ -138,17 +343,83 @@ class EventStreamHandler : public EventStreamHandlerInterface<ButtonsType> {
   // Returns the remote ports allocated as part of ReadyAndWaitForConsoleStart. 
   // Note this method will return an empty container if
   // ReadyAndWaitForConsoleStart was not successfully called.
+  // Both build a new set on every call, and are not meant for the per-frame
+  // path.
   std::set<Port> remote_ports() const override;
 
   // Returns the number of delay frames for the given port, or -1 if port is 
-  // disconnected.
+  // disconnected. The delay of local ports changes when a change agreed upon
+  // with the other clients takes effect.
   int DelayFramesForPort(Port port) const override;
 
-  // Return the timings with which this object was initialized.
-  TimingsPB* mutable_timings() override { return timings_; };
+  // Returns the latency of the event stream estimated from echoed stream
+  // pings, which has no samples unless options.stream_ping_period_millis is
+  // positive. The latest estimate is also included in trace snapshots.
+  StreamLatencyPB stream_latency() const override;
+
+  // Returns the number of frames by which this client runs ahead of the
+  // remote client furthest behind, or 0 unless
+  // options.time_sync_window_frames is positive.
+  double frame_advantage() const;
+
+  // Returns the time by which the emulator should slow down its next frame
+  // to let the remote clients catch up, or 0 unless
+  // options.time_sync_window_frames is positive. Meant to be called once per
+  // frame.
+  int64_t TakePacingNanos() override;
+
+  // Return the trace with which this object was initialized.
+  TraceRing* mutable_trace() override { return trace_; };
 
  private:
   typedef InputQueue<ButtonsType> ButtonsInputQueue;
+  typedef RollbackBuffer<ButtonsType> ButtonsRollbackBuffer;
+  typedef InputPredictor<ButtonsType> ButtonsInputPredictor;
+
+  // State of a port, connected or not. The slot of port p is
+  // slots_[p - PORT_1]. Populated by InitializeQueues, after which the
+  // pointers don't change.
+  struct Slot {
+    Slot()
+        : has_sent_buttons(false),
+          sent_buttons(),
+          received_frame(-1),
+          received_buttons(),
+          has_delay_change(false) {}
+
+    // Null if the port is not connected.
+    std::unique_ptr<ButtonsInputQueue> queue;
+    // Only set for remote ports, in rollback mode or if
+    // options_.measure_predictions is set.
+    std::unique_ptr<ButtonsInputPredictor> predictor;
+    // Only set in rollback mode. Reads from queue, and uses predictor for
+    // remote ports.
+    std::unique_ptr<ButtonsRollbackBuffer> rollback_buffer;
+    // Only set for remote ports, if options_.wait_max_spin_micros or
+    // options_.wait_yield_micros is positive. Used by queue.
+    std::unique_ptr<WaitStrategy> wait_strategy;
+
+    // Only used if run_length_buttons_ is set. The buttons last sent for a
+    // local port, only accessed by PutButtons, and the latest buttons
+    // received for a remote port with their frame, or -1, only accessed by
+    // whichever thread reads the stream.
+    bool has_sent_buttons;
+    ButtonsType sent_buttons;
+    int received_frame;
+    ButtonsType received_buttons;
+
+    // Local ports only, protected by delay_m_. The latest accepted delay
+    // change that was not applied to queue yet, if has_delay_change is set.
+    bool has_delay_change;
+    DelayChangePB delay_change;
+  };
+
+  // Returns the index of port in slots_ and in the port masks, or -1 if port
+  // is not one of PORT_1 to PORT_4.
+  static int PortIndex(Port port);
+
+  // Returns whether port was given to the constructor as a local port.
+  bool IsLocalPort(Port port) const;
 
   // Parse the returned port configuration and initialize the queues for each
   // port.
@@ -159,18 +430,78 @@ class EventStreamHandler : public EventStreamHandlerInterface<ButtonsType> {
   GetButtonsStatus GetLocalButtons(const Port port, int frame,
                                    ButtonsType* buttons);
 
-  // Get the buttons for a remote port.
+  // Get the buttons for a remote port, scoring a prediction of them if
+  // options_.measure_predictions is set and they have not arrived yet.
   GetButtonsStatus GetRemoteButtons(const Port port, int frame,
                                     ButtonsType* buttons);
 
+  // Get the buttons for a remote port, waiting for them to arrive.
+  GetButtonsStatus WaitForRemoteButtons(const Port port, int frame,
+                                        ButtonsType* buttons);
+
+  // Clears event to reuse it for the next outgoing event. Under time sync,
+  // every event sent carries a frame status, which Clear would free, so an
+  // empty one is kept instead.
+  void ClearOutgoingEvent(OutgoingEventPB* event);
+
+  // Attaches a stream ping to event if the ping period has elapsed.
+  void MaybeAttachPing(OutgoingEventPB* event);
+
+  // Moves the delay changes this client proposed into event.
+  void AttachDelayChanges(OutgoingEventPB* event);
+
+  // Moves the key presses and frame status of event, put for a single frame,
+  // into the batch of coalesced key presses. If the batch is due, swaps it
+  // into event and returns true, and returns false otherwise.
+  bool CoalesceEvent(OutgoingEventPB* event);
+
+  // Returns the number of frames a batch may hold without the other clients
+  // waiting for it.
+  int CoalesceBudgetFrames();
+
+  // Attaches pings and delay changes to event, which must have key presses,
+  // and writes it to the stream or queues it for the writer.
+  PutButtonsStatus SendEvent(OutgoingEventPB* event);
+
+  // Returns true if buttons are the ones last sent for port, and records them
+  // as such otherwise.
+  bool RepeatsSentButtons(const Port port, const ButtonsType& buttons);
+
+  // Folds every unchanged key press of event into the key press of the same
+  // port for the previous frame, if event has it, extending its run.
+  void MergeUnchangedFrames(OutgoingEventPB* event);
+
+  // Adds the sample of an echoed stream ping to the latency estimate.
+  void HandlePong(const StreamPingPB& pong);
+
+  // Feeds the remote frames and frame status in a button event to time sync.
+  void ObserveRemoteFrames(const IncomingEventPB& event);
+
+  // Counts whether the buttons of a remote port for frame had to be waited
+  // for, and queues the delay change proposed as a result, if any.
+  void ObserveStall(const Port port, int frame, bool stalled);
+
+  // Accepts a delay change proposed by this or another client. Accepted
+  // changes of local ports are applied by the next call to PutButtons.
+  void HandleDelayChange(const DelayChangePB& change);
+
   // Transmit the given buttons on the stream. std::abort's if the port is
   // invalid or local.
   bool SendButtons(const Port port, int frame, const ButtonsType& buttons);
 
-  // Helper method to GetButtons that reads from stream_ until the buttons for
-  // the given port number and frame arrive. Returns the following:
+  // Moves *event into the outbound queue, waiting for space if the queue is
+  // full. Returns false if a previous write failed.
+  bool EnqueueWrite(OutgoingEventPB* event);
+
+  // Body of writer_thread_. Writes queued events in order until a write fails
+  // or the handler is destroyed.
+  void WriteEventsLoop();
+
+  // Helper method to GetButtons that reads from transport_ until the buttons
+  // for the given port number and frame arrive. Returns the following:
   //  - GOT_BUTTONS: If the requested frame data was received.
-  //  - RPC_READ_FAILURE: If the read on stream_ returned false for any reason.
+  //  - RPC_READ_FAILURE: If the read on transport_ returned false for any
+  //    reason.
   // If this method returns with status GOT_BUTTONS, the queue associated with
   // the given port will have button data ready for the given frame.
   enum class ReadUntilButtonsStatus {
@@ -183,6 +514,20 @@ class EventStreamHandler : public EventStreamHandlerInterface<ButtonsType> {
   };
   ReadUntilButtonsStatus ReadUntilButtons(const Port port, int frame);
 
+  // Decodes the buttons in event into their ports' queues. Returns GOT_BUTTONS
+  // if every button in the event was queued, and the status describing the
+  // problem otherwise. Shared by ReadUntilButtons and the background reader.
+  ReadUntilButtonsStatus EnqueueEvent(const IncomingEventPB& event);
+
+  // Body of reader_thread_. Reads and enqueues events until the stream fails or
+  // an event can't be enqueued, then closes the remote queues so that blocked
+  // calls to GetButtons return.
+  void ReadEventsLoop();
+
+  // Adds the stream latency, time sync, delay adjustment and wait stats that
+  // have samples to timings. Called by trace_ once the console started.
+  void AddSummary(TimingsPB* timings) const override;
+
   // Utility method that returns a borrowed pointer to a queue, or nullptr if  
   // there is no queue for the given port. Logs an error if there is no queue 
   // for the given port.
@@ -190,18 +535,84 @@ class EventStreamHandler : public EventStreamHandlerInterface<ButtonsType> {
 
   const int console_id_;
   const int client_id_;
-  std::set<Port> local_ports_;
-  TimingsPB* timings_;
+  const EventStreamHandlerOptions options_;
+  // Bit PortIndex(p) is set for every local port p, and for every connected
+  // port p once InitializeQueues succeeds.
+  unsigned local_port_mask_;
+  unsigned connected_port_mask_;
+  // Borrowed reference
+  TraceRing* trace_;
   // Borrowed reference
   const ButtonCoderInterface<ButtonsType>& coder_;
-  std::shared_ptr<NetPlayServerService::StubInterface> stub_;
-  grpc::ClientContext stream_context_;
-  std::unique_ptr<BidirectionalStream> stream_;
-
-  std::unordered_map<int /* Port */, std::unique_ptr<ButtonsInputQueue>>
-      input_queues_;
-
-  HandlerStatus status_;
+  std::unique_ptr<EventTransport> transport_;
+  // Whether the server chose the packed button form for this session. Set by
+  // WaitForConsoleStart.
+  bool packed_buttons_;
+  // Whether the server accepted run-length compression for this session. Set
+  // by WaitForConsoleStart.
+  bool run_length_buttons_;
+
+  // Indexed by PortIndex. The reader accesses the slots without
+  // synchronization once the console starts.
+  std::array<Slot, 4> slots_;
+
+  std::atomic<HandlerStatus> status_;
+
+  // Stream ping state. The next ping is only accessed by PutButtons, while
+  // latency_m_ protects the estimator, which is fed by whichever thread reads
+  // the stream.
+  int64_t next_ping_nanos_;
+  int64_t next_ping_sequence_;
+  mutable std::mutex latency_m_;
+  StreamLatencyEstimator latency_estimator_;
+
+  // Messages reused for every event rather than constructed, so that their
+  // repeated fields keep their elements allocated from one event to the next.
+  // put_event_ is only accessed by PutButtons and FlushWrites, and
+  // read_event_ by whichever thread reads the stream.
+  OutgoingEventPB put_event_;
+  IncomingEventPB read_event_;
+
+  // Key presses coalesced by PutButtons and not sent yet, the number of
+  // frames they cover, and the time the first of them was put. Only accessed
+  // by PutButtons and FlushWrites.
+  OutgoingEventPB batch_;
+  int batch_frames_;
+  int64_t batch_start_nanos_;
+
+  // Only set if options_.time_sync_window_frames is positive. time_sync_m_
+  // protects it, since it is fed by whichever thread reads the stream.
+  mutable std::mutex time_sync_m_;
+  std::unique_ptr<TimeSync> time_sync_;
+
+  // delay_m_ protects the adjuster, the changes proposed by this client that
+  // were not sent yet, and the accepted changes of local ports that were not
+  // applied to their queues yet, held in their slots. Changes are accepted by
+  // whichever thread reads the stream, and applied by PutButtons.
+  mutable std::mutex delay_m_;
+  DelayAdjuster delay_adjuster_;
+  std::vector<DelayChangePB> proposed_delay_changes_;
+
+  // Background reader state, only used if options_.background_reader is set.
+  // reader_status_ holds the reason the reader stopped.
+  std::thread reader_thread_;
+  std::atomic<ReadUntilButtonsStatus> reader_status_;
+
+  // Background writer state, only used if options_.async_write_queue_size is
+  // positive. write_m_ and write_cv_ protect everything but write_failed_,
+  // which is also read without the lock by PutButtons. Events waiting to be
+  // written are the pending_write_count_ events of the pending_writes_ ring
+  // starting at pending_write_head_. Events are swapped in and out of the
+  // ring, which is allocated once.
+  std::thread writer_thread_;
+  std::mutex write_m_;
+  std::condition_variable write_cv_;
+  std::vector<OutgoingEventPB> pending_writes_;
+  size_t pending_write_head_;
+  size_t pending_write_count_;
+  bool write_in_flight_;
+  bool writer_stopping_;
+  std::atomic<bool> write_failed_;
 };
 
 #include "event-stream-handler.hpp"
@@ -1,26 +1,59 @@
 #include "event-stream-handler.h"
 
 #include <algorithm>
+#include <cmath>
 #include <cstdlib>
 #include <iostream>
 #include <set>
 
+#include "client/grpc-event-transport.h"
 #include "glog/logging.h"
 
-#include "client/utils.h"
 
 template <typename ButtonsType>
 EventStreamHandler<ButtonsType>::EventStreamHandler(
     int console_id, int client_id, const std::vector<Port> local_ports,
-    TimingsPB* timings, const ButtonCoderInterface<ButtonsType>* coder,
-    std::shared_ptr<NetPlayServerService::StubInterface> stub)
+    TraceRing* trace, const ButtonCoderInterface<ButtonsType>* coder,
+    std::shared_ptr<NetPlayServerService::StubInterface> stub,
+    const EventStreamHandlerOptions& options)
+    : EventStreamHandler(console_id, client_id, local_ports, trace, coder,
+                         std::unique_ptr<EventTransport>(
+                             new GrpcEventTransport(stub)),
+                         options) {}
+
+template <typename ButtonsType>
+EventStreamHandler<ButtonsType>::EventStreamHandler(
+    int console_id, int client_id, const std::vector<Port> local_ports,
+    TraceRing* trace, const ButtonCoderInterface<ButtonsType>* coder,
+    std::unique_ptr<EventTransport> transport,
+    const EventStreamHandlerOptions& options)
     : console_id_(console_id),
       client_id_(client_id),
-      local_ports_(local_ports.begin(), local_ports.end()),
-      timings_(timings),
+      options_(options),
+      local_port_mask_(0),
+      connected_port_mask_(0),
+      trace_(trace),
       coder_(*coder),
-      stub_(stub),
-      status_(HandlerStatus::NOT_YET_STARTED) {
+      transport_(std::move(transport)),
+      packed_buttons_(false),
+      run_length_buttons_(false),
+      status_(HandlerStatus::NOT_YET_STARTED),
+      next_ping_nanos_(0),
+      next_ping_sequence_(1),
+      batch_frames_(0),
+      batch_start_nanos_(0),
+      delay_adjuster_(options.delay_adjust_window_frames,
+                      options.delay_raise_stall_rate,
+                      options.delay_lower_stall_rate, options.min_delay_frames,
+                      options.max_delay_frames,
+                      options.delay_change_lead_frames),
+      reader_status_(ReadUntilButtonsStatus::GOT_BUTTONS),
+      pending_writes_(std::max(options.async_write_queue_size, 0)),
+      pending_write_head_(0),
+      pending_write_count_(0),
+      write_in_flight_(false),
+      writer_stopping_(false),
+      write_failed_(false) {
   if (console_id_ <= 0) {
     LOG(ERROR) << "invalid console_id: " << console_id_;
     std::abort();
@@ -29,12 +62,82 @@ EventStreamHandler<ButtonsType>::EventStreamHandler(
     LOG(ERROR) << "invalid client_id: " << client_id_;
     std::abort();
   }
+  if (transport_ == nullptr) {
+    LOG(ERROR) << "invalid transport: null";
+    std::abort();
+  }
+  if (options_.rollback_frames < 0) {
+    LOG(ERROR) << "invalid rollback_frames: " << options_.rollback_frames;
+    std::abort();
+  }
+  if (options_.rollback_frames > 0 && !options_.background_reader) {
+    LOG(ERROR) << "rollback_frames requires background_reader";
+    std::abort();
+  }
+  if (options_.stream_ping_period_millis < 0) {
+    LOG(ERROR) << "invalid stream_ping_period_millis: "
+               << options_.stream_ping_period_millis;
+    std::abort();
+  }
+  if (options_.time_sync_window_frames < 0) {
+    LOG(ERROR) << "invalid time_sync_window_frames: "
+               << options_.time_sync_window_frames;
+    std::abort();
+  }
+  if (options_.time_sync_window_frames > 0 && !options_.background_reader) {
+    LOG(ERROR) << "time_sync_window_frames requires background_reader";
+    std::abort();
+  }
+  if (options_.time_sync_window_frames > 0) {
+    time_sync_.reset(new TimeSync(
+        options_.time_sync_window_frames,
+        static_cast<int64_t>(options_.frame_period_millis * 1000 * 1000),
+        options_.max_frame_stretch));
+  }
+  if (options_.delay_adjust_window_frames > 0 && !options_.background_reader) {
+    LOG(ERROR) << "delay_adjust_window_frames requires background_reader";
+    std::abort();
+  }
+  if (options_.delay_adjust_window_frames > 0 && options_.rollback_frames > 0) {
+    LOG(ERROR) << "delay_adjust_window_frames is unavailable in rollback mode";
+    std::abort();
+  }
+  if (options_.wait_max_spin_micros < 0) {
+    LOG(ERROR) << "invalid wait_max_spin_micros: "
+               << options_.wait_max_spin_micros;
+    std::abort();
+  }
+  if (options_.wait_yield_micros < 0) {
+    LOG(ERROR) << "invalid wait_yield_micros: " << options_.wait_yield_micros;
+    std::abort();
+  }
+  if ((options_.wait_max_spin_micros > 0 || options_.wait_yield_micros > 0) &&
+      !options_.background_reader) {
+    LOG(ERROR) << "wait_max_spin_micros and wait_yield_micros require "
+                  "background_reader";
+    std::abort();
+  }
+  if (options_.coalesce_max_frames < 0) {
+    LOG(ERROR) << "invalid coalesce_max_frames: "
+               << options_.coalesce_max_frames;
+    std::abort();
+  }
+  if (options_.coalesce_deadline_micros < 0) {
+    LOG(ERROR) << "invalid coalesce_deadline_micros: "
+               << options_.coalesce_deadline_micros;
+    std::abort();
+  }
+  if (options_.async_write_queue_size < 0) {
+    LOG(ERROR) << "invalid async_write_queue_size: "
+               << options_.async_write_queue_size;
+    std::abort();
+  }
   if (local_ports.size() > 4) {
     LOG(ERROR) << "local_ports has too many elements: " << local_ports.size();
     std::abort();
   }
-  // Note local_ports_ is a std::set
-  if (local_ports_.size() != local_ports.size()) {
+  if (std::set<Port>(local_ports.begin(), local_ports.end()).size() !=
+      local_ports.size()) {
     LOG(ERROR) << "local_ports contains duplicate values";
     std::abort();
   }
@@ -43,6 +146,36 @@ EventStreamHandler<ButtonsType>::EventStreamHandler(
     LOG(ERROR) << "local_ports contains PORT_ANY";
     std::abort();
   }
+  for (const Port port : local_ports) {
+    const int index = PortIndex(port);
+    if (index < 0) {
+      LOG(ERROR) << "local_ports contains invalid port: " << port;
+      std::abort();
+    }
+    local_port_mask_ |= 1u << index;
+  }
+}
+
+template <typename ButtonsType>
+EventStreamHandler<ButtonsType>::~EventStreamHandler() {
+  trace_->RemoveSummarySource(this);
+  if (writer_thread_.joinable()) {
+    {
+      std::lock_guard<std::mutex> guard(write_m_);
+      writer_stopping_ = true;
+    }
+    write_cv_.notify_all();
+  }
+  if (reader_thread_.joinable() || writer_thread_.joinable()) {
+    // Unblock the reader or writer if either is waiting on the transport.
+    transport_->TryCancel();
+  }
+  if (reader_thread_.joinable()) {
+    reader_thread_.join();
+  }
+  if (writer_thread_.joinable()) {
+    writer_thread_.join();
+  }
 }
 
 // -----------------------------------------------------------------------------
@@ -53,22 +186,25 @@ EventStreamHandler<ButtonsType>::EventStreamHandler(
 
 template <typename ButtonsType>
 bool EventStreamHandler<ButtonsType>::ClientReady() {
-  stream_ = stub_->SendEvent(&stream_context_);
+  if (!transport_->Open()) {
+    LOG(ERROR) << "Failed to open the event transport.";
+    return false;
+  }
 
   // Notify the server we are ready to start the game.
   OutgoingEventPB client_ready_event;
   ClientReadyPB* client_ready = client_ready_event.mutable_client_ready();
   client_ready->set_console_id(console_id_);
   client_ready->set_client_id(client_id_);
+  client_ready->set_supports_packed_buttons(coder_.SupportsPackedButtons());
+  client_ready->set_supports_run_length_buttons(options_.run_length_buttons);
 
   VLOG(3) << "Writing client ready request to stream:\n"
           << client_ready_event.DebugString();
 
-  timings_->add_event()->set_client_ready_sync_write_start(
-      client_utils::now_nanos());
-  bool success = stream_->Write(client_ready_event);
-  timings_->add_event()->set_client_ready_sync_write_finish(
-      client_utils::now_nanos());
+  trace_->Record(TimingEventPB::kClientReadySyncWriteStart);
+  bool success = transport_->Write(client_ready_event);
+  trace_->Record(TimingEventPB::kClientReadySyncWriteFinish);
 
   if (!success) {
     LOG(ERROR) << "Failed to write client ready request: "
@@ -86,11 +222,9 @@ bool EventStreamHandler<ButtonsType>::WaitForConsoleStart() {
   VLOG(3) << "Expecting start game notification";
   IncomingEventPB start_game_event;
 
-  timings_->add_event()->set_start_game_event_read_start(
-      client_utils::now_nanos());
-  bool success = stream_->Read(&start_game_event);
-  timings_->add_event()->set_start_game_event_read_finish(
-      client_utils::now_nanos());
+  trace_->Record(TimingEventPB::kStartGameEventReadStart);
+  bool success = transport_->Read(&start_game_event);
+  trace_->Record(TimingEventPB::kStartGameEventReadFinish);
 
   if (!success) {
     LOG(ERROR) << "Failed to read event. Expected a StartGamePB.";
@@ -102,6 +236,7 @@ bool EventStreamHandler<ButtonsType>::WaitForConsoleStart() {
   if (start_game_event.has_stop_console()) {
     LOG(ERROR) << "Console stopped before it was started: "
                << start_game_event.DebugString();
+    status_ = HandlerStatus::CONSOLE_TERMINATED;
     return false;
   }
   if (!start_game_event.has_start_game()) {
@@ -118,12 +253,70 @@ bool EventStreamHandler<ButtonsType>::WaitForConsoleStart() {
     return false;
   }
 
+  // The server only picks the packed form if every client supports it.
+  if (start_game.packed_buttons() && !coder_.SupportsPackedButtons()) {
+    LOG(ERROR) << "Server chose packed buttons, which the coder doesn't "
+                  "support: "
+               << start_game.DebugString();
+    return false;
+  }
+  packed_buttons_ = start_game.packed_buttons();
+
+  // Likewise for run-length compression.
+  if (start_game.run_length_buttons() && !options_.run_length_buttons) {
+    LOG(ERROR) << "Server chose run-length buttons, which this client didn't "
+                  "offer: "
+               << start_game.DebugString();
+    return false;
+  }
+  run_length_buttons_ = start_game.run_length_buttons();
+
   if (!InitializeQueues(start_game.connected_ports())) {
     // Error already logged.
-    input_queues_.clear();
+    slots_ = std::array<Slot, 4>();
+    connected_port_mask_ = 0;
     return false;
   }
 
+  // Outside of rollback mode, only the frame being waited for is predicted.
+  const bool predict =
+      options_.rollback_frames > 0 || options_.measure_predictions;
+  const int max_pending_frames = std::max(options_.rollback_frames, 1);
+  for (int i = 0; i < 4; ++i) {
+    Slot& slot = slots_[i];
+    if (slot.queue == nullptr) {
+      continue;
+    }
+    const Port port = static_cast<Port>(PORT_1 + i);
+    const bool remote = !IsLocalPort(port);
+    if (predict && remote) {
+      slot.predictor.reset(
+          new ButtonsInputPredictor(port, options_.prediction_strategy,
+                                    max_pending_frames, &coder_, trace_));
+    }
+    if (options_.rollback_frames > 0) {
+      slot.rollback_buffer.reset(
+          new ButtonsRollbackBuffer(slot.queue.get(), options_.rollback_frames,
+                                    remote, slot.predictor.get()));
+    }
+  }
+
+  status_ = HandlerStatus::CONSOLE_RUNNING;
+  trace_->AddSummarySource(this);
+
+  // The queues must not change from this point on, since the reader accesses
+  // them without synchronization.
+  if (options_.background_reader) {
+    VLOG(3) << "Starting background event stream reader";
+    reader_thread_ =
+        std::thread(&EventStreamHandler<ButtonsType>::ReadEventsLoop, this);
+  }
+  if (options_.async_write_queue_size > 0) {
+    VLOG(3) << "Starting background event stream writer";
+    writer_thread_ =
+        std::thread(&EventStreamHandler<ButtonsType>::WriteEventsLoop, this);
+  }
+
   return true;
 }
 
@@ -136,9 +329,9 @@ bool EventStreamHandler<ButtonsType>::InitializeQueues(
     return false;
   }
 
-  std::set<Port> handled_ports;
-
-  int local_ports_connected = 0;
+  // Map queues share a lock, so that GetFrame reads all ports under it once.
+  const std::shared_ptr<MapQueueLock> map_lock =
+      std::make_shared<MapQueueLock>();
 
   for (const StartGamePB::ConnectedPortPB connected_port : ports) {
     Port port_id = connected_port.port();
@@ -149,37 +342,51 @@ bool EventStreamHandler<ButtonsType>::InitializeQueues(
       return false;
     }
 
-    if (handled_ports.find(port_id) != handled_ports.end()) {
+    const int index = PortIndex(port_id);
+    if (index < 0) {
+      LOG(ERROR) << "Server returned connected port with unexpected value "
+                 << port_id;
+      return false;
+    }
+
+    if ((connected_port_mask_ >> index) & 1) {
       LOG(ERROR) << "Duplicate port returned from server: "
                  << Port_Name(port_id);
       return false;
     }
 
     // Actually initialize the port as either local or remote.
-    if (local_ports_.find(port_id) != local_ports_.end()) {
+    Slot& slot = slots_[index];
+    if (IsLocalPort(port_id)) {
       VLOG(3) << "Inserting local queue for connected port:\n"
               << connected_port.DebugString();
-      input_queues_.emplace(port_id, std::unique_ptr<ButtonsInputQueue>(
-                                         ButtonsInputQueue::MakeLocalQueue(
-                                             connected_port.delay_frames())));
-      ++local_ports_connected;
+      slot.queue.reset(ButtonsInputQueue::MakeLocalQueue(
+          connected_port.delay_frames(), options_.queue_backend, map_lock));
     } else {
       VLOG(3) << "Inserting remote queue for connected port:\n"
               << connected_port.DebugString();
-      input_queues_.emplace(port_id, std::unique_ptr<ButtonsInputQueue>(
-                                         ButtonsInputQueue::MakeRemoteQueue(
-                                             connected_port.delay_frames())));
+      slot.queue.reset(ButtonsInputQueue::MakeRemoteQueue(
+          connected_port.delay_frames(), options_.queue_backend, map_lock));
+      if (options_.wait_max_spin_micros > 0 || options_.wait_yield_micros > 0) {
+        slot.wait_strategy.reset(new WaitStrategy(
+            static_cast<int64_t>(options_.wait_max_spin_micros) * 1000,
+            static_cast<int64_t>(options_.wait_yield_micros) * 1000));
+        slot.queue->set_wait_strategy(slot.wait_strategy.get());
+      }
     }
 
-    handled_ports.insert(port_id);
+    delay_adjuster_.AddPort(port_id, connected_port.delay_frames());
+    connected_port_mask_ |= 1u << index;
   }
 
   // Make sure all local ports were connected.
-  if (local_ports_.size() != local_ports_connected) {
+  const unsigned unconnected_local_ports =
+      local_port_mask_ & ~connected_port_mask_;
+  if (unconnected_local_ports != 0) {
     LOG(ERROR) << "Failed to connect local ports: ";
-    for (const Port local_port : local_ports_) {
-      if (handled_ports.find(local_port) == handled_ports.end()) {
-        LOG(ERROR) << Port_Name(local_port);
+    for (int i = 0; i < 4; ++i) {
+      if ((unconnected_local_ports >> i) & 1) {
+        LOG(ERROR) << Port_Name(static_cast<Port>(PORT_1 + i));
       }
     }
 
@@ -196,49 +403,93 @@ template <typename ButtonsType>
 typename EventStreamHandler<ButtonsType>::PutButtonsStatus
 EventStreamHandler<ButtonsType>::PutButtons(const std::vector<
     EventStreamHandler<ButtonsType>::ButtonsFrameTuple>& buttons_tuples) {
-  OutgoingEventPB event;
+  // Surface failures of earlier asynchronous writes.
+  if (write_failed_.load()) {
+    LOG(ERROR) << "A previous write of outgoing buttons failed.";
+    return PutButtonsStatus::FAILED_TO_TRANSMIT_REMOTE;
+  }
+
+  OutgoingEventPB& event = put_event_;
+  ClearOutgoingEvent(&event);
+  int local_frame = -1;
+
+  // Schedule the agreed delay changes of local ports on their queues.
+  {
+    std::lock_guard<std::mutex> lock(delay_m_);
+    for (Slot& slot : slots_) {
+      if (slot.has_delay_change && slot.queue != nullptr) {
+        VLOG(3) << "Scheduling delay change:\n"
+                << slot.delay_change.DebugString();
+        slot.queue->ChangeDelayFrames(slot.delay_change.frame(),
+                                      slot.delay_change.delay_frames());
+      }
+      slot.has_delay_change = false;
+    }
+  }
 
   for (const auto& buttons_tuple : buttons_tuples) {
     const Port port = std::get<0>(buttons_tuple);
     const int frame = std::get<1>(buttons_tuple);
     const ButtonsType& buttons = std::get<2>(buttons_tuple);
 
-    auto queue_it = input_queues_.find(port);
-    if (queue_it == input_queues_.end()) {
+    const int index = PortIndex(port);
+    if (index < 0 || slots_[index].queue == nullptr) {
       LOG(ERROR) << "Attempted to send buttons for disconnected port "
                  << Port_Name(port);
       return PutButtonsStatus::NO_SUCH_PORT;
     }
-    const std::unique_ptr<ButtonsInputQueue>& queue = queue_it->second;
+    ButtonsInputQueue* queue = slots_[index].queue.get();
 
     VLOG(3) << "Inserting buttons into a the queue for port " << Port_Name(port)
             << " and frame number " << frame;
-    if (!queue->PutButtons(frame, buttons)) {
+    int first_delayed_frame;
+    int num_delayed_frames;
+    if (!queue->PutButtons(frame, buttons, &first_delayed_frame,
+                           &num_delayed_frames)) {
       // Error already logged.
       return PutButtonsStatus::REJECTED_BY_QUEUE;
     }
 
     // If this port is local, attach to the outgoing event for transmission.
-    if (local_ports_.find(port) != local_ports_.end()) {
+    if ((local_port_mask_ >> index) & 1) {
       VLOG(3)
           << "Port " << Port_Name(port)
           << " is local, attaching it to an outgoing event for transmission.";
 
-      const int delay = DelayFramesForPort(port);
-      if (delay < 0) {
-        LOG(ERROR) << "Invalid delay frames for port " << Port_Name(port)
-                   << ": " << delay;
-        return PutButtonsStatus::INTERNAL_ERROR;
+      local_frame = std::max(local_frame, frame);
+      if (num_delayed_frames == 0) {
+        VLOG(3) << "Buttons for port " << Port_Name(port) << " and frame "
+                << frame << " were dropped to lower its delay";
+        continue;
       }
 
       KeyStatePB* key = event.add_key_press();
       key->set_console_id(console_id_);
-      key->set_frame_number(frame + delay);
+      key->set_frame_number(first_delayed_frame);
       key->set_port(port);
 
-      if (!coder_.EncodeButtons(buttons, key)) {
-        LOG(ERROR) << "Failed to encode buttons.";
-        return PutButtonsStatus::FAILED_TO_ENCODE;
+      // Buttons that repeat the previous frame's are not sent again.
+      if (run_length_buttons_ && RepeatsSentButtons(port, buttons)) {
+        key->set_unchanged(true);
+      } else {
+        const bool encoded = packed_buttons_
+                                 ? coder_.EncodePackedButtons(buttons, key)
+                                 : coder_.EncodeButtons(buttons, key);
+        if (!encoded) {
+          LOG(ERROR) << "Failed to encode buttons.";
+          return PutButtonsStatus::FAILED_TO_ENCODE;
+        }
+      }
+
+      // Raising the delay repeats the buttons for the frames it skips.
+      if (run_length_buttons_) {
+        key->set_run_frames(num_delayed_frames - 1);
+        continue;
+      }
+      for (int i = 1; i < num_delayed_frames; ++i) {
+        KeyStatePB* repeated_key = event.add_key_press();
+        *repeated_key = *key;
+        repeated_key->set_frame_number(first_delayed_frame + i);
       }
     } else {
       VLOG(3) << "Port " << Port_Name(port)
@@ -246,27 +497,293 @@ EventStreamHandler<ButtonsType>::PutButtons(const std::vector<
     }
   }
 
-  // TODO(alexgolec): Use an asynchronous write here
-  if (!event.key_press().empty()) {
-    VLOG(3) << "Sending key presses:\n" << event.DebugString();
+  if (time_sync_ != nullptr && !event.key_press().empty()) {
+    std::lock_guard<std::mutex> lock(time_sync_m_);
+    time_sync_->ObserveLocalFrame(event.key_press(0).port(), local_frame,
+                                  event.mutable_frame_status());
+  }
+
+  if (options_.coalesce_max_frames > 1 && !CoalesceEvent(&event)) {
+    VLOG(3) << "Coalesced key presses into a batch of " << batch_frames_
+            << " frames";
+    return PutButtonsStatus::SUCCESS;
+  }
 
-    timings_->add_event()->set_key_state_sync_write_start(
-        client_utils::now_nanos());
-    bool success = stream_->Write(event);
-    timings_->add_event()->set_key_state_sync_write_finish(
-        client_utils::now_nanos());
+  if (event.key_press().empty()) {
+    VLOG(3) << "Event has no key presses:\n" << event.DebugString();
+    return PutButtonsStatus::SUCCESS;
+  }
+  return SendEvent(&event);
+}
 
-    if (!success) {
-      LOG(ERROR) << "Failed to write outgoing event: " << event.DebugString();
+template <typename ButtonsType>
+bool EventStreamHandler<ButtonsType>::CoalesceEvent(OutgoingEventPB* event) {
+  const int64_t now_nanos = trace_->now_nanos();
+  if (!event->key_press().empty()) {
+    if (batch_frames_ == 0) {
+      batch_start_nanos_ = now_nanos;
+    }
+    for (KeyStatePB& key : *event->mutable_key_press()) {
+      batch_.add_key_press()->Swap(&key);
+    }
+    if (event->has_frame_status()) {
+      batch_.mutable_frame_status()->Swap(event->mutable_frame_status());
+    }
+    ClearOutgoingEvent(event);
+    ++batch_frames_;
+  }
+  if (batch_frames_ == 0) {
+    return false;
+  }
+
+  const bool deadline_passed =
+      options_.coalesce_deadline_micros > 0 &&
+      now_nanos - batch_start_nanos_ >=
+          static_cast<int64_t>(options_.coalesce_deadline_micros) * 1000;
+  if (!deadline_passed && batch_frames_ < options_.coalesce_max_frames &&
+      batch_frames_ < CoalesceBudgetFrames()) {
+    return false;
+  }
+
+  event->Swap(&batch_);
+  ClearOutgoingEvent(&batch_);
+  batch_frames_ = 0;
+  return true;
+}
+
+template <typename ButtonsType>
+int EventStreamHandler<ButtonsType>::CoalesceBudgetFrames() {
+  // The key presses put for frame f are needed at frame f + delay. Holding
+  // them for n frames leaves delay - n frames for them to travel.
+  int delay_frames = -1;
+  for (int i = 0; i < 4; ++i) {
+    const ButtonsInputQueue* queue = slots_[i].queue.get();
+    if (((local_port_mask_ >> i) & 1) && queue != nullptr &&
+        (delay_frames < 0 || queue->delay_frames() < delay_frames)) {
+      delay_frames = queue->delay_frames();
+    }
+  }
+
+  int travel_frames = 0;
+  if (options_.stream_ping_period_millis > 0) {
+    std::lock_guard<std::mutex> lock(latency_m_);
+    const int64_t rtt_nanos =
+        latency_estimator_.latency().smoothed_rtt_nanos();
+    const double frame_period_nanos =
+        options_.frame_period_millis * 1000 * 1000;
+    travel_frames = static_cast<int>(std::ceil(rtt_nanos / frame_period_nanos));
+  }
+
+  // A batch of a single frame is sent right away.
+  return std::max(1, delay_frames - travel_frames);
+}
+
+template <typename ButtonsType>
+typename EventStreamHandler<ButtonsType>::PutButtonsStatus
+EventStreamHandler<ButtonsType>::SendEvent(OutgoingEventPB* event) {
+  if (run_length_buttons_) {
+    MergeUnchangedFrames(event);
+  }
+  MaybeAttachPing(event);
+  AttachDelayChanges(event);
+
+  if (options_.async_write_queue_size > 0) {
+    VLOG(3) << "Queueing key presses:\n" << event->DebugString();
+    if (!EnqueueWrite(event)) {
+      LOG(ERROR) << "A previous write of outgoing buttons failed.";
       return PutButtonsStatus::FAILED_TO_TRANSMIT_REMOTE;
     }
-  } else {
-    VLOG(3) << "Event has no key presses:\n" << event.DebugString();
+    return PutButtonsStatus::SUCCESS;
   }
 
+  VLOG(3) << "Sending key presses:\n" << event->DebugString();
+
+  trace_->Record(TimingEventPB::kKeyStateSyncWriteStart);
+  bool success = transport_->Write(*event);
+  trace_->Record(TimingEventPB::kKeyStateSyncWriteFinish);
+
+  if (!success) {
+    LOG(ERROR) << "Failed to write outgoing event: " << event->DebugString();
+    return PutButtonsStatus::FAILED_TO_TRANSMIT_REMOTE;
+  }
   return PutButtonsStatus::SUCCESS;
 }
 
+template <typename ButtonsType>
+void EventStreamHandler<ButtonsType>::ClearOutgoingEvent(
+    OutgoingEventPB* event) {
+  if (time_sync_ == nullptr || !event->has_frame_status()) {
+    event->Clear();
+    return;
+  }
+  // PutButtons overwrites the kept status before the event is sent.
+  FrameStatusPB* frame_status = event->release_frame_status();
+  event->Clear();
+  frame_status->Clear();
+  event->set_allocated_frame_status(frame_status);
+}
+
+template <typename ButtonsType>
+bool EventStreamHandler<ButtonsType>::RepeatsSentButtons(
+    const Port port, const ButtonsType& buttons) {
+  Slot& slot = slots_[PortIndex(port)];
+  if (slot.has_sent_buttons && slot.sent_buttons == buttons) {
+    return true;
+  }
+  slot.has_sent_buttons = true;
+  slot.sent_buttons = buttons;
+  return false;
+}
+
+template <typename ButtonsType>
+void EventStreamHandler<ButtonsType>::MergeUnchangedFrames(
+    OutgoingEventPB* event) {
+  // Index of the latest kept key press of each port, or -1.
+  int latest[PORT_4 + 1];
+  std::fill(latest, latest + PORT_4 + 1, -1);
+
+  // Kept key presses are moved to the front, in order, and merged ones are
+  // left behind to be removed.
+  google::protobuf::RepeatedPtrField<KeyStatePB>* keys =
+      event->mutable_key_press();
+  int kept = 0;
+  for (int i = 0; i < keys->size(); ++i) {
+    const KeyStatePB& key = keys->Get(i);
+    const int port = key.port();
+    if (key.unchanged() && latest[port] >= 0) {
+      KeyStatePB* run = keys->Mutable(latest[port]);
+      if (run->frame_number() + run->run_frames() + 1 == key.frame_number()) {
+        run->set_run_frames(run->run_frames() + key.run_frames() + 1);
+        continue;
+      }
+    }
+    if (i != kept) {
+      keys->SwapElements(i, kept);
+    }
+    latest[port] = kept++;
+  }
+  while (keys->size() > kept) {
+    keys->RemoveLast();
+  }
+}
+
+template <typename ButtonsType>
+void EventStreamHandler<ButtonsType>::MaybeAttachPing(OutgoingEventPB* event) {
+  if (options_.stream_ping_period_millis == 0) {
+    return;
+  }
+  const int64_t now_nanos = trace_->now_nanos();
+  if (now_nanos < next_ping_nanos_) {
+    return;
+  }
+  next_ping_nanos_ =
+      now_nanos +
+      static_cast<int64_t>(options_.stream_ping_period_millis) * 1000 * 1000;
+
+  // With asynchronous writes, the time the event waits to be written counts
+  // towards the round trip time.
+  StreamPingPB* ping = event->mutable_ping();
+  ping->set_sequence(next_ping_sequence_++);
+  ping->set_client_send_nanos(now_nanos);
+}
+
+template <typename ButtonsType>
+void EventStreamHandler<ButtonsType>::AttachDelayChanges(
+    OutgoingEventPB* event) {
+  std::lock_guard<std::mutex> lock(delay_m_);
+  for (DelayChangePB& change : proposed_delay_changes_) {
+    event->add_delay_change()->Swap(&change);
+  }
+  proposed_delay_changes_.clear();
+}
+
+template <typename ButtonsType>
+bool EventStreamHandler<ButtonsType>::FlushWrites() {
+  if (batch_frames_ > 0) {
+    ClearOutgoingEvent(&put_event_);
+    put_event_.Swap(&batch_);
+    batch_frames_ = 0;
+    if (SendEvent(&put_event_) != PutButtonsStatus::SUCCESS) {
+      // Error already logged.
+      return false;
+    }
+  }
+
+  if (options_.async_write_queue_size == 0) {
+    return true;
+  }
+
+  std::unique_lock<std::mutex> lock(write_m_);
+  write_cv_.wait(lock, [this] {
+    return write_failed_.load() ||
+           (pending_write_count_ == 0 && !write_in_flight_);
+  });
+  return !write_failed_.load();
+}
+
+template <typename ButtonsType>
+bool EventStreamHandler<ButtonsType>::EnqueueWrite(OutgoingEventPB* event) {
+  {
+    std::unique_lock<std::mutex> lock(write_m_);
+    write_cv_.wait(lock, [this] {
+      return write_failed_.load() ||
+             pending_write_count_ < pending_writes_.size();
+    });
+    if (write_failed_.load()) {
+      return false;
+    }
+
+    // The caller gets back the event written last from this slot, to reuse.
+    const size_t tail = (pending_write_head_ + pending_write_count_) %
+                        pending_writes_.size();
+    pending_writes_[tail].Swap(event);
+    ++pending_write_count_;
+  }
+  write_cv_.notify_all();
+
+  return true;
+}
+
+template <typename ButtonsType>
+void EventStreamHandler<ButtonsType>::WriteEventsLoop() {
+  std::unique_lock<std::mutex> lock(write_m_);
+  OutgoingEventPB event;
+
+  while (true) {
+    write_cv_.wait(lock, [this] {
+      return writer_stopping_ || pending_write_count_ > 0;
+    });
+    if (writer_stopping_) {
+      break;
+    }
+
+    // Leaves the event written last in the slot, for PutButtons to reuse.
+    event.Swap(&pending_writes_[pending_write_head_]);
+    pending_write_head_ = (pending_write_head_ + 1) % pending_writes_.size();
+    --pending_write_count_;
+    write_in_flight_ = true;
+
+    // Write without holding the lock so PutButtons can keep queueing, and let
+    // it know there is room in the queue.
+    lock.unlock();
+    write_cv_.notify_all();
+    const bool success = transport_->Write(event);
+    lock.lock();
+
+    write_in_flight_ = false;
+    if (!success) {
+      LOG(ERROR) << "Failed to write outgoing event: " << event.DebugString();
+      write_failed_ = true;
+      pending_write_count_ = 0;
+      write_cv_.notify_all();
+      break;
+    }
+    write_cv_.notify_all();
+  }
+
+  VLOG(3) << "Background event stream writer stopping";
+}
+
 // -----------------------------------------------------------------------------
 // GetButtons and helpers
 
@@ -274,20 +791,119 @@ template <typename ButtonsType>
 typename EventStreamHandler<ButtonsType>::GetButtonsStatus
 EventStreamHandler<ButtonsType>::GetButtons(const Port port, int frame,
                                             ButtonsType* buttons) {
-  if (local_ports_.find(port) != local_ports_.end()) {
+  if (options_.rollback_frames > 0) {
+    LOG(ERROR) << "GetButtons is unavailable in rollback mode, use "
+                  "GetSpeculativeButtons instead";
+    return GetButtonsStatus::FAILURE;
+  }
+
+  if (IsLocalPort(port)) {
     return GetLocalButtons(port, frame, buttons);
   } else {
-    timings_->add_event()->set_remote_key_state_requested(
-        client_utils::now_nanos());
+    trace_->Record(TimingEventPB::kRemoteKeyStateRequested);
     EventStreamHandler<ButtonsType>::GetButtonsStatus
         get_remote_buttons_status = GetRemoteButtons(port, frame, buttons);
-    timings_->add_event()->set_remote_key_state_returned(
-        client_utils::now_nanos());
+    trace_->Record(TimingEventPB::kRemoteKeyStateReturned);
 
     return get_remote_buttons_status;
   }
 }
 
+template <typename ButtonsType>
+typename EventStreamHandler<ButtonsType>::GetButtonsStatus
+EventStreamHandler<ButtonsType>::GetFrame(int frame, ButtonsType* buttons) {
+  if (options_.rollback_frames > 0) {
+    LOG(ERROR) << "GetFrame is unavailable in rollback mode, use "
+                  "GetSpeculativeButtons instead";
+    return GetButtonsStatus::FAILURE;
+  }
+
+  for (int i = 0; i < 4; ++i) {
+    buttons[i] = ButtonsType();
+  }
+
+  const unsigned local_ports = connected_port_mask_ & local_port_mask_;
+  const unsigned remote_ports = connected_port_mask_ & ~local_port_mask_;
+
+  // Remote ports are only waited for one by one if this thread reads the
+  // stream, or if each wait is predicted, counted or timed on its own.
+  bool per_port_waits = !options_.background_reader ||
+                        options_.delay_adjust_window_frames > 0;
+  for (const Slot& slot : slots_) {
+    per_port_waits = per_port_waits || slot.predictor != nullptr ||
+                     slot.wait_strategy != nullptr;
+  }
+
+  if (!per_port_waits) {
+    // Local queues come first, since their buttons must already be there.
+    ButtonsInputQueue* queues[4];
+    ButtonsType* queue_buttons[4];
+    int num_queues = 0;
+    const auto add_queues = [&](unsigned ports) {
+      for (int i = 0; i < 4; ++i) {
+        if ((ports >> i) & 1) {
+          queues[num_queues] = slots_[i].queue.get();
+          queue_buttons[num_queues] = &buttons[i];
+          ++num_queues;
+        }
+      }
+    };
+    add_queues(local_ports);
+    const int num_local = num_queues;
+    add_queues(remote_ports);
+
+    if (remote_ports != 0) {
+      trace_->Record(TimingEventPB::kRemoteKeyStateRequested);
+    }
+    const typename ButtonsInputQueue::GetButtonsStatus status =
+        ButtonsInputQueue::GetFrame(queues, num_queues, num_local, frame,
+                                    queue_buttons);
+    if (remote_ports != 0) {
+      trace_->Record(TimingEventPB::kRemoteKeyStateReturned);
+    }
+
+    if (status == ButtonsInputQueue::GetButtonsStatus::CLOSED) {
+      LOG(ERROR) << "Event stream reader stopped with status "
+                 << static_cast<int>(reader_status_.load())
+                 << " before buttons arrived for frame " << frame;
+      return GetButtonsStatus::FAILURE;
+    } else if (status != ButtonsInputQueue::GetButtonsStatus::SUCCESS) {
+      LOG(ERROR) << "Failed to read buttons of all ports for frame " << frame;
+      return GetButtonsStatus::FAILURE;
+    }
+    return GetButtonsStatus::SUCCESS;
+  }
+
+  // Local buttons never wait, so read them before blocking on remote ones.
+  for (int i = 0; i < 4; ++i) {
+    if (((local_ports >> i) & 1) &&
+        GetLocalButtons(static_cast<Port>(PORT_1 + i), frame, &buttons[i]) !=
+            GetButtonsStatus::SUCCESS) {
+      // Error already logged.
+      return GetButtonsStatus::FAILURE;
+    }
+  }
+  if (remote_ports == 0) {
+    return GetButtonsStatus::SUCCESS;
+  }
+
+  trace_->Record(TimingEventPB::kRemoteKeyStateRequested);
+  for (int i = 0; i < 4; ++i) {
+    if (((remote_ports >> i) & 1) == 0) {
+      continue;
+    }
+    if (GetRemoteButtons(static_cast<Port>(PORT_1 + i), frame, &buttons[i]) !=
+        GetButtonsStatus::SUCCESS) {
+      // Error already logged.
+      trace_->Record(TimingEventPB::kRemoteKeyStateReturned);
+      return GetButtonsStatus::FAILURE;
+    }
+  }
+  trace_->Record(TimingEventPB::kRemoteKeyStateReturned);
+
+  return GetButtonsStatus::SUCCESS;
+}
+
 template <typename ButtonsType>
 typename EventStreamHandler<ButtonsType>::GetButtonsStatus
 EventStreamHandler<ButtonsType>::GetLocalButtons(const Port port, int frame,
@@ -315,12 +931,76 @@ template <typename ButtonsType>
 typename EventStreamHandler<ButtonsType>::GetButtonsStatus
 EventStreamHandler<ButtonsType>::GetRemoteButtons(const Port port, int frame,
                                                   ButtonsType* buttons) {
+  const int index = PortIndex(port);
+  ButtonsInputPredictor* predictor =
+      index < 0 ? nullptr : slots_[index].predictor.get();
+  const bool count_stalls = options_.delay_adjust_window_frames > 0;
+  if (predictor == nullptr && !count_stalls) {
+    return WaitForRemoteButtons(port, frame, buttons);
+  }
+
+  // Buttons that are already in the queue were not waited for, and would not
+  // have been predicted.
+  ButtonsInputQueue* queue = GetQueue(port);
+  if (queue != nullptr &&
+      queue->GetButtons(frame, 0 /* zero seconds */, buttons) ==
+          ButtonsInputQueue::GetButtonsStatus::SUCCESS) {
+    if (predictor != nullptr) {
+      predictor->Observe(frame, *buttons, 0 /* wait_nanos */);
+    }
+    if (count_stalls) {
+      ObserveStall(port, frame, false /* stalled */);
+    }
+    return GetButtonsStatus::SUCCESS;
+  }
+
+  if (predictor != nullptr) {
+    predictor->Predict(frame);
+  }
+  const int64_t wait_start_nanos = trace_->now_nanos();
+  const GetButtonsStatus status = WaitForRemoteButtons(port, frame, buttons);
+  if (status == GetButtonsStatus::SUCCESS) {
+    if (predictor != nullptr) {
+      predictor->Observe(frame, *buttons,
+                         trace_->now_nanos() - wait_start_nanos);
+    }
+    if (count_stalls) {
+      ObserveStall(port, frame, true /* stalled */);
+    }
+  }
+  return status;
+}
+
+template <typename ButtonsType>
+typename EventStreamHandler<ButtonsType>::GetButtonsStatus
+EventStreamHandler<ButtonsType>::WaitForRemoteButtons(const Port port,
+                                                      int frame,
+                                                      ButtonsType* buttons) {
   ButtonsInputQueue* queue = GetQueue(port);
   if (queue == nullptr) {
     // Error already logged
     return GetButtonsStatus::NO_SUCH_PORT;
   }
 
+  // The background reader fills the queue on its own, so all we have to do is
+  // wait. The queue is closed if the reader stops.
+  if (options_.background_reader) {
+    typename ButtonsInputQueue::GetButtonsStatus status = queue->GetButtons(
+        frame, ButtonsInputQueue::kBlockForever, buttons);
+    if (status == ButtonsInputQueue::GetButtonsStatus::SUCCESS) {
+      return GetButtonsStatus::SUCCESS;
+    } else if (status == ButtonsInputQueue::GetButtonsStatus::CLOSED) {
+      LOG(ERROR) << "Event stream reader stopped with status "
+                 << static_cast<int>(reader_status_.load())
+                 << " before buttons arrived for remote port "
+                 << Port_Name(port) << " and frame " << frame;
+      return GetButtonsStatus::FAILURE;
+    }
+    LOG(ERROR) << "Failed to read buttons from remote port " << Port_Name(port)
+               << " and frame " << frame;
+    return GetButtonsStatus::FAILURE;
+  }
+
   // If button data is already in the queue, return it immediately.
   typename ButtonsInputQueue::GetButtonsStatus status =
       queue->GetButtons(frame, 0 /* zero seconds */, buttons);
@@ -357,14 +1037,14 @@ EventStreamHandler<ButtonsType>::ReadUntilButtons(const Port port, int frame) {
   bool found_buttons = false;
 
   while (!found_buttons) {
-    IncomingEventPB event;
+    IncomingEventPB& event = read_event_;
 
     VLOG(3) << "Looping on buttons for port " << Port_Name(port)
             << " and frame " << frame;
 
-    timings_->add_event()->set_key_state_read_start(client_utils::now_nanos());
-    bool success = stream_->Read(&event);
-    timings_->add_event()->set_key_state_read_finish(client_utils::now_nanos());
+    trace_->Record(TimingEventPB::kKeyStateReadStart);
+    bool success = transport_->Read(&event);
+    trace_->Record(TimingEventPB::kKeyStateReadFinish);
     if (!success) {
       LOG(ERROR) << "Failed to read event.";
       return ReadUntilButtonsStatus::RPC_READ_FAILURE;
@@ -372,60 +1052,257 @@ EventStreamHandler<ButtonsType>::ReadUntilButtons(const Port port, int frame) {
 
     VLOG(3) << "Read incoming event from stream:\n" << event.DebugString();
 
-    if (event.has_stop_console()) {
-      VLOG(3) << "Received console stopped message";
-      return ReadUntilButtonsStatus::CONSOLE_TERMINATED;
-    }
-
-    // Return an error on all non-button statuses.
-    // TODO(alexgolec): handle this more gracefully
-    if (event.has_start_game() || !event.invalid_data().empty()) {
-      LOG(ERROR)
-          << "Received non-button message when expecting button message: "
-          << event.DebugString();
-      return ReadUntilButtonsStatus::NON_BUTTON_MESSAGE;
+    const ReadUntilButtonsStatus status = EnqueueEvent(event);
+    if (status != ReadUntilButtonsStatus::GOT_BUTTONS) {
+      // Error already logged.
+      return status;
     }
 
     for (const KeyStatePB& keys : event.key_press()) {
-      ButtonsInputQueue* queue = GetQueue(keys.port());
-      if (queue == nullptr) {
-        LOG(ERROR) << "Received buttons state data for unconnected port : "
-                   << Port_Name(keys.port());
-        return ReadUntilButtonsStatus::INVALID_BUTTONS_MESSAGE;
+      if (keys.port() == port && keys.frame_number() <= frame &&
+          frame <= keys.frame_number() + keys.run_frames()) {
+        VLOG(3) << "Found buttons for frame " << port << " and frame " << frame;
+        found_buttons = true;
+        break;
       }
+    }
+  }
+
+  // We only exit the loop if we've found the requested frames.
+  return ReadUntilButtonsStatus::GOT_BUTTONS;
+}
 
-      ButtonsType buttons;
-      if (!coder_.DecodeButtons(keys, &buttons)) {
-        LOG(ERROR) << "Failed to decode buttons from message: "
+template <typename ButtonsType>
+typename EventStreamHandler<ButtonsType>::ReadUntilButtonsStatus
+EventStreamHandler<ButtonsType>::EnqueueEvent(const IncomingEventPB& event) {
+  if (event.has_stop_console()) {
+    VLOG(3) << "Received console stopped message";
+    status_ = HandlerStatus::CONSOLE_TERMINATED;
+    return ReadUntilButtonsStatus::CONSOLE_TERMINATED;
+  }
+
+  // Echoed stream pings may share an event with buttons.
+  if (event.has_pong()) {
+    HandlePong(event.pong());
+  }
+
+  // So do delay changes proposed by other clients.
+  for (const DelayChangePB& change : event.delay_change()) {
+    HandleDelayChange(change);
+  }
+
+  // Return an error on all non-button statuses.
+  // TODO(alexgolec): handle this more gracefully
+  if (event.has_start_game() || !event.invalid_data().empty()) {
+    LOG(ERROR) << "Received non-button message when expecting button message: "
+               << event.DebugString();
+    return ReadUntilButtonsStatus::NON_BUTTON_MESSAGE;
+  }
+
+  // Observed before the buttons are queued, so that the frames are known to
+  // time sync by the time GetButtons returns them.
+  if (time_sync_ != nullptr) {
+    ObserveRemoteFrames(event);
+  }
+
+  for (const KeyStatePB& keys : event.key_press()) {
+    ButtonsInputQueue* queue = GetQueue(keys.port());
+    if (queue == nullptr) {
+      LOG(ERROR) << "Received buttons state data for unconnected port : "
+                 << Port_Name(keys.port());
+      return ReadUntilButtonsStatus::INVALID_BUTTONS_MESSAGE;
+    }
+
+    if (keys.run_frames() < 0) {
+      LOG(ERROR) << "Received buttons with a negative run: "
+                 << keys.DebugString();
+      return ReadUntilButtonsStatus::INVALID_BUTTONS_MESSAGE;
+    }
+
+    // GetQueue only returns the queues of connected ports.
+    Slot& slot = slots_[PortIndex(keys.port())];
+    ButtonsType buttons;
+    if (keys.unchanged()) {
+      // Unchanged buttons repeat those of the port's previous frame.
+      if (slot.received_frame < 0 ||
+          slot.received_frame + 1 != keys.frame_number()) {
+        LOG(ERROR) << "Received unchanged buttons without the previous frame: "
                    << keys.DebugString();
         return ReadUntilButtonsStatus::INVALID_BUTTONS_MESSAGE;
       }
+      buttons = slot.received_buttons;
+    } else if (!coder_.DecodeButtons(keys, &buttons)) {
+      LOG(ERROR) << "Failed to decode buttons from message: "
+                 << keys.DebugString();
+      return ReadUntilButtonsStatus::INVALID_BUTTONS_MESSAGE;
+    }
 
-      if (!queue->PutButtons(keys.frame_number(), buttons)) {
+    for (int i = 0; i <= keys.run_frames(); ++i) {
+      if (!queue->PutButtons(keys.frame_number() + i, buttons)) {
         LOG(ERROR) << "Failed to insert buttons into queue for port "
                    << Port_Name(keys.port()) << " and frame "
-                   << keys.frame_number();
+                   << keys.frame_number() + i;
         return ReadUntilButtonsStatus::REJECTED_BY_QUEUE;
       }
+    }
 
-      if (!found_buttons && keys.port() == port &&
-          keys.frame_number() == frame) {
-        VLOG(3) << "Found buttons for frame " << port << " and frame " << frame;
-        found_buttons = true;
-      }
+    if (run_length_buttons_) {
+      slot.received_frame = keys.frame_number() + keys.run_frames();
+      slot.received_buttons = buttons;
     }
   }
 
-  // We only exit the loop if we've found the requested frames.
   return ReadUntilButtonsStatus::GOT_BUTTONS;
 }
 
+template <typename ButtonsType>
+void EventStreamHandler<ButtonsType>::ReadEventsLoop() {
+  ReadUntilButtonsStatus status = ReadUntilButtonsStatus::GOT_BUTTONS;
+
+  IncomingEventPB& event = read_event_;
+  while (status == ReadUntilButtonsStatus::GOT_BUTTONS) {
+    if (!transport_->Read(&event)) {
+      LOG(ERROR) << "Failed to read event.";
+      status = ReadUntilButtonsStatus::RPC_READ_FAILURE;
+      break;
+    }
+
+    VLOG(3) << "Read incoming event from stream:\n" << event.DebugString();
+    status = EnqueueEvent(event);
+  }
+
+  VLOG(3) << "Background event stream reader stopping with status "
+          << static_cast<int>(status);
+  reader_status_ = status;
+
+  for (int i = 0; i < 4; ++i) {
+    if (((connected_port_mask_ & ~local_port_mask_) >> i) & 1) {
+      slots_[i].queue->Close();
+    }
+  }
+}
+
+template <typename ButtonsType>
+void EventStreamHandler<ButtonsType>::HandlePong(const StreamPingPB& pong) {
+  const int64_t receive_nanos = trace_->now_nanos();
+  std::lock_guard<std::mutex> lock(latency_m_);
+  latency_estimator_.AddSample(pong, receive_nanos);
+}
+
+template <typename ButtonsType>
+void EventStreamHandler<ButtonsType>::ObserveRemoteFrames(
+    const IncomingEventPB& event) {
+  // Buttons are sent delay frames ahead of the frame that uses them, with the
+  // delay agreed for their port, which the queues of remote ports don't know.
+  int delays[4];
+  {
+    std::lock_guard<std::mutex> lock(delay_m_);
+    for (int i = 0; i < 4; ++i) {
+      delays[i] = delay_adjuster_.delay_frames(static_cast<Port>(PORT_1 + i));
+    }
+  }
+  std::lock_guard<std::mutex> lock(time_sync_m_);
+  // Buttons for unconnected ports are rejected by the caller.
+  for (const KeyStatePB& keys : event.key_press()) {
+    const int index = PortIndex(keys.port());
+    const int delay = index < 0 ? -1 : delays[index];
+    if (delay >= 0) {
+      time_sync_->ObserveRemoteFrame(
+          keys.port(), keys.frame_number() + keys.run_frames() - delay);
+    }
+  }
+  if (event.has_frame_status()) {
+    time_sync_->ObserveRemoteStatus(event.frame_status());
+  }
+}
+
+template <typename ButtonsType>
+void EventStreamHandler<ButtonsType>::ObserveStall(const Port port, int frame,
+                                                   bool stalled) {
+  std::lock_guard<std::mutex> lock(delay_m_);
+  DelayChangePB change;
+  if (delay_adjuster_.ObserveFrame(port, frame, stalled, &change) &&
+      delay_adjuster_.Accept(change)) {
+    VLOG(3) << "Proposing delay change:\n" << change.DebugString();
+    proposed_delay_changes_.push_back(change);
+  }
+}
+
+template <typename ButtonsType>
+void EventStreamHandler<ButtonsType>::HandleDelayChange(
+    const DelayChangePB& change) {
+  std::lock_guard<std::mutex> lock(delay_m_);
+  if (!delay_adjuster_.Accept(change)) {
+    VLOG(3) << "Ignoring outdated delay change:\n" << change.DebugString();
+    return;
+  }
+  if (IsLocalPort(change.port())) {
+    Slot& slot = slots_[PortIndex(change.port())];
+    slot.has_delay_change = true;
+    slot.delay_change = change;
+  }
+}
+
+// -----------------------------------------------------------------------------
+// Rollback
+
+template <typename ButtonsType>
+typename EventStreamHandler<ButtonsType>::GetButtonsStatus
+EventStreamHandler<ButtonsType>::GetSpeculativeButtons(const Port port,
+                                                       int frame,
+                                                       ButtonsType* buttons,
+                                                       bool* predicted) {
+  if (options_.rollback_frames == 0) {
+    LOG(ERROR) << "GetSpeculativeButtons requires rollback mode";
+    return GetButtonsStatus::FAILURE;
+  }
+
+  const int index = PortIndex(port);
+  ButtonsRollbackBuffer* rollback_buffer =
+      index < 0 ? nullptr : slots_[index].rollback_buffer.get();
+  if (rollback_buffer == nullptr) {
+    LOG(ERROR) << "Requested speculative buttons for disconnected port: "
+               << Port_Name(port);
+    return GetButtonsStatus::NO_SUCH_PORT;
+  }
+
+  switch (rollback_buffer->GetButtons(frame, buttons)) {
+    case ButtonsRollbackBuffer::GetButtonsStatus::CONFIRMED:
+      *predicted = false;
+      return GetButtonsStatus::SUCCESS;
+    case ButtonsRollbackBuffer::GetButtonsStatus::PREDICTED:
+      VLOG(3) << "Predicted buttons for port " << Port_Name(port)
+              << " and frame " << frame;
+      *predicted = true;
+      return GetButtonsStatus::SUCCESS;
+    default:
+      LOG(ERROR) << "Failed to get speculative buttons for port "
+                 << Port_Name(port) << " and frame " << frame;
+      return GetButtonsStatus::FAILURE;
+  }
+}
+
+template <typename ButtonsType>
+int EventStreamHandler<ButtonsType>::TakeRollbackFrame() {
+  int rollback_frame = -1;
+  for (const Slot& slot : slots_) {
+    if (slot.rollback_buffer == nullptr) {
+      continue;
+    }
+    const int frame = slot.rollback_buffer->TakeMispredictedFrame();
+    if (frame >= 0 && (rollback_frame < 0 || frame < rollback_frame)) {
+      rollback_frame = frame;
+    }
+  }
+  return rollback_frame;
+}
+
 // -----------------------------------------------------------------------------
 // Close
 
 template <typename ButtonsType>
 void EventStreamHandler<ButtonsType>::TryCancel() {
-  stream_context_.TryCancel();
+  transport_->TryCancel();
 }
 
 // -----------------------------------------------------------------------------
@@ -433,41 +1310,124 @@ void EventStreamHandler<ButtonsType>::TryCancel() {
 
 template <typename ButtonsType>
 std::set<Port> EventStreamHandler<ButtonsType>::local_ports() const {
-  return local_ports_;
+  std::set<Port> ports;
+  for (int i = 0; i < 4; ++i) {
+    if ((local_port_mask_ >> i) & 1) {
+      ports.insert(static_cast<Port>(PORT_1 + i));
+    }
+  }
+  return ports;
 }
 
 template <typename ButtonsType>
 std::set<Port> EventStreamHandler<ButtonsType>::remote_ports() const {
   std::set<Port> ports;
-  for (const auto& it : input_queues_) {
-    const Port p = static_cast<Port>(it.first);
-    if (local_ports_.find(p) == local_ports_.end()) {
-      ports.insert(p);
+  for (int i = 0; i < 4; ++i) {
+    if (((connected_port_mask_ & ~local_port_mask_) >> i) & 1) {
+      ports.insert(static_cast<Port>(PORT_1 + i));
     }
   }
   return ports;
 }
 
+template <typename ButtonsType>
+StreamLatencyPB EventStreamHandler<ButtonsType>::stream_latency() const {
+  std::lock_guard<std::mutex> lock(latency_m_);
+  return latency_estimator_.latency();
+}
+
+template <typename ButtonsType>
+double EventStreamHandler<ButtonsType>::frame_advantage() const {
+  if (time_sync_ == nullptr) {
+    return 0;
+  }
+  std::lock_guard<std::mutex> lock(time_sync_m_);
+  return time_sync_->frame_advantage();
+}
+
+template <typename ButtonsType>
+int64_t EventStreamHandler<ButtonsType>::TakePacingNanos() {
+  if (time_sync_ == nullptr) {
+    return 0;
+  }
+  std::lock_guard<std::mutex> lock(time_sync_m_);
+  return time_sync_->TakePacingNanos();
+}
+
 template <typename ButtonsType>
 int EventStreamHandler<ButtonsType>::DelayFramesForPort(Port port) const {
-  const auto it = input_queues_.find(static_cast<int>(port));
-  if (it == input_queues_.end()) {
+  const int index = PortIndex(port);
+  if (index < 0 || slots_[index].queue == nullptr) {
     return -1;
   }
-  return it->second->delay_frames();
+  return slots_[index].queue->delay_frames();
 }
 
 // -----------------------------------------------------------------------------
 // Utility methods
 
+template <typename ButtonsType>
+void EventStreamHandler<ButtonsType>::AddSummary(TimingsPB* timings) const {
+  {
+    std::lock_guard<std::mutex> lock(latency_m_);
+    if (latency_estimator_.latency().samples() > 0) {
+      *timings->mutable_stream_latency() = latency_estimator_.latency();
+    }
+  }
+  if (time_sync_ != nullptr) {
+    std::lock_guard<std::mutex> lock(time_sync_m_);
+    if (time_sync_->stats().samples() > 0) {
+      *timings->mutable_time_sync() = time_sync_->stats();
+    }
+  }
+
+  // Ports whose delay was neither counted nor changed are left out.
+  {
+    std::lock_guard<std::mutex> lock(delay_m_);
+    for (int i = 0; i < 4; ++i) {
+      const DelayAdjustmentPB stats =
+          delay_adjuster_.stats(static_cast<Port>(PORT_1 + i));
+      if (stats.observed_frames() > 0 || stats.accepted_changes() > 0) {
+        *timings->add_delay_adjustment() = stats;
+      }
+    }
+  }
+
+  // The strategies keep their histograms in atomics, and don't change once
+  // the console started.
+  for (int i = 0; i < 4; ++i) {
+    const WaitStrategy* strategy = slots_[i].wait_strategy.get();
+    if (strategy != nullptr && strategy->waits() > 0) {
+      WaitStatsPB* stats = timings->add_wait_stats();
+      strategy->GetStats(stats);
+      stats->set_port(static_cast<Port>(PORT_1 + i));
+    }
+  }
+}
+
 template <typename ButtonsType>
 typename EventStreamHandler<ButtonsType>::ButtonsInputQueue*
 EventStreamHandler<ButtonsType>::GetQueue(const Port port) {
-  const auto it = input_queues_.find(port);
-  if (it == input_queues_.end()) {
+  const int index = PortIndex(port);
+  if (index < 0 || slots_[index].queue == nullptr) {
     LOG(ERROR) << "Requested queue for disconnected port: " << Port_Name(port);
     return nullptr;
   } else {
-    return it->second.get();
+    return slots_[index].queue.get();
   }
 }
+
+// static
+template <typename ButtonsType>
+int EventStreamHandler<ButtonsType>::PortIndex(Port port) {
+  if (port < PORT_1 || port > PORT_4) {
+    return -1;
+  }
+  return port - PORT_1;
+}
+
+template <typename ButtonsType>
+bool EventStreamHandler<ButtonsType>::IsLocalPort(Port port) const {
+  const int index = PortIndex(port);
+  return index >= 0 && ((local_port_mask_ >> index) & 1);
+}
@@ -1,21 +1,29 @@
 #include "client/event-stream-handler.h"
 
+#include <chrono>
+#include <condition_variable>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 
 #include "gtest/gtest.h"
 #include "gmock/gmock.h"
 
 #include "base/timings.pb.h"
+#include "client/loopback-event-transport.h"
 #include "client/mocks.h"
 
 using std::string;
 
 using testing::_;
+using testing::AnyNumber;
 using testing::AtMost;
 using testing::ElementsAre;
 using testing::InSequence;
+using testing::Invoke;
 using testing::Return;
+using testing::SaveArg;
 using testing::Property;
 using testing::SetArgPointee;
 using testing::UnorderedElementsAre;
@@ -29,7 +37,7 @@ class EventStreamHandlerTest : public ::testing::Test {
       : mock_stub_(new MockNetPlayServerServiceStub()),
         mock_stream_(new MockStream()),
         handler_(new StringHandler(
-            kConsoleId, kClientId, {PORT_1}, &timings_, &mock_coder_,
+            kConsoleId, kClientId, {PORT_1}, &trace_, &mock_coder_,
             std::shared_ptr<MockNetPlayServerServiceStub>(mock_stub_))) {
     auto* start_game = start_game_event_.mutable_start_game();
     start_game->set_console_id(kConsoleId);
@@ -48,6 +56,46 @@ class EventStreamHandlerTest : public ::testing::Test {
     connected_port = start_game->add_connected_ports();
     connected_port->set_port(PORT_3);
     connected_port->set_delay_frames(0);
+
+    // Per-field button encoding, unless a test says otherwise.
+    EXPECT_CALL(mock_coder_, SupportsPackedButtons())
+        .Times(AnyNumber())
+        .WillRepeatedly(Return(false));
+  }
+
+  // Replaces handler_ with a handler constructed with the given options.
+  void ResetHandler(const EventStreamHandlerOptions& options) {
+    mock_stub_ = new MockNetPlayServerServiceStub();
+    handler_.reset(new StringHandler(
+        kConsoleId, kClientId, {PORT_1}, &trace_, &mock_coder_,
+        std::shared_ptr<MockNetPlayServerServiceStub>(mock_stub_), options));
+  }
+
+  // Like StartGame, except the background reader starts reading as soon as the
+  // console starts, so the events it reads must be expected up front. The
+  // reader sees each of events in turn followed by a read failure, unless it
+  // stops before then.
+  void StartGameWithBackgroundReader(
+      const std::vector<IncomingEventPB>& events,
+      EventStreamHandlerOptions options = EventStreamHandlerOptions()) {
+    options.background_reader = true;
+    ResetHandler(options);
+
+    InSequence sequence;
+    EXPECT_CALL(*mock_stub_, SendEventRaw(_)).WillOnce(Return(mock_stream_));
+    EXPECT_CALL(*mock_stream_, Write(_, _)).WillOnce(Return(true));
+    EXPECT_CALL(*mock_stream_, Read(_))
+        .WillOnce(DoAll(SetArgPointee<0>(start_game_event_), Return(true)));
+    for (const IncomingEventPB& event : events) {
+      EXPECT_CALL(*mock_stream_, Read(_))
+          .WillOnce(DoAll(SetArgPointee<0>(event), Return(true)));
+    }
+    EXPECT_CALL(*mock_stream_, Read(_))
+        .Times(AtMost(1))
+        .WillRepeatedly(Return(false));
+
+    EXPECT_TRUE(handler_->ClientReady());
+    EXPECT_TRUE(handler_->WaitForConsoleStart());
   }
 
   void StartGame() {
@@ -69,7 +117,7 @@ class EventStreamHandlerTest : public ::testing::Test {
 
   MockButtonCoder<string> mock_coder_;
   std::unique_ptr<StringHandler> handler_;
-  TimingsPB timings_;
+  TraceRing trace_;
 };
 
 const int EventStreamHandlerTest::kConsoleId = 101;
@@ -83,24 +131,24 @@ TEST_F(EventStreamHandlerTest, NewlyConstructedStatus) {
 // Constructor tests
 
 TEST_F(EventStreamHandlerTest, EventStreamHandlerInvalidConsoleId) {
-  EXPECT_DEATH(StringHandler(-1, kClientId, {PORT_1}, &timings_, &mock_coder_,
+  EXPECT_DEATH(StringHandler(-1, kClientId, {PORT_1}, &trace_, &mock_coder_,
                              std::unique_ptr<MockNetPlayServerServiceStub>(
                                  new MockNetPlayServerServiceStub())),
                "invalid console_id");
 
-  EXPECT_DEATH(StringHandler(0, kClientId, {PORT_1}, &timings_, &mock_coder_,
+  EXPECT_DEATH(StringHandler(0, kClientId, {PORT_1}, &trace_, &mock_coder_,
                              std::unique_ptr<MockNetPlayServerServiceStub>(
                                  new MockNetPlayServerServiceStub())),
                "invalid console_id");
 }
 
 TEST_F(EventStreamHandlerTest, EventStreamHandlerInvalidClientId) {
-  EXPECT_DEATH(StringHandler(kConsoleId, -1, {PORT_1}, &timings_, &mock_coder_,
+  EXPECT_DEATH(StringHandler(kConsoleId, -1, {PORT_1}, &trace_, &mock_coder_,
                              std::unique_ptr<MockNetPlayServerServiceStub>(
                                  new MockNetPlayServerServiceStub())),
                "invalid client_id");
 
-  EXPECT_DEATH(StringHandler(kConsoleId, 0, {PORT_1}, &timings_, &mock_coder_,
+  EXPECT_DEATH(StringHandler(kConsoleId, 0, {PORT_1}, &trace_, &mock_coder_,
                              std::unique_ptr<MockNetPlayServerServiceStub>(
                                  new MockNetPlayServerServiceStub())),
                "invalid client_id");
@@ -109,7 +157,7 @@ TEST_F(EventStreamHandlerTest, EventStreamHandlerInvalidClientId) {
 TEST_F(EventStreamHandlerTest, EventStreamHandlerTooManyLocalPorts) {
   EXPECT_DEATH(
       StringHandler(kConsoleId, kClientId,
-                    {PORT_1, PORT_2, PORT_3, PORT_4, PORT_ANY}, &timings_,
+                    {PORT_1, PORT_2, PORT_3, PORT_4, PORT_ANY}, &trace_,
                     &mock_coder_, std::unique_ptr<MockNetPlayServerServiceStub>(
                                       new MockNetPlayServerServiceStub())),
       "local_ports has too many elements");
@@ -118,7 +166,7 @@ TEST_F(EventStreamHandlerTest, EventStreamHandlerTooManyLocalPorts) {
 TEST_F(EventStreamHandlerTest, EventStreamHandlerDuplicateLocalPorts) {
   EXPECT_DEATH(
       StringHandler(kConsoleId, kClientId, {PORT_1, PORT_2, PORT_3, PORT_1},
-                    &timings_, &mock_coder_,
+                    &trace_, &mock_coder_,
                     std::unique_ptr<MockNetPlayServerServiceStub>(
                         new MockNetPlayServerServiceStub())),
       "local_ports contains duplicate values");
@@ -126,12 +174,26 @@ TEST_F(EventStreamHandlerTest, EventStreamHandlerDuplicateLocalPorts) {
 
 TEST_F(EventStreamHandlerTest, EventStreamHandlerPortAny) {
   EXPECT_DEATH(StringHandler(kConsoleId, kClientId, {PORT_1, PORT_2, PORT_ANY},
-                             &timings_, &mock_coder_,
+                             &trace_, &mock_coder_,
                              std::unique_ptr<MockNetPlayServerServiceStub>(
                                  new MockNetPlayServerServiceStub())),
                "local_ports contains PORT_ANY");
 }
 
+TEST_F(EventStreamHandlerTest, EventStreamHandlerInvalidLocalPort) {
+  EXPECT_DEATH(StringHandler(kConsoleId, kClientId, {PORT_1, UNKNOWN},
+                             &trace_, &mock_coder_,
+                             std::unique_ptr<MockNetPlayServerServiceStub>(
+                                 new MockNetPlayServerServiceStub())),
+               "local_ports contains invalid port");
+}
+
+TEST_F(EventStreamHandlerTest, EventStreamHandlerNullTransport) {
+  EXPECT_DEATH(StringHandler(kConsoleId, kClientId, {PORT_1}, &trace_,
+                             &mock_coder_, std::unique_ptr<EventTransport>()),
+               "invalid transport");
+}
+
 // -----------------------------------------------------------------------------
 // ReadyAndWaitForConsoleStart Tests
 
@@ -148,11 +210,65 @@ TEST_F(EventStreamHandlerTest, ReadyAndWaitForConsoleStartSuccess) {
   EXPECT_THAT(handler_->local_ports(), UnorderedElementsAre(PORT_1));
   EXPECT_THAT(handler_->remote_ports(), UnorderedElementsAre(PORT_2, PORT_3));
 
-  EXPECT_EQ(4, timings_.event_size());
-  EXPECT_GT(timings_.event(0).client_ready_sync_write_start(), 0);
-  EXPECT_GT(timings_.event(1).client_ready_sync_write_finish(), 0);
-  EXPECT_GT(timings_.event(2).start_game_event_read_start(), 0);
-  EXPECT_GT(timings_.event(3).start_game_event_read_finish(), 0);
+  TimingsPB timings;
+  trace_.Snapshot(&timings);
+  EXPECT_EQ(4, timings.event_size());
+  EXPECT_GT(timings.event(0).client_ready_sync_write_start(), 0);
+  EXPECT_GT(timings.event(1).client_ready_sync_write_finish(), 0);
+  EXPECT_GT(timings.event(2).start_game_event_read_start(), 0);
+  EXPECT_GT(timings.event(3).start_game_event_read_finish(), 0);
+}
+
+TEST_F(EventStreamHandlerTest, ReadyFailsIfStreamDoesNotOpen) {
+  EXPECT_CALL(*mock_stub_, SendEventRaw(_)).WillOnce(Return(nullptr));
+  delete mock_stream_;
+
+  EXPECT_FALSE(handler_->ClientReady());
+}
+
+TEST_F(EventStreamHandlerTest, ReadyAdvertisesPackedButtonsSupport) {
+  EXPECT_CALL(mock_coder_, SupportsPackedButtons())
+      .WillRepeatedly(Return(true));
+  EXPECT_CALL(*mock_stub_, SendEventRaw(_)).WillOnce(Return(mock_stream_));
+  EXPECT_CALL(*mock_stream_,
+              Write(Property(&OutgoingEventPB::client_ready,
+                             Property(&ClientReadyPB::supports_packed_buttons,
+                                      true)),
+                    _))
+      .WillOnce(Return(true));
+
+  EXPECT_TRUE(handler_->ClientReady());
+}
+
+TEST_F(EventStreamHandlerTest, ReadyAndWaitForConsoleStartPackedUnsupported) {
+  // The coder doesn't support the packed form the server asks for.
+  start_game_event_.mutable_start_game()->set_packed_buttons(true);
+  EXPECT_CALL(*mock_stub_, SendEventRaw(_)).WillOnce(Return(mock_stream_));
+  EXPECT_CALL(*mock_stream_, Write(_, _)).WillOnce(Return(true));
+  EXPECT_CALL(*mock_stream_, Read(_))
+      .WillOnce(DoAll(SetArgPointee<0>(start_game_event_), Return(true)));
+
+  EXPECT_TRUE(handler_->ClientReady());
+  EXPECT_FALSE(handler_->WaitForConsoleStart());
+  EXPECT_EQ(StringHandler::HandlerStatus::NOT_YET_STARTED, handler_->status());
+}
+
+TEST_F(EventStreamHandlerTest, ReadyAndWaitForConsoleStartRunLengthNotOffered) {
+  // The server asks for run-length buttons, which this client didn't offer.
+  start_game_event_.mutable_start_game()->set_run_length_buttons(true);
+  EXPECT_CALL(*mock_stub_, SendEventRaw(_)).WillOnce(Return(mock_stream_));
+  EXPECT_CALL(*mock_stream_,
+              Write(Property(&OutgoingEventPB::client_ready,
+                             Property(&ClientReadyPB::supports_run_length_buttons,
+                                      false)),
+                    _))
+      .WillOnce(Return(true));
+  EXPECT_CALL(*mock_stream_, Read(_))
+      .WillOnce(DoAll(SetArgPointee<0>(start_game_event_), Return(true)));
+
+  EXPECT_TRUE(handler_->ClientReady());
+  EXPECT_FALSE(handler_->WaitForConsoleStart());
+  EXPECT_EQ(StringHandler::HandlerStatus::NOT_YET_STARTED, handler_->status());
 }
 
 TEST_F(EventStreamHandlerTest, ReadyAndWaitForConsoleStartFailedToWriteReady) {
@@ -229,6 +345,8 @@ TEST_F(EventStreamHandlerTest, ReadyAndWaitForConsoleStartInvalidConsoleId) {
     EXPECT_THAT(handler_->remote_ports(), ElementsAre());
   }
   {
+    // The event transport is opened once per handler.
+    ResetHandler(EventStreamHandlerOptions());
     auto* mock_stream = new MockStream();
     EXPECT_CALL(*mock_stub_, SendEventRaw(_)).WillOnce(Return(mock_stream));
     EXPECT_CALL(*mock_stream, Write(_, _)).WillOnce(Return(true));
@@ -244,6 +362,7 @@ TEST_F(EventStreamHandlerTest, ReadyAndWaitForConsoleStartInvalidConsoleId) {
     EXPECT_THAT(handler_->remote_ports(), ElementsAre());
   }
   {
+    ResetHandler(EventStreamHandlerOptions());
     auto* mock_stream = new MockStream();
     EXPECT_CALL(*mock_stub_, SendEventRaw(_)).WillOnce(Return(mock_stream));
     EXPECT_CALL(*mock_stream, Write(_, _)).WillOnce(Return(true));
@@ -390,9 +509,28 @@ TEST_F(EventStreamHandlerTest, PutButtonsOnlyTransmitLocalPorts) {
   // are called.
 
   // Events 1-4 were added through StartGame().
-  EXPECT_EQ(6, timings_.event_size());
-  EXPECT_GT(timings_.event(4).key_state_sync_write_start(), 0);
-  EXPECT_GT(timings_.event(5).key_state_sync_write_finish(), 0);
+  TimingsPB timings;
+  trace_.Snapshot(&timings);
+  EXPECT_EQ(6, timings.event_size());
+  EXPECT_GT(timings.event(4).key_state_sync_write_start(), 0);
+  EXPECT_GT(timings.event(5).key_state_sync_write_finish(), 0);
+}
+
+TEST_F(EventStreamHandlerTest, PutButtonsPacked) {
+  EXPECT_CALL(mock_coder_, SupportsPackedButtons())
+      .WillRepeatedly(Return(true));
+  start_game_event_.mutable_start_game()->set_packed_buttons(true);
+  StartGame();
+
+  const string port_1_data = "PORT_1 frame 0";
+  EXPECT_CALL(mock_coder_, EncodeButtons(_, _)).Times(0);
+  EXPECT_CALL(mock_coder_, EncodePackedButtons(port_1_data, _))
+      .WillOnce(Return(true));
+  EXPECT_CALL(*mock_stream_, Write(_, _)).WillOnce(Return(true));
+
+  EXPECT_EQ(
+      StringHandler::PutButtonsStatus::SUCCESS,
+      handler_->PutButtons({std::make_tuple(PORT_1, 0, port_1_data)}));
 }
 
 TEST_F(EventStreamHandlerTest, PutButtonsDisconnectedPort) {
@@ -600,14 +738,120 @@ TEST_F(EventStreamHandlerTest, GetButtonsRemotePortReadFromStreamOneMessage) {
   EXPECT_EQ("data 300", data);
 
   // Events 1-4 were added through StartGame().
-  LOG(INFO) << timings_.DebugString();
-  EXPECT_EQ(10, timings_.event_size());
-  EXPECT_GT(timings_.event(4).remote_key_state_requested(), 0);
-  EXPECT_GT(timings_.event(5).key_state_read_start(), 0);
-  EXPECT_GT(timings_.event(6).key_state_read_finish(), 0);
-  EXPECT_GT(timings_.event(7).remote_key_state_returned(), 0);
-  EXPECT_GT(timings_.event(8).remote_key_state_requested(), 0);
-  EXPECT_GT(timings_.event(9).remote_key_state_returned(), 0);
+  TimingsPB timings;
+  trace_.Snapshot(&timings);
+  LOG(INFO) << timings.DebugString();
+  EXPECT_EQ(10, timings.event_size());
+  EXPECT_GT(timings.event(4).remote_key_state_requested(), 0);
+  EXPECT_GT(timings.event(5).key_state_read_start(), 0);
+  EXPECT_GT(timings.event(6).key_state_read_finish(), 0);
+  EXPECT_GT(timings.event(7).remote_key_state_returned(), 0);
+  EXPECT_GT(timings.event(8).remote_key_state_requested(), 0);
+  EXPECT_GT(timings.event(9).remote_key_state_returned(), 0);
+}
+
+TEST_F(EventStreamHandlerTest, GetFrameReadsAllPorts) {
+  StartGame();
+
+  EXPECT_CALL(mock_coder_, EncodeButtons(_, _)).WillOnce(Return(true));
+  EXPECT_CALL(*mock_stream_, Write(_, _)).WillOnce(Return(true));
+  ASSERT_EQ(StringHandler::PutButtonsStatus::SUCCESS,
+            handler_->PutButtons({std::make_tuple(PORT_1, 0, "frame 0")}));
+
+  // Remote ports have no delay, and local port 1 has two frames of delay.
+  IncomingEventPB event;
+  for (const Port port : {PORT_2, PORT_3}) {
+    for (int frame = 0; frame < 3; ++frame) {
+      KeyStatePB* keys = event.add_key_press();
+      keys->set_console_id(kConsoleId);
+      keys->set_port(port);
+      keys->set_frame_number(frame);
+      keys->set_reserved_1(100 * port + frame);
+    }
+  }
+  EXPECT_CALL(*mock_stream_, Read(_))
+      .WillOnce(DoAll(SetArgPointee<0>(event), Return(true)));
+  EXPECT_CALL(mock_coder_, DecodeButtons(_, _))
+      .Times(6)
+      .WillRepeatedly(Invoke([](const KeyStatePB& keys, string* buttons) {
+        *buttons = std::to_string(keys.reserved_1());
+        return true;
+      }));
+
+  string frame[4] = {"x", "x", "x", "x"};
+  for (int i = 0; i < 3; ++i) {
+    ASSERT_EQ(StringHandler::GetButtonsStatus::SUCCESS,
+              handler_->GetFrame(i, frame));
+    EXPECT_EQ(i == 2 ? "frame 0" : "", frame[0]);
+    EXPECT_EQ(std::to_string(100 * PORT_2 + i), frame[1]);
+    EXPECT_EQ(std::to_string(100 * PORT_3 + i), frame[2]);
+    // PORT_4 is not connected.
+    EXPECT_EQ("", frame[3]);
+  }
+
+  // A frame is only requested and returned once, however many remote ports.
+  TimingsPB timings;
+  trace_.Snapshot(&timings);
+  int requested = 0;
+  for (const TimingEventPB& timing : timings.event()) {
+    requested += timing.remote_key_state_requested() > 0 ? 1 : 0;
+  }
+  EXPECT_EQ(3, requested);
+
+  // Local buttons for frame 3 were never put.
+  EXPECT_EQ(StringHandler::GetButtonsStatus::FAILURE,
+            handler_->GetFrame(3, frame));
+}
+
+TEST_F(EventStreamHandlerTest, GetFrameWithBackgroundReaderReadsAllPorts) {
+  IncomingEventPB event;
+  for (const Port port : {PORT_2, PORT_3}) {
+    for (int frame = 0; frame < 3; ++frame) {
+      KeyStatePB* keys = event.add_key_press();
+      keys->set_console_id(kConsoleId);
+      keys->set_port(port);
+      keys->set_frame_number(frame);
+      keys->set_reserved_1(100 * port + frame);
+    }
+  }
+  EXPECT_CALL(mock_coder_, DecodeButtons(_, _))
+      .Times(6)
+      .WillRepeatedly(Invoke([](const KeyStatePB& keys, string* buttons) {
+        *buttons = std::to_string(keys.reserved_1());
+        return true;
+      }));
+  StartGameWithBackgroundReader({event});
+
+  EXPECT_CALL(mock_coder_, EncodeButtons(_, _)).WillRepeatedly(Return(true));
+  EXPECT_CALL(*mock_stream_, Write(_, _)).WillRepeatedly(Return(true));
+  ASSERT_EQ(StringHandler::PutButtonsStatus::SUCCESS,
+            handler_->PutButtons({std::make_tuple(PORT_1, 0, "frame 0")}));
+
+  string frame[4] = {"x", "x", "x", "x"};
+  for (int i = 0; i < 3; ++i) {
+    ASSERT_EQ(StringHandler::GetButtonsStatus::SUCCESS,
+              handler_->GetFrame(i, frame));
+    EXPECT_EQ(i == 2 ? "frame 0" : "", frame[0]);
+    EXPECT_EQ(std::to_string(100 * PORT_2 + i), frame[1]);
+    EXPECT_EQ(std::to_string(100 * PORT_3 + i), frame[2]);
+    EXPECT_EQ("", frame[3]);
+  }
+
+  // The reader stopped on the read failure, so there will be no frame 3.
+  ASSERT_EQ(StringHandler::PutButtonsStatus::SUCCESS,
+            handler_->PutButtons({std::make_tuple(PORT_1, 1, "frame 1")}));
+  EXPECT_EQ(StringHandler::GetButtonsStatus::FAILURE,
+            handler_->GetFrame(3, frame));
+}
+
+TEST_F(EventStreamHandlerTest, GetFrameUnavailableInRollbackMode) {
+  EventStreamHandlerOptions options;
+  options.rollback_frames = 2;
+  StartGameWithBackgroundReader({}, options);
+
+  string frame[4];
+  EXPECT_EQ(StringHandler::GetButtonsStatus::FAILURE,
+            handler_->GetFrame(0, frame));
 }
 
 TEST_F(EventStreamHandlerTest, GetButtonsRemotePortNonButtonMessage) {
@@ -719,3 +963,1027 @@ TEST_F(EventStreamHandlerTest, GetButtonsRemotePortRejectedByQueue) {
   ASSERT_EQ(StringHandler::GetButtonsStatus::FAILURE,
             handler_->GetButtons(PORT_3, 0, &data));
 }
+
+TEST_F(EventStreamHandlerTest, BackgroundReaderGetButtons) {
+  IncomingEventPB event;
+  KeyStatePB* keys = event.add_key_press();
+  keys->set_console_id(kConsoleId);
+  keys->set_port(PORT_3);
+  keys->set_frame_number(0);
+  keys->set_reserved_1(300);
+  keys = event.add_key_press();
+  keys->set_console_id(kConsoleId);
+  keys->set_port(PORT_2);
+  keys->set_frame_number(0);
+  keys->set_reserved_1(200);
+
+  EXPECT_CALL(mock_coder_,
+              DecodeButtons(Property(&KeyStatePB::reserved_1, 300), _))
+      .WillOnce(DoAll(SetArgPointee<1>("data 300"), Return(true)));
+  EXPECT_CALL(mock_coder_,
+              DecodeButtons(Property(&KeyStatePB::reserved_1, 200), _))
+      .WillOnce(DoAll(SetArgPointee<1>("data 200"), Return(true)));
+
+  StartGameWithBackgroundReader({event});
+  EXPECT_EQ(StringHandler::HandlerStatus::CONSOLE_RUNNING, handler_->status());
+
+  // Buttons queued before the reader stopped are still returned.
+  string data;
+  ASSERT_EQ(StringHandler::GetButtonsStatus::SUCCESS,
+            handler_->GetButtons(PORT_2, 0, &data));
+  EXPECT_EQ("data 200", data);
+  ASSERT_EQ(StringHandler::GetButtonsStatus::SUCCESS,
+            handler_->GetButtons(PORT_3, 0, &data));
+  EXPECT_EQ("data 300", data);
+
+  // The reader stopped on the read failure, so there will be no frame 1.
+  EXPECT_EQ(StringHandler::GetButtonsStatus::FAILURE,
+            handler_->GetButtons(PORT_2, 1, &data));
+}
+
+TEST_F(EventStreamHandlerTest, BackgroundReaderWakesBlockedGetButtons) {
+  EventStreamHandlerOptions options;
+  options.background_reader = true;
+  options.queue_backend = InputQueueBackend::RING;
+  ResetHandler(options);
+
+  IncomingEventPB event;
+  KeyStatePB* keys = event.add_key_press();
+  keys->set_console_id(kConsoleId);
+  keys->set_port(PORT_2);
+  keys->set_frame_number(0);
+  keys->set_reserved_1(200);
+
+  {
+    InSequence sequence;
+    EXPECT_CALL(*mock_stub_, SendEventRaw(_)).WillOnce(Return(mock_stream_));
+    EXPECT_CALL(*mock_stream_, Write(_, _)).WillOnce(Return(true));
+    EXPECT_CALL(*mock_stream_, Read(_))
+        .WillOnce(DoAll(SetArgPointee<0>(start_game_event_), Return(true)));
+    // Delay the buttons so that GetButtons has to block on the queue.
+    EXPECT_CALL(*mock_stream_, Read(_))
+        .WillOnce(Invoke([&event](IncomingEventPB* out) {
+          std::this_thread::sleep_for(std::chrono::milliseconds(50));
+          *out = event;
+          return true;
+        }));
+    EXPECT_CALL(*mock_stream_, Read(_)).WillOnce(Return(false));
+  }
+  EXPECT_CALL(mock_coder_, DecodeButtons(_, _))
+      .WillOnce(DoAll(SetArgPointee<1>("data 200"), Return(true)));
+
+  ASSERT_TRUE(handler_->ClientReady());
+  ASSERT_TRUE(handler_->WaitForConsoleStart());
+
+  string data;
+  ASSERT_EQ(StringHandler::GetButtonsStatus::SUCCESS,
+            handler_->GetButtons(PORT_2, 0, &data));
+  EXPECT_EQ("data 200", data);
+}
+
+TEST_F(EventStreamHandlerTest, WaitStrategyRecordsRemoteWaits) {
+  EventStreamHandlerOptions options;
+  options.background_reader = true;
+  options.wait_max_spin_micros = 1000;
+  options.wait_yield_micros = 1000;
+  ResetHandler(options);
+
+  IncomingEventPB event;
+  KeyStatePB* keys = event.add_key_press();
+  keys->set_console_id(kConsoleId);
+  keys->set_port(PORT_2);
+  keys->set_frame_number(0);
+  keys->set_reserved_1(200);
+
+  {
+    InSequence sequence;
+    EXPECT_CALL(*mock_stub_, SendEventRaw(_)).WillOnce(Return(mock_stream_));
+    EXPECT_CALL(*mock_stream_, Write(_, _)).WillOnce(Return(true));
+    EXPECT_CALL(*mock_stream_, Read(_))
+        .WillOnce(DoAll(SetArgPointee<0>(start_game_event_), Return(true)));
+    // Delay the buttons past the spin and yield phases.
+    EXPECT_CALL(*mock_stream_, Read(_))
+        .WillOnce(Invoke([&event](IncomingEventPB* out) {
+          std::this_thread::sleep_for(std::chrono::milliseconds(50));
+          *out = event;
+          return true;
+        }));
+    EXPECT_CALL(*mock_stream_, Read(_)).WillOnce(Return(false));
+  }
+  EXPECT_CALL(mock_coder_, DecodeButtons(_, _))
+      .WillOnce(DoAll(SetArgPointee<1>("data 200"), Return(true)));
+
+  ASSERT_TRUE(handler_->ClientReady());
+  ASSERT_TRUE(handler_->WaitForConsoleStart());
+
+  string data;
+  ASSERT_EQ(StringHandler::GetButtonsStatus::SUCCESS,
+            handler_->GetButtons(PORT_2, 0, &data));
+  EXPECT_EQ("data 200", data);
+
+  TimingsPB timings;
+  trace_.Snapshot(&timings);
+  ASSERT_EQ(1, timings.wait_stats_size());
+  const WaitStatsPB& stats = timings.wait_stats(0);
+  EXPECT_EQ(PORT_2, stats.port());
+  ASSERT_EQ(3, stats.phase_size());
+  EXPECT_EQ("BLOCK", stats.phase(2).phase());
+  EXPECT_EQ(1, stats.phase(2).waits());
+  // The wait was too long to spin through.
+  EXPECT_EQ(0, stats.spin_budget_nanos());
+}
+
+TEST_F(EventStreamHandlerTest, WaitStrategyInvalidOptions) {
+  EventStreamHandlerOptions options;
+  options.wait_max_spin_micros = -1;
+  EXPECT_DEATH(
+      StringHandler(kConsoleId, kClientId, {PORT_1}, &trace_, &mock_coder_,
+                    std::shared_ptr<MockNetPlayServerServiceStub>(
+                        new MockNetPlayServerServiceStub()),
+                    options),
+      "invalid wait_max_spin_micros");
+
+  options.wait_max_spin_micros = 0;
+  options.wait_yield_micros = 100;
+  EXPECT_DEATH(
+      StringHandler(kConsoleId, kClientId, {PORT_1}, &trace_, &mock_coder_,
+                    std::shared_ptr<MockNetPlayServerServiceStub>(
+                        new MockNetPlayServerServiceStub()),
+                    options),
+      "wait_max_spin_micros and wait_yield_micros require background_reader");
+}
+
+TEST_F(EventStreamHandlerTest, BackgroundReaderConsoleStopped) {
+  IncomingEventPB event;
+  event.mutable_stop_console()->set_console_id(kConsoleId);
+  event.mutable_stop_console()->set_stop_reason(StopConsolePB::ERROR);
+
+  StartGameWithBackgroundReader({event});
+
+  string data;
+  ASSERT_EQ(StringHandler::GetButtonsStatus::FAILURE,
+            handler_->GetButtons(PORT_3, 0, &data));
+  EXPECT_EQ(StringHandler::HandlerStatus::CONSOLE_TERMINATED,
+            handler_->status());
+}
+
+TEST_F(EventStreamHandlerTest, BackgroundReaderDecodeFailure) {
+  IncomingEventPB event;
+  KeyStatePB* keys = event.add_key_press();
+  keys->set_console_id(kConsoleId);
+  keys->set_port(PORT_3);
+  keys->set_frame_number(0);
+  keys->set_reserved_1(300);
+
+  EXPECT_CALL(mock_coder_,
+              DecodeButtons(Property(&KeyStatePB::reserved_1, 300), _))
+      .WillOnce(Return(false));
+
+  StartGameWithBackgroundReader({event});
+
+  string data;
+  ASSERT_EQ(StringHandler::GetButtonsStatus::FAILURE,
+            handler_->GetButtons(PORT_3, 0, &data));
+}
+
+TEST_F(EventStreamHandlerTest, CoalescedPutButtons) {
+  EventStreamHandlerOptions options;
+  options.coalesce_max_frames = 4;
+  ResetHandler(options);
+  // Three frames of delay leave room for batches of three frames.
+  start_game_event_.mutable_start_game()
+      ->mutable_connected_ports(0)
+      ->set_delay_frames(3);
+  StartGame();
+
+  std::vector<std::vector<int>> written_frames;
+  EXPECT_CALL(mock_coder_, EncodeButtons(_, _))
+      .Times(4)
+      .WillRepeatedly(Return(true));
+  EXPECT_CALL(*mock_stream_, Write(_, _))
+      .Times(2)
+      .WillRepeatedly(Invoke(
+          [&written_frames](const OutgoingEventPB& event, grpc::WriteOptions) {
+            written_frames.emplace_back();
+            for (const KeyStatePB& key : event.key_press()) {
+              written_frames.back().push_back(key.frame_number());
+            }
+            return true;
+          }));
+
+  for (int frame = 0; frame < 4; ++frame) {
+    ASSERT_EQ(StringHandler::PutButtonsStatus::SUCCESS,
+              handler_->PutButtons({std::make_tuple(PORT_1, frame, "data")}));
+  }
+  ASSERT_EQ(1, written_frames.size());
+  EXPECT_THAT(written_frames[0], ElementsAre(3, 4, 5));
+
+  // Flushing sends what is left of the batch.
+  ASSERT_TRUE(handler_->FlushWrites());
+  ASSERT_EQ(2, written_frames.size());
+  EXPECT_THAT(written_frames[1], ElementsAre(6));
+}
+
+TEST_F(EventStreamHandlerTest, CoalescedPutButtonsDeadline) {
+  EventStreamHandlerOptions options;
+  options.coalesce_max_frames = 4;
+  options.coalesce_deadline_micros = 1000;
+  ResetHandler(options);
+  start_game_event_.mutable_start_game()
+      ->mutable_connected_ports(0)
+      ->set_delay_frames(4);
+  StartGame();
+
+  EXPECT_CALL(mock_coder_, EncodeButtons(_, _))
+      .Times(2)
+      .WillRepeatedly(Return(true));
+  EXPECT_CALL(*mock_stream_, Write(Property(&OutgoingEventPB::key_press_size, 2),
+                                   _))
+      .WillOnce(Return(true));
+
+  ASSERT_EQ(StringHandler::PutButtonsStatus::SUCCESS,
+            handler_->PutButtons({std::make_tuple(PORT_1, 0, "data")}));
+  std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  ASSERT_EQ(StringHandler::PutButtonsStatus::SUCCESS,
+            handler_->PutButtons({std::make_tuple(PORT_1, 1, "data")}));
+}
+
+TEST_F(EventStreamHandlerTest, CoalescedPutButtonsOneFrameOfDelay) {
+  EventStreamHandlerOptions options;
+  options.coalesce_max_frames = 4;
+  ResetHandler(options);
+  start_game_event_.mutable_start_game()
+      ->mutable_connected_ports(0)
+      ->set_delay_frames(1);
+  StartGame();
+
+  // There is no headroom to hold buttons for.
+  EXPECT_CALL(mock_coder_, EncodeButtons(_, _))
+      .Times(2)
+      .WillRepeatedly(Return(true));
+  EXPECT_CALL(*mock_stream_, Write(Property(&OutgoingEventPB::key_press_size, 1),
+                                   _))
+      .Times(2)
+      .WillRepeatedly(Return(true));
+
+  for (int frame = 0; frame < 2; ++frame) {
+    ASSERT_EQ(StringHandler::PutButtonsStatus::SUCCESS,
+              handler_->PutButtons({std::make_tuple(PORT_1, frame, "data")}));
+  }
+}
+
+TEST_F(EventStreamHandlerTest, CoalesceInvalidOptions) {
+  EventStreamHandlerOptions options;
+  options.coalesce_max_frames = -1;
+  EXPECT_DEATH(
+      StringHandler(kConsoleId, kClientId, {PORT_1}, &trace_, &mock_coder_,
+                    std::shared_ptr<MockNetPlayServerServiceStub>(
+                        new MockNetPlayServerServiceStub()),
+                    options),
+      "invalid coalesce_max_frames");
+
+  options.coalesce_max_frames = 2;
+  options.coalesce_deadline_micros = -1;
+  EXPECT_DEATH(
+      StringHandler(kConsoleId, kClientId, {PORT_1}, &trace_, &mock_coder_,
+                    std::shared_ptr<MockNetPlayServerServiceStub>(
+                        new MockNetPlayServerServiceStub()),
+                    options),
+      "invalid coalesce_deadline_micros");
+}
+
+TEST_F(EventStreamHandlerTest, RunLengthPutButtons) {
+  EventStreamHandlerOptions options;
+  options.coalesce_max_frames = 4;
+  options.run_length_buttons = true;
+  ResetHandler(options);
+  start_game_event_.mutable_start_game()->set_run_length_buttons(true);
+  start_game_event_.mutable_start_game()
+      ->mutable_connected_ports(0)
+      ->set_delay_frames(3);
+  StartGame();
+
+  // Only buttons that changed are encoded.
+  std::vector<OutgoingEventPB> written;
+  EXPECT_CALL(mock_coder_, EncodeButtons("a", _)).WillOnce(Return(true));
+  EXPECT_CALL(mock_coder_, EncodeButtons("b", _)).WillOnce(Return(true));
+  EXPECT_CALL(*mock_stream_, Write(_, _))
+      .Times(2)
+      .WillRepeatedly(
+          Invoke([&written](const OutgoingEventPB& event, grpc::WriteOptions) {
+            written.push_back(event);
+            return true;
+          }));
+
+  const char* const buttons[] = {"a", "a", "b", "b", "b", "b"};
+  for (int frame = 0; frame < 6; ++frame) {
+    ASSERT_EQ(
+        StringHandler::PutButtonsStatus::SUCCESS,
+        handler_->PutButtons({std::make_tuple(PORT_1, frame, buttons[frame])}));
+  }
+  ASSERT_EQ(2, written.size());
+
+  // Frames 3 and 4 share their buttons.
+  ASSERT_EQ(2, written[0].key_press_size());
+  EXPECT_EQ(3, written[0].key_press(0).frame_number());
+  EXPECT_EQ(1, written[0].key_press(0).run_frames());
+  EXPECT_FALSE(written[0].key_press(0).unchanged());
+  EXPECT_EQ(5, written[0].key_press(1).frame_number());
+  EXPECT_EQ(0, written[0].key_press(1).run_frames());
+
+  // Frames 6 to 8 repeat frame 5, from the previous event.
+  ASSERT_EQ(1, written[1].key_press_size());
+  EXPECT_EQ(PORT_1, written[1].key_press(0).port());
+  EXPECT_EQ(6, written[1].key_press(0).frame_number());
+  EXPECT_EQ(2, written[1].key_press(0).run_frames());
+  EXPECT_TRUE(written[1].key_press(0).unchanged());
+}
+
+TEST_F(EventStreamHandlerTest, RunLengthGetButtons) {
+  EventStreamHandlerOptions options;
+  options.run_length_buttons = true;
+  ResetHandler(options);
+  start_game_event_.mutable_start_game()->set_run_length_buttons(true);
+  StartGame();
+
+  {
+    InSequence sequence;
+
+    // PORT_2 holds the same buttons for frames 0 to 3.
+    IncomingEventPB event;
+    KeyStatePB* keys = event.add_key_press();
+    keys->set_console_id(kConsoleId);
+    keys->set_port(PORT_2);
+    keys->set_frame_number(0);
+    keys->set_run_frames(1);
+    keys->set_reserved_1(200);
+    keys = event.add_key_press();
+    keys->set_console_id(kConsoleId);
+    keys->set_port(PORT_2);
+    keys->set_frame_number(2);
+    keys->set_run_frames(1);
+    keys->set_unchanged(true);
+    EXPECT_CALL(*mock_stream_, Read(_))
+        .WillOnce(DoAll(SetArgPointee<0>(event), Return(true)));
+    EXPECT_CALL(mock_coder_,
+                DecodeButtons(Property(&KeyStatePB::reserved_1, 200), _))
+        .WillOnce(DoAll(SetArgPointee<1>("data 200"), Return(true)));
+
+    // PORT_3 has no previous frame to repeat.
+    IncomingEventPB unchanged_event;
+    keys = unchanged_event.add_key_press();
+    keys->set_console_id(kConsoleId);
+    keys->set_port(PORT_3);
+    keys->set_frame_number(0);
+    keys->set_unchanged(true);
+    EXPECT_CALL(*mock_stream_, Read(_))
+        .WillOnce(DoAll(SetArgPointee<0>(unchanged_event), Return(true)));
+  }
+
+  for (int frame = 0; frame < 4; ++frame) {
+    string data;
+    ASSERT_EQ(StringHandler::GetButtonsStatus::SUCCESS,
+              handler_->GetButtons(PORT_2, frame, &data));
+    EXPECT_EQ("data 200", data);
+  }
+
+  string data;
+  EXPECT_EQ(StringHandler::GetButtonsStatus::FAILURE,
+            handler_->GetButtons(PORT_3, 0, &data));
+}
+
+TEST_F(EventStreamHandlerTest, AsyncPutButtons) {
+  EventStreamHandlerOptions options;
+  options.async_write_queue_size = 1;
+  ResetHandler(options);
+  StartGame();
+
+  // Record the frames in the order they are written.
+  std::vector<int> written_frames;
+  EXPECT_CALL(mock_coder_, EncodeButtons(_, _))
+      .Times(10)
+      .WillRepeatedly(Return(true));
+  EXPECT_CALL(*mock_stream_, Write(_, _))
+      .Times(10)
+      .WillRepeatedly(Invoke(
+          [&written_frames](const OutgoingEventPB& event, grpc::WriteOptions) {
+            written_frames.push_back(event.key_press(0).frame_number());
+            return true;
+          }));
+
+  // The outbound queue only holds one event, so most of these wait for the
+  // writer to catch up.
+  for (int frame = 0; frame < 10; ++frame) {
+    ASSERT_EQ(StringHandler::PutButtonsStatus::SUCCESS,
+              handler_->PutButtons({std::make_tuple(PORT_1, frame, "data")}));
+  }
+  ASSERT_TRUE(handler_->FlushWrites());
+
+  // Frame numbers are delayed by two frames.
+  EXPECT_THAT(written_frames, ElementsAre(2, 3, 4, 5, 6, 7, 8, 9, 10, 11));
+}
+
+TEST_F(EventStreamHandlerTest, AsyncPutButtonsWriteFailure) {
+  EventStreamHandlerOptions options;
+  options.async_write_queue_size = 4;
+  ResetHandler(options);
+  StartGame();
+
+  EXPECT_CALL(mock_coder_, EncodeButtons(_, _)).WillOnce(Return(true));
+  EXPECT_CALL(*mock_stream_, Write(_, _)).WillOnce(Return(false));
+
+  // The write fails after PutButtons returns...
+  ASSERT_EQ(StringHandler::PutButtonsStatus::SUCCESS,
+            handler_->PutButtons({std::make_tuple(PORT_1, 0, "frame 0")}));
+  EXPECT_FALSE(handler_->FlushWrites());
+
+  // ...so the next call reports it, even if it has nothing to transmit.
+  EXPECT_EQ(StringHandler::PutButtonsStatus::FAILED_TO_TRANSMIT_REMOTE,
+            handler_->PutButtons({std::make_tuple(PORT_1, 1, "frame 1")}));
+  EXPECT_EQ(StringHandler::PutButtonsStatus::FAILED_TO_TRANSMIT_REMOTE,
+            handler_->PutButtons({std::make_tuple(PORT_2, 0, "frame 0")}));
+}
+
+TEST_F(EventStreamHandlerTest, AsyncPutButtonsInvalidQueueSize) {
+  EventStreamHandlerOptions options;
+  options.async_write_queue_size = -1;
+  EXPECT_DEATH(
+      StringHandler(kConsoleId, kClientId, {PORT_1}, &trace_, &mock_coder_,
+                    std::shared_ptr<MockNetPlayServerServiceStub>(
+                        new MockNetPlayServerServiceStub()),
+                    options),
+      "invalid async_write_queue_size");
+}
+
+TEST_F(EventStreamHandlerTest, RollbackInvalidOptions) {
+  EventStreamHandlerOptions options;
+  options.rollback_frames = -1;
+  options.background_reader = true;
+  EXPECT_DEATH(
+      StringHandler(kConsoleId, kClientId, {PORT_1}, &trace_, &mock_coder_,
+                    std::shared_ptr<MockNetPlayServerServiceStub>(
+                        new MockNetPlayServerServiceStub()),
+                    options),
+      "invalid rollback_frames");
+
+  options.rollback_frames = 4;
+  options.background_reader = false;
+  EXPECT_DEATH(
+      StringHandler(kConsoleId, kClientId, {PORT_1}, &trace_, &mock_coder_,
+                    std::shared_ptr<MockNetPlayServerServiceStub>(
+                        new MockNetPlayServerServiceStub()),
+                    options),
+      "rollback_frames requires background_reader");
+}
+
+TEST_F(EventStreamHandlerTest, RollbackGetSpeculativeButtons) {
+  EventStreamHandlerOptions options;
+  options.background_reader = true;
+  options.rollback_frames = 8;
+  ResetHandler(options);
+
+  // PORT_2 sends different buttons for frame 1 than for frame 0, but they only
+  // arrive after the buttons for frame 1 were predicted.
+  IncomingEventPB frame_0;
+  KeyStatePB* keys = frame_0.add_key_press();
+  keys->set_console_id(kConsoleId);
+  keys->set_port(PORT_2);
+  keys->set_frame_number(0);
+  keys->set_reserved_1(200);
+  IncomingEventPB frame_1 = frame_0;
+  frame_1.mutable_key_press(0)->set_frame_number(1);
+  frame_1.mutable_key_press(0)->set_reserved_1(201);
+
+  std::mutex m;
+  std::condition_variable cv;
+  bool send_frame_1 = false;
+  {
+    InSequence sequence;
+    EXPECT_CALL(*mock_stub_, SendEventRaw(_)).WillOnce(Return(mock_stream_));
+    EXPECT_CALL(*mock_stream_, Write(_, _)).WillOnce(Return(true));
+    EXPECT_CALL(*mock_stream_, Read(_))
+        .WillOnce(DoAll(SetArgPointee<0>(start_game_event_), Return(true)));
+    EXPECT_CALL(*mock_stream_, Read(_))
+        .WillOnce(DoAll(SetArgPointee<0>(frame_0), Return(true)));
+    EXPECT_CALL(*mock_stream_, Read(_))
+        .WillOnce(Invoke([&](IncomingEventPB* out) {
+          std::unique_lock<std::mutex> lock(m);
+          cv.wait(lock, [&send_frame_1] { return send_frame_1; });
+          *out = frame_1;
+          return true;
+        }));
+    EXPECT_CALL(*mock_stream_, Read(_)).WillOnce(Return(false));
+  }
+  EXPECT_CALL(mock_coder_,
+              DecodeButtons(Property(&KeyStatePB::reserved_1, 200), _))
+      .WillOnce(DoAll(SetArgPointee<1>("data 200"), Return(true)));
+  EXPECT_CALL(mock_coder_,
+              DecodeButtons(Property(&KeyStatePB::reserved_1, 201), _))
+      .WillOnce(DoAll(SetArgPointee<1>("data 201"), Return(true)));
+
+  ASSERT_TRUE(handler_->ClientReady());
+  ASSERT_TRUE(handler_->WaitForConsoleStart());
+
+  string data;
+  bool predicted = false;
+  EXPECT_EQ(StringHandler::GetButtonsStatus::FAILURE,
+            handler_->GetButtons(PORT_2, 0, &data));
+  EXPECT_EQ(StringHandler::GetButtonsStatus::NO_SUCH_PORT,
+            handler_->GetSpeculativeButtons(PORT_4, 0, &data, &predicted));
+
+  // Wait for frame 0 to be confirmed.
+  do {
+    ASSERT_EQ(StringHandler::GetButtonsStatus::SUCCESS,
+              handler_->GetSpeculativeButtons(PORT_2, 0, &data, &predicted));
+  } while (predicted);
+  EXPECT_EQ("data 200", data);
+
+  ASSERT_EQ(StringHandler::GetButtonsStatus::SUCCESS,
+            handler_->GetSpeculativeButtons(PORT_2, 1, &data, &predicted));
+  EXPECT_TRUE(predicted);
+  EXPECT_EQ("data 200", data);
+  EXPECT_EQ(-1, handler_->TakeRollbackFrame());
+
+  // Let frame 1 arrive, and wait for the reader to stop after it.
+  {
+    std::lock_guard<std::mutex> guard(m);
+    send_frame_1 = true;
+  }
+  cv.notify_all();
+  EXPECT_EQ(StringHandler::GetButtonsStatus::FAILURE,
+            handler_->GetSpeculativeButtons(PORT_2, 10, &data, &predicted));
+
+  EXPECT_EQ(1, handler_->TakeRollbackFrame());
+  ASSERT_EQ(StringHandler::GetButtonsStatus::SUCCESS,
+            handler_->GetSpeculativeButtons(PORT_2, 1, &data, &predicted));
+  EXPECT_FALSE(predicted);
+  EXPECT_EQ("data 201", data);
+
+  // Frame 1, and frame 0 if it was predicted, were mispredicted.
+  TimingsPB timings;
+  trace_.Snapshot(&timings);
+  ASSERT_EQ(1, timings.prediction_stats_size());
+  EXPECT_EQ(PORT_2, timings.prediction_stats(0).port());
+  EXPECT_GE(timings.prediction_stats(0).predicted_frames(), 1);
+  EXPECT_EQ(0, timings.prediction_stats(0).correct_frames());
+}
+
+TEST_F(EventStreamHandlerTest, MeasurePredictions) {
+  EventStreamHandlerOptions options;
+  options.measure_predictions = true;
+  ResetHandler(options);
+  StartGame();
+
+  // Frame 0 arrives on its own, then frames 1 and 2 arrive together. PORT_2
+  // holds its buttons from frame 0 on.
+  {
+    InSequence sequence;
+
+    IncomingEventPB event;
+    KeyStatePB* keys = event.add_key_press();
+    keys->set_console_id(kConsoleId);
+    keys->set_port(PORT_2);
+    keys->set_frame_number(0);
+    EXPECT_CALL(*mock_stream_, Read(_))
+        .WillOnce(DoAll(SetArgPointee<0>(event), Return(true)));
+    EXPECT_CALL(mock_coder_, DecodeButtons(_, _))
+        .WillOnce(DoAll(SetArgPointee<1>("data 200"), Return(true)));
+
+    event.mutable_key_press(0)->set_frame_number(1);
+    *event.add_key_press() = event.key_press(0);
+    event.mutable_key_press(1)->set_frame_number(2);
+    EXPECT_CALL(*mock_stream_, Read(_))
+        .WillOnce(DoAll(SetArgPointee<0>(event), Return(true)));
+    EXPECT_CALL(mock_coder_, DecodeButtons(_, _))
+        .Times(2)
+        .WillRepeatedly(DoAll(SetArgPointee<1>("data 200"), Return(true)));
+  }
+
+  string data;
+  for (int frame = 0; frame < 3; ++frame) {
+    ASSERT_EQ(StringHandler::GetButtonsStatus::SUCCESS,
+              handler_->GetButtons(PORT_2, frame, &data));
+    EXPECT_EQ("data 200", data);
+  }
+
+  // Frame 0 was mispredicted, frame 1 was predicted correctly, and frame 2 had
+  // arrived when it was requested.
+  TimingsPB timings;
+  trace_.Snapshot(&timings);
+  ASSERT_EQ(1, timings.prediction_stats_size());
+  const PredictionStatsPB& stats = timings.prediction_stats(0);
+  EXPECT_EQ(PORT_2, stats.port());
+  EXPECT_EQ("REPEAT_LAST", stats.strategy());
+  EXPECT_EQ(2, stats.predicted_frames());
+  EXPECT_EQ(1, stats.correct_frames());
+  EXPECT_GE(stats.predicted_wait_nanos(), stats.correct_wait_nanos());
+}
+
+TEST_F(EventStreamHandlerTest, StreamPingInvalidPeriod) {
+  EventStreamHandlerOptions options;
+  options.stream_ping_period_millis = -1;
+  EXPECT_DEATH(
+      StringHandler(kConsoleId, kClientId, {PORT_1}, &trace_, &mock_coder_,
+                    std::shared_ptr<MockNetPlayServerServiceStub>(
+                        new MockNetPlayServerServiceStub()),
+                    options),
+      "invalid stream_ping_period_millis");
+}
+
+TEST_F(EventStreamHandlerTest, StreamPingsRideOnButtons) {
+  EventStreamHandlerOptions options;
+  options.stream_ping_period_millis = 60 * 1000;
+  ResetHandler(options);
+  StartGame();
+
+  EXPECT_CALL(mock_coder_, EncodeButtons(_, _))
+      .Times(2)
+      .WillRepeatedly(Return(true));
+  {
+    InSequence sequence;
+    EXPECT_CALL(*mock_stream_,
+                Write(Property(&OutgoingEventPB::has_ping, true), _))
+        .WillOnce(Return(true));
+    // The next ping is due a period later.
+    EXPECT_CALL(*mock_stream_,
+                Write(Property(&OutgoingEventPB::has_ping, false), _))
+        .WillOnce(Return(true));
+  }
+
+  EXPECT_EQ(StringHandler::PutButtonsStatus::SUCCESS,
+            handler_->PutButtons({std::make_tuple(PORT_1, 0, "frame 0")}));
+  EXPECT_EQ(StringHandler::PutButtonsStatus::SUCCESS,
+            handler_->PutButtons({std::make_tuple(PORT_1, 1, "frame 1")}));
+}
+
+TEST_F(EventStreamHandlerTest, StreamPongsUpdateLatency) {
+  StartGame();
+  EXPECT_EQ(0, handler_->stream_latency().samples());
+
+  // The pong shares an event with buttons. The server held the ping for 1 ms
+  // of the 3 ms since it was sent.
+  const int64_t now_nanos = trace_.now_nanos();
+  IncomingEventPB event;
+  KeyStatePB* keys = event.add_key_press();
+  keys->set_console_id(kConsoleId);
+  keys->set_port(PORT_2);
+  keys->set_frame_number(0);
+  StreamPingPB* pong = event.mutable_pong();
+  pong->set_sequence(1);
+  pong->set_client_send_nanos(now_nanos - 3000000);
+  pong->set_server_receive_nanos(now_nanos - 2000000);
+  pong->set_server_send_nanos(now_nanos - 1000000);
+  EXPECT_CALL(*mock_stream_, Read(_))
+      .WillOnce(DoAll(SetArgPointee<0>(event), Return(true)));
+  EXPECT_CALL(mock_coder_, DecodeButtons(_, _))
+      .WillOnce(DoAll(SetArgPointee<1>("data 200"), Return(true)));
+
+  string data;
+  ASSERT_EQ(StringHandler::GetButtonsStatus::SUCCESS,
+            handler_->GetButtons(PORT_2, 0, &data));
+  EXPECT_EQ("data 200", data);
+
+  const StreamLatencyPB latency = handler_->stream_latency();
+  EXPECT_EQ(1, latency.samples());
+  EXPECT_GE(latency.last_rtt_nanos(), 2000000);
+  EXPECT_EQ(latency.last_rtt_nanos(), latency.smoothed_rtt_nanos());
+
+  TimingsPB timings;
+  trace_.Snapshot(&timings);
+  EXPECT_EQ(1, timings.stream_latency().samples());
+  EXPECT_EQ(latency.last_rtt_nanos(),
+            timings.stream_latency().last_rtt_nanos());
+}
+
+TEST_F(EventStreamHandlerTest, TimeSyncInvalidOptions) {
+  EventStreamHandlerOptions options;
+  options.time_sync_window_frames = -1;
+  EXPECT_DEATH(
+      StringHandler(kConsoleId, kClientId, {PORT_1}, &trace_, &mock_coder_,
+                    std::shared_ptr<MockNetPlayServerServiceStub>(
+                        new MockNetPlayServerServiceStub()),
+                    options),
+      "invalid time_sync_window_frames");
+
+  options.time_sync_window_frames = 10;
+  EXPECT_DEATH(
+      StringHandler(kConsoleId, kClientId, {PORT_1}, &trace_, &mock_coder_,
+                    std::shared_ptr<MockNetPlayServerServiceStub>(
+                        new MockNetPlayServerServiceStub()),
+                    options),
+      "time_sync_window_frames requires background_reader");
+}
+
+TEST_F(EventStreamHandlerTest, TimeSyncReportsAndEstimatesFrameAdvantage) {
+  // PORT_2 is at frame 0 and has received frame 0.
+  IncomingEventPB event;
+  KeyStatePB* keys = event.add_key_press();
+  keys->set_console_id(kConsoleId);
+  keys->set_port(PORT_2);
+  keys->set_frame_number(0);
+  FrameStatusPB* status = event.mutable_frame_status();
+  status->set_port(PORT_2);
+  status->set_current_frame(0);
+  status->set_last_received_frame(0);
+  EXPECT_CALL(mock_coder_, DecodeButtons(_, _))
+      .WillOnce(DoAll(SetArgPointee<1>("data 200"), Return(true)));
+
+  EventStreamHandlerOptions options;
+  options.time_sync_window_frames = 10;
+  StartGameWithBackgroundReader({event}, options);
+  EXPECT_EQ(0, handler_->frame_advantage());
+
+  string data;
+  ASSERT_EQ(StringHandler::GetButtonsStatus::SUCCESS,
+            handler_->GetButtons(PORT_2, 0, &data));
+
+  OutgoingEventPB written;
+  EXPECT_CALL(mock_coder_, EncodeButtons(_, _))
+      .Times(2)
+      .WillRepeatedly(Return(true));
+  EXPECT_CALL(*mock_stream_, Write(_, _))
+      .Times(2)
+      .WillRepeatedly(DoAll(SaveArg<0>(&written), Return(true)));
+
+  ASSERT_EQ(StringHandler::PutButtonsStatus::SUCCESS,
+            handler_->PutButtons({std::make_tuple(PORT_1, 0, "frame 0")}));
+  ASSERT_TRUE(written.has_frame_status());
+  EXPECT_EQ(PORT_1, written.frame_status().port());
+  EXPECT_EQ(0, written.frame_status().current_frame());
+  EXPECT_EQ(0, written.frame_status().last_received_frame());
+
+  // This client was 0 and then 1 frame ahead of the frames it received from
+  // PORT_2, which was 0 frames ahead of the frames it received, so it is
+  // (0.5 - 0) / 2 frames ahead.
+  ASSERT_EQ(StringHandler::PutButtonsStatus::SUCCESS,
+            handler_->PutButtons({std::make_tuple(PORT_1, 1, "frame 1")}));
+  EXPECT_EQ(1, written.frame_status().current_frame());
+  EXPECT_DOUBLE_EQ(0.25, handler_->frame_advantage());
+  EXPECT_EQ(0, handler_->TakePacingNanos());
+
+  TimingsPB timings;
+  trace_.Snapshot(&timings);
+  EXPECT_EQ(2, timings.time_sync().samples());
+  EXPECT_DOUBLE_EQ(0.25, timings.time_sync().frame_advantage());
+}
+
+TEST_F(EventStreamHandlerTest, TimeSyncSubtractsRemoteDelay) {
+  // PORT_2 plays with a delay of 3 frames, so the buttons it sends at frame 0
+  // are for frame 3.
+  start_game_event_.mutable_start_game()->mutable_connected_ports(1)
+      ->set_delay_frames(3);
+  IncomingEventPB event;
+  KeyStatePB* keys = event.add_key_press();
+  keys->set_console_id(kConsoleId);
+  keys->set_port(PORT_2);
+  keys->set_frame_number(3);
+  FrameStatusPB* status = event.mutable_frame_status();
+  status->set_port(PORT_2);
+  status->set_current_frame(0);
+  status->set_last_received_frame(0);
+  EXPECT_CALL(mock_coder_, DecodeButtons(_, _))
+      .WillOnce(DoAll(SetArgPointee<1>("data 200"), Return(true)));
+
+  EventStreamHandlerOptions options;
+  options.time_sync_window_frames = 10;
+  StartGameWithBackgroundReader({event}, options);
+
+  string data;
+  for (int frame = 0; frame <= 3; ++frame) {
+    ASSERT_EQ(StringHandler::GetButtonsStatus::SUCCESS,
+              handler_->GetButtons(PORT_2, frame, &data));
+  }
+  EXPECT_EQ("data 200", data);
+
+  EXPECT_CALL(mock_coder_, EncodeButtons(_, _))
+      .Times(2)
+      .WillRepeatedly(Return(true));
+  EXPECT_CALL(*mock_stream_, Write(_, _))
+      .Times(2)
+      .WillRepeatedly(Return(true));
+  ASSERT_EQ(StringHandler::PutButtonsStatus::SUCCESS,
+            handler_->PutButtons({std::make_tuple(PORT_1, 0, "frame 0")}));
+  ASSERT_EQ(StringHandler::PutButtonsStatus::SUCCESS,
+            handler_->PutButtons({std::make_tuple(PORT_1, 1, "frame 1")}));
+
+  // As in TimeSyncReportsAndEstimatesFrameAdvantage, since PORT_2 was at
+  // frame 0 rather than 3.
+  EXPECT_DOUBLE_EQ(0.25, handler_->frame_advantage());
+}
+
+TEST_F(EventStreamHandlerTest, DelayAdjustInvalidOptions) {
+  EventStreamHandlerOptions options;
+  options.delay_adjust_window_frames = 10;
+  EXPECT_DEATH(
+      StringHandler(kConsoleId, kClientId, {PORT_1}, &trace_, &mock_coder_,
+                    std::shared_ptr<MockNetPlayServerServiceStub>(
+                        new MockNetPlayServerServiceStub()),
+                    options),
+      "delay_adjust_window_frames requires background_reader");
+
+  options.background_reader = true;
+  options.rollback_frames = 4;
+  EXPECT_DEATH(
+      StringHandler(kConsoleId, kClientId, {PORT_1}, &trace_, &mock_coder_,
+                    std::shared_ptr<MockNetPlayServerServiceStub>(
+                        new MockNetPlayServerServiceStub()),
+                    options),
+      "delay_adjust_window_frames is unavailable in rollback mode");
+}
+
+TEST_F(EventStreamHandlerTest, AppliesAgreedDelayChangeToLocalPorts) {
+  // Another client raises the delay of PORT_1 from 2 to 4 frames from frame 1
+  // on. The change rides on buttons of PORT_2, which are read once it is
+  // accepted.
+  IncomingEventPB event;
+  DelayChangePB* change = event.add_delay_change();
+  change->set_port(PORT_1);
+  change->set_frame(1);
+  change->set_delay_frames(4);
+  KeyStatePB* keys = event.add_key_press();
+  keys->set_console_id(kConsoleId);
+  keys->set_port(PORT_2);
+  keys->set_frame_number(0);
+  EXPECT_CALL(mock_coder_, DecodeButtons(_, _)).WillOnce(Return(true));
+
+  StartGameWithBackgroundReader({event});
+  string data;
+  ASSERT_EQ(StringHandler::GetButtonsStatus::SUCCESS,
+            handler_->GetButtons(PORT_2, 0, &data));
+  EXPECT_EQ(2, handler_->DelayFramesForPort(PORT_1));
+
+  std::vector<OutgoingEventPB> written;
+  EXPECT_CALL(mock_coder_, EncodeButtons(_, _))
+      .Times(2)
+      .WillRepeatedly(Return(true));
+  EXPECT_CALL(*mock_stream_, Write(_, _))
+      .Times(2)
+      .WillRepeatedly(Invoke(
+          [&written](const OutgoingEventPB& event, grpc::WriteOptions) {
+            written.push_back(event);
+            return true;
+          }));
+  ASSERT_EQ(StringHandler::PutButtonsStatus::SUCCESS,
+            handler_->PutButtons({std::make_tuple(PORT_1, 0, "frame 0")}));
+  ASSERT_EQ(StringHandler::PutButtonsStatus::SUCCESS,
+            handler_->PutButtons({std::make_tuple(PORT_1, 1, "frame 1")}));
+  EXPECT_EQ(4, handler_->DelayFramesForPort(PORT_1));
+
+  // The other clients receive the buttons of frame 1 for every delayed frame
+  // skipped by the change, and so does this one.
+  ASSERT_EQ(2, written.size());
+  ASSERT_EQ(1, written[0].key_press_size());
+  EXPECT_EQ(2, written[0].key_press(0).frame_number());
+  ASSERT_EQ(3, written[1].key_press_size());
+  for (int i = 0; i < 3; ++i) {
+    EXPECT_EQ(PORT_1, written[1].key_press(i).port());
+    EXPECT_EQ(3 + i, written[1].key_press(i).frame_number());
+  }
+
+  const char* const expected[] = {"", "", "frame 0", "frame 1", "frame 1",
+                                  "frame 1"};
+  for (int frame = 0; frame < 6; ++frame) {
+    ASSERT_EQ(StringHandler::GetButtonsStatus::SUCCESS,
+              handler_->GetButtons(PORT_1, frame, &data));
+    EXPECT_EQ(expected[frame], data);
+  }
+}
+
+TEST_F(EventStreamHandlerTest, ProposesDelayChangesFromStalls) {
+  // Frames 0 and 1 of PORT_2 arrive together, late enough for frame 0 to be
+  // waited for.
+  IncomingEventPB event;
+  for (int frame = 0; frame < 2; ++frame) {
+    KeyStatePB* keys = event.add_key_press();
+    keys->set_console_id(kConsoleId);
+    keys->set_port(PORT_2);
+    keys->set_frame_number(frame);
+  }
+  EXPECT_CALL(mock_coder_, DecodeButtons(_, _))
+      .Times(2)
+      .WillRepeatedly(Return(true));
+
+  EventStreamHandlerOptions options;
+  options.background_reader = true;
+  options.delay_adjust_window_frames = 2;
+  options.delay_raise_stall_rate = 0.5;
+  options.delay_change_lead_frames = 10;
+  ResetHandler(options);
+  {
+    InSequence sequence;
+    EXPECT_CALL(*mock_stub_, SendEventRaw(_)).WillOnce(Return(mock_stream_));
+    EXPECT_CALL(*mock_stream_, Write(_, _)).WillOnce(Return(true));
+    EXPECT_CALL(*mock_stream_, Read(_))
+        .WillOnce(DoAll(SetArgPointee<0>(start_game_event_), Return(true)));
+    EXPECT_CALL(*mock_stream_, Read(_))
+        .WillOnce(Invoke([&event](IncomingEventPB* read) {
+          std::this_thread::sleep_for(std::chrono::milliseconds(50));
+          *read = event;
+          return true;
+        }));
+    EXPECT_CALL(*mock_stream_, Read(_))
+        .Times(AtMost(1))
+        .WillRepeatedly(Return(false));
+  }
+  ASSERT_TRUE(handler_->ClientReady());
+  ASSERT_TRUE(handler_->WaitForConsoleStart());
+
+  string data;
+  ASSERT_EQ(StringHandler::GetButtonsStatus::SUCCESS,
+            handler_->GetButtons(PORT_2, 0, &data));
+  ASSERT_EQ(StringHandler::GetButtonsStatus::SUCCESS,
+            handler_->GetButtons(PORT_2, 1, &data));
+
+  // One of the two frames stalled, so the delay of PORT_2 is raised ten frames
+  // after the window.
+  OutgoingEventPB written;
+  EXPECT_CALL(mock_coder_, EncodeButtons(_, _)).WillOnce(Return(true));
+  EXPECT_CALL(*mock_stream_, Write(_, _))
+      .WillOnce(DoAll(SaveArg<0>(&written), Return(true)));
+  ASSERT_EQ(StringHandler::PutButtonsStatus::SUCCESS,
+            handler_->PutButtons({std::make_tuple(PORT_1, 0, "frame 0")}));
+  ASSERT_EQ(1, written.delay_change_size());
+  EXPECT_EQ(PORT_2, written.delay_change(0).port());
+  EXPECT_EQ(11, written.delay_change(0).frame());
+  EXPECT_EQ(1, written.delay_change(0).delay_frames());
+
+  TimingsPB timings;
+  trace_.Snapshot(&timings);
+  ASSERT_EQ(1, timings.delay_adjustment_size());
+  const DelayAdjustmentPB& adjustment = timings.delay_adjustment(0);
+  EXPECT_EQ(PORT_2, adjustment.port());
+  EXPECT_EQ(1, adjustment.delay_frames());
+  EXPECT_EQ(2, adjustment.observed_frames());
+  EXPECT_EQ(1, adjustment.stalled_frames());
+  EXPECT_EQ(1, adjustment.proposed_changes());
+  EXPECT_EQ(1, adjustment.accepted_changes());
+}
+
+// -----------------------------------------------------------------------------
+// Transports
+
+namespace {
+
+// Plays the server of a two-player console in which PORT_2 mirrors PORT_1.
+class MirrorPeer : public LoopbackEventTransport::Peer {
+ public:
+  explicit MirrorPeer(int console_id) : console_id_(console_id) {}
+
+  void HandleEvent(const OutgoingEventPB& event,
+                   LoopbackEventTransport* transport) override {
+    if (event.has_client_ready()) {
+      auto* start_game = reply_.mutable_start_game();
+      start_game->set_console_id(console_id_);
+      start_game->add_connected_ports()->set_port(PORT_1);
+      start_game->add_connected_ports()->set_port(PORT_2);
+      transport->Deliver(&reply_);
+    }
+    if (event.key_press_size() > 0) {
+      for (const KeyStatePB& key_press : event.key_press()) {
+        KeyStatePB* mirrored = reply_.add_key_press();
+        *mirrored = key_press;
+        mirrored->set_port(PORT_2);
+      }
+      transport->Deliver(&reply_);
+    }
+  }
+
+ private:
+  const int console_id_;
+  IncomingEventPB reply_;
+};
+
+}  // namespace
+
+TEST_F(EventStreamHandlerTest, ExchangesButtonsOverLoopbackTransport) {
+  MirrorPeer peer(kConsoleId);
+  handler_.reset(new StringHandler(
+      kConsoleId, kClientId, {PORT_1}, &trace_, &mock_coder_,
+      std::unique_ptr<EventTransport>(new LoopbackEventTransport(&peer))));
+
+  // The peer sees whether button A is pressed.
+  EXPECT_CALL(mock_coder_, EncodeButtons(_, _))
+      .WillRepeatedly(Invoke([](const string& buttons, KeyStatePB* key_state) {
+        key_state->set_a_button(buttons == "A");
+        return true;
+      }));
+  EXPECT_CALL(mock_coder_, DecodeButtons(_, _))
+      .WillRepeatedly(Invoke([](const KeyStatePB& key_state, string* buttons) {
+        *buttons = key_state.a_button() ? "A" : "";
+        return true;
+      }));
+
+  ASSERT_TRUE(handler_->ClientReady());
+  ASSERT_TRUE(handler_->WaitForConsoleStart());
+  EXPECT_THAT(handler_->remote_ports(), UnorderedElementsAre(PORT_2));
+
+  for (int frame = 0; frame < 4; ++frame) {
+    const string pressed = frame % 2 == 0 ? "A" : "";
+    ASSERT_EQ(StringHandler::PutButtonsStatus::SUCCESS,
+              handler_->PutButtons({std::make_tuple(PORT_1, frame, pressed)}));
+    string buttons;
+    ASSERT_EQ(StringHandler::GetButtonsStatus::SUCCESS,
+              handler_->GetButtons(PORT_2, frame, &buttons));
+    EXPECT_EQ(pressed, buttons);
+  }
+}
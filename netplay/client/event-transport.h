@@ -0,0 +1,37 @@
+#ifndef EVENT_TRANSPORT_H_
+#define EVENT_TRANSPORT_H_
+
+#include "base/netplayServiceProto.pb.h"
+
+// Carries the events of a game between a client and the other end of its
+// session: the ClientReadyPB and key presses the client writes, and the
+// StartGamePB, key presses, pings and StopConsolePB it reads.
+// EventStreamHandler only exchanges events through this interface, so that
+// transports other than the server's gRPC event stream can be swapped in
+// without touching the lockstep logic.
+//
+// At most one thread may call Write and at most one thread may call Read at
+// any given time. TryCancel may be called from any thread.
+class EventTransport {
+ public:
+  virtual ~EventTransport() {}
+
+  // Opens the transport. Called once, before any call to Write or Read.
+  // Returns false on failure.
+  virtual bool Open() = 0;
+
+  // Sends event, blocking until the transport accepts it. Returns false if the
+  // transport failed or was cancelled.
+  virtual bool Write(const OutgoingEventPB& event) = 0;
+
+  // Blocks until the next event arrives and stores it in *event. Returns false
+  // if the transport failed or was cancelled, or if the other end closed it.
+  virtual bool Read(IncomingEventPB* event) = 0;
+
+  // Fails the pending and later calls to Write and Read, unblocking them. Note
+  // this method cannot guarantee that calls already blocked in the underlying
+  // channel return.
+  virtual void TryCancel() = 0;
+};
+
+#endif  // EVENT_TRANSPORT_H_
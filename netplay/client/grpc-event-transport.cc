@@ -0,0 +1,38 @@
+#include "client/grpc-event-transport.h"
+
+#include "glog/logging.h"
+
+GrpcEventTransport::GrpcEventTransport(
+    std::shared_ptr<NetPlayServerService::StubInterface> stub)
+    : stub_(stub) {}
+
+bool GrpcEventTransport::Open() {
+  if (stream_ != nullptr) {
+    LOG(ERROR) << "Event stream already open";
+    return false;
+  }
+  stream_ = stub_->SendEvent(&context_);
+  if (stream_ == nullptr) {
+    LOG(ERROR) << "Failed to open the event stream";
+    return false;
+  }
+  return true;
+}
+
+bool GrpcEventTransport::Write(const OutgoingEventPB& event) {
+  if (stream_ == nullptr) {
+    LOG(ERROR) << "Attempted to write to an unopened event stream";
+    return false;
+  }
+  return stream_->Write(event);
+}
+
+bool GrpcEventTransport::Read(IncomingEventPB* event) {
+  if (stream_ == nullptr) {
+    LOG(ERROR) << "Attempted to read from an unopened event stream";
+    return false;
+  }
+  return stream_->Read(event);
+}
+
+void GrpcEventTransport::TryCancel() { context_.TryCancel(); }
@@ -0,0 +1,37 @@
+#ifndef GRPC_EVENT_TRANSPORT_H_
+#define GRPC_EVENT_TRANSPORT_H_
+
+#include <memory>
+
+#include "base/netplayServiceProto.grpc.pb.h"
+#include "client/event-transport.h"
+#include "grpc++/client_context.h"
+
+// EventTransport over the server's bidirectional SendEvent stream, which the
+// server relays between the clients of a console.
+class GrpcEventTransport : public EventTransport {
+ public:
+  typedef grpc::ClientReaderWriterInterface<OutgoingEventPB, IncomingEventPB>
+      BidirectionalStream;
+
+  // stub is the stub from which the stream is opened.
+  explicit GrpcEventTransport(
+      std::shared_ptr<NetPlayServerService::StubInterface> stub);
+
+  // Opens the event stream.
+  bool Open() override;
+
+  bool Write(const OutgoingEventPB& event) override;
+  bool Read(IncomingEventPB* event) override;
+
+  // Cancels the stream through its context.
+  void TryCancel() override;
+
+ private:
+  std::shared_ptr<NetPlayServerService::StubInterface> stub_;
+  grpc::ClientContext context_;
+  // Null until Open is called.
+  std::unique_ptr<BidirectionalStream> stream_;
+};
+
+#endif  // GRPC_EVENT_TRANSPORT_H_
@@ -0,0 +1,89 @@
+#include "client/grpc-event-transport.h"
+
+#include <memory>
+
+#include "gtest/gtest.h"
+#include "gmock/gmock.h"
+
+#include "client/mocks.h"
+
+using testing::_;
+using testing::DoAll;
+using testing::Property;
+using testing::Return;
+using testing::SetArgPointee;
+
+class GrpcEventTransportTest : public ::testing::Test {
+ protected:
+  typedef MockClientReaderWriter<OutgoingEventPB, IncomingEventPB> MockStream;
+
+  GrpcEventTransportTest()
+      : mock_stub_(new MockNetPlayServerServiceStub()),
+        transport_(std::shared_ptr<MockNetPlayServerServiceStub>(mock_stub_)) {}
+
+  // Owned by transport_
+  MockNetPlayServerServiceStub* mock_stub_;
+  GrpcEventTransport transport_;
+};
+
+TEST_F(GrpcEventTransportTest, OpenOpensStream) {
+  MockStream* mock_stream = new MockStream();
+  EXPECT_CALL(*mock_stub_, SendEventRaw(_)).WillOnce(Return(mock_stream));
+
+  EXPECT_TRUE(transport_.Open());
+}
+
+TEST_F(GrpcEventTransportTest, OpenFailsWithoutStream) {
+  EXPECT_CALL(*mock_stub_, SendEventRaw(_)).WillOnce(Return(nullptr));
+
+  EXPECT_FALSE(transport_.Open());
+}
+
+TEST_F(GrpcEventTransportTest, OpenTwiceFails) {
+  MockStream* mock_stream = new MockStream();
+  EXPECT_CALL(*mock_stub_, SendEventRaw(_)).WillOnce(Return(mock_stream));
+
+  EXPECT_TRUE(transport_.Open());
+  EXPECT_FALSE(transport_.Open());
+}
+
+TEST_F(GrpcEventTransportTest, WriteAndReadFailBeforeOpen) {
+  EXPECT_CALL(*mock_stub_, SendEventRaw(_)).Times(0);
+
+  OutgoingEventPB outgoing;
+  IncomingEventPB incoming;
+  EXPECT_FALSE(transport_.Write(outgoing));
+  EXPECT_FALSE(transport_.Read(&incoming));
+}
+
+TEST_F(GrpcEventTransportTest, WriteForwardsToStream) {
+  MockStream* mock_stream = new MockStream();
+  EXPECT_CALL(*mock_stub_, SendEventRaw(_)).WillOnce(Return(mock_stream));
+  EXPECT_CALL(*mock_stream,
+              Write(Property(&OutgoingEventPB::has_client_ready, true), _))
+      .WillOnce(Return(true))
+      .WillOnce(Return(false));
+
+  ASSERT_TRUE(transport_.Open());
+  OutgoingEventPB event;
+  event.mutable_client_ready()->set_console_id(101);
+  EXPECT_TRUE(transport_.Write(event));
+  EXPECT_FALSE(transport_.Write(event));
+}
+
+TEST_F(GrpcEventTransportTest, ReadForwardsToStream) {
+  IncomingEventPB start_game_event;
+  start_game_event.mutable_start_game()->set_console_id(101);
+
+  MockStream* mock_stream = new MockStream();
+  EXPECT_CALL(*mock_stub_, SendEventRaw(_)).WillOnce(Return(mock_stream));
+  EXPECT_CALL(*mock_stream, Read(_))
+      .WillOnce(DoAll(SetArgPointee<0>(start_game_event), Return(true)))
+      .WillOnce(Return(false));
+
+  ASSERT_TRUE(transport_.Open());
+  IncomingEventPB event;
+  ASSERT_TRUE(transport_.Read(&event));
+  EXPECT_EQ(101, event.start_game().console_id());
+  EXPECT_FALSE(transport_.Read(&event));
+}
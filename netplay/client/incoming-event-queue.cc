@@ -0,0 +1,28 @@
+#include "client/incoming-event-queue.h"
+
+#include <algorithm>
+
+IncomingEventQueue::IncomingEventQueue() : head_(0), count_(0) {}
+
+void IncomingEventQueue::Push(IncomingEventPB* event) {
+  // Grow the ring if it is full, keeping the queued events in order.
+  if (count_ == ring_.size()) {
+    std::rotate(ring_.begin(), ring_.begin() + head_, ring_.end());
+    head_ = 0;
+    ring_.emplace_back();
+  }
+  IncomingEventPB& slot = ring_[(head_ + count_) % ring_.size()];
+  slot.Swap(event);
+  event->Clear();
+  ++count_;
+}
+
+bool IncomingEventQueue::Pop(IncomingEventPB* event) {
+  if (count_ == 0) {
+    return false;
+  }
+  event->Swap(&ring_[head_]);
+  head_ = (head_ + 1) % ring_.size();
+  --count_;
+  return true;
+}
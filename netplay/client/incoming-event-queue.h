@@ -0,0 +1,37 @@
+#ifndef INCOMING_EVENT_QUEUE_H_
+#define INCOMING_EVENT_QUEUE_H_
+
+#include <cstddef>
+#include <vector>
+
+#include "base/netplayServiceProto.pb.h"
+
+// FIFO of the events an EventTransport has received and not yet handed to
+// Read. Not thread safe: transports guard it with the lock of their other
+// state, and wait on their own condition variable for it to fill.
+//
+// Events are swapped in and out of a ring of reused messages, so that once the
+// ring has grown to the number of events in flight, queueing and reading
+// events allocates nothing.
+class IncomingEventQueue {
+ public:
+  IncomingEventQueue();
+
+  // Queues *event after the events already queued, and leaves in *event a
+  // cleared message for the caller to reuse.
+  void Push(IncomingEventPB* event);
+
+  // Swaps the oldest queued event into *event, leaving the previous contents
+  // of *event to be reused. Returns false if no event is queued.
+  bool Pop(IncomingEventPB* event);
+
+  bool empty() const { return count_ == 0; }
+
+ private:
+  // Queued events are the count_ events of ring_ starting at head_.
+  std::vector<IncomingEventPB> ring_;
+  size_t head_;
+  size_t count_;
+};
+
+#endif  // INCOMING_EVENT_QUEUE_H_
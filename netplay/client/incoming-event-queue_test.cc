@@ -0,0 +1,53 @@
+#include "client/incoming-event-queue.h"
+
+#include "gtest/gtest.h"
+
+namespace {
+
+IncomingEventPB KeyPressEvent(int frame_number) {
+  IncomingEventPB event;
+  event.add_key_press()->set_frame_number(frame_number);
+  return event;
+}
+
+}  // namespace
+
+TEST(IncomingEventQueueTest, PopFailsWhenEmpty) {
+  IncomingEventQueue queue;
+  IncomingEventPB event = KeyPressEvent(7);
+  EXPECT_TRUE(queue.empty());
+  EXPECT_FALSE(queue.Pop(&event));
+  EXPECT_EQ(7, event.key_press(0).frame_number());
+}
+
+TEST(IncomingEventQueueTest, PushClearsEvent) {
+  IncomingEventQueue queue;
+  IncomingEventPB event = KeyPressEvent(0);
+  queue.Push(&event);
+  EXPECT_FALSE(queue.empty());
+  EXPECT_EQ(0, event.key_press_size());
+}
+
+TEST(IncomingEventQueueTest, KeepsOrderWhileGrowing) {
+  IncomingEventQueue queue;
+  IncomingEventPB event;
+  int pushed = 0;
+  int popped = 0;
+  // Interleaves pushes and pops, so the ring grows while its head is past the
+  // start.
+  for (int round = 1; round <= 5; ++round) {
+    for (int i = 0; i < round + 1; ++i) {
+      event = KeyPressEvent(pushed++);
+      queue.Push(&event);
+    }
+    for (int i = 0; i < round; ++i) {
+      ASSERT_TRUE(queue.Pop(&event));
+      EXPECT_EQ(popped++, event.key_press(0).frame_number());
+    }
+  }
+  while (queue.Pop(&event)) {
+    EXPECT_EQ(popped++, event.key_press(0).frame_number());
+  }
+  EXPECT_EQ(pushed, popped);
+  EXPECT_TRUE(queue.empty());
+}
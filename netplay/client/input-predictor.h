@@ -0,0 +1,142 @@
+#ifndef INPUT_PREDICTOR_H_
+#define INPUT_PREDICTOR_H_
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+#include "base/netplayServiceProto.pb.h"
+#include "base/timings.pb.h"
+#include "client/button-coder-interface.h"
+#include "client/trace-ring.h"
+
+// Ways of predicting the buttons a remote player will press.
+enum class PredictionStrategy {
+  // The player keeps pressing the latest confirmed buttons.
+  REPEAT_LAST = 0,
+  // The player keeps holding the digital buttons and lets go of the analog
+  // controls, as described by ButtonCoderInterface::DecayButtons.
+  HOLD_DECAY,
+  // The player moves between buttons the way they have so far. A first-order
+  // Markov model over the confirmed buttons predicts the most frequent
+  // successor of the latest confirmed buttons, and falls back to repeating
+  // them.
+  MARKOV
+};
+
+// Returns the name of the strategy, as recorded in PredictionStatsPB.
+inline const char* PredictionStrategyName(PredictionStrategy strategy) {
+  switch (strategy) {
+    case PredictionStrategy::REPEAT_LAST:
+      return "REPEAT_LAST";
+    case PredictionStrategy::HOLD_DECAY:
+      return "HOLD_DECAY";
+    case PredictionStrategy::MARKOV:
+      return "MARKOV";
+  }
+  return "UNKNOWN";
+}
+
+// Predicts the buttons of a single remote port for frames that have not
+// arrived yet, and scores each prediction once the confirmed buttons for its
+// frame arrive. The scores are summarized in trace snapshots, so that the hit
+// rate and the waiting that correct predictions could have hidden can be read
+// from them.
+//
+// Confirmed buttons must be observed in frame order. Memory is allocated at
+// construction only. ButtonsType must be equality comparable. Not thread safe,
+// except for stats(), which may be called from any thread.
+template <typename ButtonsType>
+class InputPredictor : public TraceSummarySource {
+ public:
+  static const int kMaxTransitions;
+
+  // Constructs a predictor. Arguments are:
+  //  - port: port whose buttons are predicted.
+  //  - strategy: how buttons are predicted.
+  //  - max_pending_frames: number of frames past the latest observed frame
+  //    whose predictions can be scored. Predictions further ahead are returned
+  //    but not scored. std::abort's if not positive.
+  //  - coder: borrowed coder, used by HOLD_DECAY.
+  //  - trace: borrowed ring whose snapshots include the stats, until the
+  //    predictor is destroyed.
+  InputPredictor(Port port, PredictionStrategy strategy,
+                 int max_pending_frames,
+                 const ButtonCoderInterface<ButtonsType>* coder,
+                 TraceRing* trace);
+
+  ~InputPredictor() override;
+
+  // Returns the predicted buttons for frame and remembers them to be scored
+  // by Observe. Predicting the same frame again replaces the earlier
+  // prediction. If frame is not past last_frame(), returns the latest
+  // confirmed buttons and scores nothing.
+  ButtonsType Predict(int frame);
+
+  // Feeds the confirmed buttons for frame to the model. If frame was
+  // predicted, scores the prediction, adding wait_nanos, the time the caller
+  // waited for the buttons to arrive, to the stats, and returns true. Frames
+  // that are not past last_frame() are ignored.
+  bool Observe(int frame, const ButtonsType& buttons, int64_t wait_nanos);
+
+  // Returns the latest observed frame, or -1 if no frame was observed yet.
+  int last_frame() const { return last_frame_; }
+
+  // Returns the scores of the predictions so far.
+  PredictionStatsPB stats() const;
+
+  // Adds stats() to the prediction stats of timings, once a prediction was
+  // scored.
+  void AddSummary(TimingsPB* timings) const override;
+
+ private:
+  // Number of times the player went from one set of buttons to another on
+  // consecutive observed frames, and the latest frame at which they did.
+  struct Transition {
+    ButtonsType from;
+    ButtonsType to;
+    int count;
+    int last_frame;
+  };
+
+  // A prediction waiting to be scored, or none if frame is negative.
+  struct Pending {
+    int frame;
+    ButtonsType buttons;
+  };
+
+  // Returns the buttons the Markov model expects frames_ahead frames after the
+  // latest observed frame.
+  ButtonsType PredictMarkov(int frames_ahead) const;
+
+  // Counts a transition of the Markov model made at frame. Once
+  // kMaxTransitions are known, the least frequent one is forgotten to make
+  // room, the least recently seen of those first.
+  void Learn(const ButtonsType& from, const ButtonsType& to, int frame);
+
+  const Port port_;
+  const PredictionStrategy strategy_;
+  // Borrowed reference
+  const ButtonCoderInterface<ButtonsType>& coder_;
+  // Borrowed reference
+  TraceRing* trace_;
+
+  int last_frame_;
+  ButtonsType last_buttons_;
+
+  // Only used by MARKOV.
+  std::vector<Transition> transitions_;
+
+  // Predictions of frames past last_frame_, indexed by frame modulo the size.
+  std::vector<Pending> pending_;
+
+  // Scores, only written by the predicting thread.
+  std::atomic<int64_t> predicted_frames_;
+  std::atomic<int64_t> correct_frames_;
+  std::atomic<int64_t> predicted_wait_nanos_;
+  std::atomic<int64_t> correct_wait_nanos_;
+};
+
+#include "input-predictor.hpp"
+
+#endif  // INPUT_PREDICTOR_H_
@@ -0,0 +1,169 @@
+// included by input-predictor.h
+
+#include <cstdlib>
+
+#include "glog/logging.h"
+
+// -----------------------------------------------------------------------------
+// InputPredictor
+
+template <typename ButtonsType>
+const int InputPredictor<ButtonsType>::kMaxTransitions = 64;
+
+template <typename ButtonsType>
+InputPredictor<ButtonsType>::InputPredictor(
+    Port port, PredictionStrategy strategy, int max_pending_frames,
+    const ButtonCoderInterface<ButtonsType>* coder, TraceRing* trace)
+    : port_(port),
+      strategy_(strategy),
+      coder_(*coder),
+      trace_(trace),
+      last_frame_(-1),
+      last_buttons_(),
+      predicted_frames_(0),
+      correct_frames_(0),
+      predicted_wait_nanos_(0),
+      correct_wait_nanos_(0) {
+  if (max_pending_frames <= 0) {
+    LOG(ERROR) << "invalid max_pending_frames: " << max_pending_frames;
+    std::abort();
+  }
+
+  if (strategy_ == PredictionStrategy::MARKOV) {
+    transitions_.reserve(kMaxTransitions);
+  }
+  pending_.resize(max_pending_frames, Pending{-1, ButtonsType()});
+
+  trace_->AddSummarySource(this);
+}
+
+template <typename ButtonsType>
+InputPredictor<ButtonsType>::~InputPredictor() {
+  trace_->RemoveSummarySource(this);
+}
+
+template <typename ButtonsType>
+ButtonsType InputPredictor<ButtonsType>::Predict(int frame) {
+  const int frames_ahead = frame - last_frame_;
+  if (frames_ahead <= 0) {
+    return last_buttons_;
+  }
+
+  ButtonsType buttons;
+  switch (strategy_) {
+    case PredictionStrategy::HOLD_DECAY:
+      buttons = coder_.DecayButtons(last_buttons_, frames_ahead);
+      break;
+    case PredictionStrategy::MARKOV:
+      buttons = PredictMarkov(frames_ahead);
+      break;
+    default:
+      buttons = last_buttons_;
+      break;
+  }
+
+  // Pending frames lie within pending_.size() of last_frame_, so no two of
+  // them share a slot.
+  if (frames_ahead <= static_cast<int>(pending_.size())) {
+    Pending& pending = pending_[frame % pending_.size()];
+    pending.frame = frame;
+    pending.buttons = buttons;
+  }
+  return buttons;
+}
+
+template <typename ButtonsType>
+bool InputPredictor<ButtonsType>::Observe(int frame, const ButtonsType& buttons,
+                                          int64_t wait_nanos) {
+  if (frame <= last_frame_) {
+    return false;
+  }
+
+  if (strategy_ == PredictionStrategy::MARKOV && last_frame_ >= 0) {
+    Learn(last_buttons_, buttons, frame);
+  }
+  last_frame_ = frame;
+  last_buttons_ = buttons;
+
+  Pending& pending = pending_[frame % pending_.size()];
+  if (pending.frame != frame) {
+    return false;
+  }
+  pending.frame = -1;
+
+  predicted_frames_.fetch_add(1, std::memory_order_relaxed);
+  predicted_wait_nanos_.fetch_add(wait_nanos, std::memory_order_relaxed);
+  if (pending.buttons == buttons) {
+    correct_frames_.fetch_add(1, std::memory_order_relaxed);
+    correct_wait_nanos_.fetch_add(wait_nanos, std::memory_order_relaxed);
+  } else {
+    VLOG(3) << "Mispredicted buttons for port " << Port_Name(port_)
+            << " and frame " << frame;
+  }
+  return true;
+}
+
+template <typename ButtonsType>
+PredictionStatsPB InputPredictor<ButtonsType>::stats() const {
+  PredictionStatsPB stats;
+  stats.set_port(port_);
+  stats.set_strategy(PredictionStrategyName(strategy_));
+  stats.set_predicted_frames(predicted_frames_.load(std::memory_order_relaxed));
+  stats.set_correct_frames(correct_frames_.load(std::memory_order_relaxed));
+  stats.set_predicted_wait_nanos(
+      predicted_wait_nanos_.load(std::memory_order_relaxed));
+  stats.set_correct_wait_nanos(
+      correct_wait_nanos_.load(std::memory_order_relaxed));
+  return stats;
+}
+
+template <typename ButtonsType>
+void InputPredictor<ButtonsType>::AddSummary(TimingsPB* timings) const {
+  if (predicted_frames_.load(std::memory_order_relaxed) > 0) {
+    *timings->add_prediction_stats() = stats();
+  }
+}
+
+template <typename ButtonsType>
+ButtonsType InputPredictor<ButtonsType>::PredictMarkov(int frames_ahead) const {
+  ButtonsType buttons = last_buttons_;
+  for (int i = 0; i < frames_ahead; ++i) {
+    const Transition* likeliest = nullptr;
+    for (const Transition& transition : transitions_) {
+      if (transition.from == buttons &&
+          (likeliest == nullptr || transition.count > likeliest->count)) {
+        likeliest = &transition;
+      }
+    }
+    if (likeliest == nullptr) {
+      // Nothing is known about what follows these buttons, so hold them.
+      break;
+    }
+    buttons = likeliest->to;
+  }
+  return buttons;
+}
+
+template <typename ButtonsType>
+void InputPredictor<ButtonsType>::Learn(const ButtonsType& from,
+                                        const ButtonsType& to, int frame) {
+  Transition* rarest = nullptr;
+  for (Transition& transition : transitions_) {
+    if (transition.from == from && transition.to == to) {
+      ++transition.count;
+      transition.last_frame = frame;
+      return;
+    }
+    if (rarest == nullptr || transition.count < rarest->count ||
+        (transition.count == rarest->count &&
+         transition.last_frame < rarest->last_frame)) {
+      rarest = &transition;
+    }
+  }
+
+  if (transitions_.size() < static_cast<size_t>(kMaxTransitions)) {
+    transitions_.push_back(Transition{from, to, 1, frame});
+  } else {
+    *rarest = Transition{from, to, 1, frame};
+  }
+}
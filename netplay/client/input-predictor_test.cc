@@ -0,0 +1,154 @@
+#include "client/input-predictor.h"
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+#include "client/mocks.h"
+
+using testing::_;
+using testing::Return;
+
+// -----------------------------------------------------------------------------
+// InputPredictor
+
+class InputPredictorTest : public ::testing::Test {
+ protected:
+  typedef InputPredictor<int> IntPredictor;
+
+  IntPredictor* MakePredictor(PredictionStrategy strategy,
+                              int max_pending_frames = 1) {
+    predictor_.reset(new IntPredictor(PORT_2, strategy, max_pending_frames,
+                                      &mock_coder_, &trace_));
+    return predictor_.get();
+  }
+
+  MockButtonCoder<int> mock_coder_;
+  TraceRing trace_;
+  std::unique_ptr<IntPredictor> predictor_;
+};
+
+TEST_F(InputPredictorTest, InvalidMaxPendingFrames) {
+  EXPECT_DEATH(MakePredictor(PredictionStrategy::REPEAT_LAST, 0),
+               "invalid max_pending_frames");
+}
+
+TEST_F(InputPredictorTest, RepeatLast) {
+  IntPredictor* predictor = MakePredictor(PredictionStrategy::REPEAT_LAST);
+
+  // Nothing observed yet, so predict the default buttons.
+  EXPECT_EQ(-1, predictor->last_frame());
+  EXPECT_EQ(0, predictor->Predict(0));
+  EXPECT_TRUE(predictor->Observe(0, 5, 100));
+
+  EXPECT_EQ(0, predictor->last_frame());
+  EXPECT_EQ(5, predictor->Predict(1));
+  EXPECT_TRUE(predictor->Observe(1, 5, 200));
+
+  // Frames that were not predicted are not scored.
+  EXPECT_FALSE(predictor->Observe(2, 7, 0));
+  EXPECT_EQ(7, predictor->Predict(3));
+
+  const PredictionStatsPB& stats = predictor->stats();
+  EXPECT_EQ(PORT_2, stats.port());
+  EXPECT_EQ("REPEAT_LAST", stats.strategy());
+  EXPECT_EQ(2, stats.predicted_frames());
+  EXPECT_EQ(1, stats.correct_frames());
+  EXPECT_EQ(300, stats.predicted_wait_nanos());
+  EXPECT_EQ(200, stats.correct_wait_nanos());
+}
+
+TEST_F(InputPredictorTest, ExportsStatsToTrace) {
+  IntPredictor* predictor = MakePredictor(PredictionStrategy::REPEAT_LAST);
+
+  TimingsPB timings;
+  trace_.Snapshot(&timings);
+  EXPECT_EQ(0, timings.prediction_stats_size());
+
+  predictor->Predict(0);
+  predictor->Observe(0, 0, 50);
+  trace_.Snapshot(&timings);
+  ASSERT_EQ(1, timings.prediction_stats_size());
+  EXPECT_EQ(PORT_2, timings.prediction_stats(0).port());
+  EXPECT_EQ(1, timings.prediction_stats(0).predicted_frames());
+  EXPECT_EQ(1, timings.prediction_stats(0).correct_frames());
+  EXPECT_EQ(50, timings.prediction_stats(0).correct_wait_nanos());
+}
+
+TEST_F(InputPredictorTest, HoldDecay) {
+  IntPredictor* predictor = MakePredictor(PredictionStrategy::HOLD_DECAY, 4);
+  predictor->Observe(0, 40, 0);
+
+  EXPECT_CALL(mock_coder_, DecayButtons(40, 1)).WillOnce(Return(20));
+  EXPECT_CALL(mock_coder_, DecayButtons(40, 3)).WillOnce(Return(5));
+  EXPECT_EQ(20, predictor->Predict(1));
+  EXPECT_EQ(5, predictor->Predict(3));
+
+  EXPECT_TRUE(predictor->Observe(1, 20, 0));
+  EXPECT_TRUE(predictor->Observe(3, 6, 0));
+  EXPECT_EQ("HOLD_DECAY", predictor->stats().strategy());
+  EXPECT_EQ(2, predictor->stats().predicted_frames());
+  EXPECT_EQ(1, predictor->stats().correct_frames());
+}
+
+TEST_F(InputPredictorTest, MarkovLearnsTransitions) {
+  IntPredictor* predictor = MakePredictor(PredictionStrategy::MARKOV, 4);
+
+  // The player alternates between 1 and 2, and once went from 2 to 3.
+  const int history[] = {1, 2, 1, 2, 3, 1, 2};
+  for (int frame = 0; frame < 7; ++frame) {
+    predictor->Observe(frame, history[frame], 0);
+  }
+  EXPECT_EQ(1, predictor->Predict(7));
+  EXPECT_EQ(2, predictor->Predict(8));
+  EXPECT_EQ(1, predictor->Predict(9));
+
+  // Nothing ever followed 4, so it is held.
+  predictor->Observe(7, 4, 0);
+  EXPECT_EQ(4, predictor->Predict(8));
+  EXPECT_EQ(4, predictor->Predict(10));
+}
+
+TEST_F(InputPredictorTest, MarkovForgetsRarestTransitions) {
+  IntPredictor* predictor = MakePredictor(PredictionStrategy::MARKOV);
+
+  // 0 is always followed by 1, and is seen twice.
+  int frame = 0;
+  for (int i = 0; i < 2; ++i) {
+    predictor->Observe(frame++, 0, 0);
+    predictor->Observe(frame++, 1, 0);
+  }
+  // Fill the model with transitions that are only seen once.
+  for (int i = 0; i < IntPredictor::kMaxTransitions; ++i) {
+    predictor->Observe(frame++, 100 + i, 0);
+  }
+
+  predictor->Observe(frame++, 0, 0);
+  EXPECT_EQ(1, predictor->Predict(frame));
+
+  // 1 was only followed by 0 and 100, and those transitions were forgotten.
+  predictor->Observe(frame++, 1, 0);
+  EXPECT_EQ(1, predictor->Predict(frame));
+}
+
+TEST_F(InputPredictorTest, PendingPredictions) {
+  IntPredictor* predictor = MakePredictor(PredictionStrategy::REPEAT_LAST, 2);
+  predictor->Observe(0, 1, 0);
+
+  // Predicting a frame again replaces the prediction and counts once.
+  predictor->Predict(1);
+  predictor->Predict(1);
+  predictor->Predict(2);
+  // Too far ahead to be scored.
+  predictor->Predict(3);
+
+  EXPECT_TRUE(predictor->Observe(1, 1, 0));
+  EXPECT_TRUE(predictor->Observe(2, 2, 0));
+  EXPECT_FALSE(predictor->Observe(3, 2, 0));
+  EXPECT_EQ(2, predictor->stats().predicted_frames());
+  EXPECT_EQ(1, predictor->stats().correct_frames());
+
+  // Old frames are ignored.
+  EXPECT_FALSE(predictor->Observe(1, 5, 0));
+  EXPECT_EQ(3, predictor->last_frame());
+  EXPECT_EQ(2, predictor->Predict(3));
+}
@@ -1,11 +1,37 @@
 #ifndef INPUT_QUEUE_H_
 #define INPUT_QUEUE_H_
 
+#include <atomic>
 #include <chrono>
 #include <condition_variable>
+#include <functional>
 #include <map>
+#include <memory>
 #include <mutex>
 #include <ratio>
+#include <utility>
+
+#include "client/recycling-allocator.h"
+#include "client/wait-strategy.h"
+
+// Storage backends for InputQueue. Both backends implement the same
+// PutButtons/GetButtons contract, so they can be swapped freely.
+enum class InputQueueBackend {
+  // Mutex-protected std::map keyed by frame number, which reuses the nodes of
+  // frames already read. Unbounded.
+  MAP = 0,
+  // Fixed-capacity, lock-free single-producer/single-consumer ring indexed by
+  // frame number. See ring-input-queue.h.
+  RING
+};
+
+// Mutex and condition variable of map queues. Queues made with the same lock
+// share it, so that the buttons of a frame can be read from all of them under
+// a single acquisition of the lock, see InputQueue::GetFrame.
+struct MapQueueLock {
+  std::mutex m;
+  std::condition_variable cv;
+};
 
 // Blocking queue object that will be used to communicate button values received
 // from the server to the client. This queue is designed to receive and emit
@@ -13,24 +39,52 @@
 template <typename ButtonsType>
 class InputQueue {
  public:
+  virtual ~InputQueue() {}
+
   // Make an input queue suitable for use recording inputs from a local input
   // source. In particular, the returned queue applies a delay of delay_frames
-  // to all inputs passed to PutButtons.
-  static InputQueue* MakeLocalQueue(int delay_frames);
+  // to all inputs passed to PutButtons. A map queue uses map_lock if it is
+  // not null, and a lock of its own otherwise. The ring backend ignores it.
+  static InputQueue* MakeLocalQueue(
+      int delay_frames, InputQueueBackend backend = InputQueueBackend::MAP,
+      std::shared_ptr<MapQueueLock> map_lock = nullptr);
 
   // Make an input queue suitable for use recording inputs from a remote input
   // source. In particular, the returned queue applies no additional delay to
   // the inputs passed to PutButtons. The queue assumes the inputs were already
-  // adjusted for delay by the client that sent them.
-  static InputQueue* MakeRemoteQueue(int delay_frames);
+  // adjusted for delay by the client that sent them. map_lock is used as by
+  // MakeLocalQueue.
+  static InputQueue* MakeRemoteQueue(
+      int delay_frames, InputQueueBackend backend = InputQueueBackend::MAP,
+      std::shared_ptr<MapQueueLock> map_lock = nullptr);
 
   // Record the given button presses in the queue. The buttons will be available
   // to GetButtons at frame (frame + delay_frames_).
   //
   // This method returns true on success and false when:
-  //  - frame is greater than one plus
+  //  - frame is negative
+  //  - frame + delay_frames_ is less than the initial frame delay
+  //  - frame + delay_frames_ has already been requested by GetButtons
+  //  - buttons for frame + delay_frames_ are already in the queue
   bool PutButtons(int frame, const ButtonsType& buttons);
 
+  // Same as PutButtons above, and reports the delayed frames for which the
+  // buttons were recorded: *num_delayed_frames frames starting at
+  // *first_delayed_frame. While the delay changes, see ChangeDelayFrames, the
+  // buttons may be recorded for several frames or for none.
+  bool PutButtons(int frame, const ButtonsType& buttons,
+                  int* first_delayed_frame, int* num_delayed_frames);
+
+  // Changes the delay applied to the buttons put for frame and later frames to
+  // delay_frames, replacing any change that has not taken effect yet. Delayed
+  // frames stay consecutive across the change, so that every client sees the
+  // same buttons: raising the delay records the buttons of the first frame put
+  // at the new delay for each delayed frame it skips, and lowering it drops
+  // the buttons put until the delayed frames catch up with the ones already
+  // recorded. Meant for local queues. Must be called from the thread that puts
+  // buttons. Returns false if frame or delay_frames is negative.
+  bool ChangeDelayFrames(int frame, int delay_frames);
+
   // Get the buttons associated with the given frame, accounting for delay. If
   // frame is less than delay_frames_, return a default-constructed ButtonsType.
   // Arguments are:
@@ -40,46 +94,152 @@ class InputQueue {
   //    frame is less than the initial frame delay, populated using the default
   //    constructor for ButtonsType.
   // Returns true and populates *buttons on success, returns false otherwise.
+  // Returns CLOSED rather than waiting if the queue was closed and the
+  // requested frame is not in the queue.
   static const int kBlockForever;
   static const int kReturnImmediately;
   enum class GetButtonsStatus {
     SUCCESS = 0,
     UNEXPECTED_FRAME,
-    TIMEOUT
+    TIMEOUT,
+    CLOSED
   };
-  GetButtonsStatus GetButtons(int frame, int timeout_micros,
-                              ButtonsType* buttons);
+  virtual GetButtonsStatus GetButtons(int frame, int timeout_micros,
+                                      ButtonsType* buttons) = 0;
+
+  // Gets the buttons of frame from each of the num_queues queues into
+  // *buttons[i], as GetButtons would. The first num_ready queues must already
+  // hold the frame, as local queues do once it was put, and the others are
+  // waited for without a timeout. If the queues are map queues that share a
+  // lock, they are read with a single acquisition of it, and either all or
+  // none of them are read. Their wait strategies are then not used. Other
+  // queues are read one at a time. Returns SUCCESS, or the status of the first
+  // queue that failed, which is TIMEOUT for a ready queue missing the frame.
+  static GetButtonsStatus GetFrame(InputQueue* const* queues, int num_queues,
+                                   int num_ready, int frame,
+                                   ButtonsType* const* buttons);
+
+  // Signal that no more buttons will be put into this queue, waking up any
+  // blocked call to GetButtons. Frames already in the queue can still be read.
+  virtual void Close() = 0;
 
   // Get the number of frames of button data waiting to be read.
-  size_t QueueSize();
+  virtual size_t QueueSize() = 0;
 
   // Get the number of delay frames for this queue.
-  int delay_frames() const { return delay_frames_; }
+  int delay_frames() const {
+    return delay_frames_.load(std::memory_order_relaxed);
+  }
 
- private:
-  typedef std::unique_lock<std::mutex> UniqueLock;
-  typedef std::lock_guard<std::mutex> LockGuard;
+  // Makes GetButtons spin and yield as strategy says before blocking for
+  // buttons that have not arrived, and record its waits in strategy. By
+  // default, GetButtons blocks right away and records nothing. strategy is a
+  // borrowed reference, which must outlive the queue. Must be called before
+  // buttons are requested.
+  void set_wait_strategy(WaitStrategy* strategy) { wait_strategy_ = strategy; }
+
+ protected:
   typedef std::chrono::duration<int, std::micro> Microseconds;
 
   InputQueue(int delay_frames, int initial_frame_delay);
 
-  const int delay_frames_;
+  // Records buttons for every delayed frame from first_delayed_frame to
+  // last_delayed_frame, inclusive. Returns false and logs an error, recording
+  // nothing, if any of them has already been requested or is already in the
+  // queue. Called by PutButtons once the frames are known to be past the
+  // initial frame delay.
+  virtual bool InsertButtons(int first_delayed_frame, int last_delayed_frame,
+                             const ButtonsType& buttons) = 0;
+
+  // Returns the lock of a map queue, or null for other backends.
+  virtual const MapQueueLock* map_lock() const { return nullptr; }
+
+  std::atomic<int> delay_frames_;
   const int initial_frame_delay_;
+  // Borrowed reference, may be null.
+  WaitStrategy* wait_strategy_;
+
+ private:
+  // Producer-owned state of delay changes, only accessed by the thread that
+  // puts buttons.
+
+  // Change scheduled by ChangeDelayFrames, or -1 if there is none.
+  int next_change_frame_;
+  int next_delay_frames_;
+  // Set from the time a change takes effect until the delayed frames are
+  // consecutive again.
+  bool changing_delay_;
+  // The latest delayed frame for which buttons were recorded.
+  int latest_frame_put_;
+};
+
+// InputQueue backed by a std::map protected by a mutex.
+template <typename ButtonsType>
+class MapInputQueue : public InputQueue<ButtonsType> {
+ public:
+  typedef typename InputQueue<ButtonsType>::GetButtonsStatus GetButtonsStatus;
+
+  // Uses lock if it is not null, and a lock of its own otherwise.
+  MapInputQueue(int delay_frames, int initial_frame_delay,
+                std::shared_ptr<MapQueueLock> lock = nullptr);
+
+  GetButtonsStatus GetButtons(int frame, int timeout_micros,
+                              ButtonsType* buttons) override;
+  void Close() override;
+  size_t QueueSize() override;
+
+ protected:
+  bool InsertButtons(int first_delayed_frame, int last_delayed_frame,
+                     const ButtonsType& buttons) override;
+  const MapQueueLock* map_lock() const override { return lock_.get(); }
+
+ private:
+  friend class InputQueue<ButtonsType>;
+
+  typedef std::unique_lock<std::mutex> UniqueLock;
+  typedef std::lock_guard<std::mutex> LockGuard;
+  typedef typename InputQueue<ButtonsType>::Microseconds Microseconds;
+  typedef RecyclingAllocator<std::pair<const int, ButtonsType>>
+      FrameButtonsAllocator;
 
   // Mutable state
 
+  // Set by Close().
+  bool closed_;
+
   // The latest frame for which button data has been requested. All attempts to
   // put buttons with frame less than this will fail.
   int latest_frame_requested_;
+  // Nodes of frame_buttons_ that were erased, reused by later insertions so
+  // that the steady state performs no allocations.
+  BlockPool node_pool_;
+
   // Map from frame number to buttons for that frame, sorted in order from least
   // to greatest frame number.
-  std::map<int, ButtonsType> frame_buttons_;
+  std::map<int, ButtonsType, std::less<int>, FrameButtonsAllocator>
+      frame_buttons_;
+  // Set while GetButtons blocks on cv_ with a wait strategy, and the time at
+  // which InsertButtons last notified it, or -1. Used to measure wakeup
+  // latencies.
+  bool consumer_waiting_;
+  int64_t notify_nanos_;
+
+  // These protect closed_, latest_frame_requested_, node_pool_,
+  // frame_buttons_, consumer_waiting_ and notify_nanos_. They belong to lock_,
+  // which may be shared with other queues.
+  const std::shared_ptr<MapQueueLock> lock_;
+  std::mutex& m_;
+  std::condition_variable& cv_;
 
-  // These protect latest_frame_requested_ and frame_buttons_.
-  std::mutex m_;
-  std::condition_variable cv_;
+  // Implements InputQueue::GetFrame for map queues that share a lock.
+  static GetButtonsStatus GetFrameWithSharedLock(
+      InputQueue<ButtonsType>* const* queues, int num_queues, int num_ready,
+      int frame, ButtonsType* const* buttons);
 };
 
+template <typename ButtonsType>
+class RingInputQueue;
+
 #include "input-queue.hpp"
 
 #endif  // INPUT_QUEUE_H
@@ -1,9 +1,12 @@
 // included by input-queue.h
 
+#include <algorithm>
 #include <iostream>
 
 #include "glog/logging.h"
 
+#include "client/ring-input-queue.h"
+
 // -----------------------------------------------------------------------------
 // InputQueue
 
@@ -17,51 +20,191 @@ template <typename ButtonsType>
 InputQueue<ButtonsType>::InputQueue(int delay_frames, int initial_frame_delay)
     : delay_frames_(delay_frames),
       initial_frame_delay_(initial_frame_delay),
-      latest_frame_requested_(-1) {}
+      wait_strategy_(nullptr),
+      next_change_frame_(-1),
+      next_delay_frames_(0),
+      changing_delay_(false),
+      latest_frame_put_(initial_frame_delay - 1) {}
 
 // static
 template <typename ButtonsType>
 InputQueue<ButtonsType>* InputQueue<ButtonsType>::MakeLocalQueue(
-    int delay_frames) {
-  return new InputQueue<ButtonsType>(delay_frames, delay_frames);
+    int delay_frames, InputQueueBackend backend,
+    std::shared_ptr<MapQueueLock> map_lock) {
+  switch (backend) {
+    case InputQueueBackend::RING:
+      return new RingInputQueue<ButtonsType>(delay_frames, delay_frames);
+    case InputQueueBackend::MAP:
+    default:
+      return new MapInputQueue<ButtonsType>(delay_frames, delay_frames,
+                                            std::move(map_lock));
+  }
 }
 
 // static
 template <typename ButtonsType>
 InputQueue<ButtonsType>* InputQueue<ButtonsType>::MakeRemoteQueue(
-    int delay_frames) {
-  return new InputQueue<ButtonsType>(0, delay_frames);
+    int delay_frames, InputQueueBackend backend,
+    std::shared_ptr<MapQueueLock> map_lock) {
+  switch (backend) {
+    case InputQueueBackend::RING:
+      return new RingInputQueue<ButtonsType>(0, delay_frames);
+    case InputQueueBackend::MAP:
+    default:
+      return new MapInputQueue<ButtonsType>(0, delay_frames,
+                                            std::move(map_lock));
+  }
+}
+
+// static
+template <typename ButtonsType>
+typename InputQueue<ButtonsType>::GetButtonsStatus
+InputQueue<ButtonsType>::GetFrame(InputQueue* const* queues, int num_queues,
+                                  int num_ready, int frame,
+                                  ButtonsType* const* buttons) {
+  if (num_queues == 0) {
+    return GetButtonsStatus::SUCCESS;
+  }
+
+  const MapQueueLock* const lock = queues[0]->map_lock();
+  bool shared_lock = lock != nullptr;
+  for (int i = 1; i < num_queues && shared_lock; ++i) {
+    shared_lock = queues[i]->map_lock() == lock;
+  }
+  if (shared_lock) {
+    return MapInputQueue<ButtonsType>::GetFrameWithSharedLock(
+        queues, num_queues, num_ready, frame, buttons);
+  }
+
+  for (int i = 0; i < num_queues; ++i) {
+    const GetButtonsStatus status = queues[i]->GetButtons(
+        frame, i < num_ready ? kReturnImmediately : kBlockForever,
+        buttons[i]);
+    if (status != GetButtonsStatus::SUCCESS) {
+      return status;
+    }
+  }
+  return GetButtonsStatus::SUCCESS;
 }
 
 template <typename ButtonsType>
 bool InputQueue<ButtonsType>::PutButtons(int frame,
                                          const ButtonsType& buttons) {
+  int first_delayed_frame;
+  int num_delayed_frames;
+  return PutButtons(frame, buttons, &first_delayed_frame, &num_delayed_frames);
+}
+
+template <typename ButtonsType>
+bool InputQueue<ButtonsType>::PutButtons(int frame, const ButtonsType& buttons,
+                                         int* first_delayed_frame,
+                                         int* num_delayed_frames) {
   if (frame < 0) {
     LOG(ERROR) << "PutButtons: Attempted to put buttons into invalid frame "
                << frame;
     return false;
   }
 
-  const int delayed_frame = frame + delay_frames_;
+  // Work on copies of the delay state, which only changes once the buttons
+  // are accepted.
+  int delay_frames = delay_frames_.load(std::memory_order_relaxed);
+  bool changing_delay = changing_delay_;
+  const bool change_due = next_change_frame_ >= 0 && frame >= next_change_frame_;
+  if (change_due) {
+    delay_frames = next_delay_frames_;
+    changing_delay = true;
+  }
+
+  const int delayed_frame = frame + delay_frames;
+  int first_frame = delayed_frame;
+  if (changing_delay) {
+    if (delayed_frame <= latest_frame_put_) {
+      // The delay was lowered, and these frames were already recorded at the
+      // old delay.
+      VLOG(3) << "PutButtons: Dropping buttons for frame " << frame
+              << " to lower the delay to " << delay_frames;
+      delay_frames_.store(delay_frames, std::memory_order_relaxed);
+      changing_delay_ = true;
+      if (change_due) {
+        next_change_frame_ = -1;
+      }
+      *first_delayed_frame = delayed_frame;
+      *num_delayed_frames = 0;
+      return true;
+    }
+    // Fill the frames skipped by raising the delay, if any.
+    first_frame = latest_frame_put_ + 1;
+    changing_delay = false;
+  }
 
-  if (delayed_frame < initial_frame_delay_) {
+  if (first_frame < initial_frame_delay_) {
     LOG(ERROR) << "PutButtons: Attempted to put buttons for delayed frame "
-               << delayed_frame
+               << first_frame
                << ", which is less than the initial delay period of "
                << initial_frame_delay_;
     return false;
   }
 
+  if (!InsertButtons(first_frame, delayed_frame, buttons)) {
+    // Error already logged.
+    return false;
+  }
+
+  delay_frames_.store(delay_frames, std::memory_order_relaxed);
+  changing_delay_ = changing_delay;
+  if (change_due) {
+    next_change_frame_ = -1;
+  }
+  latest_frame_put_ = std::max(latest_frame_put_, delayed_frame);
+  *first_delayed_frame = first_frame;
+  *num_delayed_frames = delayed_frame - first_frame + 1;
+  return true;
+}
+
+template <typename ButtonsType>
+bool InputQueue<ButtonsType>::ChangeDelayFrames(int frame, int delay_frames) {
+  if (frame < 0 || delay_frames < 0) {
+    LOG(ERROR) << "ChangeDelayFrames: Invalid change to " << delay_frames
+               << " delay frames at frame " << frame;
+    return false;
+  }
+  next_change_frame_ = frame;
+  next_delay_frames_ = delay_frames;
+  return true;
+}
+
+// -----------------------------------------------------------------------------
+// MapInputQueue
+
+template <typename ButtonsType>
+MapInputQueue<ButtonsType>::MapInputQueue(int delay_frames,
+                                          int initial_frame_delay,
+                                          std::shared_ptr<MapQueueLock> lock)
+    : InputQueue<ButtonsType>(delay_frames, initial_frame_delay),
+      closed_(false),
+      latest_frame_requested_(-1),
+      frame_buttons_(std::less<int>(), FrameButtonsAllocator(&node_pool_)),
+      consumer_waiting_(false),
+      notify_nanos_(-1),
+      lock_(lock != nullptr ? std::move(lock)
+                            : std::make_shared<MapQueueLock>()),
+      m_(lock_->m),
+      cv_(lock_->cv) {}
+
+template <typename ButtonsType>
+bool MapInputQueue<ButtonsType>::InsertButtons(int first_delayed_frame,
+                                               int last_delayed_frame,
+                                               const ButtonsType& buttons) {
   // Implement insertion while holding m_.
   {
     LockGuard guard(m_);
     // We now hold a lock on latest_frame_requested_ and frame_buttons_.
 
     // Reject all button data for frames that we've already read.
-    if (delayed_frame <= latest_frame_requested_) {
+    if (first_delayed_frame <= latest_frame_requested_) {
       LOG(ERROR)
           << "PutButtons: Attempted to put buttons for delayed frame "
-          << delayed_frame
+          << first_delayed_frame
           << ", which has already been requested. The latest frame requested "
              "is "
           << latest_frame_requested_;
@@ -69,15 +212,25 @@ bool InputQueue<ButtonsType>::PutButtons(int frame,
     }
 
     // Reject button data for frames we already have,
-    if (frame_buttons_.find(delayed_frame) != frame_buttons_.end()) {
-      LOG(ERROR) << "PutButtons: Attempted to put duplicate buttons for "
-                    "delayed frame "
-                 << delayed_frame;
-      return false;
+    for (int frame = first_delayed_frame; frame <= last_delayed_frame;
+         ++frame) {
+      if (frame_buttons_.find(frame) != frame_buttons_.end()) {
+        LOG(ERROR) << "PutButtons: Attempted to put duplicate buttons for "
+                      "delayed frame "
+                   << frame;
+        return false;
+      }
     }
 
     // Insert the button data.
-    frame_buttons_.insert({delayed_frame, buttons});
+    for (int frame = first_delayed_frame; frame <= last_delayed_frame;
+         ++frame) {
+      frame_buttons_.insert({frame, buttons});
+    }
+
+    if (consumer_waiting_) {
+      notify_nanos_ = this->wait_strategy_->now_nanos();
+    }
   }
 
   cv_.notify_all();
@@ -86,9 +239,9 @@ bool InputQueue<ButtonsType>::PutButtons(int frame,
 }
 
 template <typename ButtonsType>
-typename InputQueue<ButtonsType>::GetButtonsStatus
-InputQueue<ButtonsType>::GetButtons(int frame, int timeout_micros,
-                                    ButtonsType* buttons) {
+typename MapInputQueue<ButtonsType>::GetButtonsStatus
+MapInputQueue<ButtonsType>::GetButtons(int frame, int timeout_micros,
+                                       ButtonsType* buttons) {
   VLOG(3) << "Requesting buttons for frame " << frame << " with a timeout of "
           << static_cast<double>(timeout_micros) / 1000000 << " seconds";
 
@@ -107,40 +260,167 @@ InputQueue<ButtonsType>::GetButtons(int frame, int timeout_micros,
 
   // If we're requesting buttons from a frame earlier than this queue's delay,
   // emit a default-constructed ButtonsType object.
-  if (frame < initial_frame_delay_) {
+  if (frame < this->initial_frame_delay_) {
     latest_frame_requested_ = frame;
     *buttons = ButtonsType();
     return GetButtonsStatus::SUCCESS;
   }
 
-  // Wait for requested frame to appear.
+  // Wait for requested frame to appear, or for the queue to be closed.
   const auto have_buttons_for_frame = [this, frame] {
     return frame_buttons_.find(frame) != frame_buttons_.end();
   };
-  if (timeout_micros == kBlockForever) {
-    cv_.wait(lock, have_buttons_for_frame);
-  } else {
-    Microseconds timeout(timeout_micros);
-    if (!cv_.wait_for(lock, timeout, have_buttons_for_frame)) {
-      if (timeout_micros > 0) {
-        LOG(ERROR) << "Timed out waiting for buttons. Timeout is "
-                   << static_cast<double>(timeout_micros) / 1000000
-                   << " seconds.";
-      }
-      return GetButtonsStatus::TIMEOUT;
+  const auto can_return = [this, &have_buttons_for_frame] {
+    return closed_ || have_buttons_for_frame();
+  };
+
+  // Let the wait strategy, if any, spin and yield before going to sleep.
+  WaitStrategy* const strategy = this->wait_strategy_;
+  const bool waiting =
+      strategy != nullptr &&
+      timeout_micros != InputQueue<ButtonsType>::kReturnImmediately &&
+      !can_return();
+  WaitPhase phase = WaitPhase::BLOCK;
+  int64_t wait_start_nanos = 0;
+  int remaining_micros = timeout_micros;
+  if (waiting) {
+    lock.unlock();
+    phase = strategy->Poll(
+        [this, &can_return] {
+          LockGuard guard(m_);
+          return can_return();
+        },
+        timeout_micros < 0 ? -1 : static_cast<int64_t>(timeout_micros) * 1000,
+        &wait_start_nanos);
+    lock.lock();
+    if (timeout_micros > 0) {
+      remaining_micros = std::max<int64_t>(
+          0, timeout_micros -
+                 (strategy->now_nanos() - wait_start_nanos) / 1000);
     }
+    consumer_waiting_ = true;
+    notify_nanos_ = -1;
+  }
+
+  bool timed_out = false;
+  if (timeout_micros == InputQueue<ButtonsType>::kBlockForever) {
+    cv_.wait(lock, can_return);
+  } else {
+    Microseconds timeout(remaining_micros);
+    timed_out = !cv_.wait_for(lock, timeout, can_return);
   }
   // We now hold a lock on latest_frame_requested_ and frame_buttons_.
+  consumer_waiting_ = false;
+
+  if (timed_out) {
+    if (timeout_micros > 0) {
+      LOG(ERROR) << "Timed out waiting for buttons. Timeout is "
+                 << static_cast<double>(timeout_micros) / 1000000
+                 << " seconds.";
+    }
+    return GetButtonsStatus::TIMEOUT;
+  }
+
+  if (!have_buttons_for_frame()) {
+    VLOG(3) << "Queue closed while waiting for buttons for frame " << frame;
+    return GetButtonsStatus::CLOSED;
+  }
 
   *buttons = frame_buttons_.find(frame)->second;
   frame_buttons_.erase(frame);
   latest_frame_requested_ = frame;
+  const int64_t notify_nanos = notify_nanos_;
+  lock.unlock();
+
+  if (waiting) {
+    const int64_t now_nanos = strategy->now_nanos();
+    strategy->RecordWait(phase, now_nanos - wait_start_nanos,
+                         phase == WaitPhase::BLOCK && notify_nanos >= 0
+                             ? now_nanos - notify_nanos
+                             : -1);
+  }
 
   return GetButtonsStatus::SUCCESS;
 }
 
+// static
+template <typename ButtonsType>
+typename MapInputQueue<ButtonsType>::GetButtonsStatus
+MapInputQueue<ButtonsType>::GetFrameWithSharedLock(
+    InputQueue<ButtonsType>* const* queues, int num_queues, int num_ready,
+    int frame, ButtonsType* const* buttons) {
+  // InputQueue::GetFrame checked that all the queues are map queues.
+  const auto queue = [queues](int i) {
+    return static_cast<MapInputQueue*>(queues[i]);
+  };
+
+  UniqueLock lock(queue(0)->m_);
+  // We now hold a lock on the state of every queue.
+
+  for (int i = 0; i < num_queues; ++i) {
+    const int expected_frame = queue(i)->latest_frame_requested_ + 1;
+    if (frame != expected_frame) {
+      LOG(ERROR)
+          << "Attempted to get buttons from unexpected frame. Requested frame "
+          << frame << " and expected frame " << expected_frame;
+      return GetButtonsStatus::UNEXPECTED_FRAME;
+    }
+  }
+
+  // Frames earlier than a queue's delay read as default-constructed buttons.
+  const auto has_frame = [&queue, frame](int i) {
+    MapInputQueue* q = queue(i);
+    return frame < q->initial_frame_delay_ ||
+           q->frame_buttons_.find(frame) != q->frame_buttons_.end();
+  };
+  for (int i = 0; i < num_ready; ++i) {
+    if (!has_frame(i)) {
+      return GetButtonsStatus::TIMEOUT;
+    }
+  }
+
+  // Every insertion into any of the queues notifies the shared condition
+  // variable, so a single wait covers all of them.
+  queue(0)->cv_.wait(lock, [&queue, &has_frame, num_ready, num_queues] {
+    for (int i = num_ready; i < num_queues; ++i) {
+      if (!has_frame(i) && !queue(i)->closed_) {
+        return false;
+      }
+    }
+    return true;
+  });
+  for (int i = num_ready; i < num_queues; ++i) {
+    if (!has_frame(i)) {
+      VLOG(3) << "Queue closed while waiting for buttons for frame " << frame;
+      return GetButtonsStatus::CLOSED;
+    }
+  }
+
+  for (int i = 0; i < num_queues; ++i) {
+    MapInputQueue* q = queue(i);
+    if (frame < q->initial_frame_delay_) {
+      *buttons[i] = ButtonsType();
+    } else {
+      auto it = q->frame_buttons_.find(frame);
+      *buttons[i] = it->second;
+      q->frame_buttons_.erase(it);
+    }
+    q->latest_frame_requested_ = frame;
+  }
+  return GetButtonsStatus::SUCCESS;
+}
+
+template <typename ButtonsType>
+void MapInputQueue<ButtonsType>::Close() {
+  {
+    LockGuard guard(m_);
+    closed_ = true;
+  }
+  cv_.notify_all();
+}
+
 template <typename ButtonsType>
-size_t InputQueue<ButtonsType>::QueueSize() {
+size_t MapInputQueue<ButtonsType>::QueueSize() {
   LockGuard lock(m_);
   // We now have a lock on frame_buttons_
   return frame_buttons_.size();
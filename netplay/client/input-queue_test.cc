@@ -212,6 +212,81 @@ TEST_F(InputQueueTest, PutButtonsDuplicateFrame) {
   EXPECT_FALSE(remote_queue_->PutButtons(5, "frame 0"));
 }
 
+TEST_F(InputQueueTest, ChangeDelayFramesRaisesDelay) {
+  ASSERT_TRUE(local_queue_->ChangeDelayFrames(2, kDelayFrames + 2));
+
+  int first_delayed_frame;
+  int num_delayed_frames;
+  for (int frame = 0; frame < 4; ++frame) {
+    stringstream data;
+    data << "frame " << frame;
+    ASSERT_TRUE(local_queue_->PutButtons(frame, data.str(),
+                                         &first_delayed_frame,
+                                         &num_delayed_frames));
+    if (frame == 2) {
+      // Frame 2 fills the frames skipped by the new delay.
+      EXPECT_EQ(7, first_delayed_frame);
+      EXPECT_EQ(3, num_delayed_frames);
+    } else {
+      EXPECT_EQ(frame + local_queue_->delay_frames(), first_delayed_frame);
+      EXPECT_EQ(1, num_delayed_frames);
+    }
+  }
+  EXPECT_EQ(kDelayFrames + 2, local_queue_->delay_frames());
+
+  // Delayed frames stay consecutive.
+  const char* const expected[] = {"frame 0", "frame 1", "frame 2", "frame 2",
+                                  "frame 2", "frame 3"};
+  string frame_data;
+  for (int i = 0; i < 6; ++i) {
+    ASSERT_EQ(StringQueue::GetButtonsStatus::SUCCESS,
+              local_queue_->GetButtons(kDelayFrames + i, 0, &frame_data));
+    EXPECT_EQ(expected[i], frame_data);
+  }
+  EXPECT_EQ(0, local_queue_->QueueSize());
+}
+
+TEST_F(InputQueueTest, ChangeDelayFramesLowersDelay) {
+  ASSERT_TRUE(local_queue_->ChangeDelayFrames(2, kDelayFrames - 2));
+
+  int first_delayed_frame;
+  int num_delayed_frames;
+  for (int frame = 0; frame < 6; ++frame) {
+    stringstream data;
+    data << "frame " << frame;
+    ASSERT_TRUE(local_queue_->PutButtons(frame, data.str(),
+                                         &first_delayed_frame,
+                                         &num_delayed_frames));
+    // Frames 2 and 3 would land on frames that were already recorded.
+    EXPECT_EQ(frame == 2 || frame == 3 ? 0 : 1, num_delayed_frames);
+  }
+  EXPECT_EQ(kDelayFrames - 2, local_queue_->delay_frames());
+
+  // Once the delayed frames caught up, duplicates are rejected again.
+  EXPECT_FALSE(local_queue_->PutButtons(5, "frame 5 again"));
+
+  const char* const expected[] = {"frame 0", "frame 1", "frame 4", "frame 5"};
+  string frame_data;
+  for (int i = 0; i < 4; ++i) {
+    ASSERT_EQ(StringQueue::GetButtonsStatus::SUCCESS,
+              local_queue_->GetButtons(kDelayFrames + i, 0, &frame_data));
+    EXPECT_EQ(expected[i], frame_data);
+  }
+  EXPECT_EQ(0, local_queue_->QueueSize());
+}
+
+TEST_F(InputQueueTest, ChangeDelayFramesInvalid) {
+  EXPECT_FALSE(local_queue_->ChangeDelayFrames(-1, 2));
+  EXPECT_FALSE(local_queue_->ChangeDelayFrames(0, -1));
+
+  // A later change replaces one that has not taken effect.
+  ASSERT_TRUE(local_queue_->ChangeDelayFrames(0, kDelayFrames + 3));
+  ASSERT_TRUE(local_queue_->ChangeDelayFrames(0, kDelayFrames));
+  ASSERT_TRUE(local_queue_->PutButtons(0, "frame 0"));
+  EXPECT_EQ(kDelayFrames, local_queue_->delay_frames());
+  EXPECT_EQ(1, local_queue_->QueueSize());
+}
+
 TEST_F(InputQueueTest, RemoteQueuePutButtonsBeforeInitialDelayTime) {
   std::unique_ptr<StringQueue> queue(
       StringQueue::MakeRemoteQueue(kDelayFrames));
@@ -259,3 +334,180 @@ TEST_F(InputQueueTest, EmptyQueueSize) {
       StringQueue::MakeLocalQueue(kDelayFrames));
   EXPECT_EQ(0, input_queue->QueueSize());
 }
+
+TEST_F(InputQueueTest, GetButtonsAfterClose) {
+  ASSERT_TRUE(remote_queue_->PutButtons(5, "frame 5"));
+  remote_queue_->Close();
+
+  // Frames already in the queue can still be read.
+  string frame_data;
+  ASSERT_EQ(
+      StringQueue::GetButtonsStatus::SUCCESS,
+      remote_queue_->GetButtons(5, StringQueue::kBlockForever, &frame_data));
+  EXPECT_EQ("frame 5", frame_data);
+
+  EXPECT_EQ(
+      StringQueue::GetButtonsStatus::CLOSED,
+      remote_queue_->GetButtons(6, StringQueue::kBlockForever, &frame_data));
+}
+
+TEST_F(InputQueueTest, CloseWakesBlockedGetButtons) {
+  std::thread closer([this] {
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    remote_queue_->Close();
+  });
+
+  string frame_data;
+  EXPECT_EQ(
+      StringQueue::GetButtonsStatus::CLOSED,
+      remote_queue_->GetButtons(5, StringQueue::kBlockForever, &frame_data));
+
+  closer.join();
+}
+
+TEST_F(InputQueueTest, WaitStrategyRecordsHowButtonsWereWaitedFor) {
+  // Spins through the remote wait, and blocks right away on the local one.
+  WaitStrategy spinning(5E9 /* five seconds */, 0);
+  WaitStrategy blocking(0, 0);
+  remote_queue_->set_wait_strategy(&spinning);
+  local_queue_->set_wait_strategy(&blocking);
+
+  std::thread producer([this] {
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    EXPECT_TRUE(remote_queue_->PutButtons(kDelayFrames, "remote"));
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    EXPECT_TRUE(local_queue_->PutButtons(0, "local"));
+  });
+
+  string frame_data;
+  ASSERT_EQ(StringQueue::GetButtonsStatus::SUCCESS,
+            remote_queue_->GetButtons(kDelayFrames, StringQueue::kBlockForever,
+                                      &frame_data));
+  EXPECT_EQ("remote", frame_data);
+  ASSERT_EQ(StringQueue::GetButtonsStatus::SUCCESS,
+            local_queue_->GetButtons(kDelayFrames, StringQueue::kBlockForever,
+                                     &frame_data));
+  EXPECT_EQ("local", frame_data);
+  producer.join();
+
+  WaitStatsPB stats;
+  spinning.GetStats(&stats);
+  EXPECT_EQ(1, stats.phase(static_cast<int>(WaitPhase::SPIN)).waits());
+  blocking.GetStats(&stats);
+  const WaitPhaseStatsPB& block =
+      stats.phase(static_cast<int>(WaitPhase::BLOCK));
+  EXPECT_EQ(1, block.waits());
+  int64_t wakeups = 0;
+  for (const int64_t count : block.wakeup_histogram()) {
+    wakeups += count;
+  }
+  EXPECT_EQ(1, wakeups);
+
+  // Buttons that are already there were not waited for, and waits that time
+  // out are not recorded.
+  ASSERT_TRUE(local_queue_->PutButtons(1, "ready"));
+  ASSERT_EQ(StringQueue::GetButtonsStatus::SUCCESS,
+            local_queue_->GetButtons(kDelayFrames + 1,
+                                     StringQueue::kBlockForever, &frame_data));
+  EXPECT_EQ(StringQueue::GetButtonsStatus::TIMEOUT,
+            remote_queue_->GetButtons(kDelayFrames + 1, 1E6 / 10, &frame_data));
+  EXPECT_EQ(1, spinning.waits());
+  EXPECT_EQ(1, blocking.waits());
+}
+
+TEST_F(InputQueueTest, GetFrameWaitsForAllQueuesSharingALock) {
+  std::shared_ptr<MapQueueLock> lock = std::make_shared<MapQueueLock>();
+  std::unique_ptr<StringQueue> local(
+      StringQueue::MakeLocalQueue(1, InputQueueBackend::MAP, lock));
+  std::unique_ptr<StringQueue> remote_1(
+      StringQueue::MakeRemoteQueue(0, InputQueueBackend::MAP, lock));
+  std::unique_ptr<StringQueue> remote_2(
+      StringQueue::MakeRemoteQueue(0, InputQueueBackend::MAP, lock));
+  StringQueue* queues[] = {local.get(), remote_1.get(), remote_2.get()};
+  string buttons[3] = {"x", "x", "x"};
+  string* buttons_ptrs[] = {&buttons[0], &buttons[1], &buttons[2]};
+
+  // Frames within the delay of a queue are default-constructed.
+  ASSERT_TRUE(remote_1->PutButtons(0, "remote 1"));
+  ASSERT_TRUE(remote_2->PutButtons(0, "remote 2"));
+  ASSERT_EQ(StringQueue::GetButtonsStatus::SUCCESS,
+            StringQueue::GetFrame(queues, 3, 1, 0, buttons_ptrs));
+  EXPECT_EQ("", buttons[0]);
+  EXPECT_EQ("remote 1", buttons[1]);
+  EXPECT_EQ("remote 2", buttons[2]);
+
+  // The remote queues are waited for until both have the frame.
+  ASSERT_TRUE(local->PutButtons(0, "local"));
+  std::thread producer([&remote_1, &remote_2] {
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    EXPECT_TRUE(remote_2->PutButtons(1, "remote 2"));
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    EXPECT_TRUE(remote_1->PutButtons(1, "remote 1"));
+  });
+  ASSERT_EQ(StringQueue::GetButtonsStatus::SUCCESS,
+            StringQueue::GetFrame(queues, 3, 1, 1, buttons_ptrs));
+  producer.join();
+  EXPECT_EQ("local", buttons[0]);
+  EXPECT_EQ("remote 1", buttons[1]);
+  EXPECT_EQ("remote 2", buttons[2]);
+  EXPECT_EQ(0, local->QueueSize());
+  EXPECT_EQ(0, remote_1->QueueSize());
+  EXPECT_EQ(0, remote_2->QueueSize());
+}
+
+TEST_F(InputQueueTest, GetFrameReadsNoQueueIfOneFails) {
+  std::shared_ptr<MapQueueLock> lock = std::make_shared<MapQueueLock>();
+  std::unique_ptr<StringQueue> local(
+      StringQueue::MakeLocalQueue(0, InputQueueBackend::MAP, lock));
+  std::unique_ptr<StringQueue> remote(
+      StringQueue::MakeRemoteQueue(0, InputQueueBackend::MAP, lock));
+  StringQueue* queues[] = {local.get(), remote.get()};
+  string buttons[2];
+  string* buttons_ptrs[] = {&buttons[0], &buttons[1]};
+
+  // A ready queue that is missing the frame fails without waiting.
+  ASSERT_TRUE(remote->PutButtons(0, "remote"));
+  EXPECT_EQ(StringQueue::GetButtonsStatus::TIMEOUT,
+            StringQueue::GetFrame(queues, 2, 1, 0, buttons_ptrs));
+  EXPECT_EQ(1, remote->QueueSize());
+
+  // So does a closed queue that is missing the frame.
+  ASSERT_TRUE(local->PutButtons(0, "local"));
+  ASSERT_TRUE(remote->PutButtons(1, "remote"));
+  std::unique_ptr<StringQueue> closed(
+      StringQueue::MakeRemoteQueue(0, InputQueueBackend::MAP, lock));
+  closed->Close();
+  StringQueue* with_closed[] = {local.get(), closed.get()};
+  EXPECT_EQ(StringQueue::GetButtonsStatus::CLOSED,
+            StringQueue::GetFrame(with_closed, 2, 1, 0, buttons_ptrs));
+  EXPECT_EQ(1, local->QueueSize());
+
+  ASSERT_EQ(StringQueue::GetButtonsStatus::SUCCESS,
+            StringQueue::GetFrame(queues, 2, 1, 0, buttons_ptrs));
+  EXPECT_EQ("local", buttons[0]);
+  EXPECT_EQ("remote", buttons[1]);
+
+  // Frames must still be read in order.
+  EXPECT_EQ(StringQueue::GetButtonsStatus::UNEXPECTED_FRAME,
+            StringQueue::GetFrame(queues, 2, 1, 2, buttons_ptrs));
+}
+
+TEST_F(InputQueueTest, GetFrameReadsOtherQueuesOneAtATime) {
+  std::unique_ptr<StringQueue> map_queue(StringQueue::MakeLocalQueue(0));
+  std::unique_ptr<StringQueue> ring_queue(
+      StringQueue::MakeRemoteQueue(0, InputQueueBackend::RING));
+  StringQueue* queues[] = {map_queue.get(), ring_queue.get()};
+  string buttons[2];
+  string* buttons_ptrs[] = {&buttons[0], &buttons[1]};
+
+  ASSERT_TRUE(map_queue->PutButtons(0, "map"));
+  std::thread producer([&ring_queue] {
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    EXPECT_TRUE(ring_queue->PutButtons(0, "ring"));
+  });
+  ASSERT_EQ(StringQueue::GetButtonsStatus::SUCCESS,
+            StringQueue::GetFrame(queues, 2, 1, 0, buttons_ptrs));
+  producer.join();
+  EXPECT_EQ("map", buttons[0]);
+  EXPECT_EQ("ring", buttons[1]);
+}
@@ -0,0 +1,65 @@
+#include "client/loopback-event-transport.h"
+
+#include "glog/logging.h"
+
+LoopbackEventTransport::LoopbackEventTransport(Peer* peer)
+    : peer_(peer),
+      opened_(false),
+      closed_(false),
+      cancelled_(false) {}
+
+bool LoopbackEventTransport::Open() {
+  std::lock_guard<std::mutex> lock(m_);
+  if (opened_) {
+    LOG(ERROR) << "Loopback transport already open";
+    return false;
+  }
+  opened_ = true;
+  return !cancelled_;
+}
+
+bool LoopbackEventTransport::Write(const OutgoingEventPB& event) {
+  {
+    std::lock_guard<std::mutex> lock(m_);
+    if (!opened_ || cancelled_) {
+      return false;
+    }
+  }
+  // The peer may deliver replies, which takes the lock.
+  if (peer_ != nullptr) {
+    peer_->HandleEvent(event, this);
+  }
+  return true;
+}
+
+bool LoopbackEventTransport::Read(IncomingEventPB* event) {
+  std::unique_lock<std::mutex> lock(m_);
+  if (!opened_) {
+    return false;
+  }
+  cv_.wait(lock,
+           [this] { return cancelled_ || closed_ || !incoming_.empty(); });
+  return !cancelled_ && incoming_.Pop(event);
+}
+
+void LoopbackEventTransport::TryCancel() {
+  std::lock_guard<std::mutex> lock(m_);
+  cancelled_ = true;
+  cv_.notify_all();
+}
+
+bool LoopbackEventTransport::Deliver(IncomingEventPB* event) {
+  std::lock_guard<std::mutex> lock(m_);
+  if (closed_ || cancelled_) {
+    return false;
+  }
+  incoming_.Push(event);
+  cv_.notify_all();
+  return true;
+}
+
+void LoopbackEventTransport::Close() {
+  std::lock_guard<std::mutex> lock(m_);
+  closed_ = true;
+  cv_.notify_all();
+}
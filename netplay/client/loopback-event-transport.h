@@ -0,0 +1,61 @@
+#ifndef LOOPBACK_EVENT_TRANSPORT_H_
+#define LOOPBACK_EVENT_TRANSPORT_H_
+
+#include <condition_variable>
+#include <mutex>
+
+#include "base/netplayServiceProto.pb.h"
+#include "client/event-transport.h"
+#include "client/incoming-event-queue.h"
+
+// In-memory EventTransport whose other end is played by a Peer, such as a fake
+// server in tests and benchmarks. Every written event is handed to the peer on
+// the writing thread, and the events the peer delivers are queued for Read,
+// without allocating once warmed up, see IncomingEventQueue.
+class LoopbackEventTransport : public EventTransport {
+ public:
+  // Plays the other end of a LoopbackEventTransport.
+  class Peer {
+   public:
+    virtual ~Peer() {}
+
+    // Called on the writing thread with every event written to transport.
+    // May reply with any number of events through transport->Deliver.
+    virtual void HandleEvent(const OutgoingEventPB& event,
+                             LoopbackEventTransport* transport) = 0;
+  };
+
+  // peer is a borrowed reference, which must outlive the transport. If peer is
+  // null, written events are dropped.
+  explicit LoopbackEventTransport(Peer* peer);
+
+  bool Open() override;
+  bool Write(const OutgoingEventPB& event) override;
+  bool Read(IncomingEventPB* event) override;
+  void TryCancel() override;
+
+  // Queues *event to be read after the events already queued, and leaves in
+  // *event a cleared message for the caller to reuse. Returns false, queueing
+  // nothing, if the transport was closed or cancelled. May be called from any
+  // thread, including from Peer::HandleEvent.
+  bool Deliver(IncomingEventPB* event);
+
+  // Ends the transport from the other end: Read returns false once the queued
+  // events are read, and further deliveries are refused.
+  void Close();
+
+ private:
+  // Borrowed reference, may be null.
+  Peer* const peer_;
+
+  // m_ protects everything below. cv_ is notified when an event is queued and
+  // when the transport is closed or cancelled.
+  std::mutex m_;
+  std::condition_variable cv_;
+  IncomingEventQueue incoming_;
+  bool opened_;
+  bool closed_;
+  bool cancelled_;
+};
+
+#endif  // LOOPBACK_EVENT_TRANSPORT_H_
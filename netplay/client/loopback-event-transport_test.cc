@@ -0,0 +1,160 @@
+#include "client/loopback-event-transport.h"
+
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace {
+
+// Replies to every key press with the same key press on the next port, and to
+// a ready client with the start of the game.
+class EchoPeer : public LoopbackEventTransport::Peer {
+ public:
+  void HandleEvent(const OutgoingEventPB& event,
+                   LoopbackEventTransport* transport) override {
+    events_.push_back(event);
+    if (event.has_client_ready()) {
+      reply_.mutable_start_game()->set_console_id(
+          event.client_ready().console_id());
+      transport->Deliver(&reply_);
+    }
+    if (event.key_press_size() > 0) {
+      for (const KeyStatePB& key_press : event.key_press()) {
+        KeyStatePB* echo = reply_.add_key_press();
+        *echo = key_press;
+        echo->set_port(static_cast<Port>(key_press.port() + 1));
+      }
+      transport->Deliver(&reply_);
+    }
+  }
+
+  const std::vector<OutgoingEventPB>& events() const { return events_; }
+
+ private:
+  std::vector<OutgoingEventPB> events_;
+  IncomingEventPB reply_;
+};
+
+OutgoingEventPB KeyPressEvent(int frame_number) {
+  OutgoingEventPB event;
+  KeyStatePB* key_press = event.add_key_press();
+  key_press->set_port(PORT_1);
+  key_press->set_frame_number(frame_number);
+  return event;
+}
+
+}  // namespace
+
+TEST(LoopbackEventTransportTest, WriteAndReadFailBeforeOpen) {
+  EchoPeer peer;
+  LoopbackEventTransport transport(&peer);
+
+  IncomingEventPB event;
+  EXPECT_FALSE(transport.Write(KeyPressEvent(0)));
+  EXPECT_FALSE(transport.Read(&event));
+  EXPECT_TRUE(peer.events().empty());
+}
+
+TEST(LoopbackEventTransportTest, OpenTwiceFails) {
+  LoopbackEventTransport transport(nullptr);
+
+  EXPECT_TRUE(transport.Open());
+  EXPECT_FALSE(transport.Open());
+}
+
+TEST(LoopbackEventTransportTest, PeerReceivesWritesAndReplies) {
+  EchoPeer peer;
+  LoopbackEventTransport transport(&peer);
+  ASSERT_TRUE(transport.Open());
+
+  OutgoingEventPB ready;
+  ready.mutable_client_ready()->set_console_id(101);
+  ASSERT_TRUE(transport.Write(ready));
+  ASSERT_TRUE(transport.Write(KeyPressEvent(0)));
+  ASSERT_EQ(2, peer.events().size());
+  EXPECT_TRUE(peer.events()[0].has_client_ready());
+  EXPECT_EQ(1, peer.events()[1].key_press_size());
+
+  IncomingEventPB event;
+  ASSERT_TRUE(transport.Read(&event));
+  EXPECT_EQ(101, event.start_game().console_id());
+  ASSERT_TRUE(transport.Read(&event));
+  EXPECT_FALSE(event.has_start_game());
+  ASSERT_EQ(1, event.key_press_size());
+  EXPECT_EQ(PORT_2, event.key_press(0).port());
+  EXPECT_EQ(0, event.key_press(0).frame_number());
+}
+
+TEST(LoopbackEventTransportTest, ReadsInDeliveryOrder) {
+  EchoPeer peer;
+  LoopbackEventTransport transport(&peer);
+  ASSERT_TRUE(transport.Open());
+
+  // Writes more events than are read, so that the ring grows while events
+  // are queued and again after it has wrapped around.
+  IncomingEventPB event;
+  int next_read = 0;
+  for (int frame_number = 0; frame_number < 20; ++frame_number) {
+    ASSERT_TRUE(transport.Write(KeyPressEvent(frame_number)));
+    if (frame_number % 3 == 2) {
+      ASSERT_TRUE(transport.Read(&event));
+      ASSERT_EQ(1, event.key_press_size());
+      EXPECT_EQ(next_read++, event.key_press(0).frame_number());
+    }
+  }
+  transport.Close();
+  while (transport.Read(&event)) {
+    ASSERT_EQ(1, event.key_press_size());
+    EXPECT_EQ(next_read++, event.key_press(0).frame_number());
+  }
+  EXPECT_EQ(20, next_read);
+}
+
+TEST(LoopbackEventTransportTest, DeliverClearsEvent) {
+  LoopbackEventTransport transport(nullptr);
+  ASSERT_TRUE(transport.Open());
+
+  IncomingEventPB event;
+  event.add_key_press()->set_frame_number(7);
+  ASSERT_TRUE(transport.Deliver(&event));
+  EXPECT_EQ(0, event.key_press_size());
+
+  ASSERT_TRUE(transport.Read(&event));
+  ASSERT_EQ(1, event.key_press_size());
+  EXPECT_EQ(7, event.key_press(0).frame_number());
+}
+
+TEST(LoopbackEventTransportTest, CloseDrainsQueuedEvents) {
+  LoopbackEventTransport transport(nullptr);
+  ASSERT_TRUE(transport.Open());
+
+  IncomingEventPB event;
+  event.mutable_start_game()->set_console_id(101);
+  ASSERT_TRUE(transport.Deliver(&event));
+  transport.Close();
+  event.mutable_start_game()->set_console_id(102);
+  EXPECT_FALSE(transport.Deliver(&event));
+
+  ASSERT_TRUE(transport.Read(&event));
+  EXPECT_EQ(101, event.start_game().console_id());
+  EXPECT_FALSE(transport.Read(&event));
+}
+
+TEST(LoopbackEventTransportTest, TryCancelUnblocksRead) {
+  EchoPeer peer;
+  LoopbackEventTransport transport(&peer);
+  ASSERT_TRUE(transport.Open());
+
+  bool read_result = true;
+  std::thread reader([&transport, &read_result]() {
+    IncomingEventPB event;
+    read_result = transport.Read(&event);
+  });
+  transport.TryCancel();
+  reader.join();
+
+  EXPECT_FALSE(read_result);
+  EXPECT_FALSE(transport.Write(KeyPressEvent(0)));
+  EXPECT_TRUE(peer.events().empty());
+}
@@ -92,6 +92,13 @@ class MockButtonCoder : public ButtonCoderInterface<ButtonsType> {
 					   KeyStatePB *buttons_out));
   MOCK_CONST_METHOD2_T(DecodeButtons, bool(const KeyStatePB &buttons_in,
 					   ButtonsType *buttons_out));
+  MOCK_CONST_METHOD0_T(SupportsPackedButtons, bool());
+  MOCK_CONST_METHOD2_T(EncodePackedButtons,
+                       bool(const ButtonsType &buttons_in,
+                            KeyStatePB *buttons_out));
+  MOCK_CONST_METHOD2_T(DecayButtons,
+                       ButtonsType(const ButtonsType &buttons,
+                                   int frames_ahead));
 };
 
 template <typename ButtonsType>
@@ -109,7 +116,7 @@ class MockNetplayClient : public NetplayClientInterface<ButtonsType> {
   MOCK_CONST_METHOD0_T(local_ports, const std::vector<Port> &());
   MOCK_CONST_METHOD0_T(stub,
 		       std::shared_ptr<NetPlayServerService::StubInterface>());
-  MOCK_METHOD0(mutable_timings, TimingsPB *());
+  MOCK_METHOD0(mutable_trace, TraceRing *());
 };
 
 template <typename ButtonsType>
@@ -123,6 +130,14 @@ class MockEventStreamHandler : public EventStreamHandlerInterface<ButtonsType> {
   MOCK_METHOD3_T(GetButtons,
 		 typename BaseType::GetButtonsStatus(const Port port, int frame,
 						     ButtonsType *buttons));
+  MOCK_METHOD2_T(GetFrame,
+		 typename BaseType::GetButtonsStatus(int frame,
+						     ButtonsType *buttons));
+  MOCK_METHOD4_T(GetSpeculativeButtons,
+		 typename BaseType::GetButtonsStatus(const Port port, int frame,
+						     ButtonsType *buttons,
+						     bool *predicted));
+  MOCK_METHOD0_T(TakeRollbackFrame, int());
   MOCK_METHOD1_T(PutButtons,
 		 typename BaseType::PutButtonsStatus(
 		     const std::vector<typename BaseType::ButtonsFrameTuple>
@@ -131,7 +146,9 @@ class MockEventStreamHandler : public EventStreamHandlerInterface<ButtonsType> {
   MOCK_CONST_METHOD0_T(local_ports, std::set<Port>());
   MOCK_CONST_METHOD0_T(remote_ports, std::set<Port>());
   MOCK_CONST_METHOD1_T(DelayFramesForPort, int(Port port));
-  MOCK_METHOD0_T(mutable_timings, TimingsPB *());
+  MOCK_CONST_METHOD0_T(stream_latency, StreamLatencyPB());
+  MOCK_METHOD0_T(TakePacingNanos, int64_t());
+  MOCK_METHOD0_T(mutable_trace, TraceRing *());
 };
 
 #endif  // MOCKS_H_
@@ -1,5 +1,9 @@
 #include "client/plugins/mupen64/coder.h"
 
+bool operator==(const BUTTONS& lhs, const BUTTONS& rhs) {
+  return lhs.Value == rhs.Value;
+}
+
 bool Mupen64ButtonCoder::EncodeButtons(const BUTTONS& in,
                                        KeyStatePB* out) const {
   out->set_right_d_pad(in.R_DPAD == 1);
@@ -27,8 +31,31 @@ bool Mupen64ButtonCoder::EncodeButtons(const BUTTONS& in,
   return true;
 }
 
+bool Mupen64ButtonCoder::EncodePackedButtons(const BUTTONS& in,
+                                             KeyStatePB* out) const {
+  out->set_packed_buttons(in.Value);
+  return true;
+}
+
+BUTTONS Mupen64ButtonCoder::DecayButtons(const BUTTONS& buttons,
+                                         int frames_ahead) const {
+  BUTTONS decayed = buttons;
+  for (int i = 0; i < frames_ahead && (decayed.X_AXIS || decayed.Y_AXIS); ++i) {
+    decayed.X_AXIS = decayed.X_AXIS / 2;
+    decayed.Y_AXIS = decayed.Y_AXIS / 2;
+  }
+  return decayed;
+}
+
 bool Mupen64ButtonCoder::DecodeButtons(const KeyStatePB& in,
                                        BUTTONS* out) const {
+  // Packed buttons with nothing pressed and centered axes are zero, which is
+  // also what the per-field form decodes to when packed_buttons is unset.
+  if (in.packed_buttons() != 0) {
+    out->Value = in.packed_buttons();
+    return true;
+  }
+
   out->R_DPAD = in.right_d_pad();
   out->L_DPAD = in.left_d_pad();
   out->D_DPAD = in.down_d_pad();
@@ -3,10 +3,23 @@
 #include "base/netplayServiceProto.grpc.pb.h"
 #include "client/button-coder-interface.h"
 
+// Buttons are equal if every button and axis is equal.
+bool operator==(const BUTTONS& lhs, const BUTTONS& rhs);
+
 class Mupen64ButtonCoder : public ButtonCoderInterface<BUTTONS> {
  public:
   bool EncodeButtons(const BUTTONS& buttons_in,
                      KeyStatePB* buttons_out) const override;
   bool DecodeButtons(const KeyStatePB& buttons_in,
                      BUTTONS* buttons_out) const override;
+
+  // The packed form is BUTTONS::Value, which holds every button and axis.
+  bool SupportsPackedButtons() const override { return true; }
+  bool EncodePackedButtons(const BUTTONS& buttons_in,
+                           KeyStatePB* buttons_out) const override;
+
+  // The analog stick springs back to the center, so each axis is halved every
+  // frame, towards zero.
+  BUTTONS DecayButtons(const BUTTONS& buttons,
+                       int frames_ahead) const override;
 };
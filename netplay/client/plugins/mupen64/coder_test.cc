@@ -0,0 +1,87 @@
+#include "client/plugins/mupen64/coder.h"
+
+#include "gtest/gtest.h"
+
+namespace {
+
+// Buttons with a mix of pressed buttons and non-zero axes.
+BUTTONS MakeButtons() {
+  BUTTONS buttons;
+  buttons.Value = 0;
+  buttons.R_DPAD = 1;
+  buttons.START_BUTTON = 1;
+  buttons.L_CBUTTON = 1;
+  buttons.R_TRIG = 1;
+  buttons.X_AXIS = 80;
+  buttons.Y_AXIS = -40;
+  return buttons;
+}
+
+TEST(Mupen64ButtonCoderTest, RoundTrip) {
+  const Mupen64ButtonCoder coder;
+  const BUTTONS in = MakeButtons();
+  KeyStatePB keys;
+  ASSERT_TRUE(coder.EncodeButtons(in, &keys));
+  EXPECT_EQ(0, keys.packed_buttons());
+
+  BUTTONS out;
+  out.Value = 0xffffffff;
+  ASSERT_TRUE(coder.DecodeButtons(keys, &out));
+  EXPECT_EQ(in, out);
+}
+
+TEST(Mupen64ButtonCoderTest, PackedRoundTrip) {
+  const Mupen64ButtonCoder coder;
+  ASSERT_TRUE(coder.SupportsPackedButtons());
+
+  const BUTTONS in = MakeButtons();
+  KeyStatePB keys;
+  ASSERT_TRUE(coder.EncodePackedButtons(in, &keys));
+  EXPECT_EQ(in.Value, keys.packed_buttons());
+  EXPECT_FALSE(keys.start_button());
+
+  BUTTONS out;
+  out.Value = 0xffffffff;
+  ASSERT_TRUE(coder.DecodeButtons(keys, &out));
+  EXPECT_EQ(in, out);
+
+  // The packed form is smaller on the wire.
+  KeyStatePB unpacked;
+  ASSERT_TRUE(coder.EncodeButtons(in, &unpacked));
+  EXPECT_LT(keys.ByteSizeLong(), unpacked.ByteSizeLong());
+}
+
+TEST(Mupen64ButtonCoderTest, PackedNoButtons) {
+  const Mupen64ButtonCoder coder;
+  BUTTONS in;
+  in.Value = 0;
+  KeyStatePB keys;
+  ASSERT_TRUE(coder.EncodePackedButtons(in, &keys));
+
+  BUTTONS out;
+  out.Value = 0xffffffff;
+  ASSERT_TRUE(coder.DecodeButtons(keys, &out));
+  EXPECT_EQ(in, out);
+}
+
+TEST(Mupen64ButtonCoderTest, DecayButtons) {
+  const Mupen64ButtonCoder coder;
+  const BUTTONS in = MakeButtons();
+  EXPECT_EQ(in, coder.DecayButtons(in, 0));
+
+  // Digital buttons stay held while the axes return to the center.
+  BUTTONS out = coder.DecayButtons(in, 2);
+  EXPECT_EQ(1, out.R_DPAD);
+  EXPECT_EQ(1, out.START_BUTTON);
+  EXPECT_EQ(1, out.L_CBUTTON);
+  EXPECT_EQ(1, out.R_TRIG);
+  EXPECT_EQ(20, out.X_AXIS);
+  EXPECT_EQ(-10, out.Y_AXIS);
+
+  out = coder.DecayButtons(in, 10);
+  EXPECT_EQ(0, out.X_AXIS);
+  EXPECT_EQ(0, out.Y_AXIS);
+  EXPECT_EQ(1, out.START_BUTTON);
+}
+
+}  // namespace
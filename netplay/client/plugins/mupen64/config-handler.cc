@@ -1,5 +1,7 @@
 #include "client/plugins/mupen64/config-handler.h"
 
+#include "glog/logging.h"
+
 ConfigHandler::ConfigHandler(m64p_handle config_handle)
     : config_handle_(config_handle) {}
 
@@ -102,11 +104,143 @@ M64Config M64Config::FromConfigHandler(
   // DelayFrames
   config.delay_frames = config_handler.GetInt("DelayFrames");
 
+  // AutoDelayFrames
+  config.auto_delay_frames = config_handler.GetBool("AutoDelayFrames");
+
   // Port*Request
   config.port_1_request = config_handler.GetInt("Port1Request");
   config.port_2_request = config_handler.GetInt("Port2Request");
   config.port_3_request = config_handler.GetInt("Port3Request");
   config.port_4_request = config_handler.GetInt("Port4Request");
 
+  // InputQueueBackend
+  config.input_queue_backend = config_handler.GetInt("InputQueueBackend");
+  if (config.input_queue_backend < 0 || config.input_queue_backend > 1) {
+    LOG(ERROR) << "Invalid InputQueueBackend: " << config.input_queue_backend;
+    return M64Config();
+  }
+
+  // BackgroundReader
+  config.background_reader = config_handler.GetBool("BackgroundReader");
+
+  // AsyncWriteQueueSize
+  config.async_write_queue_size = config_handler.GetInt("AsyncWriteQueueSize");
+  if (config.async_write_queue_size < 0) {
+    LOG(ERROR) << "Invalid AsyncWriteQueueSize: "
+               << config.async_write_queue_size;
+    return M64Config();
+  }
+
+  // RollbackFrames
+  config.rollback_frames = config_handler.GetInt("RollbackFrames");
+  if (config.rollback_frames < 0) {
+    LOG(ERROR) << "Invalid RollbackFrames: " << config.rollback_frames;
+    return M64Config();
+  }
+
+  // PredictionStrategy
+  config.prediction_strategy = config_handler.GetInt("PredictionStrategy");
+  if (config.prediction_strategy < 0 || config.prediction_strategy > 2) {
+    LOG(ERROR) << "Invalid PredictionStrategy: " << config.prediction_strategy;
+    return M64Config();
+  }
+
+  // MeasurePredictions
+  config.measure_predictions = config_handler.GetBool("MeasurePredictions");
+
+  // StreamPingPeriodMillis
+  config.stream_ping_period_millis =
+      config_handler.GetInt("StreamPingPeriodMillis");
+  if (config.stream_ping_period_millis < 0) {
+    LOG(ERROR) << "Invalid StreamPingPeriodMillis: "
+               << config.stream_ping_period_millis;
+    return M64Config();
+  }
+
+  // TimeSyncWindowFrames
+  config.time_sync_window_frames =
+      config_handler.GetInt("TimeSyncWindowFrames");
+  if (config.time_sync_window_frames < 0) {
+    LOG(ERROR) << "Invalid TimeSyncWindowFrames: "
+               << config.time_sync_window_frames;
+    return M64Config();
+  }
+
+  // DelayAdjustWindowFrames
+  config.delay_adjust_window_frames =
+      config_handler.GetInt("DelayAdjustWindowFrames");
+  if (config.delay_adjust_window_frames < 0 ||
+      (config.delay_adjust_window_frames > 0 && config.rollback_frames > 0)) {
+    LOG(ERROR) << "Invalid DelayAdjustWindowFrames: "
+               << config.delay_adjust_window_frames;
+    return M64Config();
+  }
+
+  // WaitMaxSpinMicros
+  config.wait_max_spin_micros = config_handler.GetInt("WaitMaxSpinMicros");
+  if (config.wait_max_spin_micros < 0) {
+    LOG(ERROR) << "Invalid WaitMaxSpinMicros: " << config.wait_max_spin_micros;
+    return M64Config();
+  }
+
+  // WaitYieldMicros
+  config.wait_yield_micros = config_handler.GetInt("WaitYieldMicros");
+  if (config.wait_yield_micros < 0) {
+    LOG(ERROR) << "Invalid WaitYieldMicros: " << config.wait_yield_micros;
+    return M64Config();
+  }
+
+  // CoalesceMaxFrames
+  config.coalesce_max_frames = config_handler.GetInt("CoalesceMaxFrames");
+  if (config.coalesce_max_frames < 0) {
+    LOG(ERROR) << "Invalid CoalesceMaxFrames: " << config.coalesce_max_frames;
+    return M64Config();
+  }
+
+  // CoalesceDeadlineMicros
+  config.coalesce_deadline_micros =
+      config_handler.GetInt("CoalesceDeadlineMicros");
+  if (config.coalesce_deadline_micros < 0) {
+    LOG(ERROR) << "Invalid CoalesceDeadlineMicros: "
+               << config.coalesce_deadline_micros;
+    return M64Config();
+  }
+
+  // RunLengthButtons
+  config.run_length_buttons = config_handler.GetBool("RunLengthButtons");
+
+  // UdpPeers and UdpLocalPort, which older configurations don't have.
+  if (!config_handler.GetString("UdpPeers", &config.udp_peers)) {
+    config.udp_peers = "";
+  }
+  config.udp_local_port = config_handler.GetInt("UdpLocalPort");
+  if (config.udp_local_port < 0 || config.udp_local_port > 65535) {
+    LOG(ERROR) << "Invalid UdpLocalPort: " << config.udp_local_port;
+    return M64Config();
+  }
+
+  // PeerToPeer and PeerFallbackMillis
+  config.peer_to_peer = config_handler.GetBool("PeerToPeer");
+  config.peer_fallback_millis = config_handler.GetInt("PeerFallbackMillis");
+  if (config.peer_fallback_millis < 0) {
+    LOG(ERROR) << "Invalid PeerFallbackMillis: "
+               << config.peer_fallback_millis;
+    return M64Config();
+  }
+
+  // SharedMemory
+  config.shared_memory = config_handler.GetBool("SharedMemory");
+  if (config.shared_memory &&
+      (!config.udp_peers.empty() || config.peer_to_peer)) {
+    LOG(ERROR) << "Invalid SharedMemory: can't be used with UdpPeers or "
+                  "PeerToPeer";
+    return M64Config();
+  }
+
+  // TraceFile, which older configurations don't have.
+  if (!config_handler.GetString("TraceFile", &config.trace_file)) {
+    config.trace_file = "";
+  }
+
   return config;
 }
@@ -69,10 +69,86 @@ struct M64Config {
   int server_port = 9889;
   int console_id = -1;
   int delay_frames = 0;
+  // Measure the round trip time to the server and pick the delay frames from
+  // it, falling back to delay_frames if the server can't be reached. See
+  // NetplayClient::TuneDelayFrames.
+  bool auto_delay_frames = false;
   int port_1_request = -1;
   int port_2_request = -1;
   int port_3_request = -1;
   int port_4_request = -1;
+  // 0: std::map input queues, 1: lock-free ring input queues. See
+  // InputQueueBackend.
+  int input_queue_backend = 0;
+  // Read the event stream on a background thread. See
+  // EventStreamHandlerOptions::background_reader.
+  bool background_reader = false;
+  // Number of outgoing button events to buffer for a background writer, or 0
+  // to write synchronously. See
+  // EventStreamHandlerOptions::async_write_queue_size.
+  int async_write_queue_size = 0;
+  // Number of frames the emulator may run ahead of remote inputs by predicting
+  // them, or 0 for lockstep. See EventStreamHandlerOptions::rollback_frames.
+  int rollback_frames = 0;
+  // How remote buttons are predicted. 0: repeat the latest buttons, 1: hold
+  // the digital buttons and let the stick return to the center, 2: Markov
+  // model. See PredictionStrategy.
+  int prediction_strategy = 0;
+  // Predict remote buttons that are late outside of rollback mode too, to
+  // measure how often the predictions are right. See
+  // EventStreamHandlerOptions::measure_predictions.
+  bool measure_predictions = false;
+  // Period at which button events carry a ping the server echoes, to measure
+  // the round trip time of the event stream, or 0 to not ping. See
+  // EventStreamHandlerOptions::stream_ping_period_millis.
+  int stream_ping_period_millis = 0;
+  // Number of frames over which the frame advantage over the other clients is
+  // averaged to pace the emulator, or 0 to not pace it. See
+  // EventStreamHandlerOptions::time_sync_window_frames.
+  int time_sync_window_frames = 0;
+  // Number of frames over which stalls on each remote port are counted to
+  // raise or lower its delay mid-game, or 0 to keep the delays. Unavailable in
+  // rollback mode. See EventStreamHandlerOptions::delay_adjust_window_frames.
+  int delay_adjust_window_frames = 0;
+  // How long a wait for remote buttons may spin, and then yield, before it
+  // blocks, or 0 to block right away. See
+  // EventStreamHandlerOptions::wait_max_spin_micros.
+  int wait_max_spin_micros = 0;
+  int wait_yield_micros = 0;
+  // Number of frames of local buttons that may be sent in a single message,
+  // as far as the delay allows, and how long the first of them may wait, or 0
+  // for no limit. See EventStreamHandlerOptions::coalesce_max_frames.
+  int coalesce_max_frames = 0;
+  int coalesce_deadline_micros = 0;
+  // Offer to send runs of frames with unchanged buttons as a single key press.
+  // Only used if every player offers it. See
+  // EventStreamHandlerOptions::run_length_buttons.
+  bool run_length_buttons = false;
+  // Comma-separated "host:port" addresses of the other clients of the console,
+  // with which key presses are exchanged over UDP instead of through the
+  // server, or empty to send them through the server unless peer_to_peer.
+  // Every client of the console must list all the others. See
+  // UdpEventTransport.
+  string udp_peers = "";
+  // UDP port on which the key presses of udp_peers are received, or 0 for any
+  // free port.
+  int udp_local_port = 0;
+  // Exchange key presses over UDP with the clients the server lists when the
+  // game starts, rather than with udp_peers, receiving them on
+  // udp_local_port. Only used if every client of the console turns it on.
+  // Key presses go through the server for the rest of the game once a client
+  // has gone peer_fallback_millis without an acknowledgement, or 0 to never
+  // fall back. See UdpEventTransportOptions::peers_from_start_game.
+  bool peer_to_peer = false;
+  int peer_fallback_millis = 0;
+  // Exchange key presses through shared memory with the clients of the
+  // console running on this host. Key presses go through the server instead
+  // unless every client of the console turns it on on this host. Can't be
+  // combined with udp_peers or peer_to_peer. See ShmEventTransport.
+  bool shared_memory = false;
+  // File to which timing events are appended once per second, or empty to
+  // only keep the latest events in memory. See TraceRing::StartFlushThread.
+  string trace_file = "";
 };
 
 #endif  // CLIENT_PLUGINS_MUPEN64_CONFIG_HANDLER_H
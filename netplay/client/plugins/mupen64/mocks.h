@@ -36,6 +36,9 @@ class MockConfigHandler : public ConfigHandlerInterface {
     EXPECT_CALL(*this, GetInt("DelayFrames"))
         .Times(testing::AnyNumber())
         .WillRepeatedly(testing::Return(config.delay_frames));
+    EXPECT_CALL(*this, GetBool("AutoDelayFrames"))
+        .Times(testing::AnyNumber())
+        .WillRepeatedly(testing::Return(config.auto_delay_frames));
     EXPECT_CALL(*this, GetInt("Port1Request"))
         .Times(testing::AnyNumber())
         .WillRepeatedly(testing::Return(config.port_1_request));
@@ -48,6 +51,70 @@ class MockConfigHandler : public ConfigHandlerInterface {
     EXPECT_CALL(*this, GetInt("Port4Request"))
         .Times(testing::AnyNumber())
         .WillRepeatedly(testing::Return(config.port_4_request));
+    EXPECT_CALL(*this, GetInt("InputQueueBackend"))
+        .Times(testing::AnyNumber())
+        .WillRepeatedly(testing::Return(config.input_queue_backend));
+    EXPECT_CALL(*this, GetBool("BackgroundReader"))
+        .Times(testing::AnyNumber())
+        .WillRepeatedly(testing::Return(config.background_reader));
+    EXPECT_CALL(*this, GetInt("AsyncWriteQueueSize"))
+        .Times(testing::AnyNumber())
+        .WillRepeatedly(testing::Return(config.async_write_queue_size));
+    EXPECT_CALL(*this, GetInt("RollbackFrames"))
+        .Times(testing::AnyNumber())
+        .WillRepeatedly(testing::Return(config.rollback_frames));
+    EXPECT_CALL(*this, GetInt("PredictionStrategy"))
+        .Times(testing::AnyNumber())
+        .WillRepeatedly(testing::Return(config.prediction_strategy));
+    EXPECT_CALL(*this, GetBool("MeasurePredictions"))
+        .Times(testing::AnyNumber())
+        .WillRepeatedly(testing::Return(config.measure_predictions));
+    EXPECT_CALL(*this, GetInt("StreamPingPeriodMillis"))
+        .Times(testing::AnyNumber())
+        .WillRepeatedly(testing::Return(config.stream_ping_period_millis));
+    EXPECT_CALL(*this, GetInt("TimeSyncWindowFrames"))
+        .Times(testing::AnyNumber())
+        .WillRepeatedly(testing::Return(config.time_sync_window_frames));
+    EXPECT_CALL(*this, GetInt("DelayAdjustWindowFrames"))
+        .Times(testing::AnyNumber())
+        .WillRepeatedly(testing::Return(config.delay_adjust_window_frames));
+    EXPECT_CALL(*this, GetInt("WaitMaxSpinMicros"))
+        .Times(testing::AnyNumber())
+        .WillRepeatedly(testing::Return(config.wait_max_spin_micros));
+    EXPECT_CALL(*this, GetInt("WaitYieldMicros"))
+        .Times(testing::AnyNumber())
+        .WillRepeatedly(testing::Return(config.wait_yield_micros));
+    EXPECT_CALL(*this, GetInt("CoalesceMaxFrames"))
+        .Times(testing::AnyNumber())
+        .WillRepeatedly(testing::Return(config.coalesce_max_frames));
+    EXPECT_CALL(*this, GetInt("CoalesceDeadlineMicros"))
+        .Times(testing::AnyNumber())
+        .WillRepeatedly(testing::Return(config.coalesce_deadline_micros));
+    EXPECT_CALL(*this, GetBool("RunLengthButtons"))
+        .Times(testing::AnyNumber())
+        .WillRepeatedly(testing::Return(config.run_length_buttons));
+    EXPECT_CALL(*this, GetString("UdpPeers", testing::_))
+        .Times(testing::AnyNumber())
+        .WillRepeatedly(
+            testing::DoAll(testing::SetArgPointee<1>(config.udp_peers),
+                           testing::Return(true)));
+    EXPECT_CALL(*this, GetInt("UdpLocalPort"))
+        .Times(testing::AnyNumber())
+        .WillRepeatedly(testing::Return(config.udp_local_port));
+    EXPECT_CALL(*this, GetBool("PeerToPeer"))
+        .Times(testing::AnyNumber())
+        .WillRepeatedly(testing::Return(config.peer_to_peer));
+    EXPECT_CALL(*this, GetInt("PeerFallbackMillis"))
+        .Times(testing::AnyNumber())
+        .WillRepeatedly(testing::Return(config.peer_fallback_millis));
+    EXPECT_CALL(*this, GetBool("SharedMemory"))
+        .Times(testing::AnyNumber())
+        .WillRepeatedly(testing::Return(config.shared_memory));
+    EXPECT_CALL(*this, GetString("TraceFile", testing::_))
+        .Times(testing::AnyNumber())
+        .WillRepeatedly(
+            testing::DoAll(testing::SetArgPointee<1>(config.trace_file),
+                           testing::Return(true)));
   }
 };
 
@@ -5,10 +5,13 @@
 #include "base/netplayServiceProto.grpc.pb.h"
 #include "client/button-coder-interface.h"
 #include "client/client.h"
+#include "client/grpc-event-transport.h"
 #include "client/plugins/mupen64/coder.h"
 #include "client/plugins/mupen64/config-handler.h"
 #include "client/plugins/mupen64/plugin-impl.h"
 #include "client/plugins/mupen64/osal_dynamiclib.h"
+#include "client/shm-event-transport.h"
+#include "client/udp-event-transport.h"
 
 #include "glog/logging.h"
 #include "grpc++/channel.h"
@@ -91,9 +94,89 @@ EXPORT int CALL InitiateNetplay(NETPLAY_INFO *netplay_info,
       server_addr.str(), grpc::InsecureChannelCredentials());
   std::shared_ptr<NetPlayServerService::StubInterface> stub =
       NetPlayServerService::NewStub(channel);
-  std::unique_ptr<PluginImpl::M64Client> client(new NetplayClient<BUTTONS>(
+
+  EventStreamHandlerOptions handler_options;
+  handler_options.queue_backend =
+      config.input_queue_backend == 1 ? InputQueueBackend::RING
+                                      : InputQueueBackend::MAP;
+  handler_options.background_reader = config.background_reader;
+  handler_options.async_write_queue_size = config.async_write_queue_size;
+  handler_options.prediction_strategy =
+      static_cast<PredictionStrategy>(config.prediction_strategy);
+  handler_options.measure_predictions = config.measure_predictions;
+  handler_options.stream_ping_period_millis = config.stream_ping_period_millis;
+  handler_options.coalesce_max_frames = config.coalesce_max_frames;
+  handler_options.coalesce_deadline_micros = config.coalesce_deadline_micros;
+  handler_options.run_length_buttons = config.run_length_buttons;
+  if (config.rollback_frames > 0) {
+    // Nothing else reads remote buttons while the core runs ahead of them.
+    handler_options.rollback_frames = config.rollback_frames;
+    handler_options.background_reader = true;
+  }
+  if (config.time_sync_window_frames > 0) {
+    // Time sync needs to see remote buttons as soon as they arrive.
+    handler_options.time_sync_window_frames = config.time_sync_window_frames;
+    handler_options.background_reader = true;
+  }
+  if (config.delay_adjust_window_frames > 0) {
+    // So do the stall counts that drive delay changes.
+    handler_options.delay_adjust_window_frames =
+        config.delay_adjust_window_frames;
+    handler_options.background_reader = true;
+  }
+  if (config.wait_max_spin_micros > 0 || config.wait_yield_micros > 0) {
+    // Only the background reader leaves GetKeys waiting on a queue.
+    handler_options.wait_max_spin_micros = config.wait_max_spin_micros;
+    handler_options.wait_yield_micros = config.wait_yield_micros;
+    handler_options.background_reader = true;
+  }
+
+  auto* netplay_client = new NetplayClient<BUTTONS>(
       stub, std::unique_ptr<Mupen64ButtonCoder>(new Mupen64ButtonCoder()),
-      config.delay_frames));
+      config.delay_frames, handler_options);
+  if (!config.udp_peers.empty() || config.peer_to_peer) {
+    // Key presses go straight to the other clients, everything else still
+    // goes through the server, which also tells the clients where the others
+    // are in peer to peer mode.
+    UdpEventTransportOptions udp_options;
+    udp_options.local_port = config.udp_local_port;
+    udp_options.peers_from_start_game = config.peer_to_peer;
+    udp_options.fallback_after_millis = config.peer_fallback_millis;
+    std::stringstream peers(config.udp_peers);
+    std::string peer;
+    while (std::getline(peers, peer, ',')) {
+      if (!peer.empty()) {
+        udp_options.peers.push_back(peer);
+      }
+    }
+    netplay_client->set_transport_factory([stub, udp_options]() {
+      return std::unique_ptr<EventTransport>(new UdpEventTransport(
+          std::unique_ptr<EventTransport>(new GrpcEventTransport(stub)),
+          udp_options));
+    });
+  } else if (config.shared_memory) {
+    // Key presses go through shared memory to the clients on this host,
+    // everything else still goes through the server. Transports are made
+    // once the controllers are plugged in, so the ports are known by then.
+    netplay_client->set_transport_factory([stub, netplay_client]() {
+      ShmEventTransportOptions shm_options;
+      shm_options.local_ports = netplay_client->local_ports();
+      return std::unique_ptr<EventTransport>(new ShmEventTransport(
+          std::unique_ptr<EventTransport>(new GrpcEventTransport(stub)),
+          shm_options));
+    });
+  }
+  std::unique_ptr<PluginImpl::M64Client> client(netplay_client);
+  if (!config.trace_file.empty() &&
+      !client->mutable_trace()->StartFlushThread(config.trace_file, 1000)) {
+    // Tracing is optional, so carry on without it.
+    LOG(ERROR) << "Failed to start writing timings to " << config.trace_file;
+  }
+  if (config.auto_delay_frames) {
+    // Must happen before PluginImpl plugs in the controllers. On failure, the
+    // configured delay is kept.
+    netplay_client->TuneDelayFrames();
+  }
 
   l_PluginImpl.reset(new PluginImpl(config_handler.release(), &std::cin,
                                     &std::cout, std::move(client)));
@@ -135,6 +218,47 @@ int CALL GetKeys(m64p_netplay_frame_update *update) {
   return l_PluginImpl->GetButtons(update);
 }
 
+// -----------------------------------------------------------------------------
+// GetKeysFrame
+
+EXPORT
+int CALL GetKeysFrame(int frame, BUTTONS *buttons) {
+  VLOG(3) << "Calling GetKeysFrame";
+
+  return l_PluginImpl->GetFrame(frame, buttons);
+}
+
+// -----------------------------------------------------------------------------
+// GetRollbackWindow
+
+EXPORT
+int CALL GetRollbackWindow(void) {
+  VLOG(3) << "Calling GetRollbackWindow";
+
+  return l_PluginImpl->GetRollbackWindow();
+}
+
+// -----------------------------------------------------------------------------
+// GetKeysSpeculative
+
+EXPORT
+int CALL GetKeysSpeculative(m64p_netplay_frame_update *update,
+                            int *predicted) {
+  VLOG(3) << "Calling GetKeysSpeculative";
+
+  return l_PluginImpl->GetSpeculativeButtons(update, predicted);
+}
+
+// -----------------------------------------------------------------------------
+// GetRollbackFrame
+
+EXPORT
+int CALL GetRollbackFrame(void) {
+  VLOG(3) << "Calling GetRollbackFrame";
+
+  return l_PluginImpl->GetRollbackFrame();
+}
+
 // -----------------------------------------------------------------------------
 // PluginShutdown
 
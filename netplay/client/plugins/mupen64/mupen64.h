@@ -11,7 +11,7 @@
 extern "C" {
 
 #define MESSAGE_BUFFER_SIZE 2048
-#define NETPLAY_API_VERSION 0x20000
+#define NETPLAY_API_VERSION 0x20100
 
 // -----------------------------------------------------------------------------
 // Global functions
@@ -52,6 +52,27 @@ int CALL PutKeys(const m64p_netplay_frame_update *updates, int nupdates);
 EXPORT
 int CALL GetKeys(m64p_netplay_frame_update *update);
 
+// Retrieves the buttons of all four controllers for frame at once, placing
+// those of controller i into buttons[i]. Cheaper than calling GetKeys once per
+// controller. Must not be called in rollback mode.
+EXPORT
+int CALL GetKeysFrame(int frame, BUTTONS *buttons);
+
+// Rollback support. GetRollbackWindow returns the number of frames the core may
+// run ahead of remote inputs, or 0 if rollback is disabled, in which case the
+// other rollback methods must not be called and GetKeys must be used instead.
+// GetKeysSpeculative is like GetKeys, except that it predicts buttons that have
+// not arrived yet and sets *predicted to 1 when it does. GetRollbackFrame
+// returns the earliest frame whose predicted buttons were wrong, or -1. The
+// core must then load its savestate from before that frame and simulate
+// forward again, calling GetKeysSpeculative for each frame.
+EXPORT
+int CALL GetRollbackWindow(void);
+EXPORT
+int CALL GetKeysSpeculative(m64p_netplay_frame_update *update, int *predicted);
+EXPORT
+int CALL GetRollbackFrame(void);
+
 // Does nothing, only exists to satisfy the Python frontend.
 EXPORT m64p_error PluginShutdown();
 
@@ -1,7 +1,9 @@
 #include "client/plugins/mupen64/plugin-impl.h"
 
+#include <chrono>
 #include <map>
 #include <set>
+#include <thread>
 #include <vector>
 
 #include "base/netplayServiceProto.pb.h"
@@ -109,6 +111,9 @@ int PluginImpl::InitiateNetplay(NETPLAY_INFO* netplay_info,
     return 0;
   }
 
+  rollback_frames_ = configuration.rollback_frames;
+  time_sync_ = configuration.time_sync_window_frames > 0;
+
   return 1;
 }
 
@@ -117,7 +122,17 @@ int PluginImpl::InitiateNetplay(NETPLAY_INFO* netplay_info,
 
 int PluginImpl::PutButtons(const m64p_netplay_frame_update* updates,
                            int nupdates) {
-  vector<M64StreamHandler::ButtonsFrameTuple> button_frames_tuples;
+  // The core puts the local buttons once per frame, before emulating it, so
+  // this stretches the frame.
+  if (time_sync_) {
+    const int64_t pacing_nanos = stream_handler_->TakePacingNanos();
+    if (pacing_nanos > 0) {
+      VLOG(3) << "Pacing the emulator by " << pacing_nanos << " ns";
+      std::this_thread::sleep_for(std::chrono::nanoseconds(pacing_nanos));
+    }
+  }
+
+  button_frames_tuples_.clear();
 
   for (int i = 0; i < nupdates; ++i) {
     const Port port = util::M64PortToPort(updates[i].port);
@@ -129,12 +144,12 @@ int PluginImpl::PutButtons(const m64p_netplay_frame_update* updates,
 
     VLOG(3) << "Adding buttons for port " << Port_Name(port) << " and frame "
             << updates[i].frame;
-    button_frames_tuples.push_back(
+    button_frames_tuples_.push_back(
         std::make_tuple(port, updates[i].frame, *updates[i].buttons));
   }
 
   M64StreamHandler::PutButtonsStatus status =
-      stream_handler_->PutButtons(button_frames_tuples);
+      stream_handler_->PutButtons(button_frames_tuples_);
   if (status != M64StreamHandler::PutButtonsStatus::SUCCESS) {
     LOG(ERROR) << "Failed to put buttons into the client.";
     return false;
@@ -167,6 +182,55 @@ int PluginImpl::GetButtons(m64p_netplay_frame_update* update) {
   return true;
 }
 
+int PluginImpl::GetFrame(int frame, BUTTONS* buttons) {
+  VLOG(3) << "Requesting buttons of all ports for frame " << frame;
+
+  // The handler places the buttons of PORT_1 + i into buttons[i], which is
+  // also the index of the controller the port is played on.
+  M64StreamHandler::GetButtonsStatus status =
+      stream_handler_->GetFrame(frame, buttons);
+  if (status != M64StreamHandler::GetButtonsStatus::SUCCESS) {
+    LOG(ERROR) << "Failed to get buttons for frame " << frame
+               << " from stream";
+    return false;
+  }
+
+  return true;
+}
+
+// -----------------------------------------------------------------------------
+// Rollback
+
+int PluginImpl::GetSpeculativeButtons(m64p_netplay_frame_update* update,
+                                      int* predicted) {
+  const Port port = util::M64PortToPort(update->port);
+  if (port == UNKNOWN) {
+    LOG(ERROR) << "Called GetSpeculativeButtons on invalid port "
+               << update->port;
+    return false;
+  }
+
+  VLOG(3) << "Requesting speculative buttons for port " << Port_Name(port)
+          << " and frame " << update->frame;
+
+  bool is_predicted = false;
+  M64StreamHandler::GetButtonsStatus status =
+      stream_handler_->GetSpeculativeButtons(port, update->frame,
+                                             update->buttons, &is_predicted);
+  if (status != M64StreamHandler::GetButtonsStatus::SUCCESS) {
+    LOG(ERROR) << "Failed to get speculative buttons for port "
+               << Port_Name(port) << " and frame " << update->frame;
+    return false;
+  }
+
+  *predicted = is_predicted ? 1 : 0;
+  return true;
+}
+
+int PluginImpl::GetRollbackFrame() {
+  return stream_handler_->TakeRollbackFrame();
+}
+
 // -----------------------------------------------------------------------------
 // Helper Methods
 
@@ -21,7 +21,9 @@ class PluginImpl {
       : config_handler_(config_handler),
         cin_(*CHECK_NOTNULL(cin)),
         cout_(*CHECK_NOTNULL(cout)),
-        client_(std::move(client)) {}
+        client_(std::move(client)),
+        rollback_frames_(0),
+        time_sync_(false) {}
 
   // ---------------------------------------------------------------------------
   // mupen64plus-core API method implementations
@@ -32,13 +34,32 @@ class PluginImpl {
                       const char md5[33]);
 
   // Places local buttons into the respective queue and transmits them over the 
-  // network.
+  // network. If time sync is enabled, first sleeps for as long as the stream
+  // handler says the emulator is running ahead of the other clients.
   int PutButtons(const m64p_netplay_frame_update *updates, int nupdates);
 
   // Fetches the buttons from the stream and places them into the update's 
   // *value field.
   int GetButtons(m64p_netplay_frame_update* update);
 
+  // Fetches the buttons of all four controllers for frame in one call, and
+  // places those of controller i into buttons[i]. Controllers that are not
+  // played over netplay are cleared. Unavailable in rollback mode.
+  int GetFrame(int frame, BUTTONS* buttons);
+
+  // Rollback mode. Returns the number of frames by which the core may run
+  // ahead of the remote buttons, or 0 if rollback is disabled.
+  int GetRollbackWindow() const { return rollback_frames_; }
+
+  // Rollback mode. Like GetButtons, except that buttons which have not yet
+  // arrived are predicted instead of waited for. Sets *predicted to 1 if the
+  // buttons placed into the update's *value field are a prediction.
+  int GetSpeculativeButtons(m64p_netplay_frame_update* update, int* predicted);
+
+  // Rollback mode. Returns the earliest frame that must be simulated again
+  // because its buttons were mispredicted, or -1.
+  int GetRollbackFrame();
+
  private:
   typedef EventStreamHandlerInterface<BUTTONS> M64StreamHandler;
 
@@ -59,6 +80,12 @@ class PluginImpl {
 
   // Populated by InitializeNetplay.
   unique_ptr<EventStreamHandlerInterface<BUTTONS>> stream_handler_;
+  int rollback_frames_;
+  bool time_sync_;
+
+  // Buttons passed to the stream handler by PutButtons, kept across calls so
+  // that their storage is reused.
+  std::vector<M64StreamHandler::ButtonsFrameTuple> button_frames_tuples_;
 };
 
 #endif  // CLIENT_PLUGINS_MUPEN64_PLUGIN_IMPL_H_
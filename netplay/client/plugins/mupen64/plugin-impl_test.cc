@@ -1,8 +1,10 @@
 #include "client/plugins/mupen64/plugin-impl.h"
 
+#include <chrono>
 #include <set>
 
 #include "client/mocks.h"
+#include "client/plugins/mupen64/coder.h"
 #include "client/plugins/mupen64/mocks.h"
 #include "client/plugins/mupen64/util.h"
 #include "gmock/gmock.h"
@@ -15,6 +17,8 @@ using testing::_;
 using testing::AtMost;
 using testing::Contains;
 using testing::DoAll;
+using testing::InSequence;
+using testing::Invoke;
 using testing::Return;
 using testing::SetArgPointee;
 using testing::StrictMock;
@@ -28,7 +32,8 @@ class PluginImplTest : public testing::Test {
   typedef StrictMock<MockNetplayClient<BUTTONS>> StrictMockClient;
 
   PluginImplTest()
-      : default_local_ports_({PORT_1, PORT_4}),
+      : time_sync_window_frames_(0),
+        default_local_ports_({PORT_1, PORT_4}),
         default_remote_ports_({PORT_2}) {}
 
   void Init(Port port_1_request, Port port_2_request, Port port_3_request,
@@ -46,6 +51,7 @@ class PluginImplTest : public testing::Test {
     config.port_2_request = util::PortToM64RequestedInt(port_2_request);
     config.port_3_request = util::PortToM64RequestedInt(port_3_request);
     config.port_4_request = util::PortToM64RequestedInt(port_4_request);
+    config.time_sync_window_frames = time_sync_window_frames_;
     mock_config_handler_->ExpectConfig(config);
 
     mock_client_ = new StrictMockClient();
@@ -213,6 +219,9 @@ class PluginImplTest : public testing::Test {
 
   set<int> input_channels_;
 
+  // Configuration set by tests before calling Init.
+  int time_sync_window_frames_;
+
   // Default configuration.
   const set<Port> default_local_ports_, default_remote_ports_;
 };
@@ -484,6 +493,31 @@ TEST_F(PluginImplTest, PutButtonsSuccess) {
   EXPECT_TRUE(plugin_impl_->PutButtons(updates, 3));
 }
 
+TEST_F(PluginImplTest, PutButtonsPacesEmulator) {
+  time_sync_window_frames_ = 30;
+  InitDefault();
+  InitiateNetplayDefault();
+
+  BUTTONS b1 = {1};
+  m64p_netplay_frame_update updates[1]{{.port = 0,  // PORT_1
+                                        .frame = 10,
+                                        .buttons = &b1}};
+
+  {
+    InSequence sequence;
+    EXPECT_CALL(*mock_stream_handler_, TakePacingNanos())
+        .WillOnce(Return(2 * 1000 * 1000));
+    EXPECT_CALL(*mock_stream_handler_, PutButtons(_))
+        .WillOnce(Return(
+            EventStreamHandlerInterface<BUTTONS>::PutButtonsStatus::SUCCESS));
+  }
+
+  const auto start = std::chrono::steady_clock::now();
+  EXPECT_TRUE(plugin_impl_->PutButtons(updates, 1));
+  EXPECT_GE(std::chrono::steady_clock::now() - start,
+            std::chrono::milliseconds(2));
+}
+
 TEST_F(PluginImplTest, PutButtonsInvalidPort) {
   InitDefault();
   InitiateNetplayDefault();
@@ -533,10 +567,6 @@ TEST_F(PluginImplTest, PutButtonsFailedToPutButtons) {
 // -----------------------------------------------------------------------------
 // GetButtons
 
-bool operator==(const BUTTONS& b1, const BUTTONS& b2) {
-  return b1.Value == b2.Value;
-}
-
 TEST_F(PluginImplTest, GetButtonsSuccess) {
   InitDefault();
   InitiateNetplayDefault();
@@ -583,3 +613,91 @@ TEST_F(PluginImplTest, GetButtonsStreamGetButtonsFails) {
 
   EXPECT_FALSE(plugin_impl_->GetButtons(&update));
 }
+
+TEST_F(PluginImplTest, GetFrameSuccess) {
+  InitDefault();
+  InitiateNetplayDefault();
+
+  BUTTONS buttons[4] = {};
+  EXPECT_CALL(*mock_stream_handler_, GetFrame(11, buttons))
+      .WillOnce(Invoke([](int /* frame */, BUTTONS* buttons) {
+        buttons[1].Value = 100;
+        buttons[2].Value = 200;
+        return EventStreamHandler<BUTTONS>::GetButtonsStatus::SUCCESS;
+      }));
+
+  ASSERT_TRUE(plugin_impl_->GetFrame(11, buttons));
+
+  EXPECT_EQ(0, buttons[0].Value);
+  EXPECT_EQ(100, buttons[1].Value);
+  EXPECT_EQ(200, buttons[2].Value);
+  EXPECT_EQ(0, buttons[3].Value);
+}
+
+TEST_F(PluginImplTest, GetFrameFails) {
+  InitDefault();
+  InitiateNetplayDefault();
+
+  BUTTONS buttons[4] = {};
+  EXPECT_CALL(*mock_stream_handler_, GetFrame(11, buttons))
+      .WillOnce(Return(EventStreamHandler<BUTTONS>::GetButtonsStatus::FAILURE));
+
+  EXPECT_FALSE(plugin_impl_->GetFrame(11, buttons));
+}
+
+// -----------------------------------------------------------------------------
+// Rollback
+
+TEST_F(PluginImplTest, GetSpeculativeButtonsSuccess) {
+  InitDefault();
+  InitiateNetplayDefault();
+
+  EXPECT_EQ(0, plugin_impl_->GetRollbackWindow());
+
+  BUTTONS buttons = {0};
+  m64p_netplay_frame_update update = {
+      .port = 1, .frame = 11, .buttons = &buttons};
+
+  BUTTONS expected_buttons = {.Value = 100};
+  EXPECT_CALL(*mock_stream_handler_,
+              GetSpeculativeButtons(PORT_2, 11, &buttons, _))
+      .WillOnce(DoAll(
+          SetArgPointee<2>(expected_buttons), SetArgPointee<3>(true),
+          Return(EventStreamHandler<BUTTONS>::GetButtonsStatus::SUCCESS)));
+
+  int predicted = 0;
+  ASSERT_TRUE(plugin_impl_->GetSpeculativeButtons(&update, &predicted));
+  EXPECT_EQ(1, predicted);
+  EXPECT_EQ(expected_buttons, *update.buttons);
+}
+
+TEST_F(PluginImplTest, GetSpeculativeButtonsFails) {
+  InitDefault();
+  InitiateNetplayDefault();
+
+  BUTTONS buttons = {0};
+  m64p_netplay_frame_update update = {
+      .port = 1, .frame = 11, .buttons = &buttons};
+
+  EXPECT_CALL(*mock_stream_handler_,
+              GetSpeculativeButtons(PORT_2, 11, &buttons, _))
+      .WillOnce(Return(EventStreamHandler<BUTTONS>::GetButtonsStatus::FAILURE));
+
+  int predicted = 0;
+  EXPECT_FALSE(plugin_impl_->GetSpeculativeButtons(&update, &predicted));
+
+  update.port = -1;
+  EXPECT_FALSE(plugin_impl_->GetSpeculativeButtons(&update, &predicted));
+}
+
+TEST_F(PluginImplTest, GetRollbackFrame) {
+  InitDefault();
+  InitiateNetplayDefault();
+
+  EXPECT_CALL(*mock_stream_handler_, TakeRollbackFrame())
+      .WillOnce(Return(7))
+      .WillOnce(Return(-1));
+
+  EXPECT_EQ(7, plugin_impl_->GetRollbackFrame());
+  EXPECT_EQ(-1, plugin_impl_->GetRollbackFrame());
+}
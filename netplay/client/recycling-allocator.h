@@ -0,0 +1,109 @@
+#ifndef RECYCLING_ALLOCATOR_H_
+#define RECYCLING_ALLOCATOR_H_
+
+#include <algorithm>
+#include <cstddef>
+#include <new>
+
+// Pool of memory blocks of a single size, the size of the first block
+// allocated from it. Blocks given back to the pool are kept on a free list and
+// handed out again instead of being freed, so that once a container using the
+// pool has grown to its working size, it stops allocating. Blocks of any other
+// size go straight to operator new and delete. Not thread safe.
+class BlockPool {
+ public:
+  BlockPool() : block_size_(0), free_blocks_(nullptr) {}
+
+  ~BlockPool() {
+    while (free_blocks_ != nullptr) {
+      FreeBlock* block = free_blocks_;
+      free_blocks_ = block->next;
+      ::operator delete(block);
+    }
+  }
+
+  BlockPool(const BlockPool&) = delete;
+  BlockPool& operator=(const BlockPool&) = delete;
+
+  void* Allocate(std::size_t size) {
+    size = std::max(size, sizeof(FreeBlock));
+    if (block_size_ == 0) {
+      block_size_ = size;
+    }
+    if (size == block_size_ && free_blocks_ != nullptr) {
+      FreeBlock* block = free_blocks_;
+      free_blocks_ = block->next;
+      return block;
+    }
+    return ::operator new(size);
+  }
+
+  void Deallocate(void* ptr, std::size_t size) {
+    if (std::max(size, sizeof(FreeBlock)) != block_size_) {
+      ::operator delete(ptr);
+      return;
+    }
+    FreeBlock* block = static_cast<FreeBlock*>(ptr);
+    block->next = free_blocks_;
+    free_blocks_ = block;
+  }
+
+ private:
+  struct FreeBlock {
+    FreeBlock* next;
+  };
+
+  std::size_t block_size_;
+  FreeBlock* free_blocks_;
+};
+
+// Allocator for node-based containers, such as std::map, that recycles single
+// nodes through a BlockPool. The pool is a borrowed reference, which must
+// outlive every container using it, and is shared by all copies and rebinds of
+// the allocator. Containers sharing a pool must be accessed under the same
+// lock.
+template <typename T>
+class RecyclingAllocator {
+ public:
+  typedef T value_type;
+
+  explicit RecyclingAllocator(BlockPool* pool) : pool_(pool) {}
+
+  template <typename U>
+  RecyclingAllocator(const RecyclingAllocator<U>& other)
+      : pool_(other.pool()) {}
+
+  T* allocate(std::size_t n) {
+    if (n == 1) {
+      return static_cast<T*>(pool_->Allocate(sizeof(T)));
+    }
+    return static_cast<T*>(::operator new(n * sizeof(T)));
+  }
+
+  void deallocate(T* ptr, std::size_t n) {
+    if (n == 1) {
+      pool_->Deallocate(ptr, sizeof(T));
+      return;
+    }
+    ::operator delete(ptr);
+  }
+
+  BlockPool* pool() const { return pool_; }
+
+ private:
+  BlockPool* pool_;
+};
+
+template <typename T, typename U>
+bool operator==(const RecyclingAllocator<T>& a,
+                const RecyclingAllocator<U>& b) {
+  return a.pool() == b.pool();
+}
+
+template <typename T, typename U>
+bool operator!=(const RecyclingAllocator<T>& a,
+                const RecyclingAllocator<U>& b) {
+  return !(a == b);
+}
+
+#endif  // RECYCLING_ALLOCATOR_H_
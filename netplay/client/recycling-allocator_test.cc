@@ -0,0 +1,68 @@
+#include "client/recycling-allocator.h"
+
+#include <functional>
+#include <map>
+#include <utility>
+
+#include "gtest/gtest.h"
+
+namespace {
+
+typedef RecyclingAllocator<std::pair<const int, int>> IntMapAllocator;
+typedef std::map<int, int, std::less<int>, IntMapAllocator> IntMap;
+
+}  // namespace
+
+TEST(RecyclingAllocatorTest, ReusesBlocks) {
+  BlockPool pool;
+  void* first = pool.Allocate(24);
+  void* second = pool.Allocate(24);
+  EXPECT_NE(first, second);
+
+  pool.Deallocate(first, 24);
+  EXPECT_EQ(first, pool.Allocate(24));
+
+  pool.Deallocate(second, 24);
+  pool.Deallocate(first, 24);
+  EXPECT_EQ(first, pool.Allocate(24));
+  EXPECT_EQ(second, pool.Allocate(24));
+  pool.Deallocate(first, 24);
+  pool.Deallocate(second, 24);
+}
+
+TEST(RecyclingAllocatorTest, OtherSizesAreNotPooled) {
+  BlockPool pool;
+  void* block = pool.Allocate(24);
+  pool.Deallocate(block, 24);
+
+  void* larger = pool.Allocate(48);
+  EXPECT_NE(block, larger);
+  pool.Deallocate(larger, 48);
+  EXPECT_EQ(block, pool.Allocate(24));
+  pool.Deallocate(block, 24);
+}
+
+TEST(RecyclingAllocatorTest, MapReusesErasedNodes) {
+  BlockPool pool;
+  IntMap map{std::less<int>(), IntMapAllocator(&pool)};
+
+  map[1] = 10;
+  const int* first_value = &map[1];
+  map.erase(1);
+
+  map[2] = 20;
+  EXPECT_EQ(first_value, &map[2]);
+  EXPECT_EQ(20, map[2]);
+  EXPECT_EQ(1u, map.size());
+}
+
+TEST(RecyclingAllocatorTest, RebindsShareThePool) {
+  BlockPool pool;
+  IntMapAllocator allocator(&pool);
+  RecyclingAllocator<double> rebound(allocator);
+  EXPECT_EQ(&pool, rebound.pool());
+  EXPECT_TRUE(allocator == rebound);
+
+  BlockPool other_pool;
+  EXPECT_TRUE(allocator != IntMapAllocator(&other_pool));
+}
@@ -0,0 +1,109 @@
+#ifndef RING_INPUT_QUEUE_H_
+#define RING_INPUT_QUEUE_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+
+#include "client/input-queue.h"
+
+// InputQueue backed by a fixed-capacity single-producer/single-consumer ring.
+// The buttons for delayed frame f live in slot (f & mask), and every slot is
+// tagged with the frame it currently holds. PutButtons publishes a slot by
+// storing its tag, and GetButtons consumes it by advancing the latest requested
+// frame, so the steady state performs no allocations and takes no locks. The
+// mutex and condition variable are only touched when GetButtons has to block
+// for a frame that has not arrived yet.
+//
+// At most one thread may call PutButtons and at most one thread may call
+// GetButtons at any given time. On top of the InputQueue contract, PutButtons
+// rejects frames more than capacity() frames past the latest requested frame.
+template <typename ButtonsType>
+class RingInputQueue : public InputQueue<ButtonsType> {
+ public:
+  typedef typename InputQueue<ButtonsType>::GetButtonsStatus GetButtonsStatus;
+
+  // Roughly four seconds of input at 60 frames per second.
+  static const int kDefaultCapacity;
+
+  // Constructs a ring with the given number of slots. std::abort's if
+  // capacity is not a positive power of two.
+  RingInputQueue(int delay_frames, int initial_frame_delay,
+                 int capacity = kDefaultCapacity);
+
+  GetButtonsStatus GetButtons(int frame, int timeout_micros,
+                              ButtonsType* buttons) override;
+  void Close() override;
+  size_t QueueSize() override;
+
+  int capacity() const { return mask_ + 1; }
+
+ protected:
+  bool InsertButtons(int first_delayed_frame, int last_delayed_frame,
+                     const ButtonsType& buttons) override;
+
+ private:
+  typedef std::unique_lock<std::mutex> UniqueLock;
+  typedef std::lock_guard<std::mutex> LockGuard;
+  typedef typename InputQueue<ButtonsType>::Microseconds Microseconds;
+
+  static const int kCacheLineSize = 64;
+  static const int kEmptySlot = -1;
+
+  // Aligned to a cache line, which also pads it to a whole number of lines, to
+  // keep neighboring slots off each other's cache lines so the producer
+  // filling frame f + 1 does not invalidate the consumer reading frame f.
+  struct alignas(kCacheLineSize) Slot {
+    Slot() : frame(kEmptySlot), buttons() {}
+
+    // Delayed frame number whose buttons are stored in this slot, or
+    // kEmptySlot. Written only by the producer.
+    std::atomic<int> frame;
+    ButtonsType buttons;
+  };
+
+  // Destroys and frees slots allocated with posix_memalign, since new only
+  // guarantees the alignment of fundamental types for over-aligned types
+  // before C++17.
+  struct SlotsDeleter {
+    int count;
+    void operator()(Slot* slots) const;
+  };
+
+  // Waits until slot holds the given frame, the queue is closed, or the
+  // timeout expires, first as the wait strategy says, if any, and then by
+  // blocking. Returns SUCCESS if the frame arrived.
+  GetButtonsStatus WaitForFrame(const Slot& slot, int frame,
+                                int timeout_micros);
+
+  const int mask_;
+  std::unique_ptr<Slot[], SlotsDeleter> slots_;
+
+  char padding_0_[kCacheLineSize];
+
+  // Consumer-owned state. Written only by GetButtons and read by PutButtons.
+
+  // The latest frame for which button data has been requested. All attempts to
+  // put buttons with frame less than or equal to this will fail.
+  std::atomic<int> latest_frame_requested_;
+  // Set while GetButtons is blocked on cv_, so that PutButtons only touches m_
+  // when there is someone to wake up.
+  std::atomic<bool> consumer_waiting_;
+  // Set by Close().
+  std::atomic<bool> closed_;
+
+  char padding_1_[kCacheLineSize];
+
+  // Slow path only. Serializes consumer sleeps against producer wakeups.
+  std::mutex m_;
+  std::condition_variable cv_;
+  // Time at which the producer last woke up the consumer, or -1. Only
+  // recorded with a wait strategy, to measure wakeup latencies. Protected by
+  // m_.
+  int64_t notify_nanos_;
+};
+
+#include "ring-input-queue.hpp"
+
+#endif  // RING_INPUT_QUEUE_H_
@@ -0,0 +1,256 @@
+// included by ring-input-queue.h
+
+#include <algorithm>
+#include <cstdlib>
+#include <new>
+
+#include "glog/logging.h"
+
+// -----------------------------------------------------------------------------
+// RingInputQueue
+
+template <typename ButtonsType>
+const int RingInputQueue<ButtonsType>::kDefaultCapacity = 256;
+
+template <typename ButtonsType>
+RingInputQueue<ButtonsType>::RingInputQueue(int delay_frames,
+                                            int initial_frame_delay,
+                                            int capacity)
+    : InputQueue<ButtonsType>(delay_frames, initial_frame_delay),
+      mask_(capacity - 1),
+      latest_frame_requested_(-1),
+      consumer_waiting_(false),
+      closed_(false),
+      notify_nanos_(-1) {
+  if (capacity <= 0 || (capacity & (capacity - 1)) != 0) {
+    LOG(ERROR) << "invalid ring capacity: " << capacity;
+    std::abort();
+  }
+  void* memory = nullptr;
+  if (posix_memalign(&memory, kCacheLineSize, capacity * sizeof(Slot)) != 0) {
+    LOG(ERROR) << "failed to allocate " << capacity << " ring slots";
+    std::abort();
+  }
+  Slot* slots = static_cast<Slot*>(memory);
+  for (int i = 0; i < capacity; ++i) {
+    new (&slots[i]) Slot();
+  }
+  slots_ = std::unique_ptr<Slot[], SlotsDeleter>(slots,
+                                                 SlotsDeleter{capacity});
+}
+
+template <typename ButtonsType>
+void RingInputQueue<ButtonsType>::SlotsDeleter::operator()(
+    Slot* slots) const {
+  for (int i = 0; i < count; ++i) {
+    slots[i].~Slot();
+  }
+  std::free(slots);
+}
+
+template <typename ButtonsType>
+bool RingInputQueue<ButtonsType>::InsertButtons(int first_delayed_frame,
+                                                int last_delayed_frame,
+                                                const ButtonsType& buttons) {
+  const int latest_frame_requested =
+      latest_frame_requested_.load(std::memory_order_acquire);
+
+  // Reject all button data for frames that we've already read.
+  if (first_delayed_frame <= latest_frame_requested) {
+    LOG(ERROR)
+        << "PutButtons: Attempted to put buttons for delayed frame "
+        << first_delayed_frame
+        << ", which has already been requested. The latest frame requested "
+           "is "
+        << latest_frame_requested;
+    return false;
+  }
+
+  // Reject button data that would overwrite a slot the consumer hasn't read.
+  if (last_delayed_frame - latest_frame_requested > capacity()) {
+    LOG(ERROR) << "PutButtons: Attempted to put buttons for delayed frame "
+               << last_delayed_frame << ", which is more than " << capacity()
+               << " frames past the latest frame requested "
+               << latest_frame_requested;
+    return false;
+  }
+
+  // Reject button data for frames we already have. Only this thread writes
+  // slot tags, so a relaxed load is sufficient.
+  for (int frame = first_delayed_frame; frame <= last_delayed_frame; ++frame) {
+    if (slots_[frame & mask_].frame.load(std::memory_order_relaxed) == frame) {
+      LOG(ERROR) << "PutButtons: Attempted to put duplicate buttons for "
+                    "delayed frame "
+                 << frame;
+      return false;
+    }
+  }
+
+  // Publish the button data. The sequentially consistent store pairs with the
+  // one in WaitForFrame: either the consumer sees the new tag, or we see that
+  // it is waiting and wake it up.
+  for (int frame = first_delayed_frame; frame <= last_delayed_frame; ++frame) {
+    Slot& slot = slots_[frame & mask_];
+    slot.buttons = buttons;
+    slot.frame.store(frame, std::memory_order_seq_cst);
+  }
+
+  if (consumer_waiting_.load(std::memory_order_seq_cst)) {
+    // Acquiring m_ guarantees the consumer is either asleep on cv_ or has not
+    // yet evaluated its wait predicate.
+    {
+      LockGuard guard(m_);
+      if (this->wait_strategy_ != nullptr) {
+        notify_nanos_ = this->wait_strategy_->now_nanos();
+      }
+    }
+    cv_.notify_all();
+  }
+
+  return true;
+}
+
+template <typename ButtonsType>
+typename RingInputQueue<ButtonsType>::GetButtonsStatus
+RingInputQueue<ButtonsType>::GetButtons(int frame, int timeout_micros,
+                                        ButtonsType* buttons) {
+  VLOG(3) << "Requesting buttons for frame " << frame << " with a timeout of "
+          << static_cast<double>(timeout_micros) / 1000000 << " seconds";
+
+  // Only this thread writes latest_frame_requested_.
+  const int expected_frame =
+      latest_frame_requested_.load(std::memory_order_relaxed) + 1;
+
+  // Enforce that frames come in one at a time and in order.
+  if (frame != expected_frame) {
+    LOG(ERROR)
+        << "Attempted to get buttons from unexpected frame. Requested frame "
+        << frame << " and expected frame " << expected_frame;
+    return GetButtonsStatus::UNEXPECTED_FRAME;
+  }
+
+  // If we're requesting buttons from a frame earlier than this queue's delay,
+  // emit a default-constructed ButtonsType object.
+  if (frame < this->initial_frame_delay_) {
+    latest_frame_requested_.store(frame, std::memory_order_release);
+    *buttons = ButtonsType();
+    return GetButtonsStatus::SUCCESS;
+  }
+
+  const Slot& slot = slots_[frame & mask_];
+  if (slot.frame.load(std::memory_order_acquire) != frame) {
+    if (timeout_micros == InputQueue<ButtonsType>::kReturnImmediately) {
+      // Check the tag again after closed_ in case the frame was put just
+      // before the queue was closed.
+      const bool closed = closed_.load(std::memory_order_acquire);
+      if (slot.frame.load(std::memory_order_acquire) != frame) {
+        return closed ? GetButtonsStatus::CLOSED : GetButtonsStatus::TIMEOUT;
+      }
+    } else {
+      const GetButtonsStatus status =
+          WaitForFrame(slot, frame, timeout_micros);
+      if (status == GetButtonsStatus::TIMEOUT) {
+        LOG(ERROR) << "Timed out waiting for buttons. Timeout is "
+                   << static_cast<double>(timeout_micros) / 1000000
+                   << " seconds.";
+        return status;
+      } else if (status == GetButtonsStatus::CLOSED) {
+        VLOG(3) << "Queue closed while waiting for buttons for frame "
+                << frame;
+        return status;
+      }
+    }
+  }
+
+  *buttons = slot.buttons;
+  // Hand the slot back to the producer only after the copy is complete.
+  latest_frame_requested_.store(frame, std::memory_order_release);
+
+  return GetButtonsStatus::SUCCESS;
+}
+
+template <typename ButtonsType>
+typename RingInputQueue<ButtonsType>::GetButtonsStatus
+RingInputQueue<ButtonsType>::WaitForFrame(const Slot& slot, int frame,
+                                          int timeout_micros) {
+  // Let the wait strategy, if any, spin and yield before going to sleep.
+  WaitStrategy* const strategy = this->wait_strategy_;
+  int64_t wait_start_nanos = 0;
+  if (strategy != nullptr) {
+    const WaitPhase phase = strategy->Poll(
+        [this, &slot, frame] {
+          return slot.frame.load(std::memory_order_acquire) == frame ||
+                 closed_.load(std::memory_order_acquire);
+        },
+        timeout_micros < 0 ? -1 : static_cast<int64_t>(timeout_micros) * 1000,
+        &wait_start_nanos);
+    if (phase != WaitPhase::BLOCK) {
+      // Check the tag again in case the frame was put just before the queue
+      // was closed.
+      if (slot.frame.load(std::memory_order_acquire) != frame) {
+        return GetButtonsStatus::CLOSED;
+      }
+      strategy->RecordWait(phase, strategy->now_nanos() - wait_start_nanos,
+                           -1 /* wakeup_nanos */);
+      return GetButtonsStatus::SUCCESS;
+    }
+    if (timeout_micros > 0) {
+      timeout_micros = std::max<int64_t>(
+          0, timeout_micros -
+                 (strategy->now_nanos() - wait_start_nanos) / 1000);
+    }
+  }
+
+  UniqueLock lock(m_);
+  notify_nanos_ = -1;
+  consumer_waiting_.store(true, std::memory_order_seq_cst);
+
+  const auto have_buttons_for_frame = [&slot, frame] {
+    return slot.frame.load(std::memory_order_seq_cst) == frame;
+  };
+  const auto can_return = [this, &have_buttons_for_frame] {
+    return closed_.load(std::memory_order_seq_cst) || have_buttons_for_frame();
+  };
+  bool woken = true;
+  if (timeout_micros == InputQueue<ButtonsType>::kBlockForever) {
+    cv_.wait(lock, can_return);
+  } else {
+    woken = cv_.wait_for(lock, Microseconds(timeout_micros), can_return);
+  }
+
+  consumer_waiting_.store(false, std::memory_order_relaxed);
+  if (have_buttons_for_frame()) {
+    if (strategy != nullptr) {
+      const int64_t now_nanos = strategy->now_nanos();
+      strategy->RecordWait(
+          WaitPhase::BLOCK, now_nanos - wait_start_nanos,
+          notify_nanos_ >= 0 ? now_nanos - notify_nanos_ : -1);
+    }
+    return GetButtonsStatus::SUCCESS;
+  }
+  return woken ? GetButtonsStatus::CLOSED : GetButtonsStatus::TIMEOUT;
+}
+
+template <typename ButtonsType>
+void RingInputQueue<ButtonsType>::Close() {
+  closed_.store(true, std::memory_order_seq_cst);
+  // Same handshake as PutButtons, except that the consumer may not have
+  // announced itself yet, so always take the lock.
+  { LockGuard guard(m_); }
+  cv_.notify_all();
+}
+
+template <typename ButtonsType>
+size_t RingInputQueue<ButtonsType>::QueueSize() {
+  const int latest_frame_requested =
+      latest_frame_requested_.load(std::memory_order_acquire);
+
+  size_t size = 0;
+  for (int i = 0; i < capacity(); ++i) {
+    if (slots_[i].frame.load(std::memory_order_acquire) >
+        latest_frame_requested) {
+      ++size;
+    }
+  }
+  return size;
+}
@@ -0,0 +1,288 @@
+#include "client/ring-input-queue.h"
+
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#include "gtest/gtest.h"
+
+using std::string;
+using std::stringstream;
+
+// -----------------------------------------------------------------------------
+// RingInputQueue
+
+class RingInputQueueTest : public ::testing::Test {
+ protected:
+  typedef InputQueue<string> StringQueue;
+  typedef RingInputQueue<string> StringRingQueue;
+
+  RingInputQueueTest()
+      : local_queue_(new StringRingQueue(kDelayFrames, kDelayFrames,
+                                         kCapacity)),
+        remote_queue_(new StringRingQueue(0, kDelayFrames, kCapacity)) {}
+
+  // Reads the default-valued frames inside the initial delay period.
+  void SkipDelayFrames(StringQueue* queue) {
+    for (int i = 0; i < kDelayFrames; ++i) {
+      string frame = "default not empty";
+      ASSERT_EQ(StringQueue::GetButtonsStatus::SUCCESS,
+                queue->GetButtons(i, StringQueue::kBlockForever, &frame));
+      EXPECT_EQ("", frame);
+    }
+  }
+
+  static const int kDelayFrames;
+  static const int kCapacity;
+  std::unique_ptr<StringRingQueue> local_queue_;
+  std::unique_ptr<StringRingQueue> remote_queue_;
+};
+
+const int RingInputQueueTest::kDelayFrames = 2;
+const int RingInputQueueTest::kCapacity = 8;
+
+TEST_F(RingInputQueueTest, FactoriesSelectBackend) {
+  std::unique_ptr<StringQueue> local(
+      StringQueue::MakeLocalQueue(kDelayFrames, InputQueueBackend::RING));
+  std::unique_ptr<StringQueue> remote(
+      StringQueue::MakeRemoteQueue(kDelayFrames, InputQueueBackend::RING));
+
+  EXPECT_NE(nullptr, dynamic_cast<StringRingQueue*>(local.get()));
+  EXPECT_NE(nullptr, dynamic_cast<StringRingQueue*>(remote.get()));
+  EXPECT_EQ(kDelayFrames, local->delay_frames());
+  EXPECT_EQ(0, remote->delay_frames());
+}
+
+TEST_F(RingInputQueueTest, InvalidCapacity) {
+  EXPECT_DEATH(StringRingQueue(0, 0, 0), "invalid ring capacity");
+  EXPECT_DEATH(StringRingQueue(0, 0, 6), "invalid ring capacity");
+}
+
+TEST_F(RingInputQueueTest, PutAndGetAcrossWrapAround) {
+  SkipDelayFrames(local_queue_.get());
+
+  // Cycle through the ring several times.
+  for (int frame = 0; frame < kCapacity * 4; ++frame) {
+    stringstream data;
+    data << "frame " << frame;
+    ASSERT_TRUE(local_queue_->PutButtons(frame, data.str()));
+
+    string out;
+    ASSERT_EQ(StringQueue::GetButtonsStatus::SUCCESS,
+              local_queue_->GetButtons(frame + kDelayFrames, 0, &out));
+    EXPECT_EQ(data.str(), out);
+  }
+  EXPECT_EQ(0, local_queue_->QueueSize());
+}
+
+TEST_F(RingInputQueueTest, PutButtonsBeyondCapacity) {
+  SkipDelayFrames(remote_queue_.get());
+
+  // The latest requested frame is kDelayFrames - 1, so the ring can hold
+  // frames up to and including kDelayFrames - 1 + kCapacity.
+  const int last_frame = kDelayFrames - 1 + kCapacity;
+  for (int frame = kDelayFrames; frame <= last_frame; ++frame) {
+    ASSERT_TRUE(remote_queue_->PutButtons(frame, "data"));
+  }
+  EXPECT_EQ(kCapacity, remote_queue_->QueueSize());
+  EXPECT_FALSE(remote_queue_->PutButtons(last_frame + 1, "data"));
+
+  // Reading a frame frees up its slot.
+  string out;
+  ASSERT_EQ(StringQueue::GetButtonsStatus::SUCCESS,
+            remote_queue_->GetButtons(kDelayFrames, 0, &out));
+  EXPECT_TRUE(remote_queue_->PutButtons(last_frame + 1, "data"));
+}
+
+TEST_F(RingInputQueueTest, PutButtonsDuplicateAndStaleFrames) {
+  ASSERT_TRUE(local_queue_->PutButtons(0, "frame 0"));
+  EXPECT_FALSE(local_queue_->PutButtons(0, "frame 0 again"));
+
+  SkipDelayFrames(local_queue_.get());
+  string out;
+  ASSERT_EQ(StringQueue::GetButtonsStatus::SUCCESS,
+            local_queue_->GetButtons(kDelayFrames, 0, &out));
+  EXPECT_EQ("frame 0", out);
+
+  // Frame 0 has been consumed, so it is now stale rather than a duplicate.
+  EXPECT_FALSE(local_queue_->PutButtons(0, "frame 0 stale"));
+  EXPECT_EQ(0, local_queue_->QueueSize());
+}
+
+TEST_F(RingInputQueueTest, ChangeDelayFramesAcrossWrapAround) {
+  SkipDelayFrames(local_queue_.get());
+
+  // Raise the delay to fill most of the ring, then lower it back.
+  const int kRaisedDelayFrames = kCapacity - 2;
+  ASSERT_TRUE(local_queue_->ChangeDelayFrames(1, kRaisedDelayFrames));
+  for (int frame = 0; frame < 3; ++frame) {
+    stringstream data;
+    data << "frame " << frame;
+    ASSERT_TRUE(local_queue_->PutButtons(frame, data.str()));
+  }
+  EXPECT_EQ(kRaisedDelayFrames + 1, local_queue_->QueueSize());
+
+  // Too far past the latest requested frame for the ring.
+  ASSERT_TRUE(local_queue_->ChangeDelayFrames(3, kRaisedDelayFrames + 4));
+  EXPECT_FALSE(local_queue_->PutButtons(3, "frame 3"));
+  EXPECT_EQ(kRaisedDelayFrames, local_queue_->delay_frames());
+
+  ASSERT_TRUE(local_queue_->ChangeDelayFrames(3, kDelayFrames));
+  for (int frame = 3; frame < 8; ++frame) {
+    ASSERT_TRUE(local_queue_->PutButtons(frame, "later"));
+  }
+  EXPECT_EQ(kDelayFrames, local_queue_->delay_frames());
+
+  string out;
+  for (int frame = kDelayFrames; frame < 8 + kDelayFrames; ++frame) {
+    ASSERT_EQ(StringQueue::GetButtonsStatus::SUCCESS,
+              local_queue_->GetButtons(frame, 0, &out));
+    if (frame == kDelayFrames) {
+      EXPECT_EQ("frame 0", out);
+    } else if (frame < kRaisedDelayFrames + 2) {
+      EXPECT_EQ("frame 1", out);
+    } else if (frame == kRaisedDelayFrames + 2) {
+      EXPECT_EQ("frame 2", out);
+    } else {
+      EXPECT_EQ("later", out);
+    }
+  }
+  EXPECT_EQ(0, local_queue_->QueueSize());
+}
+
+TEST_F(RingInputQueueTest, GetButtonsUnexpectedFrame) {
+  string out;
+  EXPECT_EQ(StringQueue::GetButtonsStatus::UNEXPECTED_FRAME,
+            local_queue_->GetButtons(1, 0, &out));
+  EXPECT_EQ(StringQueue::GetButtonsStatus::SUCCESS,
+            local_queue_->GetButtons(0, 0, &out));
+}
+
+TEST_F(RingInputQueueTest, GetButtonsWithTimeout) {
+  SkipDelayFrames(local_queue_.get());
+
+  string out;
+  EXPECT_EQ(StringQueue::GetButtonsStatus::TIMEOUT,
+            local_queue_->GetButtons(kDelayFrames, 0, &out));
+  EXPECT_EQ(StringQueue::GetButtonsStatus::TIMEOUT,
+            local_queue_->GetButtons(kDelayFrames, 1E6 / 10, &out));
+}
+
+TEST_F(RingInputQueueTest, BlockingGetWakesOnPut) {
+  SkipDelayFrames(remote_queue_.get());
+
+  std::thread producer([this] {
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    EXPECT_TRUE(remote_queue_->PutButtons(kDelayFrames, "late frame"));
+  });
+
+  string out;
+  EXPECT_EQ(StringQueue::GetButtonsStatus::SUCCESS,
+            remote_queue_->GetButtons(kDelayFrames, StringQueue::kBlockForever,
+                                      &out));
+  EXPECT_EQ("late frame", out);
+
+  producer.join();
+}
+
+TEST_F(RingInputQueueTest, WaitStrategyRecordsHowButtonsWereWaitedFor) {
+  SkipDelayFrames(local_queue_.get());
+  SkipDelayFrames(remote_queue_.get());
+
+  // Spins through the remote wait, and blocks right away on the local one.
+  WaitStrategy spinning(5E9 /* five seconds */, 0);
+  WaitStrategy blocking(0, 0);
+  remote_queue_->set_wait_strategy(&spinning);
+  local_queue_->set_wait_strategy(&blocking);
+
+  std::thread producer([this] {
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    EXPECT_TRUE(remote_queue_->PutButtons(kDelayFrames, "remote"));
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    EXPECT_TRUE(local_queue_->PutButtons(0, "local"));
+  });
+
+  string out;
+  ASSERT_EQ(StringQueue::GetButtonsStatus::SUCCESS,
+            remote_queue_->GetButtons(kDelayFrames, StringQueue::kBlockForever,
+                                      &out));
+  EXPECT_EQ("remote", out);
+  ASSERT_EQ(StringQueue::GetButtonsStatus::SUCCESS,
+            local_queue_->GetButtons(kDelayFrames, StringQueue::kBlockForever,
+                                     &out));
+  EXPECT_EQ("local", out);
+  producer.join();
+
+  WaitStatsPB stats;
+  spinning.GetStats(&stats);
+  EXPECT_EQ(1, stats.phase(static_cast<int>(WaitPhase::SPIN)).waits());
+  blocking.GetStats(&stats);
+  const WaitPhaseStatsPB& block =
+      stats.phase(static_cast<int>(WaitPhase::BLOCK));
+  EXPECT_EQ(1, block.waits());
+  int64_t wakeups = 0;
+  for (const int64_t count : block.wakeup_histogram()) {
+    wakeups += count;
+  }
+  EXPECT_EQ(1, wakeups);
+
+  // A spinning wait still gives up at the timeout.
+  EXPECT_EQ(StringQueue::GetButtonsStatus::TIMEOUT,
+            remote_queue_->GetButtons(kDelayFrames + 1, 1E6 / 10, &out));
+  EXPECT_EQ(1, spinning.waits());
+}
+
+TEST_F(RingInputQueueTest, CloseWakesBlockedGetButtons) {
+  SkipDelayFrames(remote_queue_.get());
+  ASSERT_TRUE(remote_queue_->PutButtons(kDelayFrames, "last frame"));
+
+  std::thread closer([this] {
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    remote_queue_->Close();
+  });
+
+  string out;
+  EXPECT_EQ(StringQueue::GetButtonsStatus::SUCCESS,
+            remote_queue_->GetButtons(kDelayFrames, StringQueue::kBlockForever,
+                                      &out));
+  EXPECT_EQ("last frame", out);
+  EXPECT_EQ(StringQueue::GetButtonsStatus::CLOSED,
+            remote_queue_->GetButtons(kDelayFrames + 1,
+                                      StringQueue::kBlockForever, &out));
+  EXPECT_EQ(StringQueue::GetButtonsStatus::CLOSED,
+            remote_queue_->GetButtons(kDelayFrames + 1,
+                                      StringQueue::kReturnImmediately, &out));
+
+  closer.join();
+}
+
+TEST_F(RingInputQueueTest, ThreadingTortureTest) {
+  // Two minutes worth of frames at 60fps through a ring much smaller than that,
+  // with the producer backing off whenever the ring is full.
+  const int kNumFrames = 60 * 120;
+  SkipDelayFrames(remote_queue_.get());
+
+  std::thread producer([this, kNumFrames] {
+    for (int frame = kDelayFrames; frame < kNumFrames; ++frame) {
+      stringstream data;
+      data << "frame " << frame;
+      while (remote_queue_->QueueSize() == kCapacity) {
+        std::this_thread::yield();
+      }
+      EXPECT_TRUE(remote_queue_->PutButtons(frame, data.str()));
+    }
+  });
+
+  for (int frame = kDelayFrames; frame < kNumFrames; ++frame) {
+    string out;
+    ASSERT_EQ(StringQueue::GetButtonsStatus::SUCCESS,
+              remote_queue_->GetButtons(frame, StringQueue::kBlockForever,
+                                        &out));
+    stringstream expected;
+    expected << "frame " << frame;
+    ASSERT_EQ(expected.str(), out);
+  }
+
+  producer.join();
+}
@@ -0,0 +1,115 @@
+#ifndef ROLLBACK_BUFFER_H_
+#define ROLLBACK_BUFFER_H_
+
+#include <vector>
+
+#include "client/input-predictor.h"
+#include "client/input-queue.h"
+
+// Confirmed and predicted button history for a single port, used to run the
+// emulator ahead of the inputs it has received. Buttons are consumed from an
+// InputQueue, in order, into a window of confirmed frames, so that frames can
+// be requested again when the emulator re-simulates after a rollback.
+//
+// If a frame has not been confirmed yet, GetButtons predicts it, by default by
+// repeating the latest confirmed buttons, and remembers the prediction. Once the real
+// buttons for that frame arrive and differ from the prediction, the frame is
+// reported by TakeMispredictedFrame so that the emulator can restore its state
+// to before that frame and simulate it again.
+//
+// Confirmed and predicted buttons are kept in rings allocated at construction,
+// so that running ahead never allocates. Confirmed buttons that arrive too far
+// ahead of the requested frames to fit are left in the queue until there is
+// room for them.
+//
+// ButtonsType must be equality comparable. Not thread safe.
+template <typename ButtonsType>
+class RollbackBuffer {
+ public:
+  enum class GetButtonsStatus {
+    // The buttons are the real buttons for the frame.
+    CONFIRMED = 0,
+    // The buttons are a prediction.
+    PREDICTED,
+    // The frame is older than the rollback window, or the buttons could not
+    // be read from the queue.
+    FAILURE
+  };
+
+  // Constructs a buffer that reads from the given borrowed queue. Arguments
+  // are:
+  //  - queue: queue from which confirmed buttons are read, in frame order.
+  //  - max_rollback_frames: maximum number of frames past the latest confirmed
+  //    frame that may be predicted. Requesting a frame further ahead blocks
+  //    until enough frames are confirmed. std::abort's if negative.
+  //  - predict: if false, frames are never predicted and GetButtons fails if
+  //    the buttons are not already in the queue. Used for local ports.
+  //  - predictor: optional borrowed predictor which makes the predictions and
+  //    is fed the confirmed buttons, which also scores its predictions. Must
+  //    accept at least max_rollback_frames pending frames. If null,
+  //    predictions repeat the latest confirmed buttons.
+  RollbackBuffer(InputQueue<ButtonsType>* queue, int max_rollback_frames,
+                 bool predict,
+                 InputPredictor<ButtonsType>* predictor = nullptr);
+
+  // Get the confirmed or predicted buttons for the given frame. Frames may be
+  // requested in any order, as long as they are within max_rollback_frames of
+  // the latest confirmed frame.
+  GetButtonsStatus GetButtons(int frame, ButtonsType* buttons);
+
+  // Returns the earliest frame whose confirmed buttons differed from the
+  // prediction returned for it since the last call, or -1 if there were no
+  // mispredictions.
+  int TakeMispredictedFrame();
+
+  // Returns the latest frame for which all buttons up to and including that
+  // frame are confirmed, or -1 if no frame is confirmed yet.
+  int confirmed_frame() const { return first_frame_ + confirmed_count_ - 1; }
+
+ private:
+  // Moves any buttons already in the queue into confirmed_ without blocking,
+  // pruning the frames that frame can no longer roll back to as it goes, until
+  // confirmed_ is full. Returns false if the queue returned an error.
+  bool DrainQueue(int frame);
+
+  // Appends the buttons for frame confirmed_frame() + 1 to confirmed_, which
+  // must not be full, and checks them against any prediction for that frame.
+  void Confirm(const ButtonsType& buttons);
+
+  // Drops confirmed frames that can no longer be rolled back to, keeping at
+  // least the latest confirmed frame as the basis for predictions.
+  void Prune(int frame);
+
+  // A prediction returned for frame, or none if frame is negative.
+  struct Prediction {
+    int frame;
+    ButtonsType buttons;
+  };
+
+  // Borrowed reference.
+  InputQueue<ButtonsType>& queue_;
+  const int max_rollback_frames_;
+  const bool predict_;
+  // Borrowed reference, may be null.
+  InputPredictor<ButtonsType>* predictor_;
+
+  // Confirmed buttons for frames first_frame_ to confirmed_frame(), indexed
+  // by frame modulo the size. Frames are pruned as they are confirmed, so a
+  // full ring starts within max_rollback_frames_ of the requested frame, and
+  // reaches it.
+  std::vector<ButtonsType> confirmed_;
+  int first_frame_;
+  int confirmed_count_;
+
+  // Buttons returned for frames past confirmed_frame(), indexed by frame
+  // modulo the size. Such frames lie within max_rollback_frames_ of it, so
+  // no two of them share a slot, and predicting never allocates.
+  std::vector<Prediction> predicted_;
+
+  // Earliest mispredicted frame since the last TakeMispredictedFrame, or -1.
+  int mispredicted_frame_;
+};
+
+#include "rollback-buffer.hpp"
+
+#endif  // ROLLBACK_BUFFER_H_
@@ -0,0 +1,149 @@
+// included by rollback-buffer.h
+
+#include <cstdlib>
+
+#include "glog/logging.h"
+
+// -----------------------------------------------------------------------------
+// RollbackBuffer
+
+template <typename ButtonsType>
+RollbackBuffer<ButtonsType>::RollbackBuffer(
+    InputQueue<ButtonsType>* queue, int max_rollback_frames, bool predict,
+    InputPredictor<ButtonsType>* predictor)
+    : queue_(*queue),
+      max_rollback_frames_(max_rollback_frames),
+      predict_(predict),
+      predictor_(predictor),
+      first_frame_(0),
+      confirmed_count_(0),
+      mispredicted_frame_(-1) {
+  if (max_rollback_frames_ < 0) {
+    LOG(ERROR) << "invalid max_rollback_frames: " << max_rollback_frames_;
+    std::abort();
+  }
+  confirmed_.resize(max_rollback_frames_ + 1);
+  predicted_.resize(max_rollback_frames_ + 1, Prediction{-1, ButtonsType()});
+}
+
+template <typename ButtonsType>
+typename RollbackBuffer<ButtonsType>::GetButtonsStatus
+RollbackBuffer<ButtonsType>::GetButtons(int frame, ButtonsType* buttons) {
+  if (frame < first_frame_) {
+    LOG(ERROR) << "Requested buttons for frame " << frame
+               << ", which is older than the earliest frame in the rollback "
+                  "window "
+               << first_frame_;
+    return GetButtonsStatus::FAILURE;
+  }
+
+  if (!DrainQueue(frame)) {
+    // Error already logged.
+    return GetButtonsStatus::FAILURE;
+  }
+
+  if (frame > confirmed_frame() && !predict_) {
+    LOG(ERROR) << "Buttons for frame " << frame
+               << " are not available and prediction is disabled";
+    return GetButtonsStatus::FAILURE;
+  }
+
+  // Don't run further ahead of the confirmed buttons than we can roll back.
+  while (frame - confirmed_frame() > max_rollback_frames_) {
+    VLOG(3) << "Frame " << frame << " is more than " << max_rollback_frames_
+            << " frames past confirmed frame " << confirmed_frame()
+            << ", waiting for buttons";
+    ButtonsType confirmed;
+    if (queue_.GetButtons(confirmed_frame() + 1,
+                          InputQueue<ButtonsType>::kBlockForever, &confirmed) !=
+        InputQueue<ButtonsType>::GetButtonsStatus::SUCCESS) {
+      LOG(ERROR) << "Failed to wait for buttons for frame "
+                 << confirmed_frame() + 1;
+      return GetButtonsStatus::FAILURE;
+    }
+    Confirm(confirmed);
+    Prune(frame);
+  }
+
+  GetButtonsStatus status;
+  if (frame <= confirmed_frame()) {
+    *buttons = confirmed_[frame % confirmed_.size()];
+    status = GetButtonsStatus::CONFIRMED;
+  } else {
+    if (predictor_ != nullptr) {
+      *buttons = predictor_->Predict(frame);
+    } else if (confirmed_count_ == 0) {
+      *buttons = ButtonsType();
+    } else {
+      *buttons = confirmed_[confirmed_frame() % confirmed_.size()];
+    }
+    Prediction& prediction = predicted_[frame % predicted_.size()];
+    prediction.frame = frame;
+    prediction.buttons = *buttons;
+    status = GetButtonsStatus::PREDICTED;
+  }
+  return status;
+}
+
+template <typename ButtonsType>
+int RollbackBuffer<ButtonsType>::TakeMispredictedFrame() {
+  const int frame = mispredicted_frame_;
+  mispredicted_frame_ = -1;
+  return frame;
+}
+
+template <typename ButtonsType>
+bool RollbackBuffer<ButtonsType>::DrainQueue(int frame) {
+  Prune(frame);
+  while (confirmed_count_ < static_cast<int>(confirmed_.size())) {
+    ButtonsType buttons;
+    switch (queue_.GetButtons(confirmed_frame() + 1,
+                              InputQueue<ButtonsType>::kReturnImmediately,
+                              &buttons)) {
+      case InputQueue<ButtonsType>::GetButtonsStatus::SUCCESS:
+        Confirm(buttons);
+        Prune(frame);
+        break;
+      case InputQueue<ButtonsType>::GetButtonsStatus::TIMEOUT:
+      case InputQueue<ButtonsType>::GetButtonsStatus::CLOSED:
+        // Nothing more to read for now.
+        return true;
+      default:
+        LOG(ERROR) << "Failed to read buttons for frame "
+                   << confirmed_frame() + 1 << " from the queue";
+        return false;
+    }
+  }
+  return true;
+}
+
+template <typename ButtonsType>
+void RollbackBuffer<ButtonsType>::Confirm(const ButtonsType& buttons) {
+  const int frame = confirmed_frame() + 1;
+  confirmed_[frame % confirmed_.size()] = buttons;
+  ++confirmed_count_;
+  if (predictor_ != nullptr) {
+    // Nothing waits for buttons in rollback mode.
+    predictor_->Observe(frame, buttons, 0 /* wait_nanos */);
+  }
+
+  Prediction& prediction = predicted_[frame % predicted_.size()];
+  if (prediction.frame != frame) {
+    return;
+  }
+  if (!(prediction.buttons == buttons)) {
+    VLOG(3) << "Mispredicted buttons for frame " << frame;
+    if (mispredicted_frame_ < 0 || frame < mispredicted_frame_) {
+      mispredicted_frame_ = frame;
+    }
+  }
+  prediction.frame = -1;
+}
+
+template <typename ButtonsType>
+void RollbackBuffer<ButtonsType>::Prune(int frame) {
+  while (confirmed_count_ > 1 && first_frame_ < frame - max_rollback_frames_) {
+    ++first_frame_;
+    --confirmed_count_;
+  }
+}
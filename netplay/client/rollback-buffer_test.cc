@@ -0,0 +1,185 @@
+#include "client/rollback-buffer.h"
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include "gtest/gtest.h"
+
+#include "client/mocks.h"
+
+using std::string;
+
+// -----------------------------------------------------------------------------
+// RollbackBuffer
+
+class RollbackBufferTest : public ::testing::Test {
+ protected:
+  typedef InputQueue<string> StringQueue;
+  typedef RollbackBuffer<string> StringBuffer;
+  typedef StringBuffer::GetButtonsStatus Status;
+
+  RollbackBufferTest()
+      : remote_queue_(StringQueue::MakeRemoteQueue(0)),
+        buffer_(new StringBuffer(remote_queue_.get(), kRollbackFrames, true)) {}
+
+  static const int kRollbackFrames;
+  std::unique_ptr<StringQueue> remote_queue_;
+  std::unique_ptr<StringBuffer> buffer_;
+};
+
+const int RollbackBufferTest::kRollbackFrames = 4;
+
+TEST_F(RollbackBufferTest, InvalidMaxRollbackFrames) {
+  EXPECT_DEATH(StringBuffer(remote_queue_.get(), -1, true),
+               "invalid max_rollback_frames");
+}
+
+TEST_F(RollbackBufferTest, PredictsLatestConfirmedButtons) {
+  string buttons;
+
+  // Nothing confirmed yet, so predict the default buttons.
+  ASSERT_EQ(Status::PREDICTED, buffer_->GetButtons(0, &buttons));
+  EXPECT_EQ("", buttons);
+
+  ASSERT_TRUE(remote_queue_->PutButtons(0, ""));
+  ASSERT_TRUE(remote_queue_->PutButtons(1, "b"));
+  ASSERT_EQ(Status::CONFIRMED, buffer_->GetButtons(1, &buttons));
+  EXPECT_EQ("b", buttons);
+  EXPECT_EQ(1, buffer_->confirmed_frame());
+
+  ASSERT_EQ(Status::PREDICTED, buffer_->GetButtons(2, &buttons));
+  EXPECT_EQ("b", buttons);
+  ASSERT_EQ(Status::PREDICTED, buffer_->GetButtons(3, &buttons));
+  EXPECT_EQ("b", buttons);
+
+  // The prediction for frame 0 was right.
+  EXPECT_EQ(-1, buffer_->TakeMispredictedFrame());
+}
+
+TEST_F(RollbackBufferTest, ReportsEarliestMisprediction) {
+  string buttons;
+  ASSERT_TRUE(remote_queue_->PutButtons(0, "a"));
+  ASSERT_EQ(Status::CONFIRMED, buffer_->GetButtons(0, &buttons));
+  for (int frame = 1; frame <= 3; ++frame) {
+    ASSERT_EQ(Status::PREDICTED, buffer_->GetButtons(frame, &buttons));
+    EXPECT_EQ("a", buttons);
+  }
+
+  ASSERT_TRUE(remote_queue_->PutButtons(1, "a"));
+  ASSERT_TRUE(remote_queue_->PutButtons(2, "c"));
+  ASSERT_TRUE(remote_queue_->PutButtons(3, "d"));
+  ASSERT_EQ(Status::PREDICTED, buffer_->GetButtons(4, &buttons));
+  EXPECT_EQ("d", buttons);
+
+  EXPECT_EQ(2, buffer_->TakeMispredictedFrame());
+  EXPECT_EQ(-1, buffer_->TakeMispredictedFrame());
+
+  // Re-simulating from the rollback frame sees the confirmed buttons.
+  ASSERT_EQ(Status::CONFIRMED, buffer_->GetButtons(2, &buttons));
+  EXPECT_EQ("c", buttons);
+  ASSERT_EQ(Status::CONFIRMED, buffer_->GetButtons(3, &buttons));
+  EXPECT_EQ("d", buttons);
+}
+
+TEST_F(RollbackBufferTest, WaitsWhenTooFarAhead) {
+  std::thread producer([this] {
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    EXPECT_TRUE(remote_queue_->PutButtons(0, "a"));
+  });
+
+  // Frame kRollbackFrames is one frame too far past confirmed frame -1.
+  string buttons;
+  ASSERT_EQ(Status::PREDICTED, buffer_->GetButtons(kRollbackFrames, &buttons));
+  EXPECT_EQ("a", buttons);
+  EXPECT_EQ(0, buffer_->confirmed_frame());
+
+  producer.join();
+}
+
+TEST_F(RollbackBufferTest, WaitFailsWhenQueueClosed) {
+  remote_queue_->Close();
+
+  string buttons;
+  EXPECT_EQ(Status::PREDICTED, buffer_->GetButtons(0, &buttons));
+  EXPECT_EQ(Status::FAILURE, buffer_->GetButtons(kRollbackFrames, &buttons));
+}
+
+TEST_F(RollbackBufferTest, FramesOutsideWindow) {
+  string buttons;
+  for (int frame = 0; frame < 3 * kRollbackFrames; ++frame) {
+    ASSERT_TRUE(remote_queue_->PutButtons(frame, "data"));
+    ASSERT_EQ(Status::CONFIRMED, buffer_->GetButtons(frame, &buttons));
+  }
+
+  EXPECT_EQ(Status::FAILURE, buffer_->GetButtons(0, &buttons));
+  EXPECT_EQ(Status::CONFIRMED,
+            buffer_->GetButtons(2 * kRollbackFrames, &buttons));
+}
+
+TEST_F(RollbackBufferTest, LeavesFramesTooFarAheadInQueue) {
+  string buttons;
+  for (int frame = 0; frame < 3 * kRollbackFrames; ++frame) {
+    ASSERT_TRUE(remote_queue_->PutButtons(frame, std::to_string(frame)));
+  }
+
+  // Only the rollback window past frame 0 fits in the buffer.
+  ASSERT_EQ(Status::CONFIRMED, buffer_->GetButtons(0, &buttons));
+  EXPECT_EQ("0", buttons);
+  EXPECT_EQ(kRollbackFrames, buffer_->confirmed_frame());
+
+  // The rest is confirmed as the requested frames move on.
+  ASSERT_EQ(Status::CONFIRMED,
+            buffer_->GetButtons(3 * kRollbackFrames - 1, &buttons));
+  EXPECT_EQ(std::to_string(3 * kRollbackFrames - 1), buttons);
+  ASSERT_EQ(Status::CONFIRMED,
+            buffer_->GetButtons(2 * kRollbackFrames - 1, &buttons));
+  EXPECT_EQ(std::to_string(2 * kRollbackFrames - 1), buttons);
+  EXPECT_EQ(-1, buffer_->TakeMispredictedFrame());
+}
+
+TEST_F(RollbackBufferTest, NoPrediction) {
+  std::unique_ptr<StringQueue> local_queue(StringQueue::MakeLocalQueue(2));
+  StringBuffer local_buffer(local_queue.get(), kRollbackFrames, false);
+
+  // Frames in the delay period are always available.
+  string buttons = "not empty";
+  ASSERT_EQ(Status::CONFIRMED, local_buffer.GetButtons(1, &buttons));
+  EXPECT_EQ("", buttons);
+
+  EXPECT_EQ(Status::FAILURE, local_buffer.GetButtons(2, &buttons));
+
+  ASSERT_TRUE(local_queue->PutButtons(0, "frame 0"));
+  ASSERT_EQ(Status::CONFIRMED, local_buffer.GetButtons(2, &buttons));
+  EXPECT_EQ("frame 0", buttons);
+}
+
+TEST_F(RollbackBufferTest, UsesPredictor) {
+  MockButtonCoder<string> mock_coder;
+  TraceRing trace;
+  InputPredictor<string> predictor(PORT_2, PredictionStrategy::MARKOV,
+                                   kRollbackFrames, &mock_coder, &trace);
+  StringBuffer buffer(remote_queue_.get(), kRollbackFrames, true, &predictor);
+
+  // The player alternates between a and b.
+  string buttons;
+  for (int frame = 0; frame < 4; ++frame) {
+    ASSERT_TRUE(remote_queue_->PutButtons(frame, frame % 2 ? "b" : "a"));
+  }
+  ASSERT_EQ(Status::CONFIRMED, buffer.GetButtons(3, &buttons));
+  EXPECT_EQ(3, predictor.last_frame());
+
+  ASSERT_EQ(Status::PREDICTED, buffer.GetButtons(4, &buttons));
+  EXPECT_EQ("a", buttons);
+  ASSERT_EQ(Status::PREDICTED, buffer.GetButtons(5, &buttons));
+  EXPECT_EQ("b", buttons);
+
+  // The player held a instead, so frame 5 was mispredicted.
+  ASSERT_TRUE(remote_queue_->PutButtons(4, "a"));
+  ASSERT_TRUE(remote_queue_->PutButtons(5, "a"));
+  ASSERT_EQ(Status::CONFIRMED, buffer.GetButtons(5, &buttons));
+  EXPECT_EQ(5, buffer.TakeMispredictedFrame());
+  EXPECT_EQ(2, predictor.stats().predicted_frames());
+  EXPECT_EQ(1, predictor.stats().correct_frames());
+}
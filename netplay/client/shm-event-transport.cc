@@ -0,0 +1,515 @@
+#include "client/shm-event-transport.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "client/utils.h"
+#include "glog/logging.h"
+
+// The atomics below live in memory shared between processes, which only works
+// if they are plain words, and the futex needs a 32 bit one.
+static_assert(ATOMIC_INT_LOCK_FREE == 2 && ATOMIC_LLONG_LOCK_FREE == 2,
+              "shared memory atomics must be lock free");
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t),
+              "futex words must be 32 bits");
+
+namespace {
+
+// A console has at most one client per port.
+const int kMaxClients = 4;
+
+// Key presses a ring holds before its writer waits for the readers.
+const int64_t kRingSize = 1024;
+
+// Largest serialized key press a slot holds, which leaves a slot at 128 bytes.
+const size_t kSlotBytes = 124;
+
+// Longest a reader sleeps before checking whether it was cancelled.
+const int kWaitMillis = 50;
+
+// Returns whether the process that claimed a ring still exists, as opposed to
+// having exited without leaving the console.
+bool ProcessAlive(int32_t pid) {
+  return pid > 0 && (kill(pid, 0) == 0 || errno == EPERM);
+}
+
+void FutexWait(std::atomic<uint32_t>* word, uint32_t value,
+               int timeout_millis) {
+  timespec timeout;
+  timeout.tv_sec = timeout_millis / 1000;
+  timeout.tv_nsec = (timeout_millis % 1000) * 1000000L;
+  // Not FUTEX_PRIVATE_FLAG, since the waker may be another process.
+  syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAIT, value,
+          &timeout, nullptr, 0);
+}
+
+void FutexWake(std::atomic<uint32_t>* word) {
+  syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAKE, INT_MAX,
+          nullptr, nullptr, 0);
+}
+
+// Bit of port in Segment::Ring::ports, or 0 if port isn't one of PORT_1 to
+// PORT_4.
+uint32_t PortBit(Port port) {
+  return port >= PORT_1 && port <= PORT_4 ? 1u << (port - PORT_1) : 0;
+}
+
+}  // namespace
+
+// Layout of the shared memory object of a console. All zeros, as ftruncate
+// leaves a new object, is a console without clients.
+struct ShmEventTransport::Segment {
+  struct Slot {
+    uint32_t size;
+    char data[kSlotBytes];
+  };
+
+  // Key presses written by one client and read by all the others.
+  struct Ring {
+    // Client that writes the ring, 0 if the ring is free, or -1 while it is
+    // being claimed.
+    std::atomic<int64_t> client_id;
+    std::atomic<int32_t> pid;
+    // Bit PortBit(port) of each port of the client.
+    std::atomic<uint32_t> ports;
+    // Bumped whenever a ring this client reads is written to. While waiting
+    // is set, the reader of this client may be asleep on it.
+    std::atomic<uint32_t> doorbell;
+    std::atomic<uint32_t> waiting;
+    // Number of key presses written to the ring, and read from it by the
+    // client of each ring.
+    std::atomic<int64_t> written;
+    std::atomic<int64_t> read[kMaxClients];
+    Slot slots[kRingSize];
+  };
+
+  Ring rings[kMaxClients];
+};
+
+ShmEventTransport::ShmEventTransport(std::unique_ptr<EventTransport> control,
+                                     const ShmEventTransportOptions& options)
+    : options_(options),
+      control_(std::move(control)),
+      segment_(nullptr),
+      index_(-1),
+      opened_(false),
+      joined_(false),
+      control_closed_(false),
+      cancelled_(false),
+      failed_(false),
+      started_(false),
+      fallen_back_(false) {
+  if (control_ == nullptr) {
+    LOG(ERROR) << "invalid control: null";
+    std::abort();
+  }
+  if (options_.name_prefix.empty() || options_.name_prefix[0] != '/' ||
+      options_.name_prefix.find('/', 1) != std::string::npos) {
+    LOG(ERROR) << "invalid name_prefix: " << options_.name_prefix;
+    std::abort();
+  }
+  if (options_.write_timeout_millis < 0) {
+    LOG(ERROR) << "invalid write_timeout_millis: "
+               << options_.write_timeout_millis;
+    std::abort();
+  }
+  for (Port port : options_.local_ports) {
+    if (PortBit(port) == 0) {
+      LOG(ERROR) << "invalid local_ports: " << Port_Name(port);
+      std::abort();
+    }
+  }
+}
+
+ShmEventTransport::~ShmEventTransport() {
+  TryCancel();
+  if (receive_thread_.joinable()) {
+    receive_thread_.join();
+  }
+  if (control_thread_.joinable()) {
+    control_thread_.join();
+  }
+  if (segment_ != nullptr) {
+    Leave();
+  }
+}
+
+bool ShmEventTransport::Open() {
+  {
+    std::lock_guard<std::mutex> lock(m_);
+    if (opened_) {
+      LOG(ERROR) << "Shared memory transport already open";
+      return false;
+    }
+  }
+  if (!control_->Open()) {
+    LOG(ERROR) << "Failed to open the control transport";
+    return false;
+  }
+  {
+    std::lock_guard<std::mutex> lock(m_);
+    opened_ = true;
+  }
+  control_thread_ = std::thread(&ShmEventTransport::ControlReadLoop, this);
+  return true;
+}
+
+bool ShmEventTransport::Write(const OutgoingEventPB& event) {
+  bool joined;
+  bool fallen_back;
+  {
+    std::lock_guard<std::mutex> lock(m_);
+    if (!opened_ || cancelled_ || failed_) {
+      return false;
+    }
+    joined = joined_;
+    fallen_back = fallen_back_;
+  }
+
+  if (event.has_client_ready()) {
+    // The others must be able to find this client before the server can
+    // start the game.
+    if (joined) {
+      LOG(ERROR) << "Client already joined console "
+                 << event.client_ready().console_id();
+      return false;
+    }
+    if (!Join(event.client_ready().console_id(),
+              event.client_ready().client_id())) {
+      return false;
+    }
+    return control_->Write(event);
+  }
+  if (event.key_press_size() == 0 || fallen_back) {
+    return control_->Write(event);
+  }
+  if (!joined) {
+    LOG(ERROR) << "Key presses written before the ClientReadyPB";
+    return false;
+  }
+
+  Segment::Ring& own = segment_->rings[index_];
+  // Only this thread writes to the ring.
+  int64_t written = own.written.load(std::memory_order_relaxed);
+  const int64_t deadline_nanos =
+      client_utils::now_nanos() + options_.write_timeout_millis * 1000000LL;
+  for (const KeyStatePB& key_press : event.key_press()) {
+    const size_t size = key_press.ByteSizeLong();
+    if (size > kSlotBytes) {
+      LOG(ERROR) << "Key press of " << size << " bytes doesn't fit a slot";
+      return false;
+    }
+
+    // Wait for every other client to have read the key press in the slot.
+    while (true) {
+      int64_t oldest_read = written;
+      for (int i = 0; i < kMaxClients; ++i) {
+        if (i != index_ && segment_->rings[i].client_id.load() > 0) {
+          oldest_read = std::min(
+              oldest_read, own.read[i].load(std::memory_order_acquire));
+        }
+      }
+      if (written - oldest_read < kRingSize) {
+        break;
+      }
+      if (client_utils::now_nanos() >= deadline_nanos) {
+        LOG(ERROR) << "Other clients stopped reading key presses, "
+                   << written - oldest_read << " are unread";
+        return false;
+      }
+      std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+
+    Segment::Slot& slot = own.slots[written % kRingSize];
+    key_press.SerializeWithCachedSizesToArray(
+        reinterpret_cast<uint8_t*>(slot.data));
+    slot.size = size;
+    ++written;
+  }
+  own.written.store(written, std::memory_order_release);
+  for (int i = 0; i < kMaxClients; ++i) {
+    if (i != index_) {
+      Wake(i);
+    }
+  }
+
+  // Anything else the event carries goes through the control transport.
+  control_event_.CopyFrom(event);
+  control_event_.clear_key_press();
+  if (control_event_.ByteSizeLong() == 0) {
+    return true;
+  }
+  return control_->Write(control_event_);
+}
+
+bool ShmEventTransport::Read(IncomingEventPB* event) {
+  std::unique_lock<std::mutex> lock(m_);
+  if (!opened_) {
+    return false;
+  }
+  cv_.wait(lock, [this] {
+    return cancelled_ || failed_ || control_closed_ || !incoming_.empty();
+  });
+  return !cancelled_ && !failed_ && incoming_.Pop(event);
+}
+
+void ShmEventTransport::TryCancel() {
+  bool joined;
+  {
+    std::lock_guard<std::mutex> lock(m_);
+    cancelled_ = true;
+    joined = joined_;
+    cv_.notify_all();
+  }
+  if (joined) {
+    Wake(index_);
+  }
+  control_->TryCancel();
+}
+
+bool ShmEventTransport::fallen_back() const {
+  std::lock_guard<std::mutex> lock(m_);
+  return fallen_back_;
+}
+
+bool ShmEventTransport::Join(int64_t console_id, int64_t client_id) {
+  if (client_id <= 0) {
+    LOG(ERROR) << "Invalid client ID: " << client_id;
+    return false;
+  }
+  const std::string name = options_.name_prefix + std::to_string(console_id);
+  const int fd = shm_open(name.c_str(), O_CREAT | O_RDWR, 0600);
+  if (fd < 0) {
+    LOG(ERROR) << "Failed to open " << name << ": " << std::strerror(errno);
+    return false;
+  }
+  struct stat status;
+  if (fstat(fd, &status) < 0) {
+    LOG(ERROR) << "Failed to stat " << name << ": " << std::strerror(errno);
+    close(fd);
+    return false;
+  }
+  if (status.st_size == 0) {
+    // Whoever gets here first sizes the object, to the same size.
+    if (ftruncate(fd, sizeof(Segment)) < 0) {
+      LOG(ERROR) << "Failed to size " << name << ": " << std::strerror(errno);
+      close(fd);
+      return false;
+    }
+  } else if (status.st_size != sizeof(Segment)) {
+    LOG(ERROR) << name << " has " << status.st_size << " bytes instead of "
+               << sizeof(Segment) << ", it belongs to another version";
+    close(fd);
+    return false;
+  }
+  void* address = mmap(nullptr, sizeof(Segment), PROT_READ | PROT_WRITE,
+                       MAP_SHARED, fd, 0);
+  close(fd);
+  if (address == MAP_FAILED) {
+    LOG(ERROR) << "Failed to map " << name << ": " << std::strerror(errno);
+    return false;
+  }
+  Segment* segment = static_cast<Segment*>(address);
+
+  // Free the rings of clients that exited without leaving, as after a crash,
+  // and claim one.
+  int index = -1;
+  for (int i = 0; i < kMaxClients; ++i) {
+    Segment::Ring& ring = segment->rings[i];
+    int64_t owner = ring.client_id.load();
+    if (owner > 0 && !ProcessAlive(ring.pid.load())) {
+      LOG(WARNING) << "Freeing the ring of client " << owner << " in " << name
+                   << ", whose process exited";
+      ring.client_id.compare_exchange_strong(owner, 0);
+    }
+    if (ring.client_id.load() == client_id) {
+      LOG(ERROR) << "Client " << client_id << " already joined " << name;
+      munmap(address, sizeof(Segment));
+      return false;
+    }
+  }
+  for (int i = 0; i < kMaxClients && index < 0; ++i) {
+    int64_t free_id = 0;
+    if (segment->rings[i].client_id.compare_exchange_strong(free_id, -1)) {
+      index = i;
+    }
+  }
+  if (index < 0) {
+    LOG(ERROR) << "Every ring of " << name << " is taken";
+    munmap(address, sizeof(Segment));
+    return false;
+  }
+
+  // Start the ring afresh, and read the others from their latest key press,
+  // which is where they are until the game starts.
+  Segment::Ring& own = segment->rings[index];
+  own.pid.store(getpid());
+  uint32_t ports = 0;
+  for (Port port : options_.local_ports) {
+    ports |= PortBit(port);
+  }
+  own.ports.store(ports);
+  own.written.store(0);
+  own.waiting.store(0);
+  for (int i = 0; i < kMaxClients; ++i) {
+    own.read[i].store(0);
+    if (i != index) {
+      segment->rings[i].read[index].store(segment->rings[i].written.load());
+    }
+  }
+  own.client_id.store(client_id);
+
+  {
+    std::lock_guard<std::mutex> lock(m_);
+    name_ = name;
+    segment_ = segment;
+    index_ = index;
+    joined_ = true;
+  }
+  receive_thread_ = std::thread(&ShmEventTransport::ReceiveLoop, this);
+  return true;
+}
+
+void ShmEventTransport::Leave() {
+  segment_->rings[index_].client_id.store(0);
+  bool in_use = false;
+  for (int i = 0; i < kMaxClients; ++i) {
+    in_use = in_use || segment_->rings[i].client_id.load() != 0;
+  }
+  munmap(segment_, sizeof(Segment));
+  segment_ = nullptr;
+  if (!in_use) {
+    shm_unlink(name_.c_str());
+  }
+}
+
+void ShmEventTransport::ReceiveLoop() {
+  Segment::Ring& own = segment_->rings[index_];
+  while (true) {
+    bool started;
+    {
+      std::lock_guard<std::mutex> lock(m_);
+      if (cancelled_) {
+        return;
+      }
+      started = started_;
+    }
+
+    // Writers check waiting after bumping the doorbell, so either they see it
+    // set and wake us up, or we see their key presses.
+    own.waiting.store(1);
+    const uint32_t doorbell = own.doorbell.load();
+    if (started && !ReadRings()) {
+      own.waiting.store(0);
+      {
+        std::lock_guard<std::mutex> lock(m_);
+        failed_ = true;
+        cv_.notify_all();
+      }
+      control_->TryCancel();
+      return;
+    }
+    if (received_event_.key_press_size() > 0) {
+      own.waiting.store(0);
+      std::lock_guard<std::mutex> lock(m_);
+      PushIncoming(&received_event_);
+      continue;
+    }
+    FutexWait(&own.doorbell, doorbell, kWaitMillis);
+    own.waiting.store(0);
+  }
+}
+
+void ShmEventTransport::ControlReadLoop() {
+  while (control_->Read(&control_read_event_)) {
+    bool wake = false;
+    {
+      std::lock_guard<std::mutex> lock(m_);
+      if (control_read_event_.has_start_game()) {
+        // By now, every client of the console on this host has joined, so
+        // the ports no ring claims belong to clients elsewhere.
+        uint32_t shared_ports = 0;
+        for (int i = 0; joined_ && i < kMaxClients; ++i) {
+          const Segment::Ring& ring = segment_->rings[i];
+          if (ring.client_id.load() > 0) {
+            shared_ports |= ring.ports.load();
+          }
+        }
+        for (const StartGamePB::ConnectedPortPB& connected :
+             control_read_event_.start_game().connected_ports()) {
+          if ((shared_ports & PortBit(connected.port())) == 0) {
+            LOG(WARNING) << "Port " << Port_Name(connected.port())
+                         << " has no client sharing memory, sending key "
+                            "presses through the control transport";
+            fallen_back_ = true;
+            break;
+          }
+        }
+        started_ = true;
+        wake = joined_;
+      }
+      PushIncoming(&control_read_event_);
+    }
+    if (wake) {
+      // The receive thread may read the key presses of the others now.
+      Wake(index_);
+    }
+  }
+  std::lock_guard<std::mutex> lock(m_);
+  control_closed_ = true;
+  cv_.notify_all();
+}
+
+bool ShmEventTransport::ReadRings() {
+  for (int i = 0; i < kMaxClients; ++i) {
+    Segment::Ring& ring = segment_->rings[i];
+    if (i == index_ || ring.client_id.load() <= 0) {
+      continue;
+    }
+    const int64_t read = ring.read[index_].load(std::memory_order_relaxed);
+    const int64_t written = ring.written.load(std::memory_order_acquire);
+    for (int64_t sequence = read; sequence < written; ++sequence) {
+      const Segment::Slot& slot = ring.slots[sequence % kRingSize];
+      if (slot.size > kSlotBytes ||
+          !received_event_.add_key_press()->ParseFromArray(slot.data,
+                                                           slot.size)) {
+        LOG(ERROR) << "Failed to parse key press " << sequence
+                   << " of client " << ring.client_id.load();
+        return false;
+      }
+    }
+    // Hands the slots back to the writer.
+    ring.read[index_].store(written, std::memory_order_release);
+  }
+  return true;
+}
+
+void ShmEventTransport::Wake(int index) {
+  Segment::Ring& ring = segment_->rings[index];
+  if (ring.client_id.load() <= 0) {
+    return;
+  }
+  ring.doorbell.fetch_add(1);
+  if (ring.waiting.load() != 0) {
+    FutexWake(&ring.doorbell);
+  }
+}
+
+void ShmEventTransport::PushIncoming(IncomingEventPB* event) {
+  incoming_.Push(event);
+  cv_.notify_all();
+}
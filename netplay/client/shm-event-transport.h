@@ -0,0 +1,144 @@
+#ifndef SHM_EVENT_TRANSPORT_H_
+#define SHM_EVENT_TRANSPORT_H_
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "base/netplayServiceProto.pb.h"
+#include "client/event-transport.h"
+#include "client/incoming-event-queue.h"
+
+struct ShmEventTransportOptions {
+  // Prefix of the name of the shared memory object of each console, see
+  // shm_open, which the console ID completes. Clients of a console share key
+  // presses if they run on the same host with the same prefix.
+  std::string name_prefix = "/mupen64plus-netplay-console-";
+
+  // How long a write waits for the other clients to read enough key presses
+  // to make room for its own, before failing.
+  int write_timeout_millis = 1000;
+
+  // Ports of this client, each one of PORT_1 to PORT_4, which it claims in
+  // the shared memory object. Key presses only go through shared memory if
+  // every connected port of the game is claimed there.
+  std::vector<Port> local_ports;
+};
+
+// EventTransport that exchanges key presses with the other clients of the
+// console through shared memory, and every other event through a control
+// transport, usually the server's event stream. Meant for several emulators
+// running on one host, for which the round trip through the server costs more
+// than the frame itself.
+//
+// The clients of a console find each other by console ID: each one maps the
+// shared memory object named after it, and claims a ring there under its
+// client ID when writing its ClientReadyPB. Key presses written to the ring
+// are read by every other client of the console, in order, and wake up the
+// ones waiting for them through a futex, without any system call if they are
+// not waiting. The object is removed once its last client is done with it.
+//
+// The server no longer sees the key presses, so every client of the console
+// must run on this host and use a ShmEventTransport. If a connected port of
+// the game isn't claimed by a client in the shared memory object by the time
+// the game starts, as when its client runs on another host, key presses go
+// through the control transport instead, for every client of the console.
+class ShmEventTransport : public EventTransport {
+ public:
+  // Exchanges the events other than key presses through control. std::abort's
+  // if control is null or options are invalid.
+  ShmEventTransport(std::unique_ptr<EventTransport> control,
+                    const ShmEventTransportOptions& options);
+
+  // Cancels the transport, joins its threads and leaves the console.
+  ~ShmEventTransport() override;
+
+  // Opens the control transport and starts the thread that reads it.
+  bool Open() override;
+
+  // Joins the console of a ClientReadyPB before sending it through the control
+  // transport. Writes the key presses of event to the ring of this client,
+  // and the rest of event, if any, through the control transport. Fails if
+  // the other clients stop reading key presses.
+  bool Write(const OutgoingEventPB& event) override;
+
+  // Fails once a key press read from shared memory is corrupt, which also
+  // cancels the control transport.
+  bool Read(IncomingEventPB* event) override;
+  void TryCancel() override;
+
+  // Whether key presses go through the control transport.
+  bool fallen_back() const;
+
+ private:
+  struct Segment;
+
+  // Maps the shared memory object of console_id and claims a ring in it for
+  // client_id. Only called from the writing thread.
+  bool Join(int64_t console_id, int64_t client_id);
+
+  // Releases the ring of this client, and removes the shared memory object
+  // if no other client uses it.
+  void Leave();
+
+  // Reads the rings of the other clients once the game started, until the
+  // transport is cancelled or a key press is corrupt.
+  void ReceiveLoop();
+
+  // Reads the control transport into the incoming events until it fails.
+  void ControlReadLoop();
+
+  // Reads the key presses of the other clients into received_event_. Returns
+  // false if one of them is corrupt, since the frames it held are lost.
+  bool ReadRings();
+
+  // Wakes up the reader of the ring at index, if it's waiting.
+  void Wake(int index);
+
+  // Queues *event to be read, leaving a cleared message in *event. Must hold
+  // m_.
+  void PushIncoming(IncomingEventPB* event);
+
+  const ShmEventTransportOptions options_;
+  std::unique_ptr<EventTransport> control_;
+
+  // Set by Join before the receive thread starts, and then left alone.
+  std::string name_;
+  Segment* segment_;
+  int index_;
+
+  std::thread receive_thread_;
+  std::thread control_thread_;
+
+  // Only used by the writing thread.
+  OutgoingEventPB control_event_;
+  // Only used by the control reading thread.
+  IncomingEventPB control_read_event_;
+  // Only used by the receive thread.
+  IncomingEventPB received_event_;
+
+  // m_ protects everything below. cv_ is notified when an event is queued and
+  // when the transport is cancelled or the control transport fails.
+  mutable std::mutex m_;
+  std::condition_variable cv_;
+
+  IncomingEventQueue incoming_;
+
+  bool opened_;
+  bool joined_;
+  bool control_closed_;
+  bool cancelled_;
+  // Whether a corrupt key press was read from shared memory, after which
+  // every read and write fails.
+  bool failed_;
+  // Whether the game start was queued, before which no key press may be.
+  bool started_;
+  bool fallen_back_;
+};
+
+#endif  // SHM_EVENT_TRANSPORT_H_
@@ -0,0 +1,407 @@
+#include "client/shm-event-transport.h"
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "gtest/gtest.h"
+
+#include "client/event-stream-handler.h"
+#include "client/loopback-event-transport.h"
+#include "client/test-utils.h"
+#include "client/trace-ring.h"
+
+namespace {
+
+using test_utils::IntegerCoder;
+using test_utils::KeyPressEvent;
+using test_utils::ReadFrames;
+
+const int kConsoleId = 101;
+
+// Plays the server on the control transports of several clients, one per port
+// from PORT_1 on. Starts the game once every client is ready, and relays key
+// presses to the other clients.
+class RelayServer {
+ public:
+  explicit RelayServer(int num_clients) {
+    for (int i = 0; i < num_clients; ++i) {
+      clients_.emplace_back(new Client(this, i));
+    }
+  }
+
+  LoopbackEventTransport::Peer* client(int index) {
+    return clients_[index].get();
+  }
+
+  // Stops relaying, before the transports of the clients are destroyed.
+  void Stop() {
+    std::lock_guard<std::mutex> lock(m_);
+    stopped_ = true;
+  }
+
+  int relayed_key_presses() {
+    std::lock_guard<std::mutex> lock(m_);
+    return relayed_key_presses_;
+  }
+
+ private:
+  struct Client : public LoopbackEventTransport::Peer {
+    Client(RelayServer* server, int index) : server(server), index(index) {}
+
+    void HandleEvent(const OutgoingEventPB& event,
+                     LoopbackEventTransport* transport) override {
+      server->HandleEvent(index, event, transport);
+    }
+
+    RelayServer* const server;
+    const int index;
+    LoopbackEventTransport* transport = nullptr;
+  };
+
+  void HandleEvent(int index, const OutgoingEventPB& event,
+                   LoopbackEventTransport* transport) {
+    std::lock_guard<std::mutex> lock(m_);
+    if (stopped_) {
+      return;
+    }
+    Client& sender = *clients_[index];
+    if (event.has_client_ready()) {
+      sender.transport = transport;
+      if (++ready_ == clients_.size()) {
+        for (const auto& client : clients_) {
+          StartGamePB* start_game = reply_.mutable_start_game();
+          start_game->set_console_id(kConsoleId);
+          for (const auto& other : clients_) {
+            start_game->add_connected_ports()->set_port(
+                static_cast<Port>(PORT_1 + other->index));
+          }
+          client->transport->Deliver(&reply_);
+        }
+      }
+    }
+    if (event.key_press_size() > 0) {
+      relayed_key_presses_ += event.key_press_size();
+      for (const auto& client : clients_) {
+        if (client.get() != &sender && client->transport != nullptr) {
+          reply_.mutable_key_press()->CopyFrom(event.key_press());
+          client->transport->Deliver(&reply_);
+        }
+      }
+    }
+  }
+
+  std::mutex m_;
+  std::vector<std::unique_ptr<Client>> clients_;
+  size_t ready_ = 0;
+  bool stopped_ = false;
+  int relayed_key_presses_ = 0;
+  IncomingEventPB reply_;
+};
+
+OutgoingEventPB ClientReadyEvent(int64_t client_id) {
+  OutgoingEventPB event;
+  event.mutable_client_ready()->set_console_id(kConsoleId);
+  event.mutable_client_ready()->set_client_id(client_id);
+  return event;
+}
+
+}  // namespace
+
+class ShmEventTransportTest : public ::testing::Test {
+ protected:
+  typedef EventStreamHandler<uint32_t> IntHandler;
+
+  ShmEventTransportTest() {
+    // Tests running at the same time must not share consoles.
+    options_.name_prefix =
+        "/netplay-shm-test-" + std::to_string(getpid()) + "-";
+  }
+
+  void TearDown() override {
+    if (server_ != nullptr) {
+      server_->Stop();
+    }
+  }
+
+  // Options of the transport of the client at index, on its port.
+  ShmEventTransportOptions ClientOptions(int index) const {
+    ShmEventTransportOptions options = options_;
+    options.local_ports = {static_cast<Port>(PORT_1 + index)};
+    return options;
+  }
+
+  // Makes num_clients transports, each with a control transport to server_.
+  void MakeTransports(int num_clients) {
+    server_.reset(new RelayServer(num_clients));
+    for (int i = 0; i < num_clients; ++i) {
+      transports_.emplace_back(new ShmEventTransport(
+          std::unique_ptr<EventTransport>(
+              new LoopbackEventTransport(server_->client(i))),
+          ClientOptions(i)));
+    }
+  }
+
+  // Reads events from transport until the game starts.
+  static bool WaitForStart(ShmEventTransport* transport) {
+    IncomingEventPB event;
+    return transport->Read(&event) && event.has_start_game();
+  }
+
+  // Makes a handler for each transport, on the port of its client, starts the
+  // game, and plays frames in lockstep, each client pressing the frame number
+  // plus its port number.
+  void Play(int frames) {
+    const int num_clients = transports_.size();
+    for (int i = 0; i < num_clients; ++i) {
+      traces_.emplace_back(new TraceRing());
+      handlers_.emplace_back(new IntHandler(
+          kConsoleId, i + 1, {static_cast<Port>(PORT_1 + i)},
+          traces_.back().get(), &coder_,
+          std::unique_ptr<EventTransport>(transports_[i].release())));
+    }
+    for (const auto& handler : handlers_) {
+      ASSERT_TRUE(handler->ClientReady());
+    }
+    for (const auto& handler : handlers_) {
+      ASSERT_TRUE(handler->WaitForConsoleStart());
+    }
+
+    auto play = [frames, num_clients](IntHandler* handler, Port local_port) {
+      for (int frame = 0; frame < frames; ++frame) {
+        ASSERT_EQ(IntHandler::PutButtonsStatus::SUCCESS,
+                  handler->PutButtons({std::make_tuple(
+                      local_port, frame,
+                      static_cast<uint32_t>(frame + local_port))}));
+        for (int i = 0; i < num_clients; ++i) {
+          const Port port = static_cast<Port>(PORT_1 + i);
+          uint32_t buttons = 0;
+          ASSERT_EQ(IntHandler::GetButtonsStatus::SUCCESS,
+                    handler->GetButtons(port, frame, &buttons));
+          EXPECT_EQ(frame + port, buttons);
+        }
+      }
+    };
+    std::vector<std::thread> players;
+    for (int i = 0; i < num_clients; ++i) {
+      players.emplace_back(play, handlers_[i].get(),
+                           static_cast<Port>(PORT_1 + i));
+    }
+    for (std::thread& player : players) {
+      player.join();
+    }
+  }
+
+  // Name of the shared memory object of the test console.
+  std::string SegmentName() const {
+    return options_.name_prefix + std::to_string(kConsoleId);
+  }
+
+  ShmEventTransportOptions options_;
+  // Must outlive the transports.
+  std::unique_ptr<RelayServer> server_;
+  const IntegerCoder coder_;
+  std::vector<std::unique_ptr<TraceRing>> traces_;
+  std::vector<std::unique_ptr<IntHandler>> handlers_;
+  std::vector<std::unique_ptr<ShmEventTransport>> transports_;
+};
+
+TEST_F(ShmEventTransportTest, InvalidOptions) {
+  EXPECT_DEATH(ShmEventTransport(std::unique_ptr<EventTransport>(), options_),
+               "invalid control");
+
+  ShmEventTransportOptions options = options_;
+  options.name_prefix = "no-leading-slash-";
+  EXPECT_DEATH(ShmEventTransport(std::unique_ptr<EventTransport>(
+                                     new LoopbackEventTransport(nullptr)),
+                                 options),
+               "invalid name_prefix");
+
+  options = options_;
+  options.write_timeout_millis = -1;
+  EXPECT_DEATH(ShmEventTransport(std::unique_ptr<EventTransport>(
+                                     new LoopbackEventTransport(nullptr)),
+                                 options),
+               "invalid write_timeout_millis");
+
+  options = options_;
+  options.local_ports = {PORT_ANY};
+  EXPECT_DEATH(ShmEventTransport(std::unique_ptr<EventTransport>(
+                                     new LoopbackEventTransport(nullptr)),
+                                 options),
+               "invalid local_ports");
+}
+
+TEST_F(ShmEventTransportTest, KeyPressesGoToOtherClients) {
+  MakeTransports(2);
+  for (int i = 0; i < 2; ++i) {
+    ASSERT_TRUE(transports_[i]->Open());
+    ASSERT_TRUE(transports_[i]->Write(ClientReadyEvent(i + 1)));
+  }
+  for (int i = 0; i < 2; ++i) {
+    ASSERT_TRUE(WaitForStart(transports_[i].get()));
+    EXPECT_FALSE(transports_[i]->fallen_back());
+  }
+
+  for (int frame = 0; frame < 3; ++frame) {
+    ASSERT_TRUE(
+        transports_[0]->Write(KeyPressEvent(kConsoleId, PORT_1, frame)));
+  }
+  EXPECT_EQ(std::vector<int>({0, 1, 2}), ReadFrames(transports_[1].get(), 3));
+  EXPECT_EQ(0, server_->relayed_key_presses());
+}
+
+TEST_F(ShmEventTransportTest, KeyPressesBeforeReadyFail) {
+  MakeTransports(1);
+  ASSERT_TRUE(transports_[0]->Open());
+  EXPECT_FALSE(transports_[0]->Write(KeyPressEvent(kConsoleId, PORT_1, 0)));
+}
+
+TEST_F(ShmEventTransportTest, ClientJoinsOnce) {
+  MakeTransports(2);
+  for (int i = 0; i < 2; ++i) {
+    ASSERT_TRUE(transports_[i]->Open());
+  }
+  ASSERT_TRUE(transports_[0]->Write(ClientReadyEvent(1)));
+  EXPECT_FALSE(transports_[0]->Write(ClientReadyEvent(1)));
+  EXPECT_FALSE(transports_[1]->Write(ClientReadyEvent(1)));
+}
+
+TEST_F(ShmEventTransportTest, WritesFailOnceReadersFallTooFarBehind) {
+  options_.write_timeout_millis = 20;
+  // The game never starts, so client 2 never reads.
+  MakeTransports(3);
+  for (int i = 0; i < 2; ++i) {
+    ASSERT_TRUE(transports_[i]->Open());
+    ASSERT_TRUE(transports_[i]->Write(ClientReadyEvent(i + 1)));
+  }
+
+  int frame = 0;
+  while (frame < 10000 &&
+         transports_[0]->Write(KeyPressEvent(kConsoleId, PORT_1, frame))) {
+    ++frame;
+  }
+  EXPECT_GT(frame, 0);
+  EXPECT_LT(frame, 10000);
+}
+
+TEST_F(ShmEventTransportTest, CorruptKeyPressFailsTransport) {
+  // The game starts once client 3 is ready.
+  MakeTransports(3);
+  for (int i = 0; i < 3; ++i) {
+    ASSERT_TRUE(transports_[i]->Open());
+  }
+  for (int i = 0; i < 2; ++i) {
+    ASSERT_TRUE(transports_[i]->Write(ClientReadyEvent(i + 1)));
+  }
+  OutgoingEventPB event = KeyPressEvent(kConsoleId, PORT_1, 0);
+  event.mutable_key_press(0)->set_x_axis(0x5eed);
+  ASSERT_TRUE(transports_[0]->Write(event));
+
+  // Overwrites the key press in shared memory with an unterminated varint.
+  const std::string bytes = event.key_press(0).SerializeAsString();
+  const int fd = shm_open(SegmentName().c_str(), O_RDWR, 0);
+  ASSERT_GE(fd, 0);
+  struct stat status;
+  ASSERT_EQ(0, fstat(fd, &status));
+  void* address = mmap(nullptr, status.st_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED, fd, 0);
+  close(fd);
+  ASSERT_NE(MAP_FAILED, address);
+  void* slot = memmem(address, status.st_size, bytes.data(), bytes.size());
+  ASSERT_NE(nullptr, slot);
+  memset(slot, 0xff, bytes.size());
+  munmap(address, status.st_size);
+
+  ASSERT_TRUE(transports_[2]->Write(ClientReadyEvent(3)));
+  EXPECT_EQ(std::vector<int>(), ReadFrames(transports_[1].get(), 1));
+  EXPECT_FALSE(transports_[1]->Write(KeyPressEvent(kConsoleId, PORT_2, 0)));
+}
+
+TEST_F(ShmEventTransportTest, FallsBackWithoutOtherClients) {
+  MakeTransports(2);
+  // Client 2 is as good as on another host.
+  ShmEventTransportOptions other_host = ClientOptions(1);
+  other_host.name_prefix += "other-host-";
+  transports_[1].reset(new ShmEventTransport(
+      std::unique_ptr<EventTransport>(
+          new LoopbackEventTransport(server_->client(1))),
+      other_host));
+  ShmEventTransport* transport_1 = transports_[0].get();
+  ShmEventTransport* transport_2 = transports_[1].get();
+  Play(20);
+
+  EXPECT_TRUE(transport_1->fallen_back());
+  EXPECT_TRUE(transport_2->fallen_back());
+  EXPECT_EQ(40, server_->relayed_key_presses());
+}
+
+TEST_F(ShmEventTransportTest, FallsBackWithClientOffSharedMemory) {
+  MakeTransports(3);
+  // Client 3 goes through the server only.
+  LoopbackEventTransport server_only(server_->client(2));
+  for (int i = 0; i < 2; ++i) {
+    ASSERT_TRUE(transports_[i]->Open());
+    ASSERT_TRUE(transports_[i]->Write(ClientReadyEvent(i + 1)));
+  }
+  ASSERT_TRUE(server_only.Open());
+  ASSERT_TRUE(server_only.Write(ClientReadyEvent(3)));
+  for (int i = 0; i < 2; ++i) {
+    ASSERT_TRUE(WaitForStart(transports_[i].get()));
+    EXPECT_TRUE(transports_[i]->fallen_back());
+  }
+
+  ASSERT_TRUE(transports_[0]->Write(KeyPressEvent(kConsoleId, PORT_1, 0)));
+  EXPECT_EQ(std::vector<int>({0}), ReadFrames(transports_[1].get(), 1));
+  IncomingEventPB event;
+  do {
+    ASSERT_TRUE(server_only.Read(&event));
+  } while (event.key_press_size() == 0);
+  EXPECT_EQ(0, event.key_press(0).frame_number());
+  EXPECT_EQ(1, server_->relayed_key_presses());
+}
+
+TEST_F(ShmEventTransportTest, HandlersPlayInLockstep) {
+  MakeTransports(4);
+  std::vector<ShmEventTransport*> transports;
+  for (const auto& transport : transports_) {
+    transports.push_back(transport.get());
+  }
+  Play(300);
+
+  for (ShmEventTransport* transport : transports) {
+    EXPECT_FALSE(transport->fallen_back());
+  }
+  EXPECT_EQ(0, server_->relayed_key_presses());
+}
+
+TEST_F(ShmEventTransportTest, LastClientRemovesSegment) {
+  MakeTransports(2);
+  for (int i = 0; i < 2; ++i) {
+    ASSERT_TRUE(transports_[i]->Open());
+    ASSERT_TRUE(transports_[i]->Write(ClientReadyEvent(i + 1)));
+  }
+
+  transports_[0].reset();
+  int fd = shm_open(SegmentName().c_str(), O_RDONLY, 0);
+  EXPECT_GE(fd, 0);
+  if (fd >= 0) {
+    close(fd);
+  }
+
+  transports_[1].reset();
+  fd = shm_open(SegmentName().c_str(), O_RDONLY, 0);
+  EXPECT_LT(fd, 0);
+  if (fd >= 0) {
+    close(fd);
+  }
+}
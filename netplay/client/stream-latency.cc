@@ -0,0 +1,49 @@
+#include "client/stream-latency.h"
+
+#include <cstdlib>
+
+#include "glog/logging.h"
+
+bool StreamLatencyEstimator::AddSample(const StreamPingPB& pong,
+                                       int64_t receive_nanos) {
+  const int64_t round_trip_nanos = receive_nanos - pong.client_send_nanos();
+  const int64_t server_nanos =
+      pong.server_send_nanos() - pong.server_receive_nanos();
+  const int64_t rtt_nanos = round_trip_nanos - server_nanos;
+  if (round_trip_nanos < 0 || server_nanos < 0 || rtt_nanos < 0) {
+    LOG(ERROR) << "Ignoring stream ping with inconsistent timestamps, received "
+               << "at " << receive_nanos << ": " << pong.DebugString();
+    return false;
+  }
+  const int64_t offset_nanos =
+      ((pong.server_receive_nanos() - pong.client_send_nanos()) +
+       (pong.server_send_nanos() - receive_nanos)) /
+      2;
+
+  if (latency_.samples() == 0) {
+    latency_.set_smoothed_rtt_nanos(rtt_nanos);
+    latency_.set_jitter_nanos(rtt_nanos / 2);
+    latency_.set_clock_offset_nanos(offset_nanos);
+  } else {
+    // The jitter is updated first, from the previous smoothed round trip time.
+    const int64_t deviation =
+        std::abs(latency_.smoothed_rtt_nanos() - rtt_nanos);
+    latency_.set_jitter_nanos(latency_.jitter_nanos() +
+                              (deviation - latency_.jitter_nanos()) / 4);
+    latency_.set_smoothed_rtt_nanos(
+        latency_.smoothed_rtt_nanos() +
+        (rtt_nanos - latency_.smoothed_rtt_nanos()) / 8);
+    latency_.set_clock_offset_nanos(
+        latency_.clock_offset_nanos() +
+        (offset_nanos - latency_.clock_offset_nanos()) / 8);
+  }
+  latency_.set_samples(latency_.samples() + 1);
+  latency_.set_last_rtt_nanos(rtt_nanos);
+
+  VLOG(2) << "Stream round trip time " << rtt_nanos / 1000
+          << "us, smoothed " << latency_.smoothed_rtt_nanos() / 1000
+          << "us, jitter " << latency_.jitter_nanos() / 1000
+          << "us, server clock offset " << latency_.clock_offset_nanos() / 1000
+          << "us";
+  return true;
+}
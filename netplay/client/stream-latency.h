@@ -0,0 +1,37 @@
+#ifndef STREAM_LATENCY_H_
+#define STREAM_LATENCY_H_
+
+#include <cstdint>
+
+#include "base/netplayServiceProto.pb.h"
+#include "base/timings.pb.h"
+
+// Estimates the round trip time of the event stream and the offset of the
+// server's clock from the client's, from pings the client sends on the stream
+// and the server echoes back, the way NTP does. For a ping sent by the client
+// at t0, received by the server at t1, echoed at t2 and received back by the
+// client at t3:
+//   round trip time = (t3 - t0) - (t2 - t1)
+//   clock offset    = ((t1 - t0) + (t2 - t3)) / 2
+// The offset is exact if both directions take the same time.
+//
+// Like TCP's round trip time estimator (RFC 6298), the round trip time and
+// offset are smoothed with a gain of 1/8, and the jitter is the mean deviation
+// of the round trip time samples from the smoothed round trip time, smoothed
+// with a gain of 1/4.
+//
+// Not thread safe.
+class StreamLatencyEstimator {
+ public:
+  // Adds the sample of an echoed ping, received at receive_nanos on the
+  // client's clock. Returns false and ignores the sample if its timestamps are
+  // inconsistent.
+  bool AddSample(const StreamPingPB& pong, int64_t receive_nanos);
+
+  const StreamLatencyPB& latency() const { return latency_; }
+
+ private:
+  StreamLatencyPB latency_;
+};
+
+#endif  // STREAM_LATENCY_H_
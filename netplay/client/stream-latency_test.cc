@@ -0,0 +1,76 @@
+#include "client/stream-latency.h"
+
+#include "gtest/gtest.h"
+
+namespace {
+
+StreamPingPB MakePong(int64_t client_send_nanos, int64_t server_receive_nanos,
+                      int64_t server_send_nanos) {
+  StreamPingPB pong;
+  pong.set_client_send_nanos(client_send_nanos);
+  pong.set_server_receive_nanos(server_receive_nanos);
+  pong.set_server_send_nanos(server_send_nanos);
+  return pong;
+}
+
+}  // namespace
+
+// -----------------------------------------------------------------------------
+// StreamLatencyEstimator
+
+TEST(StreamLatencyEstimatorTest, FirstSample) {
+  StreamLatencyEstimator estimator;
+  EXPECT_EQ(0, estimator.latency().samples());
+
+  // 10 ns each way, 5 ns spent on the server, whose clock is 1000 ns ahead.
+  ASSERT_TRUE(estimator.AddSample(MakePong(100, 1110, 1115), 125));
+  const StreamLatencyPB& latency = estimator.latency();
+  EXPECT_EQ(1, latency.samples());
+  EXPECT_EQ(20, latency.last_rtt_nanos());
+  EXPECT_EQ(20, latency.smoothed_rtt_nanos());
+  EXPECT_EQ(10, latency.jitter_nanos());
+  EXPECT_EQ(1000, latency.clock_offset_nanos());
+}
+
+TEST(StreamLatencyEstimatorTest, AsymmetricPathsSkewOffset) {
+  StreamLatencyEstimator estimator;
+
+  // 30 ns to the server and 10 ns back, with synchronized clocks.
+  ASSERT_TRUE(estimator.AddSample(MakePong(0, 30, 30), 40));
+  EXPECT_EQ(40, estimator.latency().smoothed_rtt_nanos());
+  EXPECT_EQ(10, estimator.latency().clock_offset_nanos());
+}
+
+TEST(StreamLatencyEstimatorTest, Smoothing) {
+  StreamLatencyEstimator estimator;
+  ASSERT_TRUE(estimator.AddSample(MakePong(0, 400, 400), 800));
+  ASSERT_TRUE(estimator.AddSample(MakePong(1000, 1800, 1800), 2600));
+
+  const StreamLatencyPB& latency = estimator.latency();
+  EXPECT_EQ(2, latency.samples());
+  EXPECT_EQ(1600, latency.last_rtt_nanos());
+  // 800 + (1600 - 800) / 8
+  EXPECT_EQ(900, latency.smoothed_rtt_nanos());
+  // 400 + (|800 - 1600| - 400) / 4
+  EXPECT_EQ(500, latency.jitter_nanos());
+  EXPECT_EQ(0, latency.clock_offset_nanos());
+
+  // Samples that agree with the estimate shrink the jitter.
+  for (int i = 0; i < 100; ++i) {
+    ASSERT_TRUE(estimator.AddSample(MakePong(0, 450, 450), 900));
+  }
+  EXPECT_NEAR(900, latency.smoothed_rtt_nanos(), 8);
+  EXPECT_LT(latency.jitter_nanos(), 10);
+}
+
+TEST(StreamLatencyEstimatorTest, InconsistentTimestamps) {
+  StreamLatencyEstimator estimator;
+
+  // Received before it was sent.
+  EXPECT_FALSE(estimator.AddSample(MakePong(100, 150, 150), 50));
+  // Echoed before it was received.
+  EXPECT_FALSE(estimator.AddSample(MakePong(0, 150, 100), 200));
+  // Spent longer on the server than the whole round trip.
+  EXPECT_FALSE(estimator.AddSample(MakePong(0, 1000, 2000), 100));
+  EXPECT_EQ(0, estimator.latency().samples());
+}
@@ -1,5 +1,62 @@
+#ifndef TEST_UTILS_H_
+#define TEST_UTILS_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
 #include "gtest/gtest.h"
 
+#include "base/netplayServiceProto.pb.h"
+#include "client/button-coder-interface.h"
+
 #define TRACED_CALL(__CALL__) \
 { SCOPED_TRACE(""); \
   {__CALL__;}}
+
+namespace test_utils {
+
+// Stores a 32 bit integer in the x_axis field of the KeyStatePB proto.
+class IntegerCoder : public ButtonCoderInterface<uint32_t> {
+ public:
+  bool EncodeButtons(const uint32_t& in,
+                     KeyStatePB* buttons_out) const override {
+    buttons_out->set_x_axis(in);
+    return true;
+  }
+  bool DecodeButtons(const KeyStatePB& buttons_in,
+                     uint32_t* out) const override {
+    *out = buttons_in.x_axis();
+    return true;
+  }
+};
+
+// Returns an event with the key press of port for frame_number.
+inline OutgoingEventPB KeyPressEvent(int64_t console_id, Port port,
+                                     int frame_number) {
+  OutgoingEventPB event;
+  KeyStatePB* key_press = event.add_key_press();
+  key_press->set_console_id(console_id);
+  key_press->set_port(port);
+  key_press->set_frame_number(frame_number);
+  return event;
+}
+
+// Reads events from transport, an EventTransport, until count key presses
+// were read, and returns their frame numbers in the order they were read.
+template <typename Transport>
+std::vector<int> ReadFrames(Transport* transport, int count) {
+  std::vector<int> frames;
+  IncomingEventPB event;
+  while (frames.size() < static_cast<size_t>(count) &&
+         transport->Read(&event)) {
+    for (const KeyStatePB& key_press : event.key_press()) {
+      frames.push_back(key_press.frame_number());
+    }
+  }
+  return frames;
+}
+
+}  // namespace test_utils
+
+#endif  // TEST_UTILS_H_
@@ -0,0 +1,130 @@
+#include "client/time-sync.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+
+#include "glog/logging.h"
+
+TimeSync::TimeSync(int window_frames, int64_t frame_period_nanos,
+                   double max_frame_stretch)
+    : window_frames_(window_frames),
+      frame_period_nanos_(frame_period_nanos),
+      max_stretch_nanos_(
+          static_cast<int64_t>(frame_period_nanos * max_frame_stretch)),
+      local_frame_(-1),
+      pacing_debt_nanos_(0),
+      settled_frame_(0) {
+  if (window_frames_ <= 0) {
+    LOG(ERROR) << "invalid window_frames: " << window_frames_;
+    std::abort();
+  }
+  if (frame_period_nanos_ <= 0) {
+    LOG(ERROR) << "invalid frame_period_nanos: " << frame_period_nanos_;
+    std::abort();
+  }
+  if (max_frame_stretch <= 0 || max_frame_stretch > 1 ||
+      max_stretch_nanos_ <= 0) {
+    LOG(ERROR) << "invalid max_frame_stretch: " << max_frame_stretch;
+    std::abort();
+  }
+}
+
+void TimeSync::ObserveRemoteFrame(Port port, int frame) {
+  Peer& peer = peers_[port];
+  peer.last_received_frame = std::max(peer.last_received_frame, frame);
+}
+
+void TimeSync::ObserveRemoteStatus(const FrameStatusPB& status) {
+  if (status.last_received_frame() < 0) {
+    return;
+  }
+  Peer& peer = peers_[status.port()];
+  peer.reported = true;
+  peer.reported_advantage =
+      status.current_frame() - status.last_received_frame();
+}
+
+void TimeSync::ObserveLocalFrame(Port port, int frame,
+                                 FrameStatusPB* status) {
+  int last_received_frame = -1;
+  for (const auto& it : peers_) {
+    const int received = it.second.last_received_frame;
+    if (received >= 0 &&
+        (last_received_frame < 0 || received < last_received_frame)) {
+      last_received_frame = received;
+    }
+  }
+
+  if (frame > local_frame_) {
+    local_frame_ = frame;
+    bool sampled = false;
+    for (auto& it : peers_) {
+      Peer& peer = it.second;
+      if (!peer.reported || peer.last_received_frame < 0) {
+        continue;
+      }
+      if (peer.local_samples.empty()) {
+        peer.local_samples.resize(window_frames_, 0);
+        peer.remote_samples.resize(window_frames_, 0);
+      }
+      const int slot = peer.samples % window_frames_;
+      const int local_advantage = frame - peer.last_received_frame;
+      peer.local_sum += local_advantage - peer.local_samples[slot];
+      peer.remote_sum += peer.reported_advantage - peer.remote_samples[slot];
+      peer.local_samples[slot] = local_advantage;
+      peer.remote_samples[slot] = peer.reported_advantage;
+      ++peer.samples;
+      sampled = true;
+    }
+    if (sampled) {
+      stats_.set_samples(stats_.samples() + 1);
+      stats_.set_frame_advantage(frame_advantage());
+    }
+  }
+
+  status->set_port(port);
+  status->set_current_frame(local_frame_);
+  status->set_last_received_frame(last_received_frame);
+}
+
+double TimeSync::frame_advantage() const {
+  bool sampled = false;
+  double advantage = 0;
+  for (const auto& it : peers_) {
+    const Peer& peer = it.second;
+    if (peer.samples == 0) {
+      continue;
+    }
+    const double samples = std::min<int64_t>(peer.samples, window_frames_);
+    const double peer_advantage =
+        (peer.local_sum - peer.remote_sum) / samples / 2;
+    if (!sampled || peer_advantage > advantage) {
+      advantage = peer_advantage;
+      sampled = true;
+    }
+  }
+  return advantage;
+}
+
+int64_t TimeSync::TakePacingNanos() {
+  if (pacing_debt_nanos_ == 0) {
+    const double advantage = frame_advantage();
+    if (local_frame_ - settled_frame_ < window_frames_ || advantage < 1) {
+      return 0;
+    }
+    pacing_debt_nanos_ = std::llround(advantage * frame_period_nanos_);
+    VLOG(2) << "Running " << advantage
+            << " frames ahead, slowing down by " << pacing_debt_nanos_
+            << " ns";
+  }
+
+  const int64_t pacing_nanos = std::min(pacing_debt_nanos_, max_stretch_nanos_);
+  pacing_debt_nanos_ -= pacing_nanos;
+  if (pacing_debt_nanos_ == 0) {
+    settled_frame_ = local_frame_;
+  }
+  stats_.set_paced_frames(stats_.paced_frames() + 1);
+  stats_.set_paced_nanos(stats_.paced_nanos() + pacing_nanos);
+  return pacing_nanos;
+}
@@ -0,0 +1,112 @@
+#ifndef TIME_SYNC_H_
+#define TIME_SYNC_H_
+
+#include <cstdint>
+#include <map>
+#include <vector>
+
+#include "base/netplayServiceProto.pb.h"
+#include "base/timings.pb.h"
+
+// Estimates by how many frames the local emulator runs ahead of the remote
+// ones, and recommends slowing it down so that they stay within a frame of
+// each other instead of taking turns stalling on each other's buttons.
+//
+// Every client reports its current frame and the latest remote frame it
+// received buttons for. For a remote client, the local advantage is the local
+// frame minus the latest frame received from it, and its advantage is what it
+// reports. Both include the time buttons take to travel, so half of their
+// difference is the number of frames by which the local emulator is ahead:
+//   local  = a - (b - latency)
+//   remote = b - (a - latency)
+//   (local - remote) / 2 = a - b
+// Both advantages are averaged over a window of frames to smooth out jitter.
+// Clients with several remote clients report the latest frame received from
+// the one furthest behind, which understates their own advantage over the
+// others.
+//
+// Frames are emulated frames, not the frames buttons are delayed to. Not
+// thread safe.
+class TimeSync {
+ public:
+  // Arguments are:
+  //  - window_frames: number of frames over which advantages are averaged,
+  //    which is also the least number of frames between corrections.
+  //  - frame_period_nanos: time the console takes to emulate one frame.
+  //  - max_frame_stretch: share of a frame period by which a single frame may
+  //    be slowed down, in (0, 1].
+  // std::abort's if any argument is out of range.
+  TimeSync(int window_frames, int64_t frame_period_nanos,
+           double max_frame_stretch);
+
+  // Records that the buttons of port for remote frame arrived.
+  void ObserveRemoteFrame(Port port, int frame);
+
+  // Records the frame status reported by the client that owns status.port().
+  // Statuses of clients that haven't received any remote frame yet are
+  // ignored.
+  void ObserveRemoteStatus(const FrameStatusPB& status);
+
+  // Records that the local emulator reached frame, and samples the advantage
+  // over every remote client that has reported its status. Populates *status
+  // with the status to report, on behalf of port. Frames that are not past the
+  // latest local frame are not sampled again.
+  void ObserveLocalFrame(Port port, int frame, FrameStatusPB* status);
+
+  // Returns the number of frames by which the local emulator is ahead of the
+  // remote client furthest behind, averaged over the window, or 0 if no
+  // advantage was sampled yet. Negative if every remote client is ahead.
+  double frame_advantage() const;
+
+  // Returns the latest frame observed by ObserveLocalFrame, or -1.
+  int local_frame() const { return local_frame_; }
+
+  // Returns the time by which to slow down the next frame. Meant to be called
+  // once per frame. Once the advantage reaches a frame, it is paid back by
+  // stretching the following frames by at most max_frame_stretch each, and
+  // then left to settle for a window.
+  int64_t TakePacingNanos();
+
+  const TimeSyncPB& stats() const { return stats_; }
+
+ private:
+  // What is known about the client that owns a remote port.
+  struct Peer {
+    Peer()
+        : last_received_frame(-1),
+          reported(false),
+          reported_advantage(0),
+          samples(0),
+          local_sum(0),
+          remote_sum(0) {}
+
+    // Latest remote frame received, or -1.
+    int last_received_frame;
+    // Whether the client reported its status, and the advantage it reported.
+    bool reported;
+    int reported_advantage;
+    // Sampled advantages of the local and remote emulators, indexed by
+    // sample modulo the window, and their sums over the window.
+    std::vector<int> local_samples;
+    std::vector<int> remote_samples;
+    int64_t samples;
+    int64_t local_sum;
+    int64_t remote_sum;
+  };
+
+  const int window_frames_;
+  const int64_t frame_period_nanos_;
+  const int64_t max_stretch_nanos_;
+
+  std::map<int /* Port */, Peer> peers_;
+  int local_frame_;
+
+  // Time still to be paid back by the current correction, and the local frame
+  // at which the latest correction was paid back.
+  int64_t pacing_debt_nanos_;
+  int settled_frame_;
+
+  TimeSyncPB stats_;
+};
+
+#endif  // TIME_SYNC_H_
@@ -0,0 +1,137 @@
+#include "client/time-sync.h"
+
+#include "gtest/gtest.h"
+
+namespace {
+
+const int64_t kFramePeriodNanos = 16 * 1000 * 1000;
+
+FrameStatusPB MakeStatus(Port port, int current_frame,
+                         int last_received_frame) {
+  FrameStatusPB status;
+  status.set_port(port);
+  status.set_current_frame(current_frame);
+  status.set_last_received_frame(last_received_frame);
+  return status;
+}
+
+// Plays frames [begin, end) on two clients, the local one ahead_frames ahead
+// of the remote one on PORT_2, with buttons taking latency_frames to travel
+// either way.
+void PlayFrames(TimeSync* sync, int begin, int end, int ahead_frames,
+                int latency_frames) {
+  FrameStatusPB status;
+  for (int frame = begin; frame < end; ++frame) {
+    const int remote_frame = frame - ahead_frames;
+    sync->ObserveRemoteFrame(PORT_2, remote_frame - latency_frames);
+    sync->ObserveRemoteStatus(MakeStatus(PORT_2, remote_frame - latency_frames,
+                                         frame - 2 * latency_frames));
+    sync->ObserveLocalFrame(PORT_1, frame, &status);
+  }
+}
+
+}  // namespace
+
+TEST(TimeSyncTest, InvalidArguments) {
+  EXPECT_DEATH(TimeSync(0, kFramePeriodNanos, 0.5), "invalid window_frames");
+  EXPECT_DEATH(TimeSync(10, 0, 0.5), "invalid frame_period_nanos");
+  EXPECT_DEATH(TimeSync(10, kFramePeriodNanos, 0), "invalid max_frame_stretch");
+  EXPECT_DEATH(TimeSync(10, kFramePeriodNanos, 1.5),
+               "invalid max_frame_stretch");
+}
+
+TEST(TimeSyncTest, ReportsFrameStatus) {
+  TimeSync sync(10, kFramePeriodNanos, 0.25);
+
+  FrameStatusPB status;
+  sync.ObserveLocalFrame(PORT_1, 0, &status);
+  EXPECT_EQ(PORT_1, status.port());
+  EXPECT_EQ(0, status.current_frame());
+  EXPECT_EQ(-1, status.last_received_frame());
+
+  // The remote client furthest behind is reported.
+  sync.ObserveRemoteFrame(PORT_2, 5);
+  sync.ObserveRemoteFrame(PORT_3, 3);
+  sync.ObserveRemoteFrame(PORT_3, 2);
+  sync.ObserveLocalFrame(PORT_1, 6, &status);
+  EXPECT_EQ(6, status.current_frame());
+  EXPECT_EQ(3, status.last_received_frame());
+
+  // Old frames don't move the local frame back.
+  sync.ObserveLocalFrame(PORT_1, 4, &status);
+  EXPECT_EQ(6, status.current_frame());
+  EXPECT_EQ(6, sync.local_frame());
+
+  // Nothing was reported, so there is no advantage.
+  EXPECT_EQ(0, sync.frame_advantage());
+  EXPECT_EQ(0, sync.TakePacingNanos());
+}
+
+TEST(TimeSyncTest, LatencyCancelsOut) {
+  for (int latency_frames : {0, 3, 8}) {
+    SCOPED_TRACE(latency_frames);
+    TimeSync sync(10, kFramePeriodNanos, 0.25);
+    PlayFrames(&sync, 20, 40, 2, latency_frames);
+    EXPECT_DOUBLE_EQ(2, sync.frame_advantage());
+    EXPECT_DOUBLE_EQ(2, sync.stats().frame_advantage());
+    EXPECT_EQ(20, sync.stats().samples());
+
+    // Once the window only holds newer samples, the advantage follows them.
+    PlayFrames(&sync, 40, 50, -1, latency_frames);
+    EXPECT_DOUBLE_EQ(-1, sync.frame_advantage());
+  }
+}
+
+TEST(TimeSyncTest, IgnoresStatusesBeforeFirstFrame) {
+  TimeSync sync(10, kFramePeriodNanos, 0.25);
+  FrameStatusPB status;
+  sync.ObserveRemoteFrame(PORT_2, 0);
+  sync.ObserveRemoteStatus(MakeStatus(PORT_2, 0, -1));
+  sync.ObserveLocalFrame(PORT_1, 0, &status);
+  EXPECT_EQ(0, sync.frame_advantage());
+  EXPECT_EQ(0, sync.stats().samples());
+}
+
+TEST(TimeSyncTest, FurthestBehindClientWins) {
+  TimeSync sync(10, kFramePeriodNanos, 0.25);
+  FrameStatusPB status;
+  for (int frame = 10; frame < 20; ++frame) {
+    // PORT_2 is 1 frame behind and PORT_3 3 frames behind, with no latency.
+    sync.ObserveRemoteFrame(PORT_2, frame - 1);
+    sync.ObserveRemoteStatus(MakeStatus(PORT_2, frame - 1, frame));
+    sync.ObserveRemoteFrame(PORT_3, frame - 3);
+    sync.ObserveRemoteStatus(MakeStatus(PORT_3, frame - 3, frame));
+    sync.ObserveLocalFrame(PORT_1, frame, &status);
+  }
+  EXPECT_DOUBLE_EQ(3, sync.frame_advantage());
+}
+
+TEST(TimeSyncTest, PacesOffTheAdvantage) {
+  const int64_t max_stretch_nanos = kFramePeriodNanos / 4;
+
+  // Less than a frame ahead is close enough.
+  TimeSync close_sync(4, kFramePeriodNanos, 0.25);
+  PlayFrames(&close_sync, 0, 8, 0, 1);
+  EXPECT_EQ(0, close_sync.TakePacingNanos());
+
+  // Corrections wait for a full window of samples.
+  TimeSync sync(4, kFramePeriodNanos, 0.25);
+  PlayFrames(&sync, 0, 3, 2, 1);
+  EXPECT_EQ(0, sync.TakePacingNanos());
+
+  // Two frames ahead take eight stretched frames to pay back.
+  PlayFrames(&sync, 3, 12, 2, 1);
+  for (int i = 0; i < 8; ++i) {
+    EXPECT_EQ(max_stretch_nanos, sync.TakePacingNanos());
+  }
+  EXPECT_EQ(8, sync.stats().paced_frames());
+  EXPECT_EQ(2 * kFramePeriodNanos, sync.stats().paced_nanos());
+
+  // The correction then settles for a window, even though the advantage
+  // hasn't been sampled since.
+  EXPECT_EQ(0, sync.TakePacingNanos());
+  PlayFrames(&sync, 12, 15, 2, 1);
+  EXPECT_EQ(0, sync.TakePacingNanos());
+  PlayFrames(&sync, 15, 16, 2, 1);
+  EXPECT_EQ(max_stretch_nanos, sync.TakePacingNanos());
+}
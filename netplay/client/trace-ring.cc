@@ -0,0 +1,206 @@
+#include "client/trace-ring.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+
+#include "glog/logging.h"
+
+namespace {
+
+// Marks a slot whose record is being written.
+const int64_t kWriting = -1;
+
+}  // namespace
+
+// 2^16 records take 1.5 MiB and hold about three minutes of events at 60
+// frames per second and six events per frame.
+const int TraceRing::kDefaultCapacity = 1 << 16;
+
+TraceRing::TraceRing(int capacity, const ClockInterface* clock)
+    : mask_(capacity - 1),
+      clock_(clock),
+      next_(0),
+      dropped_(0),
+      flushed_(0),
+      flush_stopping_(false) {
+  if (capacity <= 0 || (capacity & mask_) != 0) {
+    LOG(ERROR) << "invalid capacity: " << capacity;
+    std::abort();
+  }
+  slots_.reset(new Slot[capacity]);
+  for (int i = 0; i < capacity; ++i) {
+    slots_[i].sequence.store(0, std::memory_order_relaxed);
+    slots_[i].event.store(0, std::memory_order_relaxed);
+    slots_[i].nanos.store(0, std::memory_order_relaxed);
+  }
+}
+
+TraceRing::~TraceRing() { StopFlushThread(); }
+
+void TraceRing::Record(TimingEventPB::EventCase event) {
+  Record(event, clock_->now_nanos());
+}
+
+void TraceRing::Record(TimingEventPB::EventCase event, int64_t nanos) {
+  const int64_t index = next_.fetch_add(1, std::memory_order_relaxed);
+  Slot& slot = slots_[index & mask_];
+
+  // Readers check the sequence before and after reading the record, so they
+  // can tell if it changed underneath them.
+  slot.sequence.store(kWriting, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  slot.event.store(event, std::memory_order_relaxed);
+  slot.nanos.store(nanos, std::memory_order_relaxed);
+  slot.sequence.store(index + 1, std::memory_order_release);
+}
+
+TraceRing::ReadStatus TraceRing::ReadRecord(int64_t index,
+                                            TimingEventPB::EventCase* event,
+                                            int64_t* nanos) const {
+  const Slot& slot = slots_[index & mask_];
+  const int64_t before = slot.sequence.load(std::memory_order_acquire);
+  const int32_t event_value = slot.event.load(std::memory_order_relaxed);
+  const int64_t nanos_value = slot.nanos.load(std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_acquire);
+  const int64_t after = slot.sequence.load(std::memory_order_relaxed);
+
+  if (before == index + 1 && after == before) {
+    *event = static_cast<TimingEventPB::EventCase>(event_value);
+    *nanos = nanos_value;
+    return ReadStatus::SUCCESS;
+  }
+
+  // A later record may have claimed the slot but not finished writing it yet.
+  if (next_.load(std::memory_order_acquire) - index > capacity()) {
+    return ReadStatus::OVERWRITTEN;
+  }
+  return ReadStatus::NOT_READY;
+}
+
+void TraceRing::Snapshot(TimingsPB* timings) const {
+  timings->Clear();
+
+  const int64_t end = next_.load(std::memory_order_acquire);
+  const int64_t begin = end > capacity() ? end - capacity() : 0;
+  const google::protobuf::Descriptor* descriptor = TimingEventPB::descriptor();
+  for (int64_t index = begin; index < end; ++index) {
+    TimingEventPB::EventCase event;
+    int64_t nanos;
+    if (ReadRecord(index, &event, &nanos) != ReadStatus::SUCCESS) {
+      continue;
+    }
+
+    const google::protobuf::FieldDescriptor* field =
+        descriptor->FindFieldByNumber(event);
+    if (field == nullptr ||
+        field->cpp_type() != google::protobuf::FieldDescriptor::CPPTYPE_INT64) {
+      LOG(ERROR) << "Unknown timing event type " << event;
+      continue;
+    }
+    TimingEventPB* event_pb = timings->add_event();
+    event_pb->GetReflection()->SetInt64(event_pb, field, nanos);
+  }
+
+  std::lock_guard<std::mutex> lock(summary_m_);
+  if (delay_tuning_.ByteSizeLong() > 0) {
+    *timings->mutable_delay_tuning() = delay_tuning_;
+  }
+  for (const TraceSummarySource* source : summary_sources_) {
+    source->AddSummary(timings);
+  }
+}
+
+void TraceRing::AddSummarySource(const TraceSummarySource* source) {
+  std::lock_guard<std::mutex> lock(summary_m_);
+  summary_sources_.push_back(source);
+}
+
+void TraceRing::RemoveSummarySource(const TraceSummarySource* source) {
+  std::lock_guard<std::mutex> lock(summary_m_);
+  const auto it =
+      std::find(summary_sources_.begin(), summary_sources_.end(), source);
+  if (it != summary_sources_.end()) {
+    summary_sources_.erase(it);
+  }
+}
+
+void TraceRing::SetDelayTuning(const DelayTuningPB& delay_tuning) {
+  std::lock_guard<std::mutex> lock(summary_m_);
+  delay_tuning_ = delay_tuning;
+}
+
+bool TraceRing::StartFlushThread(const std::string& path,
+                                 int flush_period_millis) {
+  if (flush_thread_.joinable()) {
+    LOG(ERROR) << "Trace flush thread is already running";
+    return false;
+  }
+
+  std::lock_guard<std::mutex> lock(flush_m_);
+  flush_file_.open(path, std::ios::out | std::ios::app);
+  if (!flush_file_.is_open()) {
+    LOG(ERROR) << "Failed to open trace file " << path;
+    return false;
+  }
+  flushed_ = next_.load(std::memory_order_acquire);
+  if (flushed_ > capacity()) {
+    flushed_ -= capacity();
+  } else {
+    flushed_ = 0;
+  }
+  flush_stopping_ = false;
+
+  flush_thread_ =
+      std::thread(&TraceRing::FlushLoop, this, flush_period_millis);
+  return true;
+}
+
+void TraceRing::StopFlushThread() {
+  if (!flush_thread_.joinable()) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(flush_m_);
+    flush_stopping_ = true;
+  }
+  flush_cv_.notify_all();
+  flush_thread_.join();
+
+  std::lock_guard<std::mutex> lock(flush_m_);
+  Flush();
+  flush_file_.close();
+}
+
+void TraceRing::FlushLoop(int flush_period_millis) {
+  std::unique_lock<std::mutex> lock(flush_m_);
+  while (!flush_stopping_) {
+    flush_cv_.wait_for(lock, std::chrono::milliseconds(flush_period_millis),
+                       [this] { return flush_stopping_; });
+    Flush();
+  }
+}
+
+void TraceRing::Flush() {
+  const google::protobuf::Descriptor* descriptor = TimingEventPB::descriptor();
+  const int64_t end = next_.load(std::memory_order_acquire);
+  for (; flushed_ < end; ++flushed_) {
+    TimingEventPB::EventCase event;
+    int64_t nanos;
+    const ReadStatus status = ReadRecord(flushed_, &event, &nanos);
+    if (status == ReadStatus::NOT_READY) {
+      // Try again on the next flush.
+      break;
+    }
+    if (status == ReadStatus::OVERWRITTEN) {
+      dropped_.fetch_add(1, std::memory_order_relaxed);
+      continue;
+    }
+
+    const google::protobuf::FieldDescriptor* field =
+        descriptor->FindFieldByNumber(event);
+    flush_file_ << (field != nullptr ? field->name() : "unknown") << ' '
+                << nanos << '\n';
+  }
+  flush_file_.flush();
+}
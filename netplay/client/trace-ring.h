@@ -0,0 +1,159 @@
+#ifndef TRACE_RING_H_
+#define TRACE_RING_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "base/timings.pb.h"
+#include "client/clock.h"
+
+// A component that keeps stats of its own, which TraceRing snapshots include.
+// See TraceRing::AddSummarySource.
+class TraceSummarySource {
+ public:
+  virtual ~TraceSummarySource() {}
+
+  // Adds the latest stats of the component to *timings.
+  virtual void AddSummary(TimingsPB* timings) const = 0;
+};
+
+// Fixed-size ring of timing records. Each record is a TimingEventPB event type
+// and a timestamp, stored in preallocated memory, so that recording an event
+// never allocates and memory use stays constant no matter how long a session
+// runs. Once the ring is full, new records overwrite the oldest ones.
+//
+// Record is lock-free and may be called from any number of threads. A
+// TimingsPB holding the records currently in the ring is only built when
+// Snapshot is called. To keep the full history, StartFlushThread appends
+// records to a file in the background before they're overwritten.
+//
+// Snapshots also summarize the stats of the components registered with
+// AddSummarySource. The ring asks them for their latest stats when a snapshot
+// is taken, so that components never take a lock or copy a message on the
+// per-frame path just in case a snapshot is taken. Sources are asked from the
+// thread taking the snapshot, and must keep their stats safe to read while
+// they're updated. Summaries are not written by the flush thread.
+class TraceRing {
+ public:
+  static const int kDefaultCapacity;
+
+  // Constructs a ring holding up to capacity records, timestamped with the
+  // given clock, which must outlive the ring. std::abort's if capacity is not
+  // a positive power of two.
+  explicit TraceRing(int capacity = kDefaultCapacity,
+                     const ClockInterface* clock = SystemClock::Get());
+
+  // Stops the flush thread, if any, after flushing all remaining records.
+  ~TraceRing();
+
+  // Records an event of the given type which happened at the current time of
+  // the ring's clock.
+  void Record(TimingEventPB::EventCase event);
+
+  // Records an event of the given type which happened at the given time, in
+  // nanoseconds.
+  void Record(TimingEventPB::EventCase event, int64_t nanos);
+
+  // Replaces the contents of *timings with the records currently in the ring,
+  // oldest first, the latest delay tuning, and the summaries of the
+  // registered sources, in the order they were added. Records that are being
+  // written or overwritten concurrently are skipped.
+  void Snapshot(TimingsPB* timings) const;
+
+  // Includes the summary of source in snapshots until RemoveSummarySource is
+  // called with it, which must happen before source is destroyed.
+  void AddSummarySource(const TraceSummarySource* source);
+
+  // Stops including the summary of source in snapshots, waiting for any
+  // snapshot that is reading it. Does nothing if source was not added.
+  void RemoveSummarySource(const TraceSummarySource* source);
+
+  // Replaces the delay tuning included in snapshots. The tuning is made once,
+  // by a DelayTuner that doesn't outlive it, so unlike summaries it is copied
+  // into the ring.
+  void SetDelayTuning(const DelayTuningPB& delay_tuning);
+
+  // Starts a thread which appends new records to the file at path every
+  // flush_period_millis, one "<event name> <nanos>" line per record. Records
+  // overwritten before they could be flushed are counted by dropped(). Returns
+  // false if the file couldn't be opened or a flush thread is already running.
+  bool StartFlushThread(const std::string& path, int flush_period_millis);
+
+  // Flushes all remaining records and stops the flush thread. Does nothing if
+  // there is no flush thread.
+  void StopFlushThread();
+
+  // Returns the current time of the ring's clock.
+  int64_t now_nanos() const { return clock_->now_nanos(); }
+
+  int capacity() const { return mask_ + 1; }
+
+  // Returns the number of records made since construction.
+  int64_t recorded() const { return next_.load(std::memory_order_acquire); }
+
+  // Returns the number of records the flush thread has lost because they were
+  // overwritten before being flushed.
+  int64_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+ private:
+  // Slot sequence values are the index of the record they hold plus one, so
+  // that zero means empty.
+  struct Slot {
+    std::atomic<int64_t> sequence;
+    std::atomic<int32_t> event;
+    std::atomic<int64_t> nanos;
+  };
+
+  enum class ReadStatus {
+    SUCCESS = 0,
+    // The record hasn't been written yet, or is being written.
+    NOT_READY,
+    // The record was overwritten by a newer one.
+    OVERWRITTEN
+  };
+
+  // Copies the record with the given index out of the ring.
+  ReadStatus ReadRecord(int64_t index, TimingEventPB::EventCase* event,
+                        int64_t* nanos) const;
+
+  // Writes all complete records past flushed_ to flush_file_. Must be called
+  // with flush_m_ held.
+  void Flush();
+
+  // Body of flush_thread_.
+  void FlushLoop(int flush_period_millis);
+
+  const int mask_;
+  // Borrowed reference
+  const ClockInterface* clock_;
+  std::unique_ptr<Slot[]> slots_;
+  // Index of the next record to be made.
+  std::atomic<int64_t> next_;
+  std::atomic<int64_t> dropped_;
+
+  // summary_m_ protects delay_tuning_ and summary_sources_, and is held
+  // while the sources are asked for their summaries.
+  mutable std::mutex summary_m_;
+  DelayTuningPB delay_tuning_;
+  // Borrowed references
+  std::vector<const TraceSummarySource*> summary_sources_;
+
+  // Flush thread state. flush_m_ protects everything but flush_thread_, which
+  // is only accessed by StartFlushThread and StopFlushThread.
+  std::thread flush_thread_;
+  std::mutex flush_m_;
+  std::condition_variable flush_cv_;
+  std::ofstream flush_file_;
+  // Index of the next record to be flushed.
+  int64_t flushed_;
+  bool flush_stopping_;
+};
+
+#endif  // TRACE_RING_H_
@@ -0,0 +1,218 @@
+#include "client/trace-ring.h"
+
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "base/netplayServiceProto.pb.h"
+#include "gtest/gtest.h"
+
+using std::string;
+
+// -----------------------------------------------------------------------------
+// TraceRing
+
+class TraceRingTest : public ::testing::Test {
+ protected:
+  TraceRingTest() : trace_(kCapacity) {}
+
+  static const int kCapacity;
+  TraceRing trace_;
+};
+
+const int TraceRingTest::kCapacity = 8;
+
+TEST_F(TraceRingTest, InvalidCapacity) {
+  EXPECT_DEATH(TraceRing(0), "invalid capacity");
+  EXPECT_DEATH(TraceRing(6), "invalid capacity");
+}
+
+TEST_F(TraceRingTest, SnapshotIsOldestFirst) {
+  TimingsPB timings;
+  trace_.Snapshot(&timings);
+  EXPECT_EQ(0, timings.event_size());
+
+  trace_.Record(TimingEventPB::kKeyStateSyncWriteStart, 10);
+  trace_.Record(TimingEventPB::kKeyStateSyncWriteFinish, 20);
+  trace_.Record(TimingEventPB::kKeyStateReadStart, 30);
+  EXPECT_EQ(3, trace_.recorded());
+
+  trace_.Snapshot(&timings);
+  ASSERT_EQ(3, timings.event_size());
+  EXPECT_EQ(10, timings.event(0).key_state_sync_write_start());
+  EXPECT_EQ(20, timings.event(1).key_state_sync_write_finish());
+  EXPECT_EQ(30, timings.event(2).key_state_read_start());
+
+  // Snapshots replace the previous contents.
+  trace_.Snapshot(&timings);
+  EXPECT_EQ(3, timings.event_size());
+}
+
+TEST_F(TraceRingTest, KeepsNewestRecordsWhenFull) {
+  for (int i = 0; i < kCapacity * 2 + 3; ++i) {
+    trace_.Record(TimingEventPB::kRemoteKeyStateReturned, i);
+  }
+  EXPECT_EQ(kCapacity * 2 + 3, trace_.recorded());
+
+  TimingsPB timings;
+  trace_.Snapshot(&timings);
+  ASSERT_EQ(kCapacity, timings.event_size());
+  for (int i = 0; i < kCapacity; ++i) {
+    EXPECT_EQ(kCapacity + 3 + i, timings.event(i).remote_key_state_returned());
+  }
+}
+
+TEST_F(TraceRingTest, RecordsUseCurrentTime) {
+  trace_.Record(TimingEventPB::kPlugControllerRequest);
+  trace_.Record(TimingEventPB::kPlugControllerResponse);
+
+  TimingsPB timings;
+  trace_.Snapshot(&timings);
+  ASSERT_EQ(2, timings.event_size());
+  EXPECT_GT(timings.event(0).plug_controller_request(), 0);
+  EXPECT_LE(timings.event(0).plug_controller_request(),
+            timings.event(1).plug_controller_response());
+}
+
+TEST_F(TraceRingTest, RecordsUseGivenClock) {
+  class FakeClock : public ClockInterface {
+   public:
+    int64_t now_nanos() const override { return 1234; }
+  };
+  const FakeClock clock;
+  TraceRing trace(kCapacity, &clock);
+  trace.Record(TimingEventPB::kPingRequest);
+
+  TimingsPB timings;
+  trace.Snapshot(&timings);
+  ASSERT_EQ(1, timings.event_size());
+  EXPECT_EQ(1234, timings.event(0).ping_request());
+}
+
+TEST_F(TraceRingTest, SnapshotsSummarySources) {
+  class FakeSource : public TraceSummarySource {
+   public:
+    explicit FakeSource(int port) : port(port), predicted_frames(0) {}
+
+    void AddSummary(TimingsPB* timings) const override {
+      PredictionStatsPB* stats = timings->add_prediction_stats();
+      stats->set_port(port);
+      stats->set_predicted_frames(predicted_frames);
+    }
+
+    const int port;
+    int predicted_frames;
+  };
+  FakeSource port_3(PORT_3);
+  FakeSource port_2(PORT_2);
+  trace_.AddSummarySource(&port_3);
+  trace_.AddSummarySource(&port_2);
+
+  // Sources are asked for their latest stats when the snapshot is taken.
+  port_3.predicted_frames = 2;
+  port_2.predicted_frames = 1;
+  TimingsPB timings;
+  trace_.Snapshot(&timings);
+  ASSERT_EQ(2, timings.prediction_stats_size());
+  EXPECT_EQ(PORT_3, timings.prediction_stats(0).port());
+  EXPECT_EQ(2, timings.prediction_stats(0).predicted_frames());
+  EXPECT_EQ(PORT_2, timings.prediction_stats(1).port());
+  EXPECT_EQ(1, timings.prediction_stats(1).predicted_frames());
+
+  trace_.RemoveSummarySource(&port_3);
+  trace_.RemoveSummarySource(&port_3);
+  trace_.Snapshot(&timings);
+  ASSERT_EQ(1, timings.prediction_stats_size());
+  EXPECT_EQ(PORT_2, timings.prediction_stats(0).port());
+  trace_.RemoveSummarySource(&port_2);
+}
+
+TEST_F(TraceRingTest, ConcurrentRecords) {
+  const int kThreads = 4;
+  const int kRecordsPerThread = 10000;
+  TraceRing trace(1 << 16);
+
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kThreads; ++t) {
+    threads.emplace_back([&trace, t, kRecordsPerThread] {
+      for (int i = 0; i < kRecordsPerThread; ++i) {
+        trace.Record(TimingEventPB::kKeyStateReadFinish,
+                     t * kRecordsPerThread + i);
+      }
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+
+  TimingsPB timings;
+  trace.Snapshot(&timings);
+  ASSERT_EQ(kThreads * kRecordsPerThread, timings.event_size());
+  std::vector<bool> seen(kThreads * kRecordsPerThread, false);
+  for (const TimingEventPB& event : timings.event()) {
+    const int64_t nanos = event.key_state_read_finish();
+    ASSERT_GE(nanos, 0);
+    ASSERT_LT(nanos, kThreads * kRecordsPerThread);
+    EXPECT_FALSE(seen[nanos]);
+    seen[nanos] = true;
+  }
+}
+
+TEST_F(TraceRingTest, FlushesToFile) {
+  const string path = ::testing::TempDir() + "trace-ring_test.txt";
+  std::remove(path.c_str());
+
+  // Records made before the flush thread starts and still in the ring are
+  // flushed too.
+  trace_.Record(TimingEventPB::kClientReadySyncWriteStart, 1);
+  ASSERT_TRUE(trace_.StartFlushThread(path, 1));
+  EXPECT_FALSE(trace_.StartFlushThread(path, 1));
+  trace_.Record(TimingEventPB::kClientReadySyncWriteFinish, 2);
+  trace_.StopFlushThread();
+  EXPECT_EQ(0, trace_.dropped());
+
+  std::ifstream file(path);
+  string name;
+  int64_t nanos;
+  ASSERT_TRUE(file >> name >> nanos);
+  EXPECT_EQ("client_ready_sync_write_start", name);
+  EXPECT_EQ(1, nanos);
+  ASSERT_TRUE(file >> name >> nanos);
+  EXPECT_EQ("client_ready_sync_write_finish", name);
+  EXPECT_EQ(2, nanos);
+  EXPECT_FALSE(file >> name);
+
+  std::remove(path.c_str());
+}
+
+TEST_F(TraceRingTest, CountsRecordsOverwrittenBeforeFlush) {
+  const string path = ::testing::TempDir() + "trace-ring_test_dropped.txt";
+  std::remove(path.c_str());
+
+  // A long period, so that nothing is flushed until the thread stops.
+  ASSERT_TRUE(trace_.StartFlushThread(path, 60 * 1000));
+  for (int i = 0; i < kCapacity + 5; ++i) {
+    trace_.Record(TimingEventPB::kStartGameEventReadStart, i);
+  }
+  trace_.StopFlushThread();
+  EXPECT_EQ(5, trace_.dropped());
+
+  std::ifstream file(path);
+  string name;
+  int64_t nanos;
+  for (int i = 5; i < kCapacity + 5; ++i) {
+    ASSERT_TRUE(file >> name >> nanos);
+    EXPECT_EQ("start_game_event_read_start", name);
+    EXPECT_EQ(i, nanos);
+  }
+  EXPECT_FALSE(file >> name);
+
+  std::remove(path.c_str());
+}
+
+TEST_F(TraceRingTest, FailsToOpenFile) {
+  EXPECT_FALSE(trace_.StartFlushThread("/nonexistent/dir/trace.txt", 1));
+  trace_.StopFlushThread();
+}
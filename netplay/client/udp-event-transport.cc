@@ -0,0 +1,558 @@
+#include "client/udp-event-transport.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+
+#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "client/utils.h"
+#include "glog/logging.h"
+
+namespace {
+
+// Largest payload of a UDP datagram over IPv4.
+const size_t kMaxDatagramBytes = 65507;
+
+// Upper bound of history_size, which keeps a full datagram well below
+// kMaxDatagramBytes.
+const int kMaxHistorySize = 256;
+
+bool SameAddress(const sockaddr_in& a, const sockaddr_in& b) {
+  return a.sin_addr.s_addr == b.sin_addr.s_addr && a.sin_port == b.sin_port;
+}
+
+}  // namespace
+
+UdpEventTransport::UdpEventTransport(std::unique_ptr<EventTransport> control,
+                                     const UdpEventTransportOptions& options)
+    : options_(options),
+      control_(std::move(control)),
+      socket_(-1),
+      local_port_(0),
+      receive_buffer_(kMaxDatagramBytes),
+      client_id_(0),
+      history_head_(0),
+      history_first_(0),
+      history_count_(0),
+      send_buffer_(kMaxDatagramBytes),
+      loss_generator_(options.loss_seed),
+      loss_distribution_(0.0, 1.0),
+      opened_(false),
+      control_closed_(false),
+      cancelled_(false),
+      started_(false),
+      fallen_back_(false) {
+  if (control_ == nullptr) {
+    LOG(ERROR) << "invalid control: null";
+    std::abort();
+  }
+  if (options_.local_port < 0 || options_.local_port > 65535) {
+    LOG(ERROR) << "invalid local_port: " << options_.local_port;
+    std::abort();
+  }
+  if (options_.history_size < 1 || options_.history_size > kMaxHistorySize) {
+    LOG(ERROR) << "invalid history_size: " << options_.history_size;
+    std::abort();
+  }
+  if (options_.max_unacked_key_presses < options_.history_size) {
+    LOG(ERROR) << "invalid max_unacked_key_presses: "
+               << options_.max_unacked_key_presses;
+    std::abort();
+  }
+  if (options_.resend_interval_millis < 1) {
+    LOG(ERROR) << "invalid resend_interval_millis: "
+               << options_.resend_interval_millis;
+    std::abort();
+  }
+  if (options_.fallback_after_millis < 0) {
+    LOG(ERROR) << "invalid fallback_after_millis: "
+               << options_.fallback_after_millis;
+    std::abort();
+  }
+  if (options_.send_loss_rate < 0 || options_.send_loss_rate >= 1) {
+    LOG(ERROR) << "invalid send_loss_rate: " << options_.send_loss_rate;
+    std::abort();
+  }
+
+  history_.resize(options_.max_unacked_key_presses);
+  std::fill(std::begin(next_frames_), std::end(next_frames_), 0);
+}
+
+UdpEventTransport::~UdpEventTransport() {
+  TryCancel();
+  if (receive_thread_.joinable()) {
+    receive_thread_.join();
+  }
+  if (control_thread_.joinable()) {
+    control_thread_.join();
+  }
+  if (socket_ >= 0) {
+    close(socket_);
+  }
+}
+
+bool UdpEventTransport::Open() {
+  {
+    std::lock_guard<std::mutex> lock(m_);
+    if (opened_) {
+      LOG(ERROR) << "UDP transport already open";
+      return false;
+    }
+  }
+  if (!control_->Open()) {
+    LOG(ERROR) << "Failed to open the control transport";
+    return false;
+  }
+
+  socket_ = socket(AF_INET, SOCK_DGRAM, 0);
+  if (socket_ < 0) {
+    LOG(ERROR) << "Failed to create a UDP socket: " << std::strerror(errno);
+    return false;
+  }
+  sockaddr_in address;
+  std::memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_ANY);
+  address.sin_port = htons(options_.local_port);
+  if (bind(socket_, reinterpret_cast<sockaddr*>(&address), sizeof(address)) <
+      0) {
+    LOG(ERROR) << "Failed to bind UDP port " << options_.local_port << ": "
+               << std::strerror(errno);
+    return false;
+  }
+  socklen_t address_size = sizeof(address);
+  if (getsockname(socket_, reinterpret_cast<sockaddr*>(&address),
+                  &address_size) < 0) {
+    LOG(ERROR) << "Failed to get the UDP port: " << std::strerror(errno);
+    return false;
+  }
+
+  for (const std::string& peer : options_.peers) {
+    if (!AddPeer(peer)) {
+      return false;
+    }
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(m_);
+    local_port_ = ntohs(address.sin_port);
+    opened_ = true;
+  }
+  receive_thread_ = std::thread(&UdpEventTransport::ReceiveLoop, this);
+  control_thread_ = std::thread(&UdpEventTransport::ControlReadLoop, this);
+  return true;
+}
+
+bool UdpEventTransport::Write(const OutgoingEventPB& event) {
+  std::lock_guard<std::mutex> write_lock(control_write_m_);
+  if (event.has_client_ready() && options_.peers_from_start_game) {
+    control_event_.CopyFrom(event);
+    ClientReadyPB* client_ready = control_event_.mutable_client_ready();
+    {
+      std::lock_guard<std::mutex> lock(m_);
+      client_id_ = client_ready->client_id();
+      client_ready->set_peer_port(local_port_);
+    }
+    if (!options_.advertised_host.empty()) {
+      client_ready->set_peer_host(options_.advertised_host);
+    }
+    return control_->Write(control_event_);
+  }
+  if (event.key_press_size() == 0) {
+    return control_->Write(event);
+  }
+
+  bool fallen_back;
+  {
+    std::lock_guard<std::mutex> lock(m_);
+    if (!opened_ || cancelled_) {
+      return false;
+    }
+    fallen_back = fallen_back_;
+    if (fallen_back) {
+      stats_.key_presses_sent_to_control += event.key_press_size();
+    } else {
+      if (history_count_ + event.key_press_size() >
+          static_cast<int64_t>(history_.size())) {
+        LOG(ERROR) << "Peers stopped acknowledging key presses, "
+                   << history_count_ << " are unacknowledged";
+        return false;
+      }
+      const int64_t now = client_utils::now_nanos();
+      for (Peer& peer : peers_) {
+        if (peer.acked == history_first_ + history_count_) {
+          // The peer starts waiting for these key presses now.
+          peer.last_ack_nanos = now;
+        }
+      }
+      for (const KeyStatePB& key_press : event.key_press()) {
+        history_[(history_head_ + history_count_) % history_.size()] =
+            key_press;
+        ++history_count_;
+      }
+      for (Peer& peer : peers_) {
+        SendDatagram(&peer, now);
+      }
+      TrimHistory();
+    }
+  }
+  if (fallen_back) {
+    // Behind the key presses FallBack sent, since it held control_write_m_.
+    return control_->Write(event);
+  }
+
+  // Anything else the event carries goes through the control transport.
+  control_event_.CopyFrom(event);
+  control_event_.clear_key_press();
+  if (control_event_.ByteSizeLong() == 0) {
+    return true;
+  }
+  return control_->Write(control_event_);
+}
+
+bool UdpEventTransport::Read(IncomingEventPB* event) {
+  std::unique_lock<std::mutex> lock(m_);
+  if (!opened_) {
+    return false;
+  }
+  cv_.wait(lock, [this] {
+    return cancelled_ || control_closed_ || !incoming_.empty();
+  });
+  return !cancelled_ && incoming_.Pop(event);
+}
+
+void UdpEventTransport::TryCancel() {
+  {
+    std::lock_guard<std::mutex> lock(m_);
+    cancelled_ = true;
+    cv_.notify_all();
+  }
+  control_->TryCancel();
+}
+
+bool UdpEventTransport::AddPeer(const std::string& address) {
+  const size_t colon = address.rfind(':');
+  if (colon == std::string::npos) {
+    LOG(ERROR) << "Invalid peer address, expected host:port: " << address;
+    return false;
+  }
+  const std::string host = address.substr(0, colon);
+  const std::string port = address.substr(colon + 1);
+
+  addrinfo hints;
+  std::memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_DGRAM;
+  addrinfo* result = nullptr;
+  const int error = getaddrinfo(host.c_str(), port.c_str(), &hints, &result);
+  if (error != 0 || result == nullptr) {
+    LOG(ERROR) << "Failed to resolve peer " << address << ": "
+               << gai_strerror(error);
+    return false;
+  }
+  Peer peer;
+  std::memcpy(&peer.address, result->ai_addr, sizeof(peer.address));
+  freeaddrinfo(result);
+
+  std::lock_guard<std::mutex> lock(m_);
+  for (const Peer& existing : peers_) {
+    if (SameAddress(existing.address, peer.address)) {
+      LOG(ERROR) << "Peer already added: " << address;
+      return false;
+    }
+  }
+  peer.acked = history_first_;
+  peer.received = -1;
+  peer.ack_pending = false;
+  peer.last_send_nanos = 0;
+  peer.last_ack_nanos = client_utils::now_nanos();
+  peers_.push_back(peer);
+  return true;
+}
+
+int UdpEventTransport::local_port() const {
+  std::lock_guard<std::mutex> lock(m_);
+  return local_port_;
+}
+
+UdpEventTransportStats UdpEventTransport::stats() const {
+  std::lock_guard<std::mutex> lock(m_);
+  return stats_;
+}
+
+bool UdpEventTransport::fallen_back() const {
+  std::lock_guard<std::mutex> lock(m_);
+  return fallen_back_;
+}
+
+void UdpEventTransport::ReceiveLoop() {
+  const int64_t resend_interval_nanos =
+      options_.resend_interval_millis * 1000000LL;
+  const int64_t fallback_nanos = options_.fallback_after_millis * 1000000LL;
+  const int poll_timeout_millis =
+      std::max(1, options_.resend_interval_millis / 2);
+
+  while (true) {
+    pollfd poll_fd;
+    poll_fd.fd = socket_;
+    poll_fd.events = POLLIN;
+    poll_fd.revents = 0;
+    const int ready = poll(&poll_fd, 1, poll_timeout_millis);
+
+    sockaddr_in from;
+    socklen_t from_size = sizeof(from);
+    ssize_t size = -1;
+    if (ready > 0 && (poll_fd.revents & POLLIN) != 0) {
+      size = recvfrom(socket_, receive_buffer_.data(), receive_buffer_.size(),
+                      0, reinterpret_cast<sockaddr*>(&from), &from_size);
+    }
+    const bool parsed =
+        size >= 0 &&
+        received_datagram_.ParseFromArray(receive_buffer_.data(), size);
+
+    bool fall_back = false;
+    {
+      std::lock_guard<std::mutex> lock(m_);
+      if (cancelled_) {
+        return;
+      }
+      if (size >= 0) {
+        auto peer = std::find_if(peers_.begin(), peers_.end(),
+                                 [&from](const Peer& peer) {
+                                   return SameAddress(peer.address, from);
+                                 });
+        if (!parsed || peer == peers_.end() ||
+            (options_.peers_from_start_game && !started_)) {
+          // Until the game start is read, the key presses of peers that
+          // started first are left for them to resend.
+          ++stats_.datagrams_ignored;
+        } else {
+          HandleDatagram(received_datagram_, &*peer);
+        }
+      }
+
+      // Resend to the peers that heard nothing from us for a while, if there
+      // is anything to tell them, and give up on the ones that have stopped
+      // listening.
+      const int64_t now = client_utils::now_nanos();
+      const int64_t history_end = history_first_ + history_count_;
+      for (Peer& peer : peers_) {
+        if (now - peer.last_send_nanos >= resend_interval_nanos &&
+            (peer.acked < history_end || peer.ack_pending)) {
+          SendDatagram(&peer, now);
+        }
+        if (fallback_nanos > 0 && !fallen_back_ && peer.acked < history_end &&
+            now - peer.last_ack_nanos >= fallback_nanos) {
+          fall_back = true;
+        }
+      }
+    }
+    if (fall_back) {
+      FallBack();
+    }
+  }
+}
+
+void UdpEventTransport::ControlReadLoop() {
+  while (control_->Read(&control_read_event_)) {
+    // The peers are added before the game start is read, so that the first
+    // key presses are written to them.
+    if (options_.peers_from_start_game &&
+        control_read_event_.has_start_game()) {
+      AddStartGamePeers(control_read_event_.start_game());
+    }
+    std::lock_guard<std::mutex> lock(m_);
+    if (control_read_event_.has_start_game()) {
+      started_ = true;
+    }
+    PushIncoming(&control_read_event_);
+  }
+  std::lock_guard<std::mutex> lock(m_);
+  control_closed_ = true;
+  cv_.notify_all();
+}
+
+void UdpEventTransport::AddStartGamePeers(const StartGamePB& start_game) {
+  int64_t client_id;
+  {
+    std::lock_guard<std::mutex> lock(m_);
+    client_id = client_id_;
+  }
+  int added = 0;
+  bool failed = false;
+  for (const PeerEndpointPB& peer : start_game.peers()) {
+    if (peer.client_id() == client_id) {
+      continue;
+    }
+    if (AddPeer(peer.address())) {
+      ++added;
+    } else {
+      failed = true;
+    }
+  }
+  if (added > 0 && !failed) {
+    return;
+  }
+
+  // No key press was written yet, so there's nothing to send.
+  LOG(WARNING) << "Not exchanging key presses with peers: "
+               << (failed ? "some peers can't be reached"
+                          : "the server listed none");
+  std::lock_guard<std::mutex> lock(m_);
+  fallen_back_ = true;
+}
+
+void UdpEventTransport::FallBack() {
+  std::lock_guard<std::mutex> write_lock(control_write_m_);
+  control_event_.Clear();
+  {
+    std::lock_guard<std::mutex> lock(m_);
+    if (fallen_back_ || cancelled_) {
+      return;
+    }
+    fallen_back_ = true;
+    for (int64_t i = 0; i < history_count_; ++i) {
+      *control_event_.add_key_press() =
+          history_[(history_head_ + i) % history_.size()];
+    }
+    history_first_ += history_count_;
+    history_count_ = 0;
+    for (Peer& peer : peers_) {
+      peer.acked = history_first_;
+    }
+    stats_.key_presses_sent_to_control += control_event_.key_press_size();
+  }
+  LOG(WARNING) << "Peers stopped acknowledging key presses, sending them "
+                  "through the control transport instead";
+  if (control_event_.key_press_size() > 0 &&
+      !control_->Write(control_event_)) {
+    LOG(ERROR) << "Failed to send unacknowledged key presses through the "
+                  "control transport";
+  }
+}
+
+void UdpEventTransport::HandleDatagram(const KeyPressDatagramPB& datagram,
+                                       Peer* peer) {
+  ++stats_.datagrams_received;
+
+  const int64_t history_end = history_first_ + history_count_;
+  if (datagram.ack_sequence() > peer->acked) {
+    peer->acked = std::min(datagram.ack_sequence(), history_end);
+    peer->last_ack_nanos = client_utils::now_nanos();
+    TrimHistory();
+  }
+
+  // Every datagram starts at the first key press we have yet to acknowledge,
+  // which for the first one received is the first key press the peer sent.
+  if (peer->received < 0) {
+    peer->received = datagram.first_sequence();
+  }
+  int64_t sequence = datagram.first_sequence();
+  for (const KeyStatePB& key_press : datagram.key_press()) {
+    ++stats_.key_presses_received;
+    if (sequence < peer->received) {
+      ++stats_.duplicate_key_presses;
+    } else if (sequence == peer->received) {
+      *received_event_.add_key_press() = key_press;
+      ++peer->received;
+    } else {
+      // Past a key press that never arrived, which the peer doesn't skip.
+      LOG(ERROR) << "Peer skipped key presses " << peer->received << " to "
+                 << sequence;
+      break;
+    }
+    ++sequence;
+  }
+  if (datagram.key_press_size() > 0) {
+    peer->ack_pending = true;
+  }
+  if (received_event_.key_press_size() > 0) {
+    PushIncoming(&received_event_);
+  }
+}
+
+void UdpEventTransport::SendDatagram(Peer* peer, int64_t now_nanos) {
+  const int64_t first = std::max(peer->acked, history_first_);
+  const int64_t end = std::min(history_first_ + history_count_,
+                               first + options_.history_size);
+
+  send_datagram_.Clear();
+  send_datagram_.set_first_sequence(first);
+  for (int64_t sequence = first; sequence < end; ++sequence) {
+    *send_datagram_.add_key_press() =
+        history_[(history_head_ + (sequence - history_first_)) %
+                 history_.size()];
+  }
+  send_datagram_.set_ack_sequence(std::max<int64_t>(peer->received, 0));
+
+  const size_t size = send_datagram_.ByteSizeLong();
+  send_datagram_.SerializeWithCachedSizesToArray(
+      reinterpret_cast<uint8_t*>(send_buffer_.data()));
+  peer->last_send_nanos = now_nanos;
+  peer->ack_pending = false;
+  ++stats_.datagrams_sent;
+
+  if (options_.send_loss_rate > 0 &&
+      loss_distribution_(loss_generator_) < options_.send_loss_rate) {
+    ++stats_.datagrams_dropped;
+    return;
+  }
+  if (sendto(socket_, send_buffer_.data(), size, MSG_DONTWAIT,
+             reinterpret_cast<const sockaddr*>(&peer->address),
+             sizeof(peer->address)) < 0) {
+    // Lost like any other datagram, and resent the same way.
+    VLOG(2) << "Failed to send a datagram: " << std::strerror(errno);
+  }
+}
+
+void UdpEventTransport::TrimHistory() {
+  int64_t acked = history_first_ + history_count_;
+  for (const Peer& peer : peers_) {
+    acked = std::min(acked, peer.acked);
+  }
+  if (acked <= history_first_) {
+    return;
+  }
+  const int64_t trimmed = acked - history_first_;
+  history_head_ = (history_head_ + trimmed) % history_.size();
+  history_first_ = acked;
+  history_count_ -= trimmed;
+}
+
+void UdpEventTransport::PushIncoming(IncomingEventPB* event) {
+  // Drop the key presses read already, from the other path, keeping the
+  // others in order.
+  int kept = 0;
+  for (int i = 0; i < event->key_press_size(); ++i) {
+    const KeyStatePB& key_press = event->key_press(i);
+    if (Port_IsValid(key_press.port())) {
+      int& next_frame = next_frames_[key_press.port()];
+      if (key_press.frame_number() < next_frame) {
+        ++stats_.stale_key_presses;
+        continue;
+      }
+      next_frame = key_press.frame_number() + key_press.run_frames() + 1;
+    }
+    if (kept != i) {
+      event->mutable_key_press()->SwapElements(kept, i);
+    }
+    ++kept;
+  }
+  if (kept < event->key_press_size()) {
+    while (event->key_press_size() > kept) {
+      event->mutable_key_press()->RemoveLast();
+    }
+    if (event->ByteSizeLong() == 0) {
+      return;
+    }
+  }
+
+  incoming_.Push(event);
+  cv_.notify_all();
+}
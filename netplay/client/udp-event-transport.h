@@ -0,0 +1,245 @@
+#ifndef UDP_EVENT_TRANSPORT_H_
+#define UDP_EVENT_TRANSPORT_H_
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <netinet/in.h>
+
+#include "base/netplayServiceProto.pb.h"
+#include "client/event-transport.h"
+#include "client/incoming-event-queue.h"
+
+struct UdpEventTransportOptions {
+  // UDP port on which key presses are received, on every IPv4 interface. Zero
+  // picks a free port, see UdpEventTransport::local_port.
+  int local_port = 0;
+
+  // "host:port" addresses of the transports of the other clients of the
+  // console, to which local key presses are sent. More can be added with
+  // UdpEventTransport::AddPeer.
+  std::vector<std::string> peers;
+
+  // Most key presses a datagram carries. A peer that falls further behind in
+  // acknowledging them is sent the oldest ones first.
+  int history_size = 16;
+
+  // Most key presses kept for peers that have yet to acknowledge them. Writes
+  // fail once a peer is this far behind.
+  int max_unacked_key_presses = 1024;
+
+  // Unacknowledged key presses, and acknowledgements not yet sent, are resent
+  // to a peer after this long without a datagram to it.
+  int resend_interval_millis = 10;
+
+  // Whether to also send key presses to the peers the server lists when the
+  // game starts, see StartGamePB.peers. The transport then advertises its
+  // port, and advertised_host if not empty, in the ClientReadyPB written
+  // through it, for the server to pass on to the other clients. Otherwise the
+  // server uses the host the client reaches it from. If the server lists no
+  // peers, because some client didn't advertise itself, key presses go
+  // through the control transport for the server to relay.
+  bool peers_from_start_game = false;
+  std::string advertised_host;
+
+  // After this long without an acknowledgement from a peer that has key
+  // presses to acknowledge, the transport gives up on UDP and sends its key
+  // presses through the control transport for the rest of the game, starting
+  // with the ones some peer has yet to acknowledge. Zero never gives up.
+  int fallback_after_millis = 0;
+
+  // For tests: share of the outgoing datagrams that are dropped instead of
+  // sent, picked by a generator seeded with loss_seed.
+  double send_loss_rate = 0;
+  uint32_t loss_seed = 1;
+};
+
+// Counters of a UdpEventTransport, see UdpEventTransport::stats.
+struct UdpEventTransportStats {
+  // Datagrams sent, including the ones dropped by send_loss_rate.
+  int64_t datagrams_sent = 0;
+  // Datagrams dropped by send_loss_rate.
+  int64_t datagrams_dropped = 0;
+  // Datagrams received from peers, and from unknown addresses.
+  int64_t datagrams_received = 0;
+  int64_t datagrams_ignored = 0;
+  // Key presses received from peers, and how many of them were already
+  // received, as copies sent while their acknowledgement was in flight.
+  int64_t key_presses_received = 0;
+  int64_t duplicate_key_presses = 0;
+  // Key presses read from both UDP and the control transport, around the
+  // time a peer falls back to the latter, of which the second copy is
+  // dropped.
+  int64_t stale_key_presses = 0;
+  // Key presses sent through the control transport after falling back.
+  int64_t key_presses_sent_to_control = 0;
+};
+
+// EventTransport that sends key presses as UDP datagrams straight to the
+// other clients of the console, and every other event through a control
+// transport, usually the server's event stream.
+//
+// The event stream runs over TCP, where a single lost segment holds up every
+// later key press until it is retransmitted. Here, each datagram to a peer
+// instead carries all the key presses the peer has yet to acknowledge, up to
+// history_size, along with the acknowledgement of the key presses received
+// from it. A lost datagram is then made up for by the next one, which is at
+// most a frame or resend_interval_millis away.
+//
+// Key presses are numbered in the order they are written. Those received from
+// each peer are read in that order, exactly once, whatever the loss,
+// duplication and reordering of the datagrams that carry them. Key presses of
+// the control transport, from clients that don't use UDP or fell back from
+// it, are read as well, and a key press read from both is only read once.
+//
+// Every client of the console must exchange key presses over UDP with every
+// other one, since the server no longer sees them. The peers are either given
+// up front, or distributed by the server when the game starts, see
+// UdpEventTransportOptions::peers_from_start_game.
+class UdpEventTransport : public EventTransport {
+ public:
+  // Exchanges the events other than key presses through control. std::abort's
+  // if control is null or options are invalid.
+  UdpEventTransport(std::unique_ptr<EventTransport> control,
+                    const UdpEventTransportOptions& options);
+
+  // Cancels the transport and joins its threads.
+  ~UdpEventTransport() override;
+
+  // Opens the control transport and the UDP socket, adds the peers of the
+  // options, and starts the threads that read both.
+  bool Open() override;
+
+  // Sends the key presses of event to every peer, and the rest of event, if
+  // any, through the control transport. Once the transport fell back, sends
+  // all of event through the control transport.
+  bool Write(const OutgoingEventPB& event) override;
+
+  bool Read(IncomingEventPB* event) override;
+  void TryCancel() override;
+
+  // Starts sending key presses to the transport at address, given as
+  // "host:port". Key presses written before are sent too, unless every peer
+  // already acknowledged them, or there was no peer to send them to. Returns
+  // false if address doesn't resolve to an IPv4 address. May be called from
+  // any thread.
+  bool AddPeer(const std::string& address);
+
+  // UDP port the transport receives on, once open.
+  int local_port() const;
+
+  UdpEventTransportStats stats() const;
+
+  // Whether key presses go through the control transport, see
+  // UdpEventTransportOptions::fallback_after_millis.
+  bool fallen_back() const;
+
+ private:
+  struct Peer {
+    sockaddr_in address;
+    // Sequence number of the first key press the peer has yet to
+    // acknowledge.
+    int64_t acked;
+    // Sequence number of the next key press expected from the peer, or -1
+    // until its first datagram, whose first key press it adopts.
+    int64_t received;
+    // Whether key presses were received since the last datagram to the peer.
+    bool ack_pending;
+    int64_t last_send_nanos;
+    // When the peer last acknowledged key presses, or last had none to
+    // acknowledge.
+    int64_t last_ack_nanos;
+  };
+
+  // Reads the socket, and resends to the peers that are due, until the
+  // transport is cancelled.
+  void ReceiveLoop();
+
+  // Reads the control transport into the incoming events until it fails.
+  void ControlReadLoop();
+
+  // Adds the peers of start_game other than this client. Falls back to the
+  // control transport if there are none, or some can't be added.
+  void AddStartGamePeers(const StartGamePB& start_game);
+
+  // Sends the key presses some peer has yet to acknowledge through the
+  // control transport, as all later ones will be.
+  void FallBack();
+
+  // Handles a datagram received from peer. Must hold m_.
+  void HandleDatagram(const KeyPressDatagramPB& datagram, Peer* peer);
+
+  // Sends peer its unacknowledged key presses and acknowledgement. Must hold
+  // m_.
+  void SendDatagram(Peer* peer, int64_t now_nanos);
+
+  // Forgets the key presses every peer acknowledged. Must hold m_.
+  void TrimHistory();
+
+  // Queues *event to be read, without the key presses already read, leaving a
+  // cleared message in *event. Must hold m_.
+  void PushIncoming(IncomingEventPB* event);
+
+  const UdpEventTransportOptions options_;
+  std::unique_ptr<EventTransport> control_;
+  int socket_;
+  int local_port_;
+
+  std::thread receive_thread_;
+  std::thread control_thread_;
+
+  // Held while writing to the control transport, which both the writing
+  // thread and the receive thread do once falling back. Taken before m_.
+  std::mutex control_write_m_;
+  // Only used while holding control_write_m_.
+  OutgoingEventPB control_event_;
+  // Only used by the control reading thread.
+  IncomingEventPB control_read_event_;
+  // Only used by the receive thread.
+  std::vector<char> receive_buffer_;
+  KeyPressDatagramPB received_datagram_;
+  IncomingEventPB received_event_;
+
+  // m_ protects everything below. cv_ is notified when an event is queued and
+  // when the transport is cancelled or the control transport fails.
+  mutable std::mutex m_;
+  std::condition_variable cv_;
+  std::vector<Peer> peers_;
+  // The client_id of the ClientReadyPB written through the transport.
+  int64_t client_id_;
+
+  // The key presses some peer has yet to acknowledge, numbered from
+  // history_first_, in a ring of max_unacked_key_presses starting at
+  // history_head_.
+  std::vector<KeyStatePB> history_;
+  size_t history_head_;
+  int64_t history_first_;
+  int64_t history_count_;
+
+  // Reused to build and serialize outgoing datagrams.
+  KeyPressDatagramPB send_datagram_;
+  std::vector<char> send_buffer_;
+  std::minstd_rand loss_generator_;
+  std::uniform_real_distribution<double> loss_distribution_;
+
+  IncomingEventQueue incoming_;
+  // For each port, the frame after the last one read.
+  int next_frames_[Port_ARRAYSIZE];
+
+  bool opened_;
+  bool control_closed_;
+  bool cancelled_;
+  // Whether the game start was queued, before which no key press may be.
+  bool started_;
+  bool fallen_back_;
+  UdpEventTransportStats stats_;
+};
+
+#endif  // UDP_EVENT_TRANSPORT_H_
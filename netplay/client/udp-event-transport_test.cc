@@ -0,0 +1,586 @@
+#include "client/udp-event-transport.h"
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "client/event-stream-handler.h"
+#include "client/loopback-event-transport.h"
+#include "client/test-utils.h"
+#include "client/trace-ring.h"
+
+namespace {
+
+using test_utils::IntegerCoder;
+using test_utils::KeyPressEvent;
+using test_utils::ReadFrames;
+
+const int kConsoleId = 101;
+
+// Plays the server on the control transport: records the events written to
+// it, and replies to a ready client with the start of a game on ports 1 and 2.
+class ServerPeer : public LoopbackEventTransport::Peer {
+ public:
+  void HandleEvent(const OutgoingEventPB& event,
+                   LoopbackEventTransport* transport) override {
+    events_.push_back(event);
+    transport_ = transport;
+    if (event.has_client_ready()) {
+      auto* start_game = reply_.mutable_start_game();
+      start_game->set_console_id(kConsoleId);
+      start_game->add_connected_ports()->set_port(PORT_1);
+      start_game->add_connected_ports()->set_port(PORT_2);
+      transport->Deliver(&reply_);
+    }
+  }
+
+  const std::vector<OutgoingEventPB>& events() const { return events_; }
+
+  // The transport of the last event written, to deliver events through.
+  LoopbackEventTransport* transport() const { return transport_; }
+
+ private:
+  std::vector<OutgoingEventPB> events_;
+  LoopbackEventTransport* transport_ = nullptr;
+  IncomingEventPB reply_;
+};
+
+// Plays the server on the control transports of several clients, one per
+// port from PORT_1 on. Starts the game once every client is ready, listing
+// the endpoints they advertised on 127.0.0.1, and relays key presses and
+// frame statuses to the other clients.
+class SignallingServer {
+ public:
+  // Returns the peer to give the control transport of the next client.
+  LoopbackEventTransport::Peer* AddClient() {
+    std::lock_guard<std::mutex> lock(m_);
+    clients_.emplace_back(new Client(this, clients_.size()));
+    return clients_.back().get();
+  }
+
+  // Lists address instead of the advertised endpoint of client index.
+  void OverrideAddress(int index, const std::string& address) {
+    std::lock_guard<std::mutex> lock(m_);
+    clients_[index]->address = address;
+  }
+
+  // Whether the game start lists the endpoints of the clients.
+  void set_list_peers(bool list_peers) {
+    std::lock_guard<std::mutex> lock(m_);
+    list_peers_ = list_peers;
+  }
+
+  // Stops relaying, before the transports of the clients are destroyed.
+  void Stop() {
+    std::lock_guard<std::mutex> lock(m_);
+    stopped_ = true;
+  }
+
+  int advertised_port(int index) {
+    std::lock_guard<std::mutex> lock(m_);
+    return clients_[index]->advertised_port;
+  }
+
+  int relayed_key_presses() {
+    std::lock_guard<std::mutex> lock(m_);
+    return relayed_key_presses_;
+  }
+
+ private:
+  struct Client : public LoopbackEventTransport::Peer {
+    Client(SignallingServer* server, int index)
+        : server(server), index(index) {}
+
+    void HandleEvent(const OutgoingEventPB& event,
+                     LoopbackEventTransport* transport) override {
+      server->HandleEvent(index, event, transport);
+    }
+
+    SignallingServer* const server;
+    const int index;
+    LoopbackEventTransport* transport = nullptr;
+    int advertised_port = 0;
+    std::string address;
+  };
+
+  void HandleEvent(int index, const OutgoingEventPB& event,
+                   LoopbackEventTransport* transport) {
+    std::lock_guard<std::mutex> lock(m_);
+    if (stopped_) {
+      return;
+    }
+    Client& sender = *clients_[index];
+    if (event.has_client_ready()) {
+      sender.transport = transport;
+      sender.advertised_port = event.client_ready().peer_port();
+      if (sender.address.empty()) {
+        sender.address =
+            "127.0.0.1:" + std::to_string(event.client_ready().peer_port());
+      }
+      if (++ready_ == clients_.size()) {
+        StartGame();
+      }
+    }
+    if (event.key_press_size() > 0 || event.has_frame_status()) {
+      relayed_key_presses_ += event.key_press_size();
+      for (const auto& client : clients_) {
+        if (client.get() == &sender) {
+          continue;
+        }
+        reply_.mutable_key_press()->CopyFrom(event.key_press());
+        if (event.has_frame_status()) {
+          *reply_.mutable_frame_status() = event.frame_status();
+        }
+        client->transport->Deliver(&reply_);
+      }
+    }
+  }
+
+  void StartGame() {
+    for (const auto& client : clients_) {
+      StartGamePB* start_game = reply_.mutable_start_game();
+      start_game->set_console_id(kConsoleId);
+      for (const auto& other : clients_) {
+        start_game->add_connected_ports()->set_port(
+            static_cast<Port>(PORT_1 + other->index));
+        if (list_peers_) {
+          PeerEndpointPB* peer = start_game->add_peers();
+          peer->set_client_id(other->index + 1);
+          peer->set_address(other->address);
+        }
+      }
+      client->transport->Deliver(&reply_);
+    }
+  }
+
+  std::mutex m_;
+  std::vector<std::unique_ptr<Client>> clients_;
+  size_t ready_ = 0;
+  bool list_peers_ = true;
+  bool stopped_ = false;
+  int relayed_key_presses_ = 0;
+  IncomingEventPB reply_;
+};
+
+std::string LocalAddress(const UdpEventTransport& transport) {
+  return "127.0.0.1:" + std::to_string(transport.local_port());
+}
+
+}  // namespace
+
+class UdpEventTransportTest : public ::testing::Test {
+ protected:
+  // Makes transport_1_ and transport_2_, which send each other key presses
+  // with the given options, and server_1_ and server_2_ on their control
+  // transports.
+  void MakeTransports(const UdpEventTransportOptions& options) {
+    transport_1_.reset(new UdpEventTransport(
+        std::unique_ptr<EventTransport>(new LoopbackEventTransport(&server_1_)),
+        options));
+    transport_2_.reset(new UdpEventTransport(
+        std::unique_ptr<EventTransport>(new LoopbackEventTransport(&server_2_)),
+        options));
+  }
+
+  void OpenTransports() {
+    ASSERT_TRUE(transport_1_->Open());
+    ASSERT_TRUE(transport_2_->Open());
+    ASSERT_TRUE(transport_1_->AddPeer(LocalAddress(*transport_2_)));
+    ASSERT_TRUE(transport_2_->AddPeer(LocalAddress(*transport_1_)));
+  }
+
+  // Must outlive the transports.
+  ServerPeer server_1_;
+  ServerPeer server_2_;
+  std::unique_ptr<UdpEventTransport> transport_1_;
+  std::unique_ptr<UdpEventTransport> transport_2_;
+};
+
+TEST_F(UdpEventTransportTest, InvalidOptions) {
+  UdpEventTransportOptions options;
+  EXPECT_DEATH(UdpEventTransport(std::unique_ptr<EventTransport>(), options),
+               "invalid control");
+
+  options.history_size = 0;
+  EXPECT_DEATH(UdpEventTransport(std::unique_ptr<EventTransport>(
+                                     new LoopbackEventTransport(nullptr)),
+                                 options),
+               "invalid history_size");
+
+  options = UdpEventTransportOptions();
+  options.max_unacked_key_presses = options.history_size - 1;
+  EXPECT_DEATH(UdpEventTransport(std::unique_ptr<EventTransport>(
+                                     new LoopbackEventTransport(nullptr)),
+                                 options),
+               "invalid max_unacked_key_presses");
+
+  options = UdpEventTransportOptions();
+  options.fallback_after_millis = -1;
+  EXPECT_DEATH(UdpEventTransport(std::unique_ptr<EventTransport>(
+                                     new LoopbackEventTransport(nullptr)),
+                                 options),
+               "invalid fallback_after_millis");
+
+  options = UdpEventTransportOptions();
+  options.send_loss_rate = 1;
+  EXPECT_DEATH(UdpEventTransport(std::unique_ptr<EventTransport>(
+                                     new LoopbackEventTransport(nullptr)),
+                                 options),
+               "invalid send_loss_rate");
+}
+
+TEST_F(UdpEventTransportTest, AddPeerInvalidAddress) {
+  MakeTransports(UdpEventTransportOptions());
+  ASSERT_TRUE(transport_1_->Open());
+
+  EXPECT_FALSE(transport_1_->AddPeer("127.0.0.1"));
+  EXPECT_FALSE(transport_1_->AddPeer("127.0.0.1:not a port"));
+  EXPECT_TRUE(transport_1_->AddPeer("127.0.0.1:1234"));
+  EXPECT_FALSE(transport_1_->AddPeer("127.0.0.1:1234"));
+}
+
+TEST_F(UdpEventTransportTest, ControlEventsGoThroughControlTransport) {
+  MakeTransports(UdpEventTransportOptions());
+  OpenTransports();
+
+  OutgoingEventPB ready;
+  ready.mutable_client_ready()->set_console_id(kConsoleId);
+  ASSERT_TRUE(transport_1_->Write(ready));
+  ASSERT_EQ(1, server_1_.events().size());
+  EXPECT_TRUE(server_1_.events()[0].has_client_ready());
+
+  IncomingEventPB event;
+  ASSERT_TRUE(transport_1_->Read(&event));
+  EXPECT_EQ(kConsoleId, event.start_game().console_id());
+  EXPECT_TRUE(server_2_.events().empty());
+}
+
+TEST_F(UdpEventTransportTest, KeyPressesGoToPeers) {
+  MakeTransports(UdpEventTransportOptions());
+  OpenTransports();
+
+  // The frame status rides on the control transport, the key press doesn't.
+  OutgoingEventPB event = KeyPressEvent(kConsoleId, PORT_1, 0);
+  event.mutable_frame_status()->set_current_frame(0);
+  ASSERT_TRUE(transport_1_->Write(event));
+  ASSERT_EQ(1, server_1_.events().size());
+  EXPECT_TRUE(server_1_.events()[0].has_frame_status());
+  EXPECT_EQ(0, server_1_.events()[0].key_press_size());
+
+  IncomingEventPB read_event;
+  ASSERT_TRUE(transport_2_->Read(&read_event));
+  ASSERT_EQ(1, read_event.key_press_size());
+  EXPECT_EQ(PORT_1, read_event.key_press(0).port());
+  EXPECT_EQ(0, read_event.key_press(0).frame_number());
+  EXPECT_FALSE(read_event.has_frame_status());
+}
+
+TEST_F(UdpEventTransportTest, DeliversInOrderExactlyOnceDespiteLoss) {
+  const int kFrames = 300;
+  UdpEventTransportOptions options;
+  options.send_loss_rate = 0.3;
+  MakeTransports(options);
+  OpenTransports();
+
+  std::vector<int> frames_2;
+  std::thread reader_2([this, &frames_2]() {
+    frames_2 = ReadFrames(transport_2_.get(), kFrames);
+  });
+  std::vector<int> frames_1;
+  std::thread reader_1([this, &frames_1]() {
+    frames_1 = ReadFrames(transport_1_.get(), kFrames);
+  });
+  for (int frame = 0; frame < kFrames; ++frame) {
+    ASSERT_TRUE(transport_1_->Write(KeyPressEvent(kConsoleId, PORT_1, frame)));
+    ASSERT_TRUE(transport_2_->Write(KeyPressEvent(kConsoleId, PORT_2, frame)));
+  }
+  reader_1.join();
+  reader_2.join();
+
+  ASSERT_EQ(kFrames, frames_1.size());
+  ASSERT_EQ(kFrames, frames_2.size());
+  for (int frame = 0; frame < kFrames; ++frame) {
+    EXPECT_EQ(frame, frames_1[frame]);
+    EXPECT_EQ(frame, frames_2[frame]);
+  }
+
+  const UdpEventTransportStats stats = transport_1_->stats();
+  EXPECT_GT(stats.datagrams_dropped, 0);
+  EXPECT_LT(stats.datagrams_dropped, stats.datagrams_sent);
+  // Redundant copies of the key presses were received, and skipped.
+  EXPECT_GT(stats.duplicate_key_presses, 0);
+  EXPECT_EQ(kFrames,
+            stats.key_presses_received - stats.duplicate_key_presses);
+}
+
+TEST_F(UdpEventTransportTest, ResendsAfterWritesStop) {
+  UdpEventTransportOptions options;
+  options.send_loss_rate = 0.5;
+  MakeTransports(options);
+  OpenTransports();
+
+  // Nothing is written after the last key press, so it can only get through
+  // by being resent until acknowledged.
+  for (int frame = 0; frame < 3; ++frame) {
+    ASSERT_TRUE(transport_1_->Write(KeyPressEvent(kConsoleId, PORT_1, frame)));
+  }
+  EXPECT_EQ(std::vector<int>({0, 1, 2}), ReadFrames(transport_2_.get(), 3));
+}
+
+TEST_F(UdpEventTransportTest, PeersAddedLaterGetUnacknowledgedKeyPresses) {
+  MakeTransports(UdpEventTransportOptions());
+  ASSERT_TRUE(transport_1_->Open());
+  ASSERT_TRUE(transport_2_->Open());
+  ASSERT_TRUE(transport_1_->AddPeer("127.0.0.1:1"));
+
+  // The first peer never acknowledges, so the key press is kept for the
+  // second.
+  ASSERT_TRUE(transport_1_->Write(KeyPressEvent(kConsoleId, PORT_1, 0)));
+  ASSERT_TRUE(transport_1_->AddPeer(LocalAddress(*transport_2_)));
+  ASSERT_TRUE(transport_2_->AddPeer(LocalAddress(*transport_1_)));
+  ASSERT_TRUE(transport_1_->Write(KeyPressEvent(kConsoleId, PORT_1, 1)));
+
+  EXPECT_EQ(std::vector<int>({0, 1}), ReadFrames(transport_2_.get(), 2));
+}
+
+TEST_F(UdpEventTransportTest, FailsWritesOncePeersFallTooFarBehind) {
+  UdpEventTransportOptions options;
+  options.history_size = 2;
+  options.max_unacked_key_presses = 4;
+  MakeTransports(options);
+  ASSERT_TRUE(transport_1_->Open());
+  ASSERT_TRUE(transport_1_->AddPeer("127.0.0.1:1"));
+
+  for (int frame = 0; frame < 4; ++frame) {
+    ASSERT_TRUE(transport_1_->Write(KeyPressEvent(kConsoleId, PORT_1, frame)));
+  }
+  EXPECT_FALSE(transport_1_->Write(KeyPressEvent(kConsoleId, PORT_1, 4)));
+}
+
+TEST_F(UdpEventTransportTest, TryCancelUnblocksRead) {
+  MakeTransports(UdpEventTransportOptions());
+  OpenTransports();
+
+  bool read_result = true;
+  std::thread reader([this, &read_result]() {
+    IncomingEventPB event;
+    read_result = transport_1_->Read(&event);
+  });
+  transport_1_->TryCancel();
+  reader.join();
+
+  EXPECT_FALSE(read_result);
+  EXPECT_FALSE(transport_1_->Write(KeyPressEvent(kConsoleId, PORT_1, 0)));
+}
+
+TEST_F(UdpEventTransportTest, HandlersPlayInLockstepDespiteLoss) {
+  typedef EventStreamHandler<uint32_t> IntHandler;
+  const int kFrames = 120;
+
+  UdpEventTransportOptions options;
+  options.send_loss_rate = 0.2;
+  MakeTransports(options);
+  UdpEventTransport* transport_1 = transport_1_.get();
+  UdpEventTransport* transport_2 = transport_2_.get();
+
+  const IntegerCoder coder;
+  TraceRing trace_1;
+  TraceRing trace_2;
+  IntHandler handler_1(kConsoleId, 1, {PORT_1}, &trace_1, &coder,
+                       std::unique_ptr<EventTransport>(transport_1_.release()));
+  IntHandler handler_2(kConsoleId, 2, {PORT_2}, &trace_2, &coder,
+                       std::unique_ptr<EventTransport>(transport_2_.release()));
+
+  ASSERT_TRUE(handler_1.ClientReady());
+  ASSERT_TRUE(handler_2.ClientReady());
+  ASSERT_TRUE(transport_1->AddPeer(LocalAddress(*transport_2)));
+  ASSERT_TRUE(transport_2->AddPeer(LocalAddress(*transport_1)));
+  ASSERT_TRUE(handler_1.WaitForConsoleStart());
+  ASSERT_TRUE(handler_2.WaitForConsoleStart());
+
+  // Each client presses its own frame number plus its port number.
+  auto play = [kFrames](IntHandler* handler, Port local_port) {
+    for (int frame = 0; frame < kFrames; ++frame) {
+      ASSERT_EQ(IntHandler::PutButtonsStatus::SUCCESS,
+                handler->PutButtons({std::make_tuple(
+                    local_port, frame,
+                    static_cast<uint32_t>(frame + local_port))}));
+      uint32_t buttons_1 = 0;
+      uint32_t buttons_2 = 0;
+      ASSERT_EQ(IntHandler::GetButtonsStatus::SUCCESS,
+                handler->GetButtons(PORT_1, frame, &buttons_1));
+      ASSERT_EQ(IntHandler::GetButtonsStatus::SUCCESS,
+                handler->GetButtons(PORT_2, frame, &buttons_2));
+      EXPECT_EQ(frame + PORT_1, buttons_1);
+      EXPECT_EQ(frame + PORT_2, buttons_2);
+    }
+  };
+  std::thread player_2(play, &handler_2, PORT_2);
+  play(&handler_1, PORT_1);
+  player_2.join();
+
+  // Only the client ready events went to the server.
+  EXPECT_EQ(1, server_1_.events().size());
+  EXPECT_EQ(1, server_2_.events().size());
+  EXPECT_GT(transport_1->stats().datagrams_dropped, 0);
+}
+
+TEST_F(UdpEventTransportTest, ReadsKeyPressesFromBothPathsOnce) {
+  MakeTransports(UdpEventTransportOptions());
+  OpenTransports();
+
+  OutgoingEventPB ready;
+  ready.mutable_client_ready()->set_console_id(kConsoleId);
+  ASSERT_TRUE(transport_2_->Write(ready));
+  IncomingEventPB event;
+  ASSERT_TRUE(transport_2_->Read(&event));
+  ASSERT_TRUE(event.has_start_game());
+
+  for (int frame = 0; frame < 3; ++frame) {
+    ASSERT_TRUE(transport_1_->Write(KeyPressEvent(kConsoleId, PORT_1, frame)));
+  }
+  EXPECT_EQ(std::vector<int>({0, 1, 2}), ReadFrames(transport_2_.get(), 3));
+
+  // The server relays frames 1 to 4, as after transport_1_ fell back.
+  event.Clear();
+  for (int frame = 1; frame < 5; ++frame) {
+    *event.add_key_press() =
+        KeyPressEvent(kConsoleId, PORT_1, frame).key_press(0);
+  }
+  ASSERT_TRUE(server_2_.transport()->Deliver(&event));
+  EXPECT_EQ(std::vector<int>({3, 4}), ReadFrames(transport_2_.get(), 2));
+  EXPECT_EQ(2, transport_2_->stats().stale_key_presses);
+
+  // An event left without key presses isn't read at all.
+  for (int frame = 3; frame < 5; ++frame) {
+    *event.add_key_press() =
+        KeyPressEvent(kConsoleId, PORT_1, frame).key_press(0);
+  }
+  ASSERT_TRUE(server_2_.transport()->Deliver(&event));
+  ASSERT_TRUE(transport_1_->Write(KeyPressEvent(kConsoleId, PORT_1, 5)));
+  EXPECT_EQ(std::vector<int>({5}), ReadFrames(transport_2_.get(), 1));
+}
+
+// Clients whose peers are the ones SignallingServer lists when the game
+// starts.
+class UdpEventTransportPeerToPeerTest : public ::testing::Test {
+ protected:
+  typedef EventStreamHandler<uint32_t> IntHandler;
+
+  void TearDown() override { server_.Stop(); }
+
+  // Makes the handler of the next client, on the next port from PORT_1 on,
+  // over a UdpEventTransport with options.
+  UdpEventTransport* AddClient(UdpEventTransportOptions options) {
+    options.peers_from_start_game = true;
+    UdpEventTransport* transport = new UdpEventTransport(
+        std::unique_ptr<EventTransport>(
+            new LoopbackEventTransport(server_.AddClient())),
+        options);
+    const int index = handlers_.size();
+    traces_.emplace_back(new TraceRing());
+    handlers_.emplace_back(new IntHandler(
+        kConsoleId, index + 1, {static_cast<Port>(PORT_1 + index)},
+        traces_.back().get(), &coder_,
+        std::unique_ptr<EventTransport>(transport)));
+    transports_.push_back(transport);
+    return transport;
+  }
+
+  // Starts the game, and plays frames in lockstep, each client pressing the
+  // frame number plus its port number.
+  void Play(int frames) {
+    for (const auto& handler : handlers_) {
+      ASSERT_TRUE(handler->ClientReady());
+    }
+    for (const auto& handler : handlers_) {
+      ASSERT_TRUE(handler->WaitForConsoleStart());
+    }
+
+    const int num_clients = handlers_.size();
+    auto play = [frames, num_clients](IntHandler* handler, Port local_port) {
+      for (int frame = 0; frame < frames; ++frame) {
+        ASSERT_EQ(IntHandler::PutButtonsStatus::SUCCESS,
+                  handler->PutButtons({std::make_tuple(
+                      local_port, frame,
+                      static_cast<uint32_t>(frame + local_port))}));
+        for (int i = 0; i < num_clients; ++i) {
+          const Port port = static_cast<Port>(PORT_1 + i);
+          uint32_t buttons = 0;
+          ASSERT_EQ(IntHandler::GetButtonsStatus::SUCCESS,
+                    handler->GetButtons(port, frame, &buttons));
+          EXPECT_EQ(frame + port, buttons);
+        }
+      }
+    };
+    std::vector<std::thread> players;
+    for (int i = 0; i < num_clients; ++i) {
+      players.emplace_back(play, handlers_[i].get(),
+                           static_cast<Port>(PORT_1 + i));
+    }
+    for (std::thread& player : players) {
+      player.join();
+    }
+  }
+
+  // Must outlive the handlers.
+  SignallingServer server_;
+  const IntegerCoder coder_;
+  std::vector<std::unique_ptr<TraceRing>> traces_;
+  std::vector<std::unique_ptr<IntHandler>> handlers_;
+  // Owned by the handlers.
+  std::vector<UdpEventTransport*> transports_;
+};
+
+TEST_F(UdpEventTransportPeerToPeerTest, ExchangesKeyPressesDirectly) {
+  UdpEventTransportOptions options;
+  options.send_loss_rate = 0.1;
+  options.fallback_after_millis = 10000;
+  for (int i = 0; i < 3; ++i) {
+    AddClient(options);
+  }
+  Play(60);
+
+  for (int i = 0; i < 3; ++i) {
+    EXPECT_EQ(transports_[i]->local_port(), server_.advertised_port(i));
+    EXPECT_FALSE(transports_[i]->fallen_back());
+    EXPECT_GT(transports_[i]->stats().key_presses_received, 0);
+  }
+  EXPECT_EQ(0, server_.relayed_key_presses());
+}
+
+TEST_F(UdpEventTransportPeerToPeerTest, FallsBackIfPeerIsUnreachable) {
+  UdpEventTransportOptions options;
+  options.fallback_after_millis = 50;
+  AddClient(options);
+  AddClient(options);
+  // Client 0 sends to a port nobody listens on, and ignores the datagrams of
+  // client 1, which come from elsewhere.
+  server_.OverrideAddress(1, "127.0.0.1:1");
+  Play(60);
+
+  for (UdpEventTransport* transport : transports_) {
+    EXPECT_TRUE(transport->fallen_back());
+    EXPECT_GT(transport->stats().key_presses_sent_to_control, 0);
+  }
+  EXPECT_GT(server_.relayed_key_presses(), 0);
+}
+
+TEST_F(UdpEventTransportPeerToPeerTest, FallsBackIfServerListsNoPeers) {
+  server_.set_list_peers(false);
+  AddClient(UdpEventTransportOptions());
+  AddClient(UdpEventTransportOptions());
+  Play(20);
+
+  for (UdpEventTransport* transport : transports_) {
+    EXPECT_TRUE(transport->fallen_back());
+    EXPECT_EQ(0, transport->stats().datagrams_sent);
+    EXPECT_EQ(20, transport->stats().key_presses_sent_to_control);
+  }
+  EXPECT_EQ(40, server_.relayed_key_presses());
+}
@@ -0,0 +1,107 @@
+#include "client/wait-strategy.h"
+
+#include <cstdlib>
+
+#include "glog/logging.h"
+
+namespace {
+
+const char* const kPhaseNames[] = {"SPIN", "YIELD", "BLOCK"};
+
+}  // namespace
+
+const int WaitStrategy::kNumBuckets;
+const int WaitStrategy::kTuningWaits;
+
+WaitStrategy::PhaseStats::PhaseStats() : waits(0), wait_nanos(0) {
+  for (int i = 0; i < kNumBuckets; ++i) {
+    wait_histogram[i].store(0, std::memory_order_relaxed);
+    wakeup_histogram[i].store(0, std::memory_order_relaxed);
+  }
+}
+
+WaitStrategy::WaitStrategy(int64_t max_spin_nanos, int64_t yield_nanos,
+                           const ClockInterface* clock)
+    : max_spin_nanos_(max_spin_nanos),
+      yield_nanos_(yield_nanos),
+      clock_(clock),
+      spin_budget_nanos_(max_spin_nanos),
+      waits_(0) {
+  if (max_spin_nanos_ < 0) {
+    LOG(ERROR) << "invalid max_spin_nanos: " << max_spin_nanos_;
+    std::abort();
+  }
+  if (yield_nanos_ < 0) {
+    LOG(ERROR) << "invalid yield_nanos: " << yield_nanos_;
+    std::abort();
+  }
+  for (int i = 0; i < kTuningWaits; ++i) {
+    recent_wait_nanos_[i] = 0;
+  }
+}
+
+void WaitStrategy::RecordWait(WaitPhase phase, int64_t wait_nanos,
+                              int64_t wakeup_nanos) {
+  PhaseStats& stats = phases_[static_cast<int>(phase)];
+  stats.waits.fetch_add(1, std::memory_order_relaxed);
+  stats.wait_nanos.fetch_add(wait_nanos, std::memory_order_relaxed);
+  stats.wait_histogram[Bucket(wait_nanos)].fetch_add(
+      1, std::memory_order_relaxed);
+  if (phase == WaitPhase::BLOCK && wakeup_nanos >= 0) {
+    stats.wakeup_histogram[Bucket(wakeup_nanos)].fetch_add(
+        1, std::memory_order_relaxed);
+  }
+
+  // Only this thread writes waits_.
+  const int64_t waits = waits_.load(std::memory_order_relaxed);
+  recent_wait_nanos_[waits % kTuningWaits] = wait_nanos;
+  waits_.store(waits + 1, std::memory_order_relaxed);
+
+  // Spin long enough to catch the longest recent wait that spinning could
+  // have caught, with some margin, and not at all if none could have been.
+  const int recent_waits =
+      waits + 1 < kTuningWaits ? static_cast<int>(waits + 1) : kTuningWaits;
+  int64_t longest_short_wait = -1;
+  for (int i = 0; i < recent_waits; ++i) {
+    if (recent_wait_nanos_[i] <= max_spin_nanos_ &&
+        recent_wait_nanos_[i] > longest_short_wait) {
+      longest_short_wait = recent_wait_nanos_[i];
+    }
+  }
+  int64_t spin_budget_nanos = 0;
+  if (longest_short_wait >= 0) {
+    spin_budget_nanos =
+        std::min(max_spin_nanos_, longest_short_wait + longest_short_wait / 4);
+  }
+  spin_budget_nanos_.store(spin_budget_nanos, std::memory_order_relaxed);
+}
+
+void WaitStrategy::GetStats(WaitStatsPB* stats) const {
+  stats->Clear();
+  stats->set_spin_budget_nanos(spin_budget_nanos());
+  for (int phase = 0; phase < kNumPhases; ++phase) {
+    const PhaseStats& phase_stats = phases_[phase];
+    WaitPhaseStatsPB* phase_pb = stats->add_phase();
+    phase_pb->set_phase(kPhaseNames[phase]);
+    phase_pb->set_waits(phase_stats.waits.load(std::memory_order_relaxed));
+    phase_pb->set_wait_nanos(
+        phase_stats.wait_nanos.load(std::memory_order_relaxed));
+    for (int i = 0; i < kNumBuckets; ++i) {
+      phase_pb->add_wait_histogram(
+          phase_stats.wait_histogram[i].load(std::memory_order_relaxed));
+      phase_pb->add_wakeup_histogram(
+          phase_stats.wakeup_histogram[i].load(std::memory_order_relaxed));
+    }
+  }
+}
+
+// static
+int WaitStrategy::Bucket(int64_t nanos) {
+  int64_t micros = nanos / 1000;
+  int bucket = 0;
+  while (micros > 0 && bucket < kNumBuckets - 1) {
+    micros >>= 1;
+    ++bucket;
+  }
+  return bucket;
+}
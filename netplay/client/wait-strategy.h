@@ -0,0 +1,163 @@
+#ifndef WAIT_STRATEGY_H_
+#define WAIT_STRATEGY_H_
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <thread>
+
+#include "base/timings.pb.h"
+#include "client/clock.h"
+
+// Phases of a wait for buttons that have not arrived yet, in the order in
+// which they are tried.
+enum class WaitPhase {
+  // Polls for the buttons, pausing the CPU between polls.
+  SPIN = 0,
+  // Polls for the buttons, yielding the CPU to other threads between polls.
+  YIELD,
+  // Sleeps on the queue's condition variable until the buttons are put.
+  BLOCK
+};
+
+// Decides how the consumer of an input queue waits for buttons that have not
+// arrived yet, and records how each wait went.
+//
+// Blocking on a condition variable costs a futex sleep and a scheduler wakeup,
+// which adds jitter exactly when the buttons are already late. Instead, a wait
+// first spins, then yields, and only then blocks. Spinning burns a core, so it
+// only pays off for buttons that arrive within a few hundred microseconds. The
+// spin budget is therefore tuned from the recent waits: it covers the longest
+// of them that was short enough to spin through, up to max_spin_nanos, and
+// drops to zero when they all took longer.
+//
+// Each wait is recorded in a histogram of the phase that ended it. Waits that
+// ended blocked also record their wakeup latency, from the moment the producer
+// notified the consumer to the moment the consumer ran again.
+//
+// Poll and RecordWait must only be called by the consumer of the queue.
+// GetStats may be called from any thread.
+class WaitStrategy {
+ public:
+  // Histogram bucket i counts the waits that took less than 2^i microseconds
+  // and, for i > 0, at least 2^(i-1). The last bucket also counts the longer
+  // ones.
+  static const int kNumBuckets = 24;
+
+  // Number of recent waits the spin budget is tuned from.
+  static const int kTuningWaits = 16;
+
+  // Arguments are:
+  //  - max_spin_nanos: longest a wait may spin.
+  //  - yield_nanos: how long a wait yields after spinning, before blocking.
+  //  - clock: times the waits. Must outlive the strategy.
+  // std::abort's if either duration is negative.
+  WaitStrategy(int64_t max_spin_nanos, int64_t yield_nanos,
+               const ClockInterface* clock = SystemClock::Get());
+
+  // Polls ready() until it returns true or the spin and yield phases are over,
+  // but for no longer than timeout_nanos if it is not negative. Sets
+  // *start_nanos to the time the wait started. Returns the phase in which
+  // ready() returned true, or BLOCK if the caller is left to block.
+  template <typename Ready>
+  WaitPhase Poll(const Ready& ready, int64_t timeout_nanos,
+                 int64_t* start_nanos);
+
+  // Records a wait that ended in phase after wait_nanos, and tunes the spin
+  // budget. wakeup_nanos is the wakeup latency of a wait that ended blocked,
+  // or negative if it is unknown.
+  void RecordWait(WaitPhase phase, int64_t wait_nanos, int64_t wakeup_nanos);
+
+  // Populates *stats with the spin budget and the histograms of every phase.
+  // Leaves the port unset.
+  void GetStats(WaitStatsPB* stats) const;
+
+  // Returns the current time of the strategy's clock.
+  int64_t now_nanos() const { return clock_->now_nanos(); }
+
+  int64_t spin_budget_nanos() const {
+    return spin_budget_nanos_.load(std::memory_order_relaxed);
+  }
+
+  // Returns the number of waits recorded so far.
+  int64_t waits() const { return waits_.load(std::memory_order_relaxed); }
+
+ private:
+  static const int kNumPhases = 3;
+
+  struct PhaseStats {
+    PhaseStats();
+
+    std::atomic<int64_t> waits;
+    std::atomic<int64_t> wait_nanos;
+    std::atomic<int64_t> wait_histogram[kNumBuckets];
+    std::atomic<int64_t> wakeup_histogram[kNumBuckets];
+  };
+
+  // Returns the histogram bucket of nanos.
+  static int Bucket(int64_t nanos);
+
+  const int64_t max_spin_nanos_;
+  const int64_t yield_nanos_;
+  // Borrowed reference
+  const ClockInterface* clock_;
+
+  // Consumer-owned durations of the latest waits, indexed by wait modulo
+  // kTuningWaits.
+  int64_t recent_wait_nanos_[kTuningWaits];
+
+  std::atomic<int64_t> spin_budget_nanos_;
+  std::atomic<int64_t> waits_;
+  PhaseStats phases_[kNumPhases];
+};
+
+namespace wait_strategy_internal {
+
+// Tells the CPU that this thread is busy-waiting.
+inline void CpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  asm volatile("yield");
+#endif
+}
+
+}  // namespace wait_strategy_internal
+
+template <typename Ready>
+WaitPhase WaitStrategy::Poll(const Ready& ready, int64_t timeout_nanos,
+                             int64_t* start_nanos) {
+  const int64_t start = clock_->now_nanos();
+  *start_nanos = start;
+
+  int64_t spin_nanos = spin_budget_nanos();
+  int64_t poll_nanos = spin_nanos + yield_nanos_;
+  if (timeout_nanos >= 0 && timeout_nanos < poll_nanos) {
+    poll_nanos = timeout_nanos;
+    spin_nanos = std::min(spin_nanos, poll_nanos);
+  }
+
+  // Only read the clock every few polls while spinning, since reading it can
+  // take longer than a poll.
+  static const int kPollsPerClockRead = 16;
+  int64_t elapsed = 0;
+  while (elapsed < spin_nanos) {
+    for (int i = 0; i < kPollsPerClockRead; ++i) {
+      if (ready()) {
+        return WaitPhase::SPIN;
+      }
+      wait_strategy_internal::CpuRelax();
+    }
+    elapsed = clock_->now_nanos() - start;
+  }
+  while (elapsed < poll_nanos) {
+    if (ready()) {
+      return WaitPhase::YIELD;
+    }
+    std::this_thread::yield();
+    elapsed = clock_->now_nanos() - start;
+  }
+  return WaitPhase::BLOCK;
+}
+
+#endif  // WAIT_STRATEGY_H_
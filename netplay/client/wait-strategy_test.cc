@@ -0,0 +1,129 @@
+#include "client/wait-strategy.h"
+
+#include <functional>
+#include <memory>
+
+#include "gtest/gtest.h"
+
+namespace {
+
+const int64_t kMicros = 1000;
+
+// Clock which advances by a fixed step every time it is read.
+class SteppingClock : public ClockInterface {
+ public:
+  explicit SteppingClock(int64_t step_nanos) : step_nanos_(step_nanos) {}
+
+  int64_t now_nanos() const override {
+    now_nanos_ += step_nanos_;
+    return now_nanos_;
+  }
+
+ private:
+  const int64_t step_nanos_;
+  mutable int64_t now_nanos_ = 0;
+};
+
+// Returns a predicate which becomes true on its polls-th call.
+std::function<bool()> ReadyAfter(int polls) {
+  auto calls = std::make_shared<int>(0);
+  return [calls, polls] { return ++*calls >= polls; };
+}
+
+}  // namespace
+
+TEST(WaitStrategyTest, InvalidArguments) {
+  EXPECT_DEATH(WaitStrategy(-1, 0), "invalid max_spin_nanos");
+  EXPECT_DEATH(WaitStrategy(0, -1), "invalid yield_nanos");
+}
+
+TEST(WaitStrategyTest, PollSpinsThenYieldsThenGivesUp) {
+  const SteppingClock clock(1 * kMicros);
+  WaitStrategy strategy(100 * kMicros, 100 * kMicros, &clock);
+  int64_t start_nanos;
+
+  EXPECT_EQ(WaitPhase::SPIN, strategy.Poll(ReadyAfter(1), -1, &start_nanos));
+  EXPECT_EQ(1 * kMicros, start_nanos);
+
+  // The clock is read every 16 polls while spinning, and every poll while
+  // yielding.
+  EXPECT_EQ(WaitPhase::SPIN,
+            strategy.Poll(ReadyAfter(16 * 100), -1, &start_nanos));
+  EXPECT_EQ(WaitPhase::YIELD,
+            strategy.Poll(ReadyAfter(16 * 100 + 1), -1, &start_nanos));
+  EXPECT_EQ(WaitPhase::YIELD,
+            strategy.Poll(ReadyAfter(16 * 100 + 100), -1, &start_nanos));
+  EXPECT_EQ(WaitPhase::BLOCK,
+            strategy.Poll(ReadyAfter(16 * 100 + 101), -1, &start_nanos));
+
+  // The timeout cuts polling short.
+  EXPECT_EQ(WaitPhase::BLOCK,
+            strategy.Poll(ReadyAfter(16 * 10 + 1), 10 * kMicros,
+                          &start_nanos));
+  EXPECT_EQ(WaitPhase::BLOCK,
+            strategy.Poll(ReadyAfter(1), 0, &start_nanos));
+}
+
+TEST(WaitStrategyTest, TunesSpinBudgetFromRecentWaits) {
+  WaitStrategy strategy(500 * kMicros, 0);
+  EXPECT_EQ(500 * kMicros, strategy.spin_budget_nanos());
+
+  // Spin a quarter longer than the longest recent wait spinning could catch.
+  strategy.RecordWait(WaitPhase::SPIN, 100 * kMicros, -1);
+  EXPECT_EQ(125 * kMicros, strategy.spin_budget_nanos());
+  strategy.RecordWait(WaitPhase::BLOCK, 2000 * kMicros, -1);
+  EXPECT_EQ(125 * kMicros, strategy.spin_budget_nanos());
+  strategy.RecordWait(WaitPhase::SPIN, 480 * kMicros, -1);
+  EXPECT_EQ(500 * kMicros, strategy.spin_budget_nanos());
+
+  // Stop spinning once no recent wait was short enough.
+  for (int i = 0; i < WaitStrategy::kTuningWaits - 1; ++i) {
+    strategy.RecordWait(WaitPhase::BLOCK, 2000 * kMicros, -1);
+  }
+  EXPECT_EQ(500 * kMicros, strategy.spin_budget_nanos());
+  strategy.RecordWait(WaitPhase::BLOCK, 2000 * kMicros, -1);
+  EXPECT_EQ(0, strategy.spin_budget_nanos());
+
+  // And start again once waits get short.
+  strategy.RecordWait(WaitPhase::BLOCK, 40 * kMicros, -1);
+  EXPECT_EQ(50 * kMicros, strategy.spin_budget_nanos());
+  EXPECT_EQ(WaitStrategy::kTuningWaits + 4, strategy.waits());
+}
+
+TEST(WaitStrategyTest, RecordsHistogramsPerPhase) {
+  WaitStrategy strategy(0, 0);
+  strategy.RecordWait(WaitPhase::SPIN, 500, -1);
+  strategy.RecordWait(WaitPhase::SPIN, 3 * kMicros, -1);
+  strategy.RecordWait(WaitPhase::BLOCK, 3 * kMicros, 1 * kMicros);
+  strategy.RecordWait(WaitPhase::BLOCK, 100 * 1000 * 1000 * kMicros, -1);
+
+  WaitStatsPB stats;
+  strategy.GetStats(&stats);
+  EXPECT_EQ(0, stats.port());
+  ASSERT_EQ(3, stats.phase_size());
+
+  const WaitPhaseStatsPB& spin = stats.phase(0);
+  EXPECT_EQ("SPIN", spin.phase());
+  EXPECT_EQ(2, spin.waits());
+  EXPECT_EQ(3500, spin.wait_nanos());
+  ASSERT_EQ(WaitStrategy::kNumBuckets, spin.wait_histogram_size());
+  EXPECT_EQ(1, spin.wait_histogram(0));
+  EXPECT_EQ(1, spin.wait_histogram(2));
+
+  const WaitPhaseStatsPB& yield = stats.phase(1);
+  EXPECT_EQ("YIELD", yield.phase());
+  EXPECT_EQ(0, yield.waits());
+
+  // Waits longer than the last bucket land in it.
+  const WaitPhaseStatsPB& block = stats.phase(2);
+  EXPECT_EQ("BLOCK", block.phase());
+  EXPECT_EQ(2, block.waits());
+  EXPECT_EQ(1, block.wait_histogram(2));
+  EXPECT_EQ(1, block.wait_histogram(WaitStrategy::kNumBuckets - 1));
+  EXPECT_EQ(1, block.wakeup_histogram(1));
+  int64_t wakeups = 0;
+  for (const int64_t count : block.wakeup_histogram()) {
+    wakeups += count;
+  }
+  EXPECT_EQ(1, wakeups);
+}
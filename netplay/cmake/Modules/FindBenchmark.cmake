@@ -0,0 +1,42 @@
+# - Try to find Google Benchmark
+#
+# The following variables are optionally searched for defaults
+#  BENCHMARK_ROOT_DIR:       Base directory where all Benchmark components are
+#                            found
+#
+# The following are set after configuration is done: 
+#  BENCHMARK_FOUND
+#  BENCHMARK_INCLUDE_DIRS
+#  BENCHMARK_LIBRARIES
+#  BENCHMARK_MAIN_LIBRARIES
+
+include(FindPackageHandleStandardArgs)
+
+set(BENCHMARK_ROOT_DIR "" CACHE PATH "Folder contains Google Benchmark")
+
+find_path(BENCHMARK_INCLUDE_DIR benchmark/benchmark.h
+    PATHS ${BENCHMARK_ROOT_DIR}
+    PATH_SUFFIXES include)
+
+find_library(BENCHMARK_LIBRARY benchmark
+    PATHS ${BENCHMARK_ROOT_DIR}
+    PATH_SUFFIXES
+        lib
+        lib64
+        build/src)
+
+find_library(BENCHMARK_MAIN_LIBRARY benchmark_main
+    PATHS ${BENCHMARK_ROOT_DIR}
+    PATH_SUFFIXES
+        lib
+        lib64
+        build/src)
+
+find_package_handle_standard_args(BENCHMARK DEFAULT_MSG
+    BENCHMARK_INCLUDE_DIR BENCHMARK_LIBRARY BENCHMARK_MAIN_LIBRARY)
+
+if(BENCHMARK_FOUND)
+    set(BENCHMARK_INCLUDE_DIRS ${BENCHMARK_INCLUDE_DIR})
+    set(BENCHMARK_LIBRARIES ${BENCHMARK_LIBRARY})
+    set(BENCHMARK_MAIN_LIBRARIES ${BENCHMARK_MAIN_LIBRARY})
+endif()
@@ -22,13 +22,11 @@ class NetplayIntegrationTest : public testing::Test {
  public:
   typedef EventStreamHandlerInterface<uint32_t> StreamHandler;
 
-  NetplayIntegrationTest() : fixture_(*integration_tests::GetJars()) {}
-
   void SetUp() override {
     integration_tests::MUST_USE_INTEGRATION_TEST_MAIN();
 
-    LOG(INFO) << "Starting VM";
-    fixture_.StartVM();
+    LOG(INFO) << "Starting Netplay server";
+    fixture_.StartServer();
     if (!fixture_.WaitForPing(10, 500)) {
       LOG(INFO)
           << "Timed out waiting for the server to respond to a ping request.";
@@ -76,21 +74,17 @@ class NetplayIntegrationTest : public testing::Test {
     return frame_data;
   }
 
-  // Wait until the server declares that we're ready for a game.
-  bool ReadyForGame(int num_attempts, int wait_per_attempt_millis,
-                    StreamHandler* handler) {
-    for (int i = 0; i < num_attempts; ++i) {
-      if (handler->ReadyAndWaitForConsoleStart()) {
-        return true;
-      }
-
-      LOG(ERROR) << "Handler ReadyAndWaitForConsoleStart failed. Retrying.";
-
-      std::this_thread::sleep_for(
-          std::chrono::milliseconds(wait_per_attempt_millis));
+  // Declare the client ready and wait until the server starts the game.
+  bool ReadyForGame(StreamHandler* handler) {
+    if (!handler->ClientReady()) {
+      LOG(ERROR) << "Handler ClientReady failed.";
+      return false;
     }
-
-    return false;
+    if (!handler->WaitForConsoleStart()) {
+      LOG(ERROR) << "Handler WaitForConsoleStart failed.";
+      return false;
+    }
+    return true;
   }
 
   // Start the game using player 1. This method will loop for the specified
@@ -131,6 +125,7 @@ class NetplayIntegrationTest : public testing::Test {
 
   static const char kConsoleName[];
   static const char kRomName[];
+  static const char kRomMd5[];
 
   NetplayServerTestFixture fixture_;
   shared_ptr<NetPlayServerService::Stub> p1_stub_;
@@ -140,6 +135,7 @@ class NetplayIntegrationTest : public testing::Test {
 const char NetplayIntegrationTest::kConsoleName[] =
     "integration-test-console-name";
 const char NetplayIntegrationTest::kRomName[] = "integration-test-rom-name";
+const char NetplayIntegrationTest::kRomMd5[] = "integration-test-rom-md5";
 
 // -----------------------------------------------------------------------------
 // A button coder that encodes a 32 bit integer in the x_axis field of the
@@ -179,25 +175,25 @@ TEST_F(NetplayIntegrationTest, StartGameAndTransmitButtons) {
   // Player 1 and 2 create clients to the returned console.
   NetplayClient<uint32_t> client_1(
       p1_stub_, unique_ptr<ButtonCoderInterface<uint32_t>>(new IntegerCoder()),
-      0,  // delay_frames
-      console_id);
+      0);  // delay_frames
   NetplayClient<uint32_t> client_2(
-      p1_stub_, unique_ptr<ButtonCoderInterface<uint32_t>>(new IntegerCoder()),
-      0,  // delay_frames
-      console_id);
+      p2_stub_, unique_ptr<ButtonCoderInterface<uint32_t>>(new IntegerCoder()),
+      0);  // delay_frames
 
   // Player 1 requests port 1, player 2 requests port 2.
   {
     PlugControllerResponsePB::Status plug_controller_status =
         PlugControllerResponsePB::UNKNOWN;
 
-    ASSERT_TRUE(client_1.PlugControllers({PORT_1}, &plug_controller_status));
+    ASSERT_TRUE(client_1.PlugControllers(console_id, kRomMd5, {PORT_1},
+                                         &plug_controller_status));
     ASSERT_EQ(PlugControllerResponsePB::Status_Name(
                   PlugControllerResponsePB::SUCCESS),
               PlugControllerResponsePB::Status_Name(plug_controller_status));
 
     plug_controller_status = PlugControllerResponsePB::UNKNOWN;
-    ASSERT_TRUE(client_2.PlugControllers({PORT_2}, &plug_controller_status));
+    ASSERT_TRUE(client_2.PlugControllers(console_id, kRomMd5, {PORT_2},
+                                         &plug_controller_status));
     ASSERT_EQ(PlugControllerResponsePB::Status_Name(
                   PlugControllerResponsePB::SUCCESS),
               PlugControllerResponsePB::Status_Name(plug_controller_status));
@@ -214,7 +210,7 @@ TEST_F(NetplayIntegrationTest, StartGameAndTransmitButtons) {
 
   thread stream_1_thread([&, this] {
     auto* stream = event_stream_1.get();
-    ASSERT_TRUE(ReadyForGame(100, 500, stream));
+    ASSERT_TRUE(ReadyForGame(stream));
     ASSERT_THAT(stream->local_ports(), UnorderedElementsAre(PORT_1));
     ASSERT_THAT(stream->remote_ports(), UnorderedElementsAre(PORT_2));
 
@@ -244,7 +240,7 @@ TEST_F(NetplayIntegrationTest, StartGameAndTransmitButtons) {
 
   thread stream_2_thread([&, this] {
     auto* stream = event_stream_2.get();
-    ASSERT_TRUE(ReadyForGame(100, 500, stream));
+    ASSERT_TRUE(ReadyForGame(stream));
     ASSERT_THAT(stream->local_ports(), UnorderedElementsAre(PORT_2));
     ASSERT_THAT(stream->remote_ports(), UnorderedElementsAre(PORT_1));
 
@@ -4,24 +4,22 @@
 #include <memory>
 #include <string>
 #include <thread>
-#include <vector>
 
 #include "base/netplayServiceProto.grpc.pb.h"
-#include "jni.h"
+#include "server/netplay-server.h"
 
 using std::string;
 using std::shared_ptr;
 using std::thread;
-using std::vector;
 
-// Starts a netplay server VM.
+// Runs a netplay server in this process, listening on localhost.
 class NetplayServerTestFixture {
  public:
-  NetplayServerTestFixture(const vector<string>& jars) : jars_(jars) {}
+  NetplayServerTestFixture() {}
 
-  // Starts the server main process. Returns immediately, does not wait until 
-  // the server exits.
-  void StartVM();
+  // Starts the server. Returns immediately, does not wait until the server 
+  // exits.
+  void StartServer();
 
   // Shut down the test server and wait until its thread terminates. CHECK-fails 
   // if any step in this process fails.
@@ -35,20 +33,10 @@ class NetplayServerTestFixture {
   bool WaitForPing(int requests, int request_timeout_millis);
 
  private:
-  static const char kMainClass[];
   static const char kLocalhost[];
 
-  void VMThread();
-
-  // Parses the jar list in jars_ and emits a classpath argument string of the 
-  // form -Djava.class.path=x.y.z
-  string MakeClasspath();
-
-  vector<string> jars_;
-  thread vm_thread_;
-
-  JavaVM* jvm_;
-  JNIEnv* env_;
+  std::unique_ptr<NetplayServer> server_;
+  thread server_thread_;
 };
 
 #endif  // INTEGRATION_TESTS_FIXTURE_H_
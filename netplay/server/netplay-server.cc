@@ -0,0 +1,534 @@
+#include "server/netplay-server.h"
+
+#include <chrono>
+
+#include "glog/logging.h"
+#include "grpc++/channel.h"
+#include "grpc++/create_channel.h"
+#include "grpc++/security/credentials.h"
+#include "grpc++/security/server_credentials.h"
+#include "grpc++/server_builder.h"
+
+namespace {
+
+const Port kAllPorts[] = {PORT_1, PORT_2, PORT_3, PORT_4};
+
+// Returns the current time on the clock clients timestamp stream pings with,
+// see client_utils::now_nanos.
+int64_t NowNanos() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::high_resolution_clock::now().time_since_epoch())
+      .count();
+}
+
+// Returns the host of a gRPC peer such as "ipv4:127.0.0.1:40000", or an empty
+// string if the peer isn't an IPv4 address, on which button presses can't be
+// exchanged directly.
+std::string PeerHost(const std::string& peer) {
+  static const char kIpv4Prefix[] = "ipv4:";
+  const size_t prefix_size = sizeof(kIpv4Prefix) - 1;
+  if (peer.compare(0, prefix_size, kIpv4Prefix) != 0) {
+    return "";
+  }
+  const size_t colon = peer.rfind(':');
+  if (colon <= prefix_size) {
+    return "";
+  }
+  return peer.substr(prefix_size, colon - prefix_size);
+}
+
+}  // namespace
+
+// -----------------------------------------------------------------------------
+// NetplayServerServiceImpl
+
+NetplayServerServiceImpl::NetplayServerServiceImpl()
+    : next_console_id_(1), next_client_id_(1), shut_down_requested_(false) {}
+
+grpc::Status NetplayServerServiceImpl::Ping(
+    grpc::ServerContext* /* context */, const PingPB* /* request */,
+    PingPB* /* response */) {
+  return grpc::Status::OK;
+}
+
+grpc::Status NetplayServerServiceImpl::MakeConsole(
+    grpc::ServerContext* /* context */, const MakeConsoleRequestPB* request,
+    MakeConsoleResponsePB* response) {
+  VLOG(3) << "Received console creation request:\n" << request->DebugString();
+
+  std::lock_guard<std::mutex> lock(m_);
+  const int64_t console_id = next_console_id_++;
+  Console& console = consoles_[console_id];
+  console.console_id = console_id;
+  console.console_title = request->console_title();
+  console.rom_name = request->rom_name();
+
+  response->set_status(MakeConsoleResponsePB::SUCCESS);
+  response->set_console_id(console_id);
+  return grpc::Status::OK;
+}
+
+grpc::Status NetplayServerServiceImpl::PlugController(
+    grpc::ServerContext* /* context */, const PlugControllerRequestPB* request,
+    PlugControllerResponsePB* response) {
+  VLOG(3) << "Received plug controller request:\n" << request->DebugString();
+
+  std::lock_guard<std::mutex> lock(m_);
+  response->set_console_id(request->console_id());
+
+  auto console_it = consoles_.find(request->console_id());
+  if (console_it == consoles_.end()) {
+    response->set_status(PlugControllerResponsePB::NO_SUCH_CONSOLE);
+    return grpc::Status::OK;
+  }
+  Console& console = console_it->second;
+
+  if (console.started || request->delay_frames() < 0) {
+    response->set_status(PlugControllerResponsePB::UNSPECIFIED_FAILURE);
+    return grpc::Status::OK;
+  }
+
+  if (!console.clients.empty() &&
+      request->rom_file_md5() != console.rom_file_md5) {
+    response->set_status(PlugControllerResponsePB::ROM_MD5_MISMATCH);
+    return grpc::Status::OK;
+  }
+
+  // Resolve all requested ports before assigning any of them, so that a
+  // rejected request leaves the console unchanged.
+  const Port requested[] = {
+      request->requested_port_1(), request->requested_port_2(),
+      request->requested_port_3(), request->requested_port_4()};
+  std::set<Port> ports;
+  for (Port port : requested) {
+    if (port == UNKNOWN) {
+      continue;
+    }
+    if (port == PORT_ANY) {
+      port = FirstFreePort(console, ports);
+    }
+    if (port == UNKNOWN ||
+        console.port_owners.find(port) != console.port_owners.end() ||
+        !ports.insert(port).second) {
+      response->set_status(PlugControllerResponsePB::PORT_REQUEST_REJECTED);
+      return grpc::Status::OK;
+    }
+  }
+
+  const int64_t client_id = next_client_id_++;
+  Client& client = console.clients[client_id];
+  client.client_id = client_id;
+  client.delay_frames = request->delay_frames();
+  for (Port port : ports) {
+    client.ports.push_back(port);
+    console.port_owners[port] = client_id;
+    response->add_port(port);
+  }
+  if (console.clients.size() == 1) {
+    console.rom_file_md5 = request->rom_file_md5();
+  }
+
+  response->set_status(PlugControllerResponsePB::SUCCESS);
+  response->set_client_id(client_id);
+  return grpc::Status::OK;
+}
+
+grpc::Status NetplayServerServiceImpl::StartGame(
+    grpc::ServerContext* /* context */, const StartGameRequestPB* request,
+    StartGameResponsePB* response) {
+  VLOG(3) << "Received start game request:\n" << request->DebugString();
+
+  IncomingEventPB event;
+  std::vector<std::shared_ptr<ClientStream>> streams;
+  {
+    std::lock_guard<std::mutex> lock(m_);
+    auto console_it = consoles_.find(request->console_id());
+    if (console_it == consoles_.end()) {
+      response->set_status(StartGameResponsePB::NO_SUCH_CONSOLE);
+      return grpc::Status::OK;
+    }
+    Console& console = console_it->second;
+
+    if (console.started) {
+      response->set_status(StartGameResponsePB::UNSPECIFIED_FAILURE);
+      return grpc::Status::OK;
+    }
+
+    if (console.clients.empty()) {
+      response->set_status(StartGameResponsePB::CLIENTS_NOT_READY);
+      return grpc::Status::OK;
+    }
+    for (const auto& it : console.clients) {
+      if (it.second.stream == nullptr) {
+        response->set_status(StartGameResponsePB::CLIENTS_NOT_READY);
+        return grpc::Status::OK;
+      }
+    }
+
+    StartGamePB* start_game = event.mutable_start_game();
+    start_game->set_console_id(console.console_id);
+    for (const auto& it : console.port_owners) {
+      StartGamePB::ConnectedPortPB* connected_port =
+          start_game->add_connected_ports();
+      connected_port->set_port(it.first);
+      connected_port->set_delay_frames(
+          console.clients[it.second].delay_frames);
+    }
+    // Key presses are relayed as-is, so every client must be able to decode
+    // the packed form, and expand runs of unchanged frames, before anyone may
+    // send them.
+    bool packed_buttons = true;
+    bool run_length_buttons = true;
+    // Likewise, button presses only bypass the server if every client can
+    // be reached directly.
+    bool peers = true;
+    for (const auto& it : console.clients) {
+      streams.push_back(it.second.stream);
+      packed_buttons = packed_buttons && it.second.supports_packed_buttons;
+      run_length_buttons =
+          run_length_buttons && it.second.supports_run_length_buttons;
+      peers = peers && !it.second.peer_address.empty();
+    }
+    start_game->set_packed_buttons(packed_buttons);
+    start_game->set_run_length_buttons(run_length_buttons);
+    if (peers) {
+      for (const auto& it : console.clients) {
+        PeerEndpointPB* peer = start_game->add_peers();
+        peer->set_client_id(it.first);
+        peer->set_address(it.second.peer_address);
+      }
+    }
+    console.started = true;
+  }
+
+  // Write outside the server lock so that a slow client can't block other
+  // consoles. Button presses can't be relayed before the start message, since
+  // clients only send buttons after receiving it.
+  for (const auto& stream : streams) {
+    if (!WriteToClient(stream.get(), event)) {
+      LOG(ERROR) << "Failed to send game start to a client of console "
+                 << request->console_id();
+    }
+  }
+
+  response->set_status(StartGameResponsePB::SUCCESS);
+  return grpc::Status::OK;
+}
+
+grpc::Status NetplayServerServiceImpl::SendEvent(
+    grpc::ServerContext* context,
+    grpc::ServerReaderWriter<IncomingEventPB, OutgoingEventPB>* stream) {
+  HandleEventStream(stream, context->peer());
+  return grpc::Status::OK;
+}
+
+void NetplayServerServiceImpl::HandleEventStream(EventStream* stream,
+                                                 const std::string& peer) {
+  const std::string peer_host = PeerHost(peer);
+  auto client_stream = std::make_shared<ClientStream>();
+  client_stream->stream = stream;
+
+  int64_t console_id = 0;
+  int64_t client_id = 0;
+
+  OutgoingEventPB event;
+  while (stream->Read(&event)) {
+    const int64_t receive_nanos = NowNanos();
+    VLOG(3) << "Read event from client " << client_id << ":\n"
+            << event.DebugString();
+
+    if (event.has_client_ready()) {
+      IncomingEventPB invalid_data;
+      if (client_id != 0 ||
+          !RegisterClient(event.client_ready(), client_stream, peer_host,
+                          &invalid_data)) {
+        if (client_id != 0) {
+          invalid_data.add_invalid_data()->set_description(
+              "Client already sent ClientReadyPB on this stream");
+        }
+        WriteToClient(client_stream.get(), invalid_data);
+        continue;
+      }
+      console_id = event.client_ready().console_id();
+      client_id = event.client_ready().client_id();
+    }
+
+    // Clients that exchange button presses directly still send their frame
+    // statuses and delay changes through the server, on their own.
+    if (event.key_press_size() > 0 || event.has_frame_status() ||
+        event.delay_change_size() > 0) {
+      if (client_id == 0) {
+        IncomingEventPB invalid_data;
+        invalid_data.add_invalid_data()->set_description(
+            "Received button presses before ClientReadyPB");
+        WriteToClient(client_stream.get(), invalid_data);
+        continue;
+      }
+      RelayKeyPresses(console_id, client_id, event);
+    }
+
+    // Pings ride along with button presses, which are relayed first.
+    if (event.has_ping()) {
+      EchoPing(client_stream.get(), event.ping(), receive_nanos);
+    }
+  }
+
+  VLOG(3) << "Event stream of client " << client_id << " closed";
+
+  // The stream is destroyed once SendEvent returns, so make sure no other
+  // thread writes to it from now on.
+  {
+    std::lock_guard<std::mutex> lock(client_stream->m);
+    client_stream->stream = nullptr;
+  }
+
+  // A client whose stream closed before the game started is no longer ready,
+  // but may open a new stream.
+  if (client_id != 0) {
+    std::lock_guard<std::mutex> lock(m_);
+    Console& console = consoles_[console_id];
+    Client& client = console.clients[client_id];
+    if (!console.started && client.stream == client_stream) {
+      client.stream.reset();
+    }
+  }
+}
+
+grpc::Status NetplayServerServiceImpl::ShutDownServer(
+    grpc::ServerContext* /* context */,
+    const ShutDownServerRequestPB* /* request */,
+    ShutDownServerResponsePB* response) {
+  LOG(INFO) << "Received server shutdown request";
+
+  IncomingEventPB event;
+  event.mutable_stop_console()->set_stop_reason(
+      StopConsolePB::STOP_REQUESTED_BY_CLIENT);
+
+  std::vector<std::shared_ptr<ClientStream>> streams;
+  {
+    std::lock_guard<std::mutex> lock(m_);
+    shut_down_requested_ = true;
+    for (const auto& console : consoles_) {
+      for (const auto& client : console.second.clients) {
+        if (client.second.stream != nullptr) {
+          streams.push_back(client.second.stream);
+        }
+      }
+    }
+  }
+  shut_down_cv_.notify_all();
+
+  for (const auto& stream : streams) {
+    WriteToClient(stream.get(), event);
+  }
+
+  response->set_server_will_die(true);
+  return grpc::Status::OK;
+}
+
+void NetplayServerServiceImpl::WaitForShutDownRequest() {
+  std::unique_lock<std::mutex> lock(m_);
+  shut_down_cv_.wait(lock, [this] { return shut_down_requested_; });
+}
+
+bool NetplayServerServiceImpl::shut_down_requested() const {
+  std::lock_guard<std::mutex> lock(m_);
+  return shut_down_requested_;
+}
+
+bool NetplayServerServiceImpl::RegisterClient(
+    const ClientReadyPB& client_ready,
+    const std::shared_ptr<ClientStream>& stream, const std::string& peer_host,
+    IncomingEventPB* invalid_data) {
+  if (client_ready.peer_port() < 0 || client_ready.peer_port() > 65535) {
+    invalid_data->add_invalid_data()->set_description("Invalid peer port");
+    return false;
+  }
+
+  std::lock_guard<std::mutex> lock(m_);
+  auto console_it = consoles_.find(client_ready.console_id());
+  if (console_it == consoles_.end()) {
+    invalid_data->add_invalid_data()->set_description("No such console");
+    return false;
+  }
+
+  auto client_it = console_it->second.clients.find(client_ready.client_id());
+  if (client_it == console_it->second.clients.end()) {
+    invalid_data->add_invalid_data()->set_description(
+        "No such client on this console");
+    return false;
+  }
+
+  if (client_it->second.stream != nullptr) {
+    invalid_data->add_invalid_data()->set_description(
+        "Client already has an event stream");
+    return false;
+  }
+
+  client_it->second.stream = stream;
+  client_it->second.supports_packed_buttons =
+      client_ready.supports_packed_buttons();
+  client_it->second.supports_run_length_buttons =
+      client_ready.supports_run_length_buttons();
+  client_it->second.peer_address.clear();
+  if (client_ready.peer_port() > 0) {
+    const std::string& host = client_ready.peer_host().empty()
+                                  ? peer_host
+                                  : client_ready.peer_host();
+    if (host.empty()) {
+      LOG(ERROR) << "Client " << client_ready.client_id()
+                 << " advertised peer port " << client_ready.peer_port()
+                 << " from a stream without an IPv4 address";
+    } else {
+      client_it->second.peer_address =
+          host + ":" + std::to_string(client_ready.peer_port());
+    }
+  }
+  return true;
+}
+
+void NetplayServerServiceImpl::RelayKeyPresses(int64_t console_id,
+                                               int64_t sender_client_id,
+                                               const OutgoingEventPB& event) {
+  IncomingEventPB relayed;
+  relayed.mutable_key_press()->CopyFrom(event.key_press());
+  if (event.has_frame_status()) {
+    *relayed.mutable_frame_status() = event.frame_status();
+  }
+  relayed.mutable_delay_change()->CopyFrom(event.delay_change());
+
+  std::vector<std::shared_ptr<ClientStream>> streams;
+  {
+    std::lock_guard<std::mutex> lock(m_);
+    const Console& console = consoles_[console_id];
+    for (const KeyStatePB& keys : event.key_press()) {
+      auto owner = console.port_owners.find(keys.port());
+      if (owner == console.port_owners.end() ||
+          owner->second != sender_client_id) {
+        LOG(ERROR) << "Client " << sender_client_id
+                   << " sent buttons for port " << Port_Name(keys.port())
+                   << ", which it does not own";
+        return;
+      }
+    }
+    if (event.has_frame_status()) {
+      auto owner = console.port_owners.find(event.frame_status().port());
+      if (owner == console.port_owners.end() ||
+          owner->second != sender_client_id) {
+        LOG(ERROR) << "Client " << sender_client_id
+                   << " sent the frame status of port "
+                   << Port_Name(event.frame_status().port())
+                   << ", which it does not own";
+        return;
+      }
+    }
+    // Any client may propose to change the delay of any connected port.
+    for (const DelayChangePB& change : event.delay_change()) {
+      if (console.port_owners.find(change.port()) ==
+          console.port_owners.end()) {
+        LOG(ERROR) << "Client " << sender_client_id
+                   << " proposed a delay change for port "
+                   << Port_Name(change.port()) << ", which is not connected";
+        return;
+      }
+    }
+    for (const auto& it : console.clients) {
+      if (it.first != sender_client_id && it.second.stream != nullptr) {
+        streams.push_back(it.second.stream);
+      }
+    }
+  }
+
+  for (const auto& stream : streams) {
+    WriteToClient(stream.get(), relayed);
+  }
+}
+
+void NetplayServerServiceImpl::EchoPing(ClientStream* stream,
+                                        const StreamPingPB& ping,
+                                        int64_t receive_nanos) {
+  IncomingEventPB pong_event;
+  StreamPingPB* pong = pong_event.mutable_pong();
+  *pong = ping;
+  pong->set_server_receive_nanos(receive_nanos);
+  pong->set_server_send_nanos(NowNanos());
+  WriteToClient(stream, pong_event);
+}
+
+bool NetplayServerServiceImpl::WriteToClient(ClientStream* stream,
+                                             const IncomingEventPB& event) {
+  std::lock_guard<std::mutex> lock(stream->m);
+  if (stream->stream == nullptr) {
+    return false;
+  }
+  return stream->stream->Write(event);
+}
+
+Port NetplayServerServiceImpl::FirstFreePort(const Console& console,
+                                             const std::set<Port>& reserved) {
+  for (Port port : kAllPorts) {
+    if (console.port_owners.find(port) == console.port_owners.end() &&
+        reserved.find(port) == reserved.end()) {
+      return port;
+    }
+  }
+  return UNKNOWN;
+}
+
+// -----------------------------------------------------------------------------
+// NetplayServer
+
+NetplayServer::NetplayServer(const std::string& address) : address_(address) {}
+
+NetplayServer::~NetplayServer() { ShutDown(); }
+
+std::unique_ptr<NetplayServer> NetplayServer::Start(
+    const std::string& address) {
+  std::unique_ptr<NetplayServer> server(new NetplayServer(address));
+
+  grpc::ServerBuilder builder;
+  if (!address.empty()) {
+    builder.AddListeningPort(address, grpc::InsecureServerCredentials());
+  }
+  builder.RegisterService(&server->service_);
+  server->server_ = builder.BuildAndStart();
+  if (server->server_ == nullptr) {
+    LOG(ERROR) << "Failed to start Netplay server on address '" << address
+               << "'";
+    return nullptr;
+  }
+
+  LOG(INFO) << "Started Netplay server"
+            << (address.empty() ? " in-process" : " on " + address);
+  return server;
+}
+
+std::shared_ptr<NetPlayServerService::Stub>
+NetplayServer::MakeInProcessStub() {
+  return NetPlayServerService::NewStub(
+      server_->InProcessChannel(grpc::ChannelArguments()));
+}
+
+std::shared_ptr<NetPlayServerService::Stub> NetplayServer::MakeStub() {
+  CHECK(!address_.empty()) << "Server is not listening on an address";
+  return NetPlayServerService::NewStub(
+      grpc::CreateChannel(address_, grpc::InsecureChannelCredentials()));
+}
+
+void NetplayServer::WaitForShutDown() {
+  service_.WaitForShutDownRequest();
+  ShutDown();
+}
+
+void NetplayServer::ShutDown() {
+  if (server_ == nullptr) {
+    return;
+  }
+  std::call_once(shut_down_once_, [this] {
+    // Open event streams block in Read until they're cancelled, so don't wait
+    // for them to finish.
+    server_->Shutdown(std::chrono::system_clock::now());
+    server_->Wait();
+    LOG(INFO) << "Netplay server shut down";
+  });
+}
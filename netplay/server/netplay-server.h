@@ -0,0 +1,184 @@
+#ifndef NETPLAY_SERVER_H_
+#define NETPLAY_SERVER_H_
+
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "base/netplayServiceProto.grpc.pb.h"
+#include "base/netplayServiceProto.pb.h"
+#include "grpc++/server.h"
+#include "grpc++/server_context.h"
+#include "grpc++/support/sync_stream.h"
+
+// An implementation of the Netplay server service which keeps all consoles in
+// memory. Consoles are made with MakeConsole, clients plug controllers into
+// them with PlugController, and once every plugged client has opened an event
+// stream and sent its ClientReadyPB, StartGame sends the connected ports to all
+// clients. From then on, button presses written to a client's event stream are
+// relayed to every other client on the same console, and stream pings are
+// echoed back to their sender.
+//
+// Clients may also advertise an endpoint on which they exchange button presses
+// directly with each other. If all the clients of a console do, StartGame
+// sends them the endpoints of one another. The server then only sees the
+// button presses of clients that fall back to their event stream.
+//
+// Thread safe. Every RPC runs on the calling gRPC thread, and event streams are
+// only written while holding the lock of the stream being written to.
+class NetplayServerServiceImpl : public NetPlayServerService::Service {
+ public:
+  typedef grpc::ServerReaderWriterInterface<IncomingEventPB, OutgoingEventPB>
+      EventStream;
+
+  NetplayServerServiceImpl();
+
+  grpc::Status Ping(grpc::ServerContext* context, const PingPB* request,
+                    PingPB* response) override;
+  grpc::Status MakeConsole(grpc::ServerContext* context,
+                           const MakeConsoleRequestPB* request,
+                           MakeConsoleResponsePB* response) override;
+  grpc::Status PlugController(grpc::ServerContext* context,
+                              const PlugControllerRequestPB* request,
+                              PlugControllerResponsePB* response) override;
+  grpc::Status StartGame(grpc::ServerContext* context,
+                         const StartGameRequestPB* request,
+                         StartGameResponsePB* response) override;
+  grpc::Status SendEvent(
+      grpc::ServerContext* context,
+      grpc::ServerReaderWriter<IncomingEventPB, OutgoingEventPB>* stream)
+      override;
+  grpc::Status ShutDownServer(grpc::ServerContext* context,
+                              const ShutDownServerRequestPB* request,
+                              ShutDownServerResponsePB* response) override;
+
+  // Serves a single client event stream until the client closes it or the
+  // server shuts down. SendEvent forwards to this method, which exists so that
+  // streams can be served without a gRPC server. peer is the address of the
+  // client as gRPC reports it, for instance "ipv4:127.0.0.1:40000", from which
+  // the host of an advertised endpoint is taken if the client leaves it out.
+  void HandleEventStream(EventStream* stream, const std::string& peer = "");
+
+  // Blocks until a ShutDownServer request has been received.
+  void WaitForShutDownRequest();
+
+  // Returns true if a ShutDownServer request has been received.
+  bool shut_down_requested() const;
+
+ private:
+  // A client's event stream. The stream pointer is cleared by the thread
+  // serving it before the stream is destroyed, after which writes are dropped.
+  struct ClientStream {
+    std::mutex m;
+    EventStream* stream = nullptr;
+  };
+
+  struct Client {
+    int64_t client_id = 0;
+    int delay_frames = 0;
+    std::vector<Port> ports;
+    // Set once the client has sent its ClientReadyPB.
+    std::shared_ptr<ClientStream> stream;
+    bool supports_packed_buttons = false;
+    bool supports_run_length_buttons = false;
+    // "host:port" on which the client exchanges button presses with the
+    // others, or empty if it didn't advertise one.
+    std::string peer_address;
+  };
+
+  struct Console {
+    int64_t console_id = 0;
+    std::string console_title;
+    std::string rom_name;
+    // MD5 of the ROM of the first client to plug a controller, which all
+    // later clients must match.
+    std::string rom_file_md5;
+    bool started = false;
+    std::map<int64_t, Client> clients;
+    // Port number to client ID.
+    std::map<Port, int64_t> port_owners;
+  };
+
+  // Handles a ClientReadyPB from the given stream, opened from peer_host.
+  // Returns false if no such client exists, in which case invalid_data is
+  // populated.
+  bool RegisterClient(const ClientReadyPB& client_ready,
+                      const std::shared_ptr<ClientStream>& stream,
+                      const std::string& peer_host,
+                      IncomingEventPB* invalid_data);
+
+  // Sends the button presses, and the frame status and delay changes that
+  // come with them, to all clients on the console other than the sender.
+  void RelayKeyPresses(int64_t console_id, int64_t sender_client_id,
+                       const OutgoingEventPB& event);
+
+  // Echoes a stream ping read at receive_nanos back to the client that sent
+  // it, with the server's timestamps.
+  static void EchoPing(ClientStream* stream, const StreamPingPB& ping,
+                       int64_t receive_nanos);
+
+  // Writes the event to a client stream. Returns false if the stream is closed
+  // or the write failed.
+  static bool WriteToClient(ClientStream* stream, const IncomingEventPB& event);
+
+  // Returns the lowest numbered port which has no owner on the console, or
+  // UNKNOWN if every port is taken. Must be called with m_ held.
+  static Port FirstFreePort(const Console& console,
+                            const std::set<Port>& reserved);
+
+  mutable std::mutex m_;
+  std::condition_variable shut_down_cv_;
+
+  std::map<int64_t, Console> consoles_;
+  int64_t next_console_id_;
+  int64_t next_client_id_;
+  bool shut_down_requested_;
+};
+
+// Runs a NetplayServerServiceImpl in a gRPC server, either listening on a local
+// address or reachable only from within this process. Intended for tests and
+// benchmarks that need a real server without starting an external process.
+class NetplayServer {
+ public:
+  // Starts a server listening on the given address, for instance
+  // "localhost:10001". If address is empty, the server only accepts
+  // in-process connections made through MakeInProcessStub. Returns nullptr on
+  // failure.
+  static std::unique_ptr<NetplayServer> Start(const std::string& address);
+
+  // Shuts the server down, if it's still running.
+  ~NetplayServer();
+
+  // Returns a stub connected to the server without going through the network
+  // stack.
+  std::shared_ptr<NetPlayServerService::Stub> MakeInProcessStub();
+
+  // Returns a stub connected to the address the server listens on. Must only
+  // be called if the server was started with an address.
+  std::shared_ptr<NetPlayServerService::Stub> MakeStub();
+
+  // Blocks until a ShutDownServer request is received, and then shuts down
+  // the server, cancelling any open event streams.
+  void WaitForShutDown();
+
+  // Shuts down the server immediately, cancelling any open event streams.
+  void ShutDown();
+
+  NetplayServerServiceImpl* service() { return &service_; }
+  const std::string& address() const { return address_; }
+
+ private:
+  explicit NetplayServer(const std::string& address);
+
+  const std::string address_;
+  NetplayServerServiceImpl service_;
+  std::unique_ptr<grpc::Server> server_;
+  std::once_flag shut_down_once_;
+};
+
+#endif  // NETPLAY_SERVER_H_
@@ -0,0 +1,554 @@
+#include "server/netplay-server.h"
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+// An event stream whose incoming events are supplied by the test. Read blocks
+// until an event is available or the stream is closed.
+class FakeEventStream : public NetplayServerServiceImpl::EventStream {
+ public:
+  void SendInitialMetadata() override {}
+
+  bool Write(const IncomingEventPB& event,
+             const grpc::WriteOptions& /* options */) override {
+    std::lock_guard<std::mutex> lock(m_);
+    written_.push_back(event);
+    return true;
+  }
+
+  bool Read(OutgoingEventPB* event) override {
+    std::unique_lock<std::mutex> lock(m_);
+    reader_waiting_ = true;
+    cv_.notify_all();
+    cv_.wait(lock, [this] { return closed_ || !incoming_.empty(); });
+    reader_waiting_ = false;
+    if (incoming_.empty()) {
+      return false;
+    }
+    *event = incoming_.front();
+    incoming_.pop_front();
+    return true;
+  }
+
+  bool NextMessageSize(uint32_t* /* sz */) override { return false; }
+
+  // Queues an event to be read by the server.
+  void Send(const OutgoingEventPB& event) {
+    std::lock_guard<std::mutex> lock(m_);
+    incoming_.push_back(event);
+    cv_.notify_all();
+  }
+
+  // Closes the stream once all sent events have been read.
+  void Close() {
+    std::unique_lock<std::mutex> lock(m_);
+    cv_.wait(lock, [this] { return incoming_.empty() && reader_waiting_; });
+    closed_ = true;
+    cv_.notify_all();
+  }
+
+  // Waits until the server has handled all sent events and is waiting for
+  // the next one.
+  void WaitUntilRead() {
+    std::unique_lock<std::mutex> lock(m_);
+    cv_.wait(lock, [this] { return incoming_.empty() && reader_waiting_; });
+  }
+
+  std::vector<IncomingEventPB> written() {
+    std::lock_guard<std::mutex> lock(m_);
+    return written_;
+  }
+
+ private:
+  std::mutex m_;
+  std::condition_variable cv_;
+  std::deque<OutgoingEventPB> incoming_;
+  std::vector<IncomingEventPB> written_;
+  bool reader_waiting_ = false;
+  bool closed_ = false;
+};
+
+class NetplayServerServiceImplTest : public ::testing::Test {
+ protected:
+  ~NetplayServerServiceImplTest() {
+    for (auto& stream : streams_) {
+      stream->Close();
+    }
+    for (auto& thread : stream_threads_) {
+      thread.join();
+    }
+  }
+
+  int64_t MakeConsole() {
+    MakeConsoleRequestPB request;
+    request.set_console_title("console");
+    request.set_rom_name("rom");
+    MakeConsoleResponsePB response;
+    EXPECT_TRUE(service_.MakeConsole(nullptr, &request, &response).ok());
+    EXPECT_EQ(MakeConsoleResponsePB::SUCCESS, response.status());
+    return response.console_id();
+  }
+
+  PlugControllerResponsePB PlugController(int64_t console_id,
+                                          const std::vector<Port>& ports,
+                                          int delay_frames = 0,
+                                          const std::string& md5 = "md5") {
+    PlugControllerRequestPB request;
+    request.set_console_id(console_id);
+    request.set_delay_frames(delay_frames);
+    request.set_rom_file_md5(md5);
+    if (ports.size() > 0) request.set_requested_port_1(ports[0]);
+    if (ports.size() > 1) request.set_requested_port_2(ports[1]);
+    if (ports.size() > 2) request.set_requested_port_3(ports[2]);
+    if (ports.size() > 3) request.set_requested_port_4(ports[3]);
+    PlugControllerResponsePB response;
+    EXPECT_TRUE(service_.PlugController(nullptr, &request, &response).ok());
+    return response;
+  }
+
+  StartGameResponsePB::Status StartGame(int64_t console_id) {
+    StartGameRequestPB request;
+    request.set_console_id(console_id);
+    StartGameResponsePB response;
+    EXPECT_TRUE(service_.StartGame(nullptr, &request, &response).ok());
+    return response.status();
+  }
+
+  // Opens an event stream served on its own thread, and sends ClientReadyPB
+  // on it.
+  FakeEventStream* ConnectClient(int64_t console_id, int64_t client_id,
+                                 bool supports_packed_buttons = false,
+                                 bool supports_run_length_buttons = false) {
+    streams_.emplace_back(new FakeEventStream());
+    FakeEventStream* stream = streams_.back().get();
+    stream_threads_.emplace_back(
+        [this, stream] { service_.HandleEventStream(stream); });
+
+    OutgoingEventPB event;
+    event.mutable_client_ready()->set_console_id(console_id);
+    event.mutable_client_ready()->set_client_id(client_id);
+    event.mutable_client_ready()->set_supports_packed_buttons(
+        supports_packed_buttons);
+    event.mutable_client_ready()->set_supports_run_length_buttons(
+        supports_run_length_buttons);
+    stream->Send(event);
+    stream->WaitUntilRead();
+    return stream;
+  }
+
+  // Like ConnectClient, for a client that advertises peer_port, and
+  // peer_host if not empty, on a stream opened from the gRPC peer address.
+  FakeEventStream* ConnectPeerClient(int64_t console_id, int64_t client_id,
+                                     int peer_port,
+                                     const std::string& peer_host,
+                                     const std::string& peer) {
+    streams_.emplace_back(new FakeEventStream());
+    FakeEventStream* stream = streams_.back().get();
+    stream_threads_.emplace_back(
+        [this, stream, peer] { service_.HandleEventStream(stream, peer); });
+
+    OutgoingEventPB event;
+    event.mutable_client_ready()->set_console_id(console_id);
+    event.mutable_client_ready()->set_client_id(client_id);
+    event.mutable_client_ready()->set_peer_port(peer_port);
+    event.mutable_client_ready()->set_peer_host(peer_host);
+    stream->Send(event);
+    stream->WaitUntilRead();
+    return stream;
+  }
+
+  static OutgoingEventPB MakeKeyPress(Port port, int frame) {
+    OutgoingEventPB event;
+    KeyStatePB* keys = event.add_key_press();
+    keys->set_port(port);
+    keys->set_frame_number(frame);
+    keys->set_x_axis(frame);
+    return event;
+  }
+
+  NetplayServerServiceImpl service_;
+  std::vector<std::unique_ptr<FakeEventStream>> streams_;
+  std::vector<std::thread> stream_threads_;
+};
+
+TEST_F(NetplayServerServiceImplTest, Ping) {
+  PingPB request;
+  PingPB response;
+  EXPECT_TRUE(service_.Ping(nullptr, &request, &response).ok());
+}
+
+TEST_F(NetplayServerServiceImplTest, MakeConsoleAllocatesIds) {
+  const int64_t console_1 = MakeConsole();
+  const int64_t console_2 = MakeConsole();
+  EXPECT_GT(console_1, 0);
+  EXPECT_GT(console_2, 0);
+  EXPECT_NE(console_1, console_2);
+}
+
+TEST_F(NetplayServerServiceImplTest, PlugControllerAssignsPorts) {
+  const int64_t console_id = MakeConsole();
+
+  PlugControllerResponsePB response = PlugController(console_id, {PORT_2});
+  ASSERT_EQ(PlugControllerResponsePB::SUCCESS, response.status());
+  EXPECT_EQ(console_id, response.console_id());
+  EXPECT_GT(response.client_id(), 0);
+  ASSERT_EQ(1, response.port_size());
+  EXPECT_EQ(PORT_2, response.port(0));
+
+  // PORT_ANY is assigned the lowest free ports.
+  response = PlugController(console_id, {PORT_ANY, PORT_ANY});
+  ASSERT_EQ(PlugControllerResponsePB::SUCCESS, response.status());
+  ASSERT_EQ(2, response.port_size());
+  EXPECT_EQ(PORT_1, response.port(0));
+  EXPECT_EQ(PORT_3, response.port(1));
+}
+
+TEST_F(NetplayServerServiceImplTest, PlugControllerFailures) {
+  EXPECT_EQ(PlugControllerResponsePB::NO_SUCH_CONSOLE,
+            PlugController(1234, {PORT_1}).status());
+
+  const int64_t console_id = MakeConsole();
+  ASSERT_EQ(PlugControllerResponsePB::SUCCESS,
+            PlugController(console_id, {PORT_1}).status());
+
+  EXPECT_EQ(PlugControllerResponsePB::PORT_REQUEST_REJECTED,
+            PlugController(console_id, {PORT_1}).status());
+  EXPECT_EQ(PlugControllerResponsePB::PORT_REQUEST_REJECTED,
+            PlugController(console_id, {PORT_2, PORT_2}).status());
+  EXPECT_EQ(PlugControllerResponsePB::PORT_REQUEST_REJECTED,
+            PlugController(console_id, {PORT_ANY, PORT_ANY, PORT_ANY, PORT_ANY})
+                .status());
+  EXPECT_EQ(PlugControllerResponsePB::ROM_MD5_MISMATCH,
+            PlugController(console_id, {PORT_2}, 0, "other md5").status());
+
+  // Rejected requests don't take any ports.
+  EXPECT_EQ(PlugControllerResponsePB::SUCCESS,
+            PlugController(console_id, {PORT_2, PORT_3, PORT_4}).status());
+}
+
+TEST_F(NetplayServerServiceImplTest, StartGameWaitsForClients) {
+  EXPECT_EQ(StartGameResponsePB::NO_SUCH_CONSOLE, StartGame(1234));
+
+  const int64_t console_id = MakeConsole();
+  EXPECT_EQ(StartGameResponsePB::CLIENTS_NOT_READY, StartGame(console_id));
+
+  const PlugControllerResponsePB client_1 =
+      PlugController(console_id, {PORT_1}, 2);
+  const PlugControllerResponsePB client_2 =
+      PlugController(console_id, {PORT_2}, 3);
+  FakeEventStream* stream_1 = ConnectClient(console_id, client_1.client_id());
+  EXPECT_EQ(StartGameResponsePB::CLIENTS_NOT_READY, StartGame(console_id));
+
+  FakeEventStream* stream_2 = ConnectClient(console_id, client_2.client_id());
+  ASSERT_EQ(StartGameResponsePB::SUCCESS, StartGame(console_id));
+  EXPECT_EQ(StartGameResponsePB::UNSPECIFIED_FAILURE, StartGame(console_id));
+
+  for (FakeEventStream* stream : {stream_1, stream_2}) {
+    const std::vector<IncomingEventPB> written = stream->written();
+    ASSERT_EQ(1, written.size());
+    const StartGamePB& start_game = written[0].start_game();
+    EXPECT_EQ(console_id, start_game.console_id());
+    ASSERT_EQ(2, start_game.connected_ports_size());
+    EXPECT_EQ(PORT_1, start_game.connected_ports(0).port());
+    EXPECT_EQ(2, start_game.connected_ports(0).delay_frames());
+    EXPECT_EQ(PORT_2, start_game.connected_ports(1).port());
+    EXPECT_EQ(3, start_game.connected_ports(1).delay_frames());
+    EXPECT_FALSE(start_game.packed_buttons());
+    EXPECT_FALSE(start_game.run_length_buttons());
+  }
+
+  // Controllers can't be plugged into a running console.
+  EXPECT_EQ(PlugControllerResponsePB::UNSPECIFIED_FAILURE,
+            PlugController(console_id, {PORT_3}).status());
+}
+
+TEST_F(NetplayServerServiceImplTest, PacksButtonsIfAllClientsSupportIt) {
+  const int64_t packed_console = MakeConsole();
+  FakeEventStream* stream_1 = ConnectClient(
+      packed_console, PlugController(packed_console, {PORT_1}).client_id(),
+      true);
+  FakeEventStream* stream_2 = ConnectClient(
+      packed_console, PlugController(packed_console, {PORT_2}).client_id(),
+      true);
+  ASSERT_EQ(StartGameResponsePB::SUCCESS, StartGame(packed_console));
+  for (FakeEventStream* stream : {stream_1, stream_2}) {
+    ASSERT_EQ(1, stream->written().size());
+    EXPECT_TRUE(stream->written()[0].start_game().packed_buttons());
+  }
+
+  const int64_t mixed_console = MakeConsole();
+  stream_1 = ConnectClient(
+      mixed_console, PlugController(mixed_console, {PORT_1}).client_id(),
+      true);
+  stream_2 = ConnectClient(
+      mixed_console, PlugController(mixed_console, {PORT_2}).client_id(),
+      false);
+  ASSERT_EQ(StartGameResponsePB::SUCCESS, StartGame(mixed_console));
+  for (FakeEventStream* stream : {stream_1, stream_2}) {
+    ASSERT_EQ(1, stream->written().size());
+    EXPECT_FALSE(stream->written()[0].start_game().packed_buttons());
+  }
+}
+
+TEST_F(NetplayServerServiceImplTest, RunLengthButtonsIfAllClientsOfferIt) {
+  const int64_t run_length_console = MakeConsole();
+  FakeEventStream* stream_1 = ConnectClient(
+      run_length_console,
+      PlugController(run_length_console, {PORT_1}).client_id(), false, true);
+  FakeEventStream* stream_2 = ConnectClient(
+      run_length_console,
+      PlugController(run_length_console, {PORT_2}).client_id(), false, true);
+  ASSERT_EQ(StartGameResponsePB::SUCCESS, StartGame(run_length_console));
+  for (FakeEventStream* stream : {stream_1, stream_2}) {
+    ASSERT_EQ(1, stream->written().size());
+    EXPECT_TRUE(stream->written()[0].start_game().run_length_buttons());
+    EXPECT_FALSE(stream->written()[0].start_game().packed_buttons());
+  }
+
+  const int64_t mixed_console = MakeConsole();
+  stream_1 = ConnectClient(
+      mixed_console, PlugController(mixed_console, {PORT_1}).client_id(),
+      false, true);
+  stream_2 = ConnectClient(
+      mixed_console, PlugController(mixed_console, {PORT_2}).client_id());
+  ASSERT_EQ(StartGameResponsePB::SUCCESS, StartGame(mixed_console));
+  for (FakeEventStream* stream : {stream_1, stream_2}) {
+    ASSERT_EQ(1, stream->written().size());
+    EXPECT_FALSE(stream->written()[0].start_game().run_length_buttons());
+  }
+}
+
+TEST_F(NetplayServerServiceImplTest, SendsPeersIfAllClientsAdvertiseThem) {
+  const int64_t peer_console = MakeConsole();
+  const int64_t client_1 = PlugController(peer_console, {PORT_1}).client_id();
+  const int64_t client_2 = PlugController(peer_console, {PORT_2}).client_id();
+  FakeEventStream* stream_1 = ConnectPeerClient(peer_console, client_1, 5001,
+                                                "", "ipv4:10.0.0.1:40000");
+  FakeEventStream* stream_2 = ConnectPeerClient(
+      peer_console, client_2, 5002, "192.168.0.2", "ipv4:10.0.0.2:40001");
+  ASSERT_EQ(StartGameResponsePB::SUCCESS, StartGame(peer_console));
+  for (FakeEventStream* stream : {stream_1, stream_2}) {
+    const std::vector<IncomingEventPB> written = stream->written();
+    ASSERT_EQ(1, written.size());
+    const StartGamePB& start_game = written[0].start_game();
+    ASSERT_EQ(2, start_game.peers_size());
+    EXPECT_EQ(client_1, start_game.peers(0).client_id());
+    EXPECT_EQ("10.0.0.1:5001", start_game.peers(0).address());
+    EXPECT_EQ(client_2, start_game.peers(1).client_id());
+    EXPECT_EQ("192.168.0.2:5002", start_game.peers(1).address());
+  }
+
+  // Without an address to reach every client, nobody gets any.
+  const int64_t mixed_console = MakeConsole();
+  stream_1 = ConnectPeerClient(
+      mixed_console, PlugController(mixed_console, {PORT_1}).client_id(),
+      5001, "", "ipv4:10.0.0.1:40000");
+  stream_2 = ConnectPeerClient(
+      mixed_console, PlugController(mixed_console, {PORT_2}).client_id(),
+      5002, "", "ipv6:[::1]:40001");
+  FakeEventStream* stream_3 = ConnectClient(
+      mixed_console, PlugController(mixed_console, {PORT_3}).client_id());
+  ASSERT_EQ(StartGameResponsePB::SUCCESS, StartGame(mixed_console));
+  for (FakeEventStream* stream : {stream_1, stream_2, stream_3}) {
+    ASSERT_EQ(1, stream->written().size());
+    EXPECT_EQ(0, stream->written()[0].start_game().peers_size());
+  }
+
+  // Ports beyond the UDP range are rejected.
+  const int64_t invalid_console = MakeConsole();
+  stream_1 = ConnectPeerClient(
+      invalid_console, PlugController(invalid_console, {PORT_1}).client_id(),
+      70000, "", "ipv4:10.0.0.1:40000");
+  ASSERT_EQ(1, stream_1->written().size());
+  EXPECT_EQ(1, stream_1->written()[0].invalid_data_size());
+  EXPECT_EQ(StartGameResponsePB::CLIENTS_NOT_READY,
+            StartGame(invalid_console));
+}
+
+TEST_F(NetplayServerServiceImplTest, ClosedStreamIsNotReady) {
+  const int64_t console_id = MakeConsole();
+  const PlugControllerResponsePB client =
+      PlugController(console_id, {PORT_1});
+
+  ConnectClient(console_id, client.client_id())->Close();
+  stream_threads_.back().join();
+  stream_threads_.pop_back();
+  streams_.pop_back();
+  EXPECT_EQ(StartGameResponsePB::CLIENTS_NOT_READY, StartGame(console_id));
+
+  // The client may reconnect.
+  ConnectClient(console_id, client.client_id());
+  EXPECT_EQ(StartGameResponsePB::SUCCESS, StartGame(console_id));
+}
+
+TEST_F(NetplayServerServiceImplTest, RelaysButtonsToOtherClients) {
+  const int64_t console_id = MakeConsole();
+  const PlugControllerResponsePB client_1 =
+      PlugController(console_id, {PORT_1});
+  const PlugControllerResponsePB client_2 =
+      PlugController(console_id, {PORT_2});
+  const PlugControllerResponsePB client_3 =
+      PlugController(console_id, {PORT_3});
+  FakeEventStream* stream_1 = ConnectClient(console_id, client_1.client_id());
+  FakeEventStream* stream_2 = ConnectClient(console_id, client_2.client_id());
+  FakeEventStream* stream_3 = ConnectClient(console_id, client_3.client_id());
+  ASSERT_EQ(StartGameResponsePB::SUCCESS, StartGame(console_id));
+
+  stream_1->Send(MakeKeyPress(PORT_1, 0));
+  stream_1->WaitUntilRead();
+
+  // The sender doesn't get its own buttons back.
+  EXPECT_EQ(1, stream_1->written().size());
+  for (FakeEventStream* stream : {stream_2, stream_3}) {
+    const std::vector<IncomingEventPB> written = stream->written();
+    ASSERT_EQ(2, written.size());
+    ASSERT_EQ(1, written[1].key_press_size());
+    EXPECT_EQ(PORT_1, written[1].key_press(0).port());
+    EXPECT_EQ(0, written[1].key_press(0).frame_number());
+  }
+
+  // Buttons for ports the sender doesn't own are dropped.
+  stream_1->Send(MakeKeyPress(PORT_2, 1));
+  stream_1->WaitUntilRead();
+  EXPECT_EQ(2, stream_2->written().size());
+
+  // So are frame statuses.
+  OutgoingEventPB event = MakeKeyPress(PORT_1, 1);
+  event.mutable_frame_status()->set_port(PORT_2);
+  stream_1->Send(event);
+  stream_1->WaitUntilRead();
+  EXPECT_EQ(2, stream_2->written().size());
+
+  // Frame statuses are relayed with the buttons.
+  event.mutable_frame_status()->set_port(PORT_1);
+  event.mutable_frame_status()->set_current_frame(1);
+  event.mutable_frame_status()->set_last_received_frame(0);
+  stream_1->Send(event);
+  stream_1->WaitUntilRead();
+  const std::vector<IncomingEventPB> written = stream_2->written();
+  ASSERT_EQ(3, written.size());
+  EXPECT_EQ(1, written[2].key_press_size());
+  EXPECT_EQ(PORT_1, written[2].frame_status().port());
+  EXPECT_EQ(1, written[2].frame_status().current_frame());
+  EXPECT_EQ(0, written[2].frame_status().last_received_frame());
+
+  // Delay changes may be proposed for any connected port.
+  event = MakeKeyPress(PORT_1, 2);
+  DelayChangePB* change = event.add_delay_change();
+  change->set_port(PORT_4);
+  change->set_frame(30);
+  change->set_delay_frames(3);
+  stream_1->Send(event);
+  stream_1->WaitUntilRead();
+  EXPECT_EQ(3, stream_2->written().size());
+
+  change->set_port(PORT_2);
+  stream_1->Send(event);
+  stream_1->WaitUntilRead();
+  for (FakeEventStream* stream : {stream_2, stream_3}) {
+    const std::vector<IncomingEventPB> written = stream->written();
+    ASSERT_EQ(4, written.size());
+    ASSERT_EQ(1, written[3].delay_change_size());
+    EXPECT_EQ(PORT_2, written[3].delay_change(0).port());
+    EXPECT_EQ(30, written[3].delay_change(0).frame());
+    EXPECT_EQ(3, written[3].delay_change(0).delay_frames());
+  }
+
+  // Clients that send their buttons directly still send their frame statuses
+  // and delay changes through the server.
+  event.Clear();
+  event.mutable_frame_status()->set_port(PORT_1);
+  event.mutable_frame_status()->set_current_frame(3);
+  event.add_delay_change()->set_port(PORT_3);
+  stream_1->Send(event);
+  stream_1->WaitUntilRead();
+  for (FakeEventStream* stream : {stream_2, stream_3}) {
+    const std::vector<IncomingEventPB> written = stream->written();
+    ASSERT_EQ(5, written.size());
+    EXPECT_EQ(0, written[4].key_press_size());
+    EXPECT_EQ(3, written[4].frame_status().current_frame());
+    ASSERT_EQ(1, written[4].delay_change_size());
+    EXPECT_EQ(PORT_3, written[4].delay_change(0).port());
+  }
+}
+
+TEST_F(NetplayServerServiceImplTest, EchoesStreamPings) {
+  const int64_t console_id = MakeConsole();
+  const PlugControllerResponsePB client_1 =
+      PlugController(console_id, {PORT_1});
+  const PlugControllerResponsePB client_2 =
+      PlugController(console_id, {PORT_2});
+  FakeEventStream* stream_1 = ConnectClient(console_id, client_1.client_id());
+  FakeEventStream* stream_2 = ConnectClient(console_id, client_2.client_id());
+  ASSERT_EQ(StartGameResponsePB::SUCCESS, StartGame(console_id));
+
+  OutgoingEventPB event = MakeKeyPress(PORT_1, 0);
+  event.mutable_ping()->set_sequence(7);
+  event.mutable_ping()->set_client_send_nanos(123);
+  stream_1->Send(event);
+  stream_1->WaitUntilRead();
+
+  // Only the sender gets the pong, after its buttons were relayed.
+  const std::vector<IncomingEventPB> written = stream_1->written();
+  ASSERT_EQ(2, written.size());
+  ASSERT_TRUE(written[1].has_pong());
+  EXPECT_EQ(0, written[1].key_press_size());
+  const StreamPingPB& pong = written[1].pong();
+  EXPECT_EQ(7, pong.sequence());
+  EXPECT_EQ(123, pong.client_send_nanos());
+  EXPECT_GT(pong.server_receive_nanos(), 0);
+  EXPECT_GE(pong.server_send_nanos(), pong.server_receive_nanos());
+
+  ASSERT_EQ(2, stream_2->written().size());
+  EXPECT_FALSE(stream_2->written()[1].has_pong());
+  EXPECT_EQ(1, stream_2->written()[1].key_press_size());
+}
+
+TEST_F(NetplayServerServiceImplTest, InvalidEvents) {
+  const int64_t console_id = MakeConsole();
+  const PlugControllerResponsePB client = PlugController(console_id, {PORT_1});
+
+  // Unknown client.
+  FakeEventStream* stream = ConnectClient(console_id, client.client_id() + 1);
+  ASSERT_EQ(1, stream->written().size());
+  EXPECT_EQ(1, stream->written()[0].invalid_data_size());
+
+  // Buttons before the client is ready.
+  stream->Send(MakeKeyPress(PORT_1, 0));
+  stream->WaitUntilRead();
+  ASSERT_EQ(2, stream->written().size());
+  EXPECT_EQ(1, stream->written()[1].invalid_data_size());
+
+  // A second stream for the same client.
+  ConnectClient(console_id, client.client_id());
+  stream = ConnectClient(console_id, client.client_id());
+  ASSERT_EQ(1, stream->written().size());
+  EXPECT_EQ(1, stream->written()[0].invalid_data_size());
+}
+
+TEST_F(NetplayServerServiceImplTest, ShutDownStopsConsoles) {
+  const int64_t console_id = MakeConsole();
+  const PlugControllerResponsePB client = PlugController(console_id, {PORT_1});
+  FakeEventStream* stream = ConnectClient(console_id, client.client_id());
+  ASSERT_EQ(StartGameResponsePB::SUCCESS, StartGame(console_id));
+
+  EXPECT_FALSE(service_.shut_down_requested());
+  std::thread waiter([this] { service_.WaitForShutDownRequest(); });
+
+  ShutDownServerRequestPB request;
+  ShutDownServerResponsePB response;
+  ASSERT_TRUE(service_.ShutDownServer(nullptr, &request, &response).ok());
+  EXPECT_TRUE(response.server_will_die());
+  EXPECT_TRUE(service_.shut_down_requested());
+  waiter.join();
+
+  const std::vector<IncomingEventPB> written = stream->written();
+  ASSERT_EQ(2, written.size());
+  EXPECT_TRUE(written[1].has_stop_console());
+}
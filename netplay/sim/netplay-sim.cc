@@ -0,0 +1,93 @@
+// Runs a set of network scenarios through NetworkSimulator and prints how each
+// client fared. All times are virtual, so a run takes a fraction of a second
+// and always prints the same numbers.
+
+#include <cstdio>
+#include <vector>
+
+#include "glog/logging.h"
+#include "sim/network-simulator.h"
+
+namespace {
+
+LinkModel MakeLink(double latency_millis, double jitter_millis) {
+  LinkModel link;
+  link.latency_millis = latency_millis;
+  link.jitter_millis = jitter_millis;
+  return link;
+}
+
+std::vector<SimulationOptions> MakeScenarios() {
+  std::vector<SimulationOptions> scenarios;
+
+  SimulationOptions lan;
+  lan.name = "lan";
+  lan.links = {MakeLink(1, 0.5), MakeLink(1, 0.5)};
+  scenarios.push_back(lan);
+
+  SimulationOptions broadband;
+  broadband.name = "broadband";
+  broadband.links = {MakeLink(15, 3), MakeLink(20, 3)};
+  scenarios.push_back(broadband);
+
+  SimulationOptions broadband_delay_4 = broadband;
+  broadband_delay_4.name = "broadband-delay-4";
+  broadband_delay_4.delay_frames = 4;
+  scenarios.push_back(broadband_delay_4);
+
+  SimulationOptions wifi;
+  wifi.name = "wifi-jitter";
+  wifi.links = {MakeLink(5, 2), MakeLink(10, 60)};
+  wifi.delay_frames = 3;
+  scenarios.push_back(wifi);
+
+  // Buttons are consumed in frame order, so holding events back behind a late
+  // one, as a gRPC stream does, costs nothing: this matches wifi-jitter.
+  SimulationOptions reordering = wifi;
+  reordering.name = "wifi-jitter-unordered";
+  reordering.links[1].in_order = false;
+  scenarios.push_back(reordering);
+
+  SimulationOptions stalls;
+  stalls.name = "stream-stalls";
+  stalls.links = {MakeLink(5, 1), MakeLink(5, 1)};
+  stalls.links[1].stall_period_millis = 2000;
+  stalls.links[1].stall_millis = 150;
+  scenarios.push_back(stalls);
+
+  SimulationOptions four_players;
+  four_players.name = "four-players";
+  four_players.links = {MakeLink(5, 1), MakeLink(10, 2), MakeLink(20, 5),
+                        MakeLink(40, 10)};
+  four_players.delay_frames = 4;
+  scenarios.push_back(four_players);
+
+  return scenarios;
+}
+
+}  // namespace
+
+int main(int /* argc */, char** argv) {
+  google::InitGoogleLogging(argv[0]);
+
+  std::printf("%-22s %-7s %6s %7s %9s %5s %11s %11s %11s\n", "scenario",
+              "port", "frames", "stalls", "stall_ms", "late", "latency_ms",
+              "max_lat_ms", "duration_ms");
+  bool success = true;
+  for (const SimulationOptions& options : MakeScenarios()) {
+    NetworkSimulator simulator(options);
+    SimulationReport report;
+    if (!simulator.Run(&report)) {
+      success = false;
+    }
+    for (const ClientReport& client : report.clients) {
+      std::printf("%-22s %-7s %6d %7d %9.1f %5d %11.1f %11.1f %11.1f%s\n",
+                  report.name.c_str(), Port_Name(client.port).c_str(),
+                  client.frames, client.stall_frames, client.stall_millis,
+                  client.late_frames, client.mean_input_latency_millis,
+                  client.max_input_latency_millis, report.duration_millis,
+                  report.success ? "" : " FAILED");
+    }
+  }
+  return success ? 0 : 1;
+}
@@ -0,0 +1,375 @@
+#include "sim/network-simulator.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <tuple>
+
+#include "client/mocks.h"
+#include "client/test-utils.h"
+#include "glog/logging.h"
+#include "gmock/gmock.h"
+#include "grpc++/support/sync_stream.h"
+
+namespace {
+
+const int64_t kConsoleId = 1;
+
+// Capacity of each client's trace. The simulator doesn't read the traces, but
+// handlers need one to record into.
+const int kTraceCapacity = 1 << 12;
+
+int64_t MillisToNanos(double millis) {
+  return static_cast<int64_t>(millis * 1000 * 1000);
+}
+
+double NanosToMillis(int64_t nanos) { return nanos / (1000.0 * 1000.0); }
+
+// The buttons a player puts at frame, which identify the frame. Zero is left
+// for the default buttons of the frames before the delay.
+uint32_t ButtonsForFrame(int frame) { return frame + 1; }
+
+}  // namespace
+
+// -----------------------------------------------------------------------------
+// SimulatedEventStream
+
+// The client end of an event stream whose other end is the simulated server.
+class NetworkSimulator::SimulatedEventStream
+    : public grpc::ClientReaderWriterInterface<OutgoingEventPB,
+                                               IncomingEventPB> {
+ public:
+  SimulatedEventStream(NetworkSimulator* simulator, Client* client)
+      : simulator_(simulator), client_(client) {}
+
+  void WaitForInitialMetadata() override {}
+  bool WritesDone() override { return true; }
+  grpc::Status Finish() override { return grpc::Status::OK; }
+  bool NextMessageSize(uint32_t* /* sz */) override { return false; }
+
+  bool Write(const OutgoingEventPB& event,
+             const grpc::WriteOptions& /* options */) override {
+    return simulator_->Send(client_, event);
+  }
+
+  bool Read(IncomingEventPB* event) override {
+    return simulator_->Receive(client_, event);
+  }
+
+ private:
+  // Borrowed references
+  NetworkSimulator* simulator_;
+  Client* client_;
+};
+
+// -----------------------------------------------------------------------------
+// NetworkSimulator
+
+NetworkSimulator::Client::Client(int index, const LinkModel& link)
+    : index(index),
+      port(static_cast<Port>(PORT_1 + index)),
+      link(link),
+      trace(kTraceCapacity, &clock) {
+  report.port = port;
+}
+
+NetworkSimulator::NetworkSimulator(const SimulationOptions& options)
+    : options_(options),
+      frame_period_nanos_(MillisToNanos(options.frame_period_millis)),
+      random_(options.seed),
+      next_sequence_(0),
+      ran_(false),
+      coder_(new test_utils::IntegerCoder()) {
+  if (options_.links.empty() || options_.links.size() > 4) {
+    LOG(ERROR) << "invalid number of links: " << options_.links.size();
+    std::abort();
+  }
+  if (options_.frames < 0) {
+    LOG(ERROR) << "invalid frames: " << options_.frames;
+    std::abort();
+  }
+  if (options_.delay_frames < 0) {
+    LOG(ERROR) << "invalid delay_frames: " << options_.delay_frames;
+    std::abort();
+  }
+  if (frame_period_nanos_ <= 0) {
+    LOG(ERROR) << "invalid frame_period_millis: "
+               << options_.frame_period_millis;
+    std::abort();
+  }
+  if (options_.emulation_millis < 0 ||
+      options_.emulation_millis > options_.frame_period_millis) {
+    LOG(ERROR) << "invalid emulation_millis: " << options_.emulation_millis;
+    std::abort();
+  }
+  if (options_.handler_options.background_reader ||
+      options_.handler_options.async_write_queue_size > 0) {
+    LOG(ERROR) << "invalid handler_options: background threads can't be "
+                  "simulated";
+    std::abort();
+  }
+  for (const LinkModel& link : options_.links) {
+    if (link.latency_millis < 0 || link.jitter_millis < 0 ||
+        link.stall_period_millis < 0 || link.stall_millis < 0 ||
+        link.stall_millis > link.stall_period_millis) {
+      LOG(ERROR) << "invalid link model";
+      std::abort();
+    }
+  }
+
+  start_game_.set_console_id(kConsoleId);
+  for (size_t i = 0; i < options_.links.size(); ++i) {
+    clients_.emplace_back(new Client(i, options_.links[i]));
+    Client* client = clients_.back().get();
+
+    StartGamePB::ConnectedPortPB* connected_port =
+        start_game_.add_connected_ports();
+    connected_port->set_port(client->port);
+    connected_port->set_delay_frames(options_.delay_frames);
+
+    auto* stub = new testing::NiceMock<MockNetPlayServerServiceStub>();
+    ON_CALL(*stub, SendEventRaw(testing::_))
+        .WillByDefault(testing::Invoke([this, client](grpc::ClientContext*) {
+          return new SimulatedEventStream(this, client);
+        }));
+    client->handler.reset(new Handler(
+        kConsoleId, client->index + 1, {client->port}, &client->trace,
+        coder_.get(),
+        std::shared_ptr<NetPlayServerService::StubInterface>(stub),
+        options_.handler_options));
+  }
+}
+
+NetworkSimulator::~NetworkSimulator() {}
+
+bool NetworkSimulator::Run(SimulationReport* report) {
+  if (ran_) {
+    LOG(ERROR) << "A simulation may only be run once";
+    return false;
+  }
+  ran_ = true;
+
+  *report = SimulationReport();
+  report->name = options_.name;
+
+  for (const auto& client : clients_) {
+    if (!client->handler->ClientReady()) {
+      LOG(ERROR) << "Client " << client->index << " failed to get ready";
+      FillReport(report);
+      return false;
+    }
+  }
+  for (const auto& client : clients_) {
+    if (!client->handler->WaitForConsoleStart()) {
+      LOG(ERROR) << "Client " << client->index << " failed to start";
+      FillReport(report);
+      return false;
+    }
+    client->frame_start_nanos = client->clock.now_nanos();
+  }
+
+  bool success = true;
+  for (int frame = 0; success && frame < options_.frames; ++frame) {
+    // Every client puts its buttons before any client waits for remote ones,
+    // so that a client never waits for buttons that haven't been sent yet.
+    for (const auto& client : clients_) {
+      client->clock.AdvanceTo(client->frame_start_nanos);
+      client->frame_stall_nanos = 0;
+      client->put_nanos.push_back(client->clock.now_nanos());
+      if (client->handler->PutButtons(
+              {std::make_tuple(client->port, frame, ButtonsForFrame(frame))}) !=
+          Handler::PutButtonsStatus::SUCCESS) {
+        LOG(ERROR) << "Client " << client->index << " failed to put frame "
+                   << frame;
+        success = false;
+        break;
+      }
+    }
+    for (size_t i = 0; success && i < clients_.size(); ++i) {
+      success = PlayFrame(clients_[i].get(), frame);
+    }
+  }
+
+  report->success = success;
+  FillReport(report);
+  return success;
+}
+
+bool NetworkSimulator::PlayFrame(Client* client, int frame) {
+  for (const auto& other : clients_) {
+    uint32_t buttons;
+    if (client->handler->GetButtons(other->port, frame, &buttons) !=
+        Handler::GetButtonsStatus::SUCCESS) {
+      LOG(ERROR) << "Client " << client->index << " failed to get frame "
+                 << frame << " of port " << Port_Name(other->port);
+      return false;
+    }
+    if (!CheckRemoteButtons(client, other->port, frame, buttons)) {
+      return false;
+    }
+  }
+
+  // The next frame starts a frame period after this one, or as soon as this
+  // one is emulated if the client spent too long waiting.
+  client->clock.Advance(MillisToNanos(options_.emulation_millis));
+  const int64_t deadline_nanos =
+      client->frame_start_nanos + frame_period_nanos_;
+  if (client->clock.now_nanos() > deadline_nanos) {
+    ++client->report.late_frames;
+  }
+  client->frame_start_nanos =
+      std::max(client->clock.now_nanos(), deadline_nanos);
+  if (client->frame_stall_nanos > 0) {
+    ++client->report.stall_frames;
+    client->total_stall_nanos += client->frame_stall_nanos;
+  }
+  ++client->report.frames;
+  return true;
+}
+
+bool NetworkSimulator::CheckRemoteButtons(Client* client, Port port, int frame,
+                                          uint32_t buttons) {
+  const int put_frame = frame - options_.delay_frames;
+  const uint32_t expected = put_frame < 0 ? 0 : ButtonsForFrame(put_frame);
+  if (buttons != expected) {
+    LOG(ERROR) << "Client " << client->index << " got buttons " << buttons
+               << " for frame " << frame << " of port " << Port_Name(port)
+               << ", expected " << expected;
+    return false;
+  }
+
+  if (port == client->port || put_frame < 0) {
+    return true;
+  }
+  const Client& sender = *clients_[port - PORT_1];
+  const int64_t latency =
+      client->clock.now_nanos() - sender.put_nanos[put_frame];
+  client->total_latency_nanos += latency;
+  client->max_latency_nanos = std::max(client->max_latency_nanos, latency);
+  ++client->latency_samples;
+  return true;
+}
+
+bool NetworkSimulator::Send(Client* sender, const OutgoingEventPB& event) {
+  const int64_t server_nanos = Arrival(sender->link, sender->clock.now_nanos(),
+                                       &sender->last_up_arrival_nanos);
+
+  if (event.has_client_ready()) {
+    sender->ready_nanos = server_nanos;
+
+    // Like the server, start the game once every client is ready.
+    int64_t start_nanos = 0;
+    for (const auto& client : clients_) {
+      if (client->ready_nanos < 0) {
+        return true;
+      }
+      start_nanos = std::max(start_nanos, client->ready_nanos);
+    }
+    IncomingEventPB start_game_event;
+    *start_game_event.mutable_start_game() = start_game_;
+    for (const auto& client : clients_) {
+      Deliver(client.get(), start_nanos, start_game_event);
+    }
+  }
+
+  if (event.key_press_size() > 0) {
+    IncomingEventPB relayed;
+    *relayed.mutable_key_press() = event.key_press();
+    for (const auto& client : clients_) {
+      if (client.get() != sender) {
+        Deliver(client.get(), server_nanos, relayed);
+      }
+    }
+  }
+
+  if (event.has_ping()) {
+    IncomingEventPB pong_event;
+    StreamPingPB* pong = pong_event.mutable_pong();
+    *pong = event.ping();
+    pong->set_server_receive_nanos(server_nanos);
+    pong->set_server_send_nanos(server_nanos);
+    Deliver(sender, server_nanos, pong_event);
+  }
+  return true;
+}
+
+bool NetworkSimulator::Receive(Client* client, IncomingEventPB* event) {
+  if (client->pending.empty()) {
+    LOG(ERROR) << "Client " << client->index
+               << " is waiting for an event that was never sent";
+    return false;
+  }
+
+  auto next = std::min_element(
+      client->pending.begin(), client->pending.end(),
+      [](const Delivery& lhs, const Delivery& rhs) {
+        return std::tie(lhs.arrival_nanos, lhs.sequence) <
+               std::tie(rhs.arrival_nanos, rhs.sequence);
+      });
+  const int64_t wait_nanos = next->arrival_nanos - client->clock.now_nanos();
+  if (wait_nanos > 0) {
+    client->frame_stall_nanos += wait_nanos;
+    client->clock.Advance(wait_nanos);
+  }
+
+  event->Swap(&next->event);
+  client->pending.erase(next);
+  return true;
+}
+
+void NetworkSimulator::Deliver(Client* client, int64_t server_nanos,
+                               const IncomingEventPB& event) {
+  Delivery delivery;
+  delivery.arrival_nanos =
+      Arrival(client->link, server_nanos, &client->last_down_arrival_nanos);
+  delivery.sequence = next_sequence_++;
+  delivery.event = event;
+  client->pending.push_back(std::move(delivery));
+}
+
+int64_t NetworkSimulator::Arrival(const LinkModel& link, int64_t send_nanos,
+                                  int64_t* last_arrival_nanos) {
+  int64_t arrival = send_nanos + MillisToNanos(link.latency_millis);
+
+  // std::mt19937_64 produces the same sequence everywhere, unlike the standard
+  // distributions.
+  const int64_t jitter_nanos = MillisToNanos(link.jitter_millis);
+  if (jitter_nanos > 0) {
+    arrival += random_() % (jitter_nanos + 1);
+  }
+
+  const int64_t stall_period_nanos = MillisToNanos(link.stall_period_millis);
+  const int64_t stall_nanos = MillisToNanos(link.stall_millis);
+  if (stall_period_nanos > 0 && stall_nanos > 0) {
+    const int64_t into_period = arrival % stall_period_nanos;
+    if (into_period < stall_nanos) {
+      arrival += stall_nanos - into_period;
+    }
+  }
+
+  if (link.in_order) {
+    arrival = std::max(arrival, *last_arrival_nanos);
+  }
+  *last_arrival_nanos = std::max(*last_arrival_nanos, arrival);
+  return arrival;
+}
+
+void NetworkSimulator::FillReport(SimulationReport* report) const {
+  int64_t end_nanos = 0;
+  report->clients.clear();
+  for (const auto& client : clients_) {
+    end_nanos = std::max(end_nanos, client->clock.now_nanos());
+
+    ClientReport client_report = client->report;
+    client_report.stall_millis = NanosToMillis(client->total_stall_nanos);
+    if (client->latency_samples > 0) {
+      client_report.mean_input_latency_millis = NanosToMillis(
+          client->total_latency_nanos / client->latency_samples);
+      client_report.max_input_latency_millis =
+          NanosToMillis(client->max_latency_nanos);
+    }
+    client_report.smoothed_rtt_millis =
+        NanosToMillis(client->handler->stream_latency().smoothed_rtt_nanos());
+    report->clients.push_back(client_report);
+  }
+  report->duration_millis = NanosToMillis(end_nanos);
+}
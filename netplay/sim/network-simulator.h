@@ -0,0 +1,217 @@
+#ifndef SIM_NETWORK_SIMULATOR_H_
+#define SIM_NETWORK_SIMULATOR_H_
+
+#include <cstdint>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "base/netplayServiceProto.pb.h"
+#include "client/button-coder-interface.h"
+#include "client/event-stream-handler.h"
+#include "client/trace-ring.h"
+#include "sim/virtual-clock.h"
+
+// Network conditions between one client and the server. The same conditions
+// apply to events the client sends and events it receives.
+struct LinkModel {
+  // One-way latency.
+  double latency_millis = 0;
+
+  // Each event is delayed by up to this much on top of the latency, uniformly
+  // at random.
+  double jitter_millis = 0;
+
+  // If true, events arrive in the order they were sent, as they do over a
+  // single gRPC stream, so a late event holds up the ones behind it. If false,
+  // jitter can reorder events.
+  bool in_order = true;
+
+  // If both are positive, the link delivers nothing for the first stall_millis
+  // of every stall_period_millis. Events that would arrive during a stall
+  // arrive when it ends.
+  double stall_period_millis = 0;
+  double stall_millis = 0;
+};
+
+// A scenario run by NetworkSimulator.
+struct SimulationOptions {
+  std::string name;
+
+  // Conditions of each client's link. Client i plays on port i + 1, so there
+  // may be at most four clients.
+  std::vector<LinkModel> links;
+
+  // Number of frames every client plays.
+  int frames = 600;
+
+  // Frame delay of every port.
+  int delay_frames = 2;
+
+  // Time between the starts of consecutive frames, if the console doesn't
+  // have to wait for remote buttons.
+  double frame_period_millis = 1000.0 / 60;
+
+  // Time the console spends emulating a frame after getting its buttons. The
+  // rest of the frame period is idle, and absorbs short waits for remote
+  // buttons.
+  double emulation_millis = 5;
+
+  // Seed of the jitter. Runs with the same options produce the same report.
+  uint64_t seed = 1;
+
+  // Options of every client's EventStreamHandler. The background reader and
+  // writer are not supported, since their threads run in real time.
+  EventStreamHandlerOptions handler_options;
+};
+
+struct ClientReport {
+  Port port = UNKNOWN;
+
+  // Number of frames played.
+  int frames = 0;
+
+  // Number of frames in which the client had to wait for remote buttons, and
+  // the total time it waited.
+  int stall_frames = 0;
+  double stall_millis = 0;
+
+  // Number of frames that took longer than the frame period because of
+  // waiting, slowing the game down.
+  int late_frames = 0;
+
+  // Time from the moment a remote player put their buttons for a frame to the
+  // moment this client got them, over every remote port and frame.
+  double mean_input_latency_millis = 0;
+  double max_input_latency_millis = 0;
+
+  // Round trip time to the server as measured by the handler's stream pings,
+  // or 0 if handler_options.stream_ping_period_millis is 0.
+  double smoothed_rtt_millis = 0;
+};
+
+struct SimulationReport {
+  std::string name;
+
+  // False if a handler failed, or a client got the wrong buttons. The other
+  // fields describe the frames played until then.
+  bool success = false;
+
+  // Virtual time at which the last client finished its last frame.
+  double duration_millis = 0;
+
+  std::vector<ClientReport> clients;
+};
+
+// Plays a game between EventStreamHandlers whose event streams are connected
+// through a simulated server and network, on a single thread and in virtual
+// time, so that runs are fast and reproducible.
+//
+// Every frame, each client puts the buttons of its port and then gets the
+// buttons of every port, as the emulator does. A client's clock only moves at
+// frame boundaries and while it waits for an event to arrive, which is when it
+// stalls. The buttons of each frame identify the frame, so that the simulator
+// can check that every client sees the same inputs.
+class NetworkSimulator {
+ public:
+  // std::abort's if the options are invalid.
+  explicit NetworkSimulator(const SimulationOptions& options);
+  ~NetworkSimulator();
+
+  // Runs the scenario and populates *report. May only be called once. Returns
+  // report->success.
+  bool Run(SimulationReport* report);
+
+ private:
+  typedef EventStreamHandler<uint32_t> Handler;
+
+  class SimulatedEventStream;
+
+  // An event on its way to a client.
+  struct Delivery {
+    int64_t arrival_nanos;
+    // Breaks ties between events arriving at the same time in send order.
+    int64_t sequence;
+    IncomingEventPB event;
+  };
+
+  struct Client {
+    Client(int index, const LinkModel& link);
+
+    const int index;
+    const Port port;
+    const LinkModel link;
+    VirtualClock clock;
+    TraceRing trace;
+    std::unique_ptr<Handler> handler;
+
+    // Events sent to the client that it hasn't read yet, in no particular
+    // order.
+    std::vector<Delivery> pending;
+    // Latest arrival time of an event sent over the link in each direction,
+    // used to keep in-order links in order.
+    int64_t last_up_arrival_nanos = 0;
+    int64_t last_down_arrival_nanos = 0;
+
+    // Time at which the server received the client's ClientReadyPB, or -1.
+    int64_t ready_nanos = -1;
+
+    // Time at which the current frame started, and the time the client has
+    // waited for events since.
+    int64_t frame_start_nanos = 0;
+    int64_t frame_stall_nanos = 0;
+
+    // Time at which the client put the buttons of each frame.
+    std::vector<int64_t> put_nanos;
+
+    ClientReport report;
+    int64_t total_stall_nanos = 0;
+    int64_t total_latency_nanos = 0;
+    int64_t max_latency_nanos = 0;
+    int latency_samples = 0;
+  };
+
+  // Called by the client's stream when the handler writes an event. Plays the
+  // part of the server, which relays button presses to the other clients,
+  // echoes stream pings and starts the game once every client is ready.
+  bool Send(Client* sender, const OutgoingEventPB& event);
+
+  // Called by the client's stream when the handler reads. Advances the
+  // client's clock to the arrival of its next event if the event hasn't
+  // arrived yet. Returns false if no event is on its way, in which case
+  // waiting would block forever.
+  bool Receive(Client* client, IncomingEventPB* event);
+
+  // Returns the arrival time of an event sent at send_nanos over the link, in
+  // either direction. last_arrival_nanos is that direction's latest arrival.
+  int64_t Arrival(const LinkModel& link, int64_t send_nanos,
+                  int64_t* last_arrival_nanos);
+
+  // Queues event for delivery to the client over its link, after the server
+  // got it at server_nanos.
+  void Deliver(Client* client, int64_t server_nanos,
+               const IncomingEventPB& event);
+
+  // Plays one frame on one client. Returns false on failure.
+  bool PlayFrame(Client* client, int frame);
+
+  // Records a client's remote buttons for frame, which must identify the frame
+  // the remote player put them at.
+  bool CheckRemoteButtons(Client* client, Port port, int frame,
+                          uint32_t buttons);
+
+  void FillReport(SimulationReport* report) const;
+
+  const SimulationOptions options_;
+  const int64_t frame_period_nanos_;
+  std::mt19937_64 random_;
+  int64_t next_sequence_;
+  bool ran_;
+
+  std::unique_ptr<ButtonCoderInterface<uint32_t>> coder_;
+  StartGamePB start_game_;
+  std::vector<std::unique_ptr<Client>> clients_;
+};
+
+#endif  // SIM_NETWORK_SIMULATOR_H_
@@ -0,0 +1,196 @@
+#include "sim/network-simulator.h"
+
+#include "gtest/gtest.h"
+
+namespace {
+
+LinkModel MakeLink(double latency_millis, double jitter_millis = 0) {
+  LinkModel link;
+  link.latency_millis = latency_millis;
+  link.jitter_millis = jitter_millis;
+  return link;
+}
+
+SimulationOptions MakeOptions(const std::vector<LinkModel>& links,
+                              int delay_frames) {
+  SimulationOptions options;
+  options.links = links;
+  options.delay_frames = delay_frames;
+  options.frames = 300;
+  options.frame_period_millis = 10;
+  options.emulation_millis = 5;
+  return options;
+}
+
+SimulationReport RunScenario(const SimulationOptions& options) {
+  NetworkSimulator simulator(options);
+  SimulationReport report;
+  EXPECT_TRUE(simulator.Run(&report));
+  EXPECT_EQ(options.links.size(), report.clients.size());
+  return report;
+}
+
+}  // namespace
+
+// -----------------------------------------------------------------------------
+// VirtualClock
+
+TEST(VirtualClockTest, OnlyMovesForward) {
+  VirtualClock clock(10);
+  EXPECT_EQ(10, clock.now_nanos());
+  clock.Advance(5);
+  EXPECT_EQ(15, clock.now_nanos());
+  clock.AdvanceTo(12);
+  EXPECT_EQ(15, clock.now_nanos());
+  clock.AdvanceTo(20);
+  EXPECT_EQ(20, clock.now_nanos());
+}
+
+// -----------------------------------------------------------------------------
+// NetworkSimulator
+
+TEST(NetworkSimulatorTest, InvalidOptions) {
+  SimulationOptions options = MakeOptions({}, 2);
+  EXPECT_DEATH(NetworkSimulator simulator(options), "invalid number of links");
+
+  options = MakeOptions({MakeLink(1), MakeLink(1)}, -1);
+  EXPECT_DEATH(NetworkSimulator simulator(options), "invalid delay_frames");
+
+  options = MakeOptions({MakeLink(1), MakeLink(-1)}, 2);
+  EXPECT_DEATH(NetworkSimulator simulator(options), "invalid link model");
+
+  options = MakeOptions({MakeLink(1), MakeLink(1)}, 2);
+  options.handler_options.background_reader = true;
+  EXPECT_DEATH(NetworkSimulator simulator(options), "invalid handler_options");
+}
+
+TEST(NetworkSimulatorTest, DelayCoversLatency) {
+  // Buttons take 3 + 4 = 7 ms to reach the other client, within one frame.
+  const SimulationReport report =
+      RunScenario(MakeOptions({MakeLink(3), MakeLink(4)}, 1));
+  for (const ClientReport& client : report.clients) {
+    EXPECT_EQ(300, client.frames);
+    EXPECT_EQ(0, client.stall_frames);
+    EXPECT_EQ(0, client.late_frames);
+    // Remote buttons are got a frame after they were put, give or take the
+    // 1 ms between the clients' starts.
+    EXPECT_NEAR(10, client.mean_input_latency_millis, 1);
+  }
+  EXPECT_NEAR(300 * 10, report.duration_millis, 10);
+}
+
+TEST(NetworkSimulatorTest, LatencyAboveDelayStalls) {
+  // Buttons take 40 ms to arrive, but the delay only covers 20 ms.
+  SimulationReport report =
+      RunScenario(MakeOptions({MakeLink(20), MakeLink(20)}, 2));
+  for (const ClientReport& client : report.clients) {
+    EXPECT_GT(client.stall_frames, 0);
+    EXPECT_GT(client.late_frames, 0);
+    EXPECT_GE(client.mean_input_latency_millis, 40);
+  }
+  // The game slows down to the pace of the network.
+  EXPECT_GT(report.duration_millis, 300 * 10 * 1.5);
+
+  // Enough delay frames remove the stalls.
+  report = RunScenario(MakeOptions({MakeLink(20), MakeLink(20)}, 4));
+  for (const ClientReport& client : report.clients) {
+    EXPECT_EQ(0, client.stall_frames);
+  }
+}
+
+TEST(NetworkSimulatorTest, ShortWaitsAreAbsorbed) {
+  // Buttons take 15 ms to arrive, 5 ms after the delay, which the 5 ms of idle
+  // time at the end of each frame absorbs.
+  const SimulationReport report =
+      RunScenario(MakeOptions({MakeLink(7.5), MakeLink(7.5)}, 1));
+  for (const ClientReport& client : report.clients) {
+    EXPECT_GT(client.stall_frames, 0);
+    EXPECT_EQ(0, client.late_frames);
+  }
+  EXPECT_NEAR(300 * 10, report.duration_millis, 20);
+}
+
+TEST(NetworkSimulatorTest, IsDeterministic) {
+  SimulationOptions options =
+      MakeOptions({MakeLink(5, 20), MakeLink(10, 30)}, 2);
+  const SimulationReport first = RunScenario(options);
+  const SimulationReport second = RunScenario(options);
+  ASSERT_EQ(2, first.clients.size());
+  EXPECT_EQ(first.duration_millis, second.duration_millis);
+  for (int i = 0; i < 2; ++i) {
+    EXPECT_EQ(first.clients[i].stall_frames, second.clients[i].stall_frames);
+    EXPECT_EQ(first.clients[i].stall_millis, second.clients[i].stall_millis);
+    EXPECT_EQ(first.clients[i].mean_input_latency_millis,
+              second.clients[i].mean_input_latency_millis);
+  }
+
+  // Another seed gives other jitter.
+  options.seed = 2;
+  const SimulationReport other_seed = RunScenario(options);
+  EXPECT_NE(first.clients[0].stall_millis, other_seed.clients[0].stall_millis);
+}
+
+TEST(NetworkSimulatorTest, ReorderedEvents) {
+  // Jitter far above the frame period reorders events, which the queues put
+  // back in order.
+  SimulationOptions options =
+      MakeOptions({MakeLink(5, 50), MakeLink(5, 50)}, 3);
+  for (LinkModel& link : options.links) {
+    link.in_order = false;
+  }
+  for (const InputQueueBackend backend :
+       {InputQueueBackend::MAP, InputQueueBackend::RING}) {
+    options.handler_options.queue_backend = backend;
+    const SimulationReport report = RunScenario(options);
+    EXPECT_TRUE(report.success);
+    EXPECT_EQ(300, report.clients[0].frames);
+  }
+}
+
+TEST(NetworkSimulatorTest, StreamStalls) {
+  // The second link goes quiet for 100 ms every second.
+  SimulationOptions options = MakeOptions({MakeLink(2), MakeLink(2)}, 1);
+  options.links[1].stall_period_millis = 1000;
+  options.links[1].stall_millis = 100;
+  const SimulationReport report = RunScenario(options);
+  for (const ClientReport& client : report.clients) {
+    EXPECT_GT(client.late_frames, 0);
+    EXPECT_GE(client.max_input_latency_millis, 90);
+  }
+}
+
+TEST(NetworkSimulatorTest, FourPlayers) {
+  const SimulationReport report = RunScenario(MakeOptions(
+      {MakeLink(1), MakeLink(2), MakeLink(3), MakeLink(4)}, 1));
+  ASSERT_EQ(4, report.clients.size());
+  EXPECT_EQ(PORT_1, report.clients[0].port);
+  EXPECT_EQ(PORT_4, report.clients[3].port);
+  for (const ClientReport& client : report.clients) {
+    EXPECT_EQ(300, client.frames);
+    EXPECT_EQ(0, client.late_frames);
+  }
+}
+
+TEST(NetworkSimulatorTest, MeasuresStreamLatency) {
+  SimulationOptions options = MakeOptions({MakeLink(3), MakeLink(6)}, 2);
+  options.handler_options.stream_ping_period_millis = 100;
+  const SimulationReport report = RunScenario(options);
+  // Without a background reader, pongs are only read once the client needs
+  // the remote buttons queued before them, up to delay_frames frames after
+  // they arrive.
+  EXPECT_LE(2 * 3, report.clients[0].smoothed_rtt_millis);
+  EXPECT_GE(2 * 3 + 2 * 10, report.clients[0].smoothed_rtt_millis);
+  EXPECT_LE(2 * 6, report.clients[1].smoothed_rtt_millis);
+  EXPECT_GE(2 * 6 + 2 * 10, report.clients[1].smoothed_rtt_millis);
+
+  // Nothing is measured without pings.
+  options.handler_options.stream_ping_period_millis = 0;
+  EXPECT_EQ(0, RunScenario(options).clients[0].smoothed_rtt_millis);
+}
+
+TEST(NetworkSimulatorTest, RunsOnce) {
+  NetworkSimulator simulator(MakeOptions({MakeLink(1), MakeLink(1)}, 1));
+  SimulationReport report;
+  EXPECT_TRUE(simulator.Run(&report));
+  EXPECT_FALSE(simulator.Run(&report));
+}
@@ -0,0 +1,31 @@
+#ifndef SIM_VIRTUAL_CLOCK_H_
+#define SIM_VIRTUAL_CLOCK_H_
+
+#include <cstdint>
+
+#include "client/clock.h"
+
+// A clock that only moves when told to, so that simulations don't depend on
+// real time. Not thread-safe.
+class VirtualClock : public ClockInterface {
+ public:
+  explicit VirtualClock(int64_t start_nanos = 0) : now_nanos_(start_nanos) {}
+
+  int64_t now_nanos() const override { return now_nanos_; }
+
+  // Moves the clock forward by nanos.
+  void Advance(int64_t nanos) { now_nanos_ += nanos; }
+
+  // Moves the clock forward to nanos. Does nothing if the clock is already
+  // past it.
+  void AdvanceTo(int64_t nanos) {
+    if (nanos > now_nanos_) {
+      now_nanos_ = nanos;
+    }
+  }
+
+ private:
+  int64_t now_nanos_;
+};
+
+#endif  // SIM_VIRTUAL_CLOCK_H_